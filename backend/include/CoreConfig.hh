@@ -44,6 +44,7 @@ public:
   static const std::string CFG_KEY_MONITOR_NOISE;
   static const std::string CFG_KEY_MONITOR_ACTIVITY;
   static const std::string CFG_KEY_MONITOR_IDLE;
+  static const std::string CFG_KEY_MONITOR_MOUSE_INTERVAL;
   static const std::string CFG_KEY_GENERAL_DATADIR;
   static const std::string CFG_KEY_OPERATION_MODE;
   static const std::string CFG_KEY_USAGE_MODE;
@@ -52,6 +53,8 @@ public:
   static const std::string CFG_KEY_DISTRIBUTION_ENABLED;
   static const std::string CFG_KEY_DISTRIBUTION_LISTENING;
   static const std::string CFG_KEY_DISTRIBUTION_PEERS;
+  static const std::string CFG_KEY_DISTRIBUTION_DISCOVERY;
+  static const std::string CFG_KEY_DISTRIBUTION_DISCOVERY_INTERFACE;
   static const std::string CFG_KEY_DISTRIBUTION_TCP;
   static const std::string CFG_KEY_DISTRIBUTION_TCP_PORT;
   static const std::string CFG_KEY_DISTRIBUTION_TCP_USERNAME;
@@ -21,12 +21,75 @@
 #define IDISTRIBUTIOMANAGER_HH
 
 #include <string>
+#include <list>
 using namespace std;
 
+#include <glib.h>
+
 namespace workrave
 {
   class DistributionLogListener;
 
+  //! Network statistics of a connection with a remote client.
+  struct DistributionPeerStatistics
+  {
+    //! ID of the client, or empty if not yet known.
+    string id;
+
+    //! Whether the client is connected directly, or routed through another client.
+    bool direct;
+
+    //! Host and port of the client, or empty for incoming connections.
+    string address;
+
+    //! Whether the client is currently connected.
+    bool connected;
+
+    //! Number of bytes received from the client.
+    guint64 bytes_in;
+
+    //! Number of bytes sent to the client.
+    guint64 bytes_out;
+
+    //! Number of packets received from the client.
+    guint32 packets_in;
+
+    //! Number of packets sent to the client.
+    guint32 packets_out;
+
+    //! Bytes per second received during the statistics window.
+    guint32 rate_in;
+
+    //! Bytes per second sent during the statistics window.
+    guint32 rate_out;
+
+    //! Most recent round-trip time in milliseconds, or -1 if unknown.
+    gint32 rtt;
+
+    //! Average round-trip time during the statistics window, or -1 if unknown.
+    gint32 rtt_average;
+
+    //! Maximum round-trip time during the statistics window, or -1 if unknown.
+    gint32 rtt_max;
+
+    //! Most recent latency of an acknowledged urgent message in milliseconds, or -1 if unknown.
+    gint32 ack_latency;
+
+    //! Maximum acknowledgement latency during the statistics window, or -1 if unknown.
+    gint32 ack_latency_max;
+
+    //! Number of urgent messages that were not acknowledged in time.
+    guint32 acks_missed;
+
+    //! Number of bytes waiting to be sent.
+    guint32 queue_size;
+
+    //! Number of reconnect attempts.
+    gint32 reconnects;
+  };
+
+  typedef list<DistributionPeerStatistics> DistributionPeerStatisticsList;
+
   class IDistributionManager
   {
   public:
@@ -43,6 +106,8 @@ namespace workrave
     virtual bool remove_log_listener(DistributionLogListener *listener) = 0;
     virtual list<string> get_logs() const = 0;
 
+    virtual DistributionPeerStatisticsList get_peer_statistics() const = 0;
+
     virtual bool add_peer(string peer) = 0;
     virtual bool remove_peer(string peer) = 0;
 
@@ -55,6 +120,12 @@ namespace workrave
     virtual bool get_listening() const = 0;
     virtual void set_listening(bool b) = 0;
 
+    virtual bool get_discovery() const = 0;
+    virtual void set_discovery(bool b) = 0;
+
+    virtual string get_discovery_interface() const = 0;
+    virtual void set_discovery_interface(string name) = 0;
+
     virtual string get_username() const = 0;
     virtual void set_username(string name) = 0;
 
@@ -25,7 +25,6 @@
 #include "ActivityMonitorListener.hh"
 
 #include "debug.hh"
-#include "timeutil.h"
 #include <assert.h>
 #include <math.h>
 
@@ -50,7 +49,13 @@ using namespace std;
 
 //! Constructor.
 ActivityMonitor::ActivityMonitor() :
-  activity_state(ACTIVITY_IDLE),
+  sequence(0),
+  suspended(false),
+  last_action_time(0),
+  first_action_time(0),
+  noise_threshold(G_USEC_PER_SEC),
+  activity_threshold(2 * G_USEC_PER_SEC),
+  idle_threshold(5 * G_USEC_PER_SEC),
   prev_x(-10),
   prev_y(-10),
   button_is_pressed(false),
@@ -58,21 +63,6 @@ ActivityMonitor::ActivityMonitor() :
 {
   TRACE_ENTER("ActivityMonitor::ActivityMonitor");
 
-  first_action_time.tv_sec = 0;
-  first_action_time.tv_usec = 0;
-
-  last_action_time.tv_sec = 0;
-  last_action_time.tv_usec = 0;
-
-  noise_threshold.tv_sec = 1;
-  noise_threshold.tv_usec = 0;
-
-  activity_threshold.tv_sec = 2;
-  activity_threshold.tv_usec = 0;
-
-  idle_threshold.tv_sec = 5;
-  idle_threshold.tv_usec = 0;
-
   input_monitor = InputMonitorFactory::get_monitor(IInputMonitorFactory::CAPABILITY_ACTIVITY);
   if (input_monitor != NULL)
     {
@@ -113,11 +103,11 @@ ActivityMonitor::terminate()
 void
 ActivityMonitor::suspend()
 {
-  TRACE_ENTER_MSG("ActivityMonitor::suspend", activity_state);
-  lock.lock();
-  activity_state = ACTIVITY_SUSPENDED;
-  lock.unlock();
-  TRACE_RETURN(activity_state);
+  TRACE_ENTER("ActivityMonitor::suspend");
+  begin_update();
+  suspended = true;
+  end_update();
+  TRACE_EXIT();
 }
 
 
@@ -125,11 +115,12 @@ ActivityMonitor::suspend()
 void
 ActivityMonitor::resume()
 {
-  TRACE_ENTER_MSG("ActivityMonitor::resume", activity_state);
-  lock.lock();
-  activity_state = ACTIVITY_IDLE;
-  lock.unlock();
-  TRACE_RETURN(activity_state);
+  TRACE_ENTER("ActivityMonitor::resume");
+  begin_update();
+  suspended = false;
+  last_action_time = 0;
+  end_update();
+  TRACE_EXIT();
 }
 
 
@@ -137,16 +128,14 @@ ActivityMonitor::resume()
 void
 ActivityMonitor::force_idle()
 {
-  TRACE_ENTER_MSG("ActivityMonitor::force_idle", activity_state);
-  lock.lock();
-  if (activity_state != ACTIVITY_SUSPENDED)
+  TRACE_ENTER("ActivityMonitor::force_idle");
+  begin_update();
+  if (!suspended)
     {
-      activity_state = ACTIVITY_IDLE;
-      last_action_time.tv_sec = 0;
-      last_action_time.tv_usec = 0;
+      last_action_time = 0;
     }
-  lock.unlock();
-  TRACE_RETURN(activity_state);
+  end_update();
+  TRACE_EXIT();
 }
 
 
@@ -154,30 +143,27 @@ ActivityMonitor::force_idle()
 ActivityState
 ActivityMonitor::get_current_state()
 {
-  TRACE_ENTER_MSG("ActivityMonitor::get_current_state", activity_state);
-  lock.lock();
+  TRACE_ENTER("ActivityMonitor::get_current_state");
 
-  // First update the state...
-  if (activity_state == ACTIVITY_ACTIVE)
+  // Include the input that is still queued.
+  if (input_monitor != NULL)
     {
-      GTimeVal now, tv;
+      input_monitor->process_events();
+    }
 
-      g_get_current_time(&now);
-      tvSUBTIME(tv, now, last_action_time);
+  gint64 now = g_get_monotonic_time();
+  ActivityState state;
+  guint seq;
 
-      TRACE_MSG("Active: "
-                << tv.tv_sec << "." << tv.tv_usec << " "
-                << idle_threshold.tv_sec << " " << idle_threshold.tv_usec);
-      if (tvTIMEGT(tv, idle_threshold))
-        {
-          // No longer active.
-          activity_state = ACTIVITY_IDLE;
-        }
+  do
+    {
+      seq = begin_read();
+      state = derive_state(now);
     }
+  while (!end_read(seq));
 
-  lock.unlock();
-  TRACE_RETURN(activity_state);
-  return activity_state;
+  TRACE_RETURN(state);
+  return state;
 }
 
 
@@ -186,17 +172,22 @@ ActivityMonitor::get_current_state()
 void
 ActivityMonitor::set_parameters(int noise, int activity, int idle)
 {
-  noise_threshold.tv_sec = noise / 1000;
-  noise_threshold.tv_usec = (noise % 1000) * 1000;
-
-  activity_threshold.tv_sec = activity / 1000;
-  activity_threshold.tv_usec = (activity % 1000) * 1000;
+  begin_update();
 
-  idle_threshold.tv_sec = idle / 1000;
-  idle_threshold.tv_usec = (idle % 1000) * 1000;
+  noise_threshold = (gint64) noise * 1000;
+  activity_threshold = (gint64) activity * 1000;
+  idle_threshold = (gint64) idle * 1000;
 
   // The easy way out.
-  activity_state = ACTIVITY_IDLE;
+  suspended = false;
+  last_action_time = 0;
+
+  end_update();
+
+  if (input_monitor != NULL)
+    {
+      input_monitor->set_activity_parameters(noise, activity, idle);
+    }
 }
 
 
@@ -205,29 +196,39 @@ ActivityMonitor::set_parameters(int noise, int activity, int idle)
 void
 ActivityMonitor::get_parameters(int &noise, int &activity, int &idle)
 {
-  noise = noise_threshold.tv_sec * 1000 + noise_threshold.tv_usec / 1000;
-  activity = activity_threshold.tv_sec * 1000 + activity_threshold.tv_usec / 1000;
-  idle = idle_threshold.tv_sec * 1000 + idle_threshold.tv_usec / 1000;
+  guint seq;
+
+  do
+    {
+      seq = begin_read();
+      noise = (int) (noise_threshold / 1000);
+      activity = (int) (activity_threshold / 1000);
+      idle = (int) (idle_threshold / 1000);
+    }
+  while (!end_read(seq));
 }
 
 
-//! Shifts the internal time (after system clock has been set)
+//! Sets the minimum number of milliseconds between mouse movement reports.
 void
-ActivityMonitor::shift_time(int delta)
+ActivityMonitor::set_mouse_interval(int interval)
 {
-  GTimeVal d;
-
-  lock.lock();
-
-  tvSETTIME(d, delta, 0)
-
-  if (!tvTIMEEQ0(last_action_time))
-    tvADDTIME(last_action_time, last_action_time, d);
+  if (input_monitor != NULL)
+    {
+      input_monitor->set_mouse_interval(interval);
+    }
+}
 
-  if (!tvTIMEEQ0(first_action_time))
-    tvADDTIME(first_action_time, first_action_time, d);
 
-  lock.unlock();
+//! Shifts the internal time (after system clock has been set)
+/*!
+ *  The activity times are monotonic, and do not change with the system
+ *  clock.
+ */
+void
+ActivityMonitor::shift_time(int delta)
+{
+  (void) delta;
 }
 
 
@@ -235,9 +236,7 @@ ActivityMonitor::shift_time(int delta)
 void
 ActivityMonitor::set_listener(ActivityMonitorListener *l)
 {
-  lock.lock();
-  listener = l;
-  lock.unlock();
+  g_atomic_pointer_set(&listener, l);
 }
 
 
@@ -245,55 +244,10 @@ ActivityMonitor::set_listener(ActivityMonitorListener *l)
 void
 ActivityMonitor::action_notify()
 {
-  lock.lock();
-
-  GTimeVal now;
-  g_get_current_time(&now);
+  begin_update();
+  process_action(g_get_monotonic_time());
+  end_update();
 
-  switch (activity_state)
-    {
-    case ACTIVITY_IDLE:
-      {
-        first_action_time = now;
-        last_action_time = now;
-
-        if (tvTIMEEQ0(activity_threshold))
-          {
-            activity_state = ACTIVITY_ACTIVE;
-          }
-        else
-          {
-            activity_state = ACTIVITY_NOISE;
-          }
-      }
-      break;
-
-    case ACTIVITY_NOISE:
-      {
-        GTimeVal tv;
-
-        tvSUBTIME(tv, now, last_action_time);
-        if (tvTIMEGT(tv, noise_threshold))
-          {
-            first_action_time = now;
-          }
-        else
-          {
-            tvSUBTIME(tv, now, first_action_time);
-            if (tvTIMEGEQ(tv, activity_threshold))
-              {
-                activity_state = ACTIVITY_ACTIVE;
-              }
-          }
-      }
-      break;
-
-    default:
-      break;
-    }
-
-  last_action_time = now;
-  lock.unlock();
   call_listener();
 }
 
@@ -304,7 +258,6 @@ ActivityMonitor::mouse_notify(int x, int y, int wheel_delta)
 {
   static const int sensitivity = 3;
 
-  lock.lock();
   const int delta_x = x - prev_x;
   const int delta_y = y - prev_y;
   prev_x = x;
@@ -315,7 +268,6 @@ ActivityMonitor::mouse_notify(int x, int y, int wheel_delta)
     {
       action_notify();
     }
-  lock.unlock();
 }
 
 
@@ -323,16 +275,12 @@ ActivityMonitor::mouse_notify(int x, int y, int wheel_delta)
 void
 ActivityMonitor::button_notify(bool is_press)
 {
-  lock.lock();
-
   button_is_pressed = is_press;
 
   if (is_press)
     {
       action_notify();
     }
-
-  lock.unlock();
 }
 
 
@@ -342,9 +290,173 @@ ActivityMonitor::keyboard_notify(bool repeat)
 {
   (void)repeat;
 
-  lock.lock();
   action_notify();
-  lock.unlock();
+}
+
+
+//! A batch of input events is reported by the input monitor.
+/*!
+ *  The state is updated using the time at which each event occurred, so
+ *  it does not depend on how late the batch is processed.
+ */
+void
+ActivityMonitor::input_notify(const InputEvent *events, int count)
+{
+  static const int sensitivity = 3;
+  bool active = false;
+
+  begin_update();
+  for (int i = 0; i < count; i++)
+    {
+      const InputEvent &event = events[i];
+      bool action = false;
+
+      switch (event.type)
+        {
+        case InputEvent::INPUT_MOUSE:
+        case InputEvent::INPUT_MOUSE_MOTION:
+          {
+            const int delta_x = event.x - prev_x;
+            const int delta_y = event.y - prev_y;
+            prev_x = event.x;
+            prev_y = event.y;
+
+            action = (abs(delta_x) >= sensitivity || abs(delta_y) >= sensitivity
+                      || event.wheel != 0 || button_is_pressed);
+          }
+          break;
+
+        case InputEvent::INPUT_BUTTON:
+          button_is_pressed = event.flag != 0;
+          action = button_is_pressed;
+          break;
+
+        case InputEvent::INPUT_ACTION:
+        case InputEvent::INPUT_KEYBOARD:
+          action = true;
+          break;
+        }
+
+      if (action)
+        {
+          process_action(event.time);
+          active = true;
+        }
+    }
+  end_update();
+
+  if (active)
+    {
+      call_listener();
+    }
+}
+
+
+//! Starts reading the state.
+/*!
+ *  \return the sequence number to pass to end_read().
+ */
+guint
+ActivityMonitor::begin_read() const
+{
+  guint seq;
+
+  // Wait until an update in another thread is complete.
+  while ((seq = (guint) g_atomic_int_get(&sequence)) & 1)
+    {
+    }
+
+  return seq;
+}
+
+
+//! Finishes reading the state.
+/*!
+ *  \return false if the state was updated while reading, and must be read again.
+ */
+bool
+ActivityMonitor::end_read(guint seq) const
+{
+  return (guint) g_atomic_int_get(&sequence) == seq;
+}
+
+
+//! Starts updating the state.
+void
+ActivityMonitor::begin_update()
+{
+  guint seq;
+
+  do
+    {
+      seq = (guint) g_atomic_int_get(&sequence) & ~1U;
+    }
+  while (!g_atomic_int_compare_and_exchange(&sequence, (gint) seq, (gint) (seq + 1)));
+}
+
+
+//! Finishes updating the state.
+void
+ActivityMonitor::end_update()
+{
+  g_atomic_int_inc(&sequence);
+}
+
+
+//! Returns the state at the specified time.
+/*!
+ *  The user is active once the activity lasted for the activity threshold,
+ *  and becomes idle when there was no activity for the idle threshold.
+ */
+ActivityState
+ActivityMonitor::derive_state(gint64 now) const
+{
+  if (suspended)
+    {
+      return ACTIVITY_SUSPENDED;
+    }
+  else if (last_action_time == 0)
+    {
+      return ACTIVITY_IDLE;
+    }
+  else if (last_action_time - first_action_time >= activity_threshold)
+    {
+      return (now - last_action_time > idle_threshold) ? ACTIVITY_IDLE : ACTIVITY_ACTIVE;
+    }
+
+  return ACTIVITY_NOISE;
+}
+
+
+//! Updates the state for activity at the specified time.
+/*!
+ *  Must be called between begin_update() and end_update().
+ */
+void
+ActivityMonitor::process_action(gint64 now)
+{
+  switch (derive_state(now))
+    {
+    case ACTIVITY_SUSPENDED:
+      return;
+
+    case ACTIVITY_IDLE:
+      first_action_time = now;
+      break;
+
+    case ACTIVITY_NOISE:
+      if (now - last_action_time > noise_threshold)
+        {
+          // Too long since the previous action, start again.
+          first_action_time = now;
+        }
+      break;
+
+    default:
+      break;
+    }
+
+  last_action_time = now;
 }
 
 
@@ -352,21 +464,15 @@ ActivityMonitor::keyboard_notify(bool repeat)
 void
 ActivityMonitor::call_listener()
 {
-  ActivityMonitorListener *l = NULL;
-
-  lock.lock();
-  l = listener;
-  lock.unlock();
+  ActivityMonitorListener *l = (ActivityMonitorListener *) g_atomic_pointer_get(&listener);
 
   if (l != NULL)
     {
       // Listener is set.
       if (!l->action_notify())
         {
-          // Remove listener.
-          lock.lock();
-          listener = NULL;
-          lock.unlock();
+          // Remove listener, unless it was replaced meanwhile.
+          g_atomic_pointer_compare_and_exchange(&listener, l, NULL);
         }
     }
 }
@@ -20,24 +20,23 @@
 #ifndef ACTIVITYMONITOR_HH
 #define ACTIVITYMONITOR_HH
 
+#include <glib.h>
+
 #include "IActivityMonitor.hh"
 #include "IInputMonitorListener.hh"
-#include "Mutex.hh"
-
-#if TIME_WITH_SYS_TIME
-# include <sys/time.h>
-# include <time.h>
-#else
-# if HAVE_SYS_TIME_H
-#  include <sys/time.h>
-# else
-#  include <time.h>
-# endif
-#endif
 
 class ActivityListener;
 class IInputMonitor;
 
+//! Determines whether the user is active from the reported input.
+/*!
+ *  The state is not stored, but derived from the times of the first and
+ *  last action of the current period of activity when it is read. Both
+ *  times are monotonic. Updates are guarded by a sequence number, so that
+ *  the state can be read from any thread without locking.
+ *
+ *  Input is reported from the main thread.
+ */
 class ActivityMonitor :
   public IInputMonitorListener,
   public IActivityMonitor
@@ -56,6 +55,7 @@ public:
 
   void set_parameters(int noise, int activity, int idle);
   void get_parameters(int &noise, int &activity, int &idle);
+  void set_mouse_interval(int interval);
 
   void set_listener(ActivityMonitorListener *l);
 
@@ -63,19 +63,42 @@ public:
   void mouse_notify(int x, int y, int wheel = 0);
   void button_notify(bool is_press);
   void keyboard_notify(bool repeat);
+  void input_notify(const InputEvent *events, int count);
 
 private:
+  guint begin_read() const;
+  bool end_read(guint sequence) const;
+  void begin_update();
+  void end_update();
+
+  ActivityState derive_state(gint64 now) const;
+  void process_action(gint64 now);
   void call_listener();
 
 private:
   //! The actual monitoring driver.
   IInputMonitor *input_monitor;
 
-  //! the current state.
-  ActivityState activity_state;
+  //! Incremented before and after each update, odd during an update.
+  volatile gint sequence;
+
+  //! Is the monitoring suspended?
+  bool suspended;
+
+  //! Last time activity was detected, in microseconds, or 0 when idle.
+  gint64 last_action_time;
+
+  //! First time activity was detected after being idle or noise, in microseconds.
+  gint64 first_action_time;
+
+  //! The noise threshold, in microseconds.
+  gint64 noise_threshold;
 
-  //! Internal locking
-  Mutex lock;
+  //! The activity threshold, in microseconds.
+  gint64 activity_threshold;
+
+  //! The idle threshold, in microseconds.
+  gint64 idle_threshold;
 
   //! Previous X coordinate
   int prev_x;
@@ -86,23 +109,8 @@ private:
   //! Is the button currently pressed?
   bool button_is_pressed;
 
-  //! Last time activity was detected
-  GTimeVal last_action_time;
-
-  //! First time the \c ACTIVITY_IDLE state was left.
-  GTimeVal first_action_time;
-
-  //! The noise threshold
-  GTimeVal noise_threshold;
-
-  //! The activity threshold.
-  GTimeVal activity_threshold;
-
-  //! The idle threshold.
-  GTimeVal idle_threshold;
-
   //! Activity listener.
-  ActivityMonitorListener *listener;
+  ActivityMonitorListener * volatile listener;
 };
 
 #endif // ACTIVITYMONITOR_HH
@@ -51,6 +51,7 @@
 #ifdef HAVE_DISTRIBUTION
 #include "DistributionManager.hh"
 #include "IdleLogManager.hh"
+#include "TimerStateManager.hh"
 #include "PacketBuffer.hh"
 #ifndef NDEBUG
 #include "FakeActivityMonitor.hh"
@@ -104,7 +105,8 @@ Core::Core() :
   ,
   dist_manager(NULL),
   remote_state(ACTIVITY_IDLE),
-  idlelog_manager(NULL)
+  idlelog_manager(NULL),
+  timer_state_manager(NULL)
 #  ifndef NDEBUG
   ,
   fake_monitor(NULL)
@@ -144,6 +146,8 @@ Core::~Core()
       delete idlelog_manager;
     }
 
+  delete timer_state_manager;
+
   delete dist_manager;
 #ifndef NDEBUG
   delete fake_monitor;
@@ -252,6 +256,9 @@ Core::init_bus()
 
       dbus->connect(DBUS_PATH_WORKRAVE, "org.workrave.CoreInterface", this);
       dbus->connect(DBUS_PATH_WORKRAVE, "org.workrave.ConfigInterface", configurator);
+#ifdef HAVE_DISTRIBUTION
+      dbus->connect(DBUS_PATH_WORKRAVE, "org.workrave.NetworkInterface", dist_manager);
+#endif
       dbus->register_object_path(DBUS_PATH_WORKRAVE);
       
 #ifdef HAVE_TESTS
@@ -316,11 +323,15 @@ Core::init_distribution_manager()
   dist_manager->register_client_message(DCM_MONITOR, DCMT_MASTER, this);
   dist_manager->register_client_message(DCM_IDLELOG, DCMT_SIGNON, this);
   dist_manager->register_client_message(DCM_BREAKCONTROL, DCMT_PASSIVE, this);
+  dist_manager->register_client_message(DCM_TIMERS_DELTA, DCMT_PASSIVE, this);
+  dist_manager->register_client_message(DCM_TIMERS_ACK, DCMT_PASSIVE, this);
 
   dist_manager->add_listener(this);
 
   idlelog_manager = new IdleLogManager(dist_manager->get_my_id(), this);
   idlelog_manager->init();
+
+  timer_state_manager = new TimerStateManager(dist_manager->get_my_id(), breaks);
 }
 #endif
 
@@ -343,6 +354,7 @@ Core::load_monitor_config()
   int noise;
   int activity;
   int idle;
+  int mouse_interval;
 
   assert(configurator != NULL);
   assert(monitor != NULL);
@@ -353,6 +365,8 @@ Core::load_monitor_config()
     activity = 1000;
   if (! configurator->get_value(CoreConfig::CFG_KEY_MONITOR_IDLE, idle))
     idle = 5000;
+  if (! configurator->get_value(CoreConfig::CFG_KEY_MONITOR_MOUSE_INTERVAL, mouse_interval))
+    mouse_interval = 20;
 
   // Pre 1.0 compatibility...
   if (noise < 50)
@@ -373,9 +387,10 @@ Core::load_monitor_config()
       configurator->set_value(CoreConfig::CFG_KEY_MONITOR_IDLE, idle);
     }
 
-  TRACE_MSG("Monitor config = " << noise << " " << activity << " " << idle);
+  TRACE_MSG("Monitor config = " << noise << " " << activity << " " << idle << " " << mouse_interval);
 
   monitor->set_parameters(noise, activity, idle);
+  monitor->set_mouse_interval(mouse_interval);
   TRACE_EXIT();
 }
 
@@ -1091,6 +1106,14 @@ Core::heartbeat()
   // Set current time.
   current_time = time(NULL);
 
+#ifdef HAVE_DISTRIBUTION
+  // Send all client messages of this heartbeat at once.
+  if (dist_manager != NULL)
+    {
+      dist_manager->begin_batch();
+    }
+#endif
+
   // Performs timewarp checking.
   bool warped = process_timewarp();
 
@@ -1126,6 +1149,13 @@ Core::heartbeat()
       save_state();
     }
 
+#ifdef HAVE_DISTRIBUTION
+  if (dist_manager != NULL)
+    {
+      dist_manager->end_batch();
+    }
+#endif
+
   // Done.
   last_process_time = current_time;
 
@@ -1171,11 +1201,8 @@ Core::process_distribution()
       dist_manager->broadcast_client_message(DCM_MONITOR, buffer);
 
       buffer.clear();
-      bool ret = request_timer_state(buffer);
-      if (ret)
-        {
-          dist_manager->broadcast_client_message(DCM_TIMERS, buffer);
-        }
+      DistributionClientMessageID id = timer_state_manager->get_timer_update(buffer);
+      dist_manager->broadcast_client_message(id, buffer);
     }
 
 #endif
@@ -1847,7 +1874,8 @@ Core::request_client_message(DistributionClientMessageID id, PacketBuffer &buffe
       break;
 
     case DCM_TIMERS:
-      ret = request_timer_state(buffer);
+      timer_state_manager->get_timer_state(buffer);
+      ret = true;
       break;
 
     case DCM_CONFIG:
@@ -1880,8 +1908,7 @@ Core::client_message(DistributionClientMessageID id, bool master, const char *cl
                      PacketBuffer &buffer)
 {
   bool ret = false;
-
-  (void) client_id;
+  string sender = client_id != NULL ? client_id : "";
 
   switch (id)
     {
@@ -1890,7 +1917,34 @@ Core::client_message(DistributionClientMessageID id, bool master, const char *cl
       break;
 
     case DCM_TIMERS:
-      ret = set_timer_state(buffer);
+    case DCM_TIMERS_DELTA:
+      {
+        PacketBuffer ack;
+        ack.create();
+
+        bool send_ack = (id == DCM_TIMERS
+                         ? timer_state_manager->set_timer_state(sender, buffer, ack)
+                         : timer_state_manager->set_timer_delta(sender, buffer, ack));
+        if (send_ack)
+          {
+            // Only the sender of the timer state needs the acknowledgement.
+            dist_manager->send_client_message_to(sender, DCM_TIMERS_ACK, ack);
+          }
+        ret = true;
+      }
+      break;
+
+    case DCM_TIMERS_ACK:
+      if (timer_state_manager->set_timer_ack(sender, buffer) && master_node)
+        {
+          // Remote client lost track of the timer state, send all of it.
+          PacketBuffer state;
+          state.create();
+
+          timer_state_manager->get_timer_state(state);
+          dist_manager->broadcast_client_message(DCM_TIMERS, state);
+        }
+      ret = true;
       break;
 
     case DCM_MONITOR:
@@ -1905,7 +1959,15 @@ Core::client_message(DistributionClientMessageID id, bool master, const char *cl
       break;
 
     case DCM_IDLELOG:
-      idlelog_manager->set_idlelog(buffer);
+      if (idlelog_manager->set_idlelog(buffer))
+        {
+          // Idle logs are out of sync, send mine again.
+          PacketBuffer idlelog;
+          idlelog.create();
+
+          idlelog_manager->get_idlelog(idlelog);
+          dist_manager->broadcast_client_message(DCM_IDLELOG, idlelog);
+        }
       compute_timers();
       ret = true;
       break;
@@ -1986,99 +2048,6 @@ Core::set_break_state(bool master, PacketBuffer &buffer)
   return true;
 }
 
-bool
-Core::request_timer_state(PacketBuffer &buffer) const
-{
-  TRACE_ENTER("Core::get_timer_state");
-
-  buffer.pack_ushort(BREAK_ID_SIZEOF);
-
-  for (int i = 0; i < BREAK_ID_SIZEOF; i++)
-    {
-      Timer *t = breaks[i].get_timer();
-      buffer.pack_string(t->get_id().c_str());
-
-      Timer::TimerStateData state_data;
-
-      t->get_state_data(state_data);
-
-      int pos = buffer.bytes_written();
-
-      buffer.pack_ushort(0);
-      buffer.pack_ulong((guint32)state_data.current_time);
-      buffer.pack_ulong((guint32)state_data.elapsed_time);
-      buffer.pack_ulong((guint32)state_data.elapsed_idle_time);
-      buffer.pack_ulong((guint32)state_data.last_pred_reset_time);
-      buffer.pack_ulong((guint32)state_data.total_overdue_time);
-
-      buffer.pack_ulong((guint32)state_data.last_limit_time);
-      buffer.pack_ulong((guint32)state_data.last_limit_elapsed);
-      buffer.pack_ushort((guint16)state_data.snooze_inhibited);
-
-      buffer.poke_ushort(pos, buffer.bytes_written() - pos);
-    }
-
-  TRACE_EXIT();
-  return true;
-}
-
-
-bool
-Core::set_timer_state(PacketBuffer &buffer)
-{
-  TRACE_ENTER("Core::set_timer_state");
-
-  int num_breaks = buffer.unpack_ushort();
-
-  TRACE_MSG("numtimer = " << num_breaks);
-  for (int i = 0; i < num_breaks; i++)
-    {
-      gchar *id = buffer.unpack_string();
-      TRACE_MSG("id = " << id);
-
-      if (id == NULL)
-        {
-          TRACE_EXIT();
-          return false;
-        }
-
-      Timer *t = (Timer *)get_timer(id);
-
-      Timer::TimerStateData state_data;
-
-      buffer.unpack_ushort();
-
-      state_data.current_time = buffer.unpack_ulong();
-      state_data.elapsed_time = buffer.unpack_ulong();
-      state_data.elapsed_idle_time = buffer.unpack_ulong();
-      state_data.last_pred_reset_time = buffer.unpack_ulong();
-      state_data.total_overdue_time = buffer.unpack_ulong();
-
-      state_data.last_limit_time = buffer.unpack_ulong();
-      state_data.last_limit_elapsed = buffer.unpack_ulong();
-      state_data.snooze_inhibited = buffer.unpack_ushort();
-
-      TRACE_MSG("state = "
-                << state_data.current_time << " "
-                << state_data.elapsed_time << " "
-                << state_data.elapsed_idle_time << " "
-                << state_data.last_pred_reset_time << " "
-                << state_data.total_overdue_time
-                );
-
-      if (t != NULL)
-        {
-          t->set_state_data(state_data);
-        }
-
-      g_free(id);
-    }
-
-  TRACE_EXIT();
-  return true;
-}
-
-
 bool
 Core::set_monitor_state(bool master, PacketBuffer &buffer)
 {
@@ -2102,6 +2071,7 @@ void
 Core::signon_remote_client(string client_id)
 {
   idlelog_manager->signon_remote_client(client_id);
+  timer_state_manager->signon_remote_client(client_id);
 
   if (master_node)
     {
@@ -2133,6 +2103,7 @@ Core::signoff_remote_client(string client_id)
     }
 
   idlelog_manager->signoff_remote_client(client_id);
+  timer_state_manager->signoff_remote_client(client_id);
   TRACE_EXIT();
 }
 
@@ -2170,6 +2141,11 @@ Core::compute_timers()
 
 
 //! Sends a break control message to all workrave clients.
+/*!
+ *  Break control messages are sent immediately, and not with the next
+ *  heartbeat, so that the break windows on all clients follow the user
+ *  without a noticeable delay.
+ */
 void
 Core::send_break_control_message(BreakId break_id, BreakControlMessage message)
 {
@@ -2180,7 +2156,7 @@ Core::send_break_control_message(BreakId break_id, BreakControlMessage message)
   buffer.pack_ushort(break_id);
   buffer.pack_ushort(message);
 
-  dist_manager->broadcast_client_message(DCM_BREAKCONTROL, buffer);
+  dist_manager->broadcast_urgent_client_message(DCM_BREAKCONTROL, buffer);
 }
 
 //! Sends a break control message with boolean parameter to all workrave clients.
@@ -2196,7 +2172,7 @@ Core::send_break_control_message_bool_param(BreakId break_id, BreakControlMessag
   buffer.pack_ushort(message);
   buffer.pack_byte(param);
 
-  dist_manager->broadcast_client_message(DCM_BREAKCONTROL, buffer);
+  dist_manager->broadcast_urgent_client_message(DCM_BREAKCONTROL, buffer);
 }
 
 
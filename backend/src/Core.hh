@@ -64,6 +64,7 @@ class Configurator;
 class Statistics;
 class FakeActivityMonitor;
 class IdleLogManager;
+class TimerStateManager;
 class BreakControl;
 
 #ifdef HAVE_DISTRIBUTION
@@ -200,9 +201,6 @@ private:
   bool request_break_state(PacketBuffer &buffer);
   bool set_break_state(bool master, PacketBuffer &buffer);
 
-  bool request_timer_state(PacketBuffer &buffer) const;
-  bool set_timer_state(PacketBuffer &buffer);
-
   bool set_monitor_state(bool master, PacketBuffer &buffer);
 
   enum BreakControlMessage
@@ -309,6 +307,9 @@ private:
   //! Manager that collects idle times of all clients.
   IdleLogManager *idlelog_manager;
 
+  //! Timer state replication
+  TimerStateManager *timer_state_manager;
+
 #ifndef NDEBUG
   //! A fake activity monitor for testing puposes.
   FakeActivityMonitor *fake_monitor;
@@ -50,6 +50,7 @@ const string CoreConfig::CFG_KEY_MONITOR                   = "monitor";
 const string CoreConfig::CFG_KEY_MONITOR_NOISE             = "monitor/noise";
 const string CoreConfig::CFG_KEY_MONITOR_ACTIVITY          = "monitor/activity";
 const string CoreConfig::CFG_KEY_MONITOR_IDLE              = "monitor/idle";
+const string CoreConfig::CFG_KEY_MONITOR_MOUSE_INTERVAL    = "monitor/mouse-interval";
 
 const string CoreConfig::CFG_KEY_GENERAL_DATADIR           = "general/datadir";
 const string CoreConfig::CFG_KEY_OPERATION_MODE            = "general/operation-mode";
@@ -59,6 +60,8 @@ const string CoreConfig::CFG_KEY_DISTRIBUTION              = "distribution";
 const string CoreConfig::CFG_KEY_DISTRIBUTION_ENABLED      = "distribution/enabled";
 const string CoreConfig::CFG_KEY_DISTRIBUTION_LISTENING    = "distribution/listening";
 const string CoreConfig::CFG_KEY_DISTRIBUTION_PEERS        = "distribution/peers";
+const string CoreConfig::CFG_KEY_DISTRIBUTION_DISCOVERY    = "distribution/discovery";
+const string CoreConfig::CFG_KEY_DISTRIBUTION_DISCOVERY_INTERFACE = "distribution/discovery_interface";
 const string CoreConfig::CFG_KEY_DISTRIBUTION_TCP          = "distribution/tcp";
 const string CoreConfig::CFG_KEY_DISTRIBUTION_TCP_PORT     = "distribution/port";
 const string CoreConfig::CFG_KEY_DISTRIBUTION_TCP_USERNAME = "distribution/username";
@@ -0,0 +1,288 @@
+// Discovery.cc --- Zero-configuration peer discovery
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_DISTRIBUTION)
+
+#include "debug.hh"
+
+#include "Discovery.hh"
+#include "PacketBuffer.hh"
+
+#if defined(HAVE_GIO_NET) && GLIB_CHECK_VERSION(2,32,0)
+#include "GIODiscovery.hh"
+#define HAVE_GIO_DISCOVERY 1
+#endif
+
+using namespace std;
+
+
+//! Creates a discovery on the specified network interface.
+/*!
+ *  Returns NULL if discovery is not supported on this platform.
+ */
+Discovery *
+Discovery::create(const string &interface)
+{
+#if defined(HAVE_GIO_DISCOVERY)
+  return new GIODiscovery(interface);
+#else
+  (void) interface;
+  return NULL;
+#endif
+}
+
+
+//! Constructs a discovery.
+Discovery::Discovery() :
+  listener(NULL),
+  running(false),
+  port(0),
+  protocol(0),
+  next_announcement_time(0),
+  startup_announcements(0)
+{
+}
+
+
+//! Destructs the discovery.
+Discovery::~Discovery()
+{
+}
+
+
+//! Sets the receiver of discovered peers.
+void
+Discovery::set_listener(IDiscoveryListener *listener)
+{
+  this->listener = listener;
+}
+
+
+//! Starts announcing myself and listening for announcements.
+bool
+Discovery::start(const string &id, int port, int protocol, time_t current_time)
+{
+  TRACE_ENTER_MSG("Discovery::start", id << " " << port);
+
+  if (running)
+    {
+      stop();
+    }
+
+  running = open();
+  if (running)
+    {
+      this->id = id;
+      this->port = port;
+      this->protocol = protocol;
+
+      // Announce a few times shortly after starting, so that a lost
+      // datagram does not leave me undiscovered for a long time.
+      startup_announcements = DISCOVERY_STARTUP_ANNOUNCEMENTS;
+      next_announcement_time = current_time + g_random_int_range(0, DISCOVERY_STARTUP_INTERVAL + 1);
+    }
+
+  TRACE_RETURN(running);
+  return running;
+}
+
+
+//! Stops announcing myself.
+void
+Discovery::stop()
+{
+  TRACE_ENTER("Discovery::stop");
+  if (running)
+    {
+      send_announcement(true);
+      close();
+
+      running = false;
+      nodes.clear();
+    }
+  TRACE_EXIT();
+}
+
+
+//! Sends and processes announcements.
+/*!
+ *  Must be called once a second.
+ */
+void
+Discovery::heartbeat(time_t current_time)
+{
+  if (!running)
+    {
+      return;
+    }
+
+  // Bound the work done per heartbeat, whatever the others send.
+  PacketBuffer packet;
+  string host;
+  for (int i = 0; i < DISCOVERY_MAX_RECEIVE && receive(packet, host); i++)
+    {
+      process_announcement(packet, host, current_time);
+    }
+
+  expire_nodes(current_time);
+
+  if (current_time >= next_announcement_time)
+    {
+      send_announcement(false);
+
+      if (startup_announcements > 0)
+        {
+          startup_announcements--;
+          next_announcement_time = current_time + g_random_int_range(1, DISCOVERY_STARTUP_INTERVAL + 1);
+        }
+      else
+        {
+          // Randomize between half and one and a half interval, so that
+          // nodes that started at the same time do not stay synchronized.
+          time_t interval = get_interval();
+          next_announcement_time = current_time + interval / 2 + g_random_int_range(0, interval + 1);
+        }
+    }
+}
+
+
+//! Returns the number of other nodes heard recently.
+int
+Discovery::get_number_of_nodes() const
+{
+  return nodes.size();
+}
+
+
+//! Sends an announcement to the multicast group.
+void
+Discovery::send_announcement(bool leaving)
+{
+  TRACE_ENTER_MSG("Discovery::send_announcement", leaving);
+  PacketBuffer packet;
+  packet.create();
+
+  packet.pack_ushort(DISCOVERY_MAGIC);
+  packet.pack_byte(DISCOVERY_FORMAT);
+  packet.pack_byte(leaving ? ANNOUNCEMENT_LEAVING : 0);
+  packet.pack_byte(protocol);
+  packet.pack_ushort(port);
+  packet.pack_string(id);
+
+  send(packet);
+  TRACE_EXIT();
+}
+
+
+//! Processes an announcement received from the specified host.
+void
+Discovery::process_announcement(PacketBuffer &packet, const string &host, time_t current_time)
+{
+  TRACE_ENTER_MSG("Discovery::process_announcement", host);
+
+  if (packet.bytes_available() < 7 ||
+      packet.unpack_ushort() != DISCOVERY_MAGIC ||
+      packet.unpack_byte() != DISCOVERY_FORMAT)
+    {
+      TRACE_RETURN("Not an announcement");
+      return;
+    }
+
+  int flags = packet.unpack_byte();
+  int peer_protocol = packet.unpack_byte();
+  int peer_port = packet.unpack_ushort();
+  gchar *peer_id = packet.unpack_string();
+
+  if (peer_id == NULL || peer_id[0] == '\0' || peer_port == 0 || peer_protocol == 0 || host == "")
+    {
+      g_free(peer_id);
+      TRACE_RETURN("Invalid announcement");
+      return;
+    }
+
+  string peer(peer_id);
+  g_free(peer_id);
+
+  if (peer == id)
+    {
+      // My own announcement, looped back.
+      TRACE_EXIT();
+      return;
+    }
+
+  if (flags & ANNOUNCEMENT_LEAVING)
+    {
+      nodes.erase(peer);
+      TRACE_EXIT();
+      return;
+    }
+
+  if (nodes.size() < DISCOVERY_MAX_NODES || nodes.find(peer) != nodes.end())
+    {
+      nodes[peer] = current_time;
+    }
+
+  // Every node receives the announcement. Only report it to about
+  // DISCOVERY_FANOUT of them, to prevent all nodes from connecting to
+  // the same peer at once.
+  if (listener != NULL && g_random_int_range(0, nodes.size() + 1) < DISCOVERY_FANOUT)
+    {
+      listener->peer_discovered(peer, host, peer_port, peer_protocol);
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Forgets the nodes that have not been heard for a long time.
+void
+Discovery::expire_nodes(time_t current_time)
+{
+  // A node announces itself at most one and a half interval apart, so
+  // this tolerates the loss of one announcement.
+  time_t timeout = 3 * get_interval();
+
+  map<string, time_t>::iterator i = nodes.begin();
+  while (i != nodes.end())
+    {
+      if (current_time - i->second > timeout)
+        {
+          nodes.erase(i++);
+        }
+      else
+        {
+          i++;
+        }
+    }
+}
+
+
+//! Returns the average number of seconds between my periodic announcements.
+time_t
+Discovery::get_interval() const
+{
+  time_t interval = (nodes.size() + 1) * 60 / DISCOVERY_GROUP_RATE;
+  return interval < DISCOVERY_MIN_INTERVAL ? DISCOVERY_MIN_INTERVAL : interval;
+}
+
+#endif
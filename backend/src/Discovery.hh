@@ -0,0 +1,170 @@
+// Discovery.hh --- Zero-configuration peer discovery
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef DISCOVERY_HH
+#define DISCOVERY_HH
+
+#if defined(HAVE_DISTRIBUTION)
+
+#include <string>
+#include <map>
+
+#if TIME_WITH_SYS_TIME
+# include <sys/time.h>
+# include <time.h>
+#else
+# if HAVE_SYS_TIME_H
+#  include <sys/time.h>
+# else
+#  include <time.h>
+# endif
+#endif
+
+#include <glib.h>
+
+class PacketBuffer;
+
+//! Link-local multicast group on which announcements are sent.
+#define DISCOVERY_GROUP "239.255.27.73"
+
+//! UDP port of the multicast group.
+#define DISCOVERY_PORT (27274)
+
+//! Minimum number of seconds between periodic announcements of a node.
+#define DISCOVERY_MIN_INTERVAL (60)
+
+//! Target number of announcements per minute of all nodes together.
+#define DISCOVERY_GROUP_RATE (30)
+
+//! Number of announcements sent shortly after discovery starts.
+#define DISCOVERY_STARTUP_ANNOUNCEMENTS (3)
+
+//! Maximum number of seconds between the startup announcements.
+#define DISCOVERY_STARTUP_INTERVAL (4)
+
+//! Expected number of nodes that act on a single announcement.
+#define DISCOVERY_FANOUT (3)
+
+//! Maximum number of nodes remembered.
+#define DISCOVERY_MAX_NODES (4096)
+
+//! Maximum number of announcements processed per heartbeat.
+#define DISCOVERY_MAX_RECEIVE (64)
+
+//! Maximum size of an announcement.
+#define DISCOVERY_MAX_SIZE (512)
+
+//! First two bytes of an announcement.
+#define DISCOVERY_MAGIC (0x5752)
+
+//! Format of an announcement.
+#define DISCOVERY_FORMAT (1)
+
+//! Receives the peers found by discovery.
+class IDiscoveryListener
+{
+public:
+  virtual ~IDiscoveryListener() {}
+
+  //! A peer announced itself.
+  virtual void peer_discovered(const std::string &id, const std::string &host, int port, int protocol) = 0;
+};
+
+
+//! Finds peers by exchanging announcements on a multicast group.
+/*!
+ *  Each node periodically announces its ID, port and protocol version.
+ *  The interval between announcements grows with the number of nodes
+ *  that are heard, so that all nodes together send about
+ *  DISCOVERY_GROUP_RATE announcements per minute, regardless of the
+ *  size of the network. On a network of 500 nodes, each node announces
+ *  itself once every 1000 seconds.
+ *
+ *  An announcement is reported to the listener with a probability that
+ *  also shrinks with the number of nodes, so that on average only
+ *  DISCOVERY_FANOUT nodes connect to a node that announces itself.
+ *
+ *  The transport is implemented by a subclass.
+ */
+class Discovery
+{
+public:
+  Discovery();
+  virtual ~Discovery();
+
+  static Discovery *create(const std::string &interface);
+
+  void set_listener(IDiscoveryListener *listener);
+  bool start(const std::string &id, int port, int protocol, time_t current_time);
+  void stop();
+  void heartbeat(time_t current_time);
+  int get_number_of_nodes() const;
+
+protected:
+  //! Joins the multicast group.
+  virtual bool open() = 0;
+
+  //! Leaves the multicast group.
+  virtual void close() = 0;
+
+  //! Sends a datagram to the multicast group.
+  virtual bool send(PacketBuffer &packet) = 0;
+
+  //! Receives a datagram without blocking, returns false if there is none.
+  virtual bool receive(PacketBuffer &packet, std::string &host) = 0;
+
+private:
+  enum AnnouncementFlags
+    {
+      ANNOUNCEMENT_LEAVING = 1,
+    };
+
+  void send_announcement(bool leaving);
+  void process_announcement(PacketBuffer &packet, const std::string &host, time_t current_time);
+  void expire_nodes(time_t current_time);
+  time_t get_interval() const;
+
+private:
+  //! Receiver of the discovered peers.
+  IDiscoveryListener *listener;
+
+  //! Whether announcements are sent and received.
+  bool running;
+
+  //! My ID.
+  std::string id;
+
+  //! Port at which I accept connections.
+  int port;
+
+  //! Highest protocol version I support.
+  int protocol;
+
+  //! Time of my next announcement.
+  time_t next_announcement_time;
+
+  //! Number of startup announcements still to be sent.
+  int startup_announcements;
+
+  //! Nodes heard recently, by ID, with the time they were last heard.
+  std::map<std::string, time_t> nodes;
+};
+
+#endif
+#endif // DISCOVERY_HH
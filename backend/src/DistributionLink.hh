@@ -21,12 +21,23 @@
 #define DISTRIBUTIONLINK_HH
 
 #include <string>
+#include <list>
 
 class DistributionLinkListener;
 class IDistributionClientMessage;
 class PacketBuffer;
 
 #include "IDistributionClientMessage.hh"
+#include "IDistributionManager.hh"
+
+//! A client message waiting to be sent.
+struct PendingClientMessage
+{
+  DistributionClientMessageID id;
+  PacketBuffer *buffer;
+};
+
+typedef std::list<PendingClientMessage> PendingClientMessages;
 
 class DistributionLink
 {
@@ -77,11 +88,25 @@ public:
   virtual bool broadcast_client_message(DistributionClientMessageID id,
                                         PacketBuffer &buffer) = 0;
 
+  //! Sends several client messages to all remote hosts in a single packet.
+  virtual bool broadcast_client_messages(const PendingClientMessages &messages) = 0;
+
+  //! Sends a client message to a single remote host.
+  virtual bool send_client_message_to(const string &client_id, DistributionClientMessageID id,
+                                      PacketBuffer &buffer) = 0;
+
+  //! Sends a time critical client message to all remote hosts, and requests an acknowledgement.
+  virtual bool broadcast_urgent_client_message(DistributionClientMessageID id,
+                                               PacketBuffer &buffer) = 0;
+
   //! Disconnects from all remote clients.
   virtual bool disconnect_all() = 0;
 
   //! Reconnects to all remote clients.
   virtual bool reconnect_all() = 0;
+
+  //! Returns the network statistics of all direct connections.
+  virtual workrave::DistributionPeerStatisticsList get_peer_statistics() = 0;
 };
 
 #endif // DISTRIBUTIONLINK_HH
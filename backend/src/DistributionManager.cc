@@ -33,6 +33,7 @@
 
 #include "DistributionManager.hh"
 #include "DistributionSocketLink.hh"
+#include "PacketBuffer.hh"
 #include "DistributionLogListener.hh"
 #include "DistributionListener.hh"
 #include "Configurator.hh"
@@ -50,7 +51,8 @@ DistributionManager::DistributionManager() :
   network_enabled(false),
   server_enabled(false),
   link(NULL),
-  state(NODE_ACTIVE)
+  state(NODE_ACTIVE),
+  batching(false)
 {
 }
 
@@ -58,18 +60,27 @@ DistributionManager::DistributionManager() :
 //! Destructs this DistributionManager.
 DistributionManager::~DistributionManager()
 {
+  for (PendingClientMessages::iterator i = pending_messages.begin(); i != pending_messages.end(); i++)
+    {
+      delete i->buffer;
+    }
+
   delete link;
 }
 
 
 //! Initialize the DistributionManager from the specified Configurator.
+/*!
+ *  \param driver Socket driver of the link, or NULL for the default driver.
+ *  \param time_source Source of the current time, or NULL for the system clock.
+ */
 void
-DistributionManager::init(Configurator *conf)
+DistributionManager::init(Configurator *conf, SocketDriver *driver, const TimeSource *time_source)
 {
   configurator = conf;
 
   // Create link to the outside world.
-  DistributionSocketLink *socketlink = new DistributionSocketLink(conf);
+  DistributionSocketLink *socketlink = new DistributionSocketLink(conf, driver, time_source);
 
   socketlink->set_distribution_manager(this);
   socketlink->init();
@@ -340,12 +351,27 @@ DistributionManager::remove_listener(DistributionListener *listener)
 
 
 //! Broadcasts a client message to all
+/*!
+ *  Between begin_batch and end_batch, the message is collected and sent
+ *  together with all other client messages by end_batch.
+ */
 bool
 DistributionManager::broadcast_client_message(DistributionClientMessageID id, PacketBuffer &buffer)
 {
   bool ret = false;
 
-  if (link != NULL)
+  if (link != NULL && batching)
+    {
+      PendingClientMessage message;
+      message.id = id;
+      message.buffer = new PacketBuffer;
+      message.buffer->create(buffer.bytes_written());
+      message.buffer->pack_raw((guint8 *)buffer.get_buffer(), buffer.bytes_written());
+
+      pending_messages.push_back(message);
+      ret = true;
+    }
+  else if (link != NULL)
     {
       ret = link->broadcast_client_message(id, buffer);
     }
@@ -353,6 +379,90 @@ DistributionManager::broadcast_client_message(DistributionClientMessageID id, Pa
 }
 
 
+//! Broadcasts a time critical client message to all.
+/*!
+ *  The message is sent immediately, also between begin_batch and
+ *  end_batch. Client messages collected before are sent first, so that
+ *  the order of the messages is preserved. Receivers acknowledge the
+ *  message; the latency is reported in the peer statistics.
+ */
+bool
+DistributionManager::broadcast_urgent_client_message(DistributionClientMessageID id, PacketBuffer &buffer)
+{
+  TRACE_ENTER_MSG("DistributionManager::broadcast_urgent_client_message", id);
+  bool ret = false;
+
+  if (link != NULL)
+    {
+      flush_pending_messages();
+      ret = link->broadcast_urgent_client_message(id, buffer);
+    }
+
+  TRACE_RETURN(ret);
+  return ret;
+}
+
+
+//! Sends a client message to a single remote client.
+/*!
+ *  The message is sent immediately, also between begin_batch and
+ *  end_batch.
+ */
+bool
+DistributionManager::send_client_message_to(const string &client_id, DistributionClientMessageID id,
+                                            PacketBuffer &buffer)
+{
+  bool ret = false;
+
+  if (link != NULL)
+    {
+      ret = link->send_client_message_to(client_id, id, buffer);
+    }
+  return ret;
+}
+
+
+//! Starts collecting client messages.
+void
+DistributionManager::begin_batch()
+{
+  batching = true;
+}
+
+
+//! Sends all client messages collected since begin_batch in a single packet.
+void
+DistributionManager::end_batch()
+{
+  TRACE_ENTER_MSG("DistributionManager::end_batch", pending_messages.size());
+
+  batching = false;
+  flush_pending_messages();
+
+  TRACE_EXIT();
+}
+
+
+//! Sends all client messages collected since begin_batch.
+void
+DistributionManager::flush_pending_messages()
+{
+  if (!pending_messages.empty())
+    {
+      if (link != NULL)
+        {
+          link->broadcast_client_messages(pending_messages);
+        }
+
+      for (PendingClientMessages::iterator i = pending_messages.begin(); i != pending_messages.end(); i++)
+        {
+          delete i->buffer;
+        }
+      pending_messages.clear();
+    }
+}
+
+
 //! Event from Link that our 'master' status changed.
 void
 DistributionManager::master_changed(bool new_master, string id)
@@ -740,6 +850,21 @@ DistributionManager::get_logs() const
 }
 
 
+//! Returns the network statistics of all direct connections.
+DistributionPeerStatisticsList
+DistributionManager::get_peer_statistics() const
+{
+  DistributionPeerStatisticsList ret;
+
+  if (link != NULL)
+    {
+      ret = link->get_peer_statistics();
+    }
+
+  return ret;
+}
+
+
 //! Returns all peers.
 list<string>
 DistributionManager::get_peers() const
@@ -791,6 +916,43 @@ DistributionManager::set_listening(bool b)
 }
 
 
+bool
+DistributionManager::get_discovery() const
+{
+  bool ret;
+  bool is_set = configurator->get_value(CoreConfig::CFG_KEY_DISTRIBUTION_DISCOVERY, ret);
+  if (!is_set)
+    {
+      ret = false;
+    }
+
+  return ret;
+}
+
+
+void
+DistributionManager::set_discovery(bool b)
+{
+  configurator->set_value(CoreConfig::CFG_KEY_DISTRIBUTION_DISCOVERY, b);
+}
+
+
+string
+DistributionManager::get_discovery_interface() const
+{
+  string ret;
+  configurator->get_value(CoreConfig::CFG_KEY_DISTRIBUTION_DISCOVERY_INTERFACE, ret);
+  return ret;
+}
+
+
+void
+DistributionManager::set_discovery_interface(string name)
+{
+  configurator->set_value(CoreConfig::CFG_KEY_DISTRIBUTION_DISCOVERY_INTERFACE, name);
+}
+
+
 string
 DistributionManager::get_username() const
 {
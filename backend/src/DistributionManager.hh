@@ -28,6 +28,7 @@ using namespace std;
 #include "IConfiguratorListener.hh"
 #include "IDistributionClientMessage.hh"
 #include "IDistributionManager.hh"
+#include "DistributionLink.hh"
 
 using namespace workrave;
 namespace workrave
@@ -36,10 +37,11 @@ namespace workrave
   class DistributionLogListener;
 }
 
-class DistributionLink;
 class Configurator;
 class DistributionListener;
 class PacketBuffer;
+class SocketDriver;
+class TimeSource;
 
 class DistributionManager :
   public IDistributionManager,
@@ -52,7 +54,7 @@ public:
   virtual ~DistributionManager();
 
   NodeState get_state() const;
-  void init(Configurator *conf);
+  void init(Configurator *conf, SocketDriver *driver = NULL, const TimeSource *time_source = NULL);
   void heartbeart();
   bool is_master() const;
   string get_master_id() const;
@@ -70,6 +72,10 @@ public:
   bool remove_listener(DistributionListener *listener);
 
   bool broadcast_client_message(DistributionClientMessageID id, PacketBuffer &buffer);
+  bool broadcast_urgent_client_message(DistributionClientMessageID id, PacketBuffer &buffer);
+  bool send_client_message_to(const string &client_id, DistributionClientMessageID id, PacketBuffer &buffer);
+  void begin_batch();
+  void end_batch();
   bool add_peer(string peer);
   bool remove_peer(string peer);
   bool disconnect_all();
@@ -82,12 +88,21 @@ public:
   bool remove_log_listener(DistributionLogListener *listener);
   list<string> get_logs() const;
 
+  // Telemetry.
+  DistributionPeerStatisticsList get_peer_statistics() const;
+
   bool get_enabled() const;
   void set_enabled(bool b);
 
   bool get_listening() const;
   void set_listening(bool b);
 
+  bool get_discovery() const;
+  void set_discovery(bool b);
+
+  string get_discovery_interface() const;
+  void set_discovery_interface(string name);
+
   string get_username() const;
   void set_username(string name);
 
@@ -114,6 +129,7 @@ private:
   void parse_peers(string peers, bool connect = true);
   void write_peers();
   void read_configuration();
+  void flush_pending_messages();
   void config_changed_notify(const string &key);
 
   void fire_log_event(string message);
@@ -155,6 +171,12 @@ private:
 
   //! Current master.
   string current_master;
+
+  //! Are client messages collected instead of sent immediately?
+  bool batching;
+
+  //! Client messages collected since begin_batch.
+  PendingClientMessages pending_messages;
 };
 
 
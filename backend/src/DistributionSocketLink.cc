@@ -28,6 +28,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 
 #include "nls.h"
 
@@ -46,29 +47,50 @@
 
 #include "Util.hh"
 
+#if defined(HAVE_GIO_NET) && GLIB_CHECK_VERSION(2, 24, 0)
+#include <gio/gio.h>
+#define HAVE_PACKET_COMPRESSION 1
+#endif
+
 using namespace std;
 
 //! Construct a new socket link.
 /*!
  *  \param conf Configurator to use.
+ *  \param driver Socket driver to use, or NULL for the default driver. The
+ *                link takes ownership of the driver.
+ *  \param time_source Source of the current time, or NULL for the system clock.
  */
-DistributionSocketLink::DistributionSocketLink(Configurator *conf) :
+DistributionSocketLink::DistributionSocketLink(Configurator *conf, SocketDriver *driver, const TimeSource *time_source) :
   dist_manager(NULL),
+  socket_driver(driver),
+  time_source(time_source),
   configurator(conf),
   username(NULL),
   password(NULL),
   master_client(NULL),
   i_am_master(false),
   master_locked(false),
+  master_term(0),
+  master_lease(false),
+  master_lease_expiry(0),
   server_port(DEFAULT_PORT),
   server_socket(NULL),
+  discovery(NULL),
+  discovery_enabled(false),
   network_enabled(false),
   server_enabled(false),
   reconnect_attempts(DEFAULT_ATTEMPTS),
   reconnect_interval(DEFAULT_INTERVAL),
-  heartbeat_count(0)
+  heartbeat_count(0),
+  next_message_id(g_random_int()),
+  session(g_random_int() | 1),
+  capture(NULL)
 {
-  socket_driver = SocketDriver::create();
+  if (socket_driver == NULL)
+    {
+      socket_driver = SocketDriver::create();
+    }
   init_my_id();
 }
 
@@ -76,7 +98,9 @@ DistributionSocketLink::DistributionSocketLink(Configurator *conf) :
 //! Destructs the socket link.
 DistributionSocketLink::~DistributionSocketLink()
 {
+  delete discovery;
   remove_client(NULL);
+  delete capture;
 
   g_free(username);
   g_free(password);
@@ -100,6 +124,23 @@ DistributionSocketLink::init()
   configurator->add_listener(CoreConfig::CFG_KEY_DISTRIBUTION_TCP, this);
   configurator->add_listener(CoreConfig::CFG_KEY_DISTRIBUTION, this);
 
+  // Capture all traffic, for offline analysis with distribution-replay.
+  const char *capture_file = getenv("WORKRAVE_CAPTURE");
+  if (capture_file != NULL)
+    {
+      capture = new PacketCapture();
+      if (capture->create(capture_file))
+        {
+          dist_manager->log(_("Capturing network traffic to %s."), capture_file);
+        }
+      else
+        {
+          dist_manager->log(_("Could not create capture file %s."), capture_file);
+          delete capture;
+          capture = NULL;
+        }
+    }
+
   TRACE_EXIT();
 }
 
@@ -108,12 +149,19 @@ DistributionSocketLink::init()
 void
 DistributionSocketLink::heartbeat()
 {
+  // Socket events are delivered from the main loop as soon as they
+  // arrive. Deliver any that are still pending before the timers run.
+  socket_driver->dispatch();
+
   if (server_enabled)
     {
       TRACE_ENTER("DistributionSocketLink::heartbeat");
       heartbeat_count++;
 
-      time_t current_time = time(NULL);
+      time_t current_time = get_time();
+
+      // Drop connections that do not read the data we send.
+      close_stalled_clients();
 
       // See if we have some clients that need reconncting.
       list<Client *>::iterator i = clients.begin();
@@ -127,26 +175,41 @@ DistributionSocketLink::heartbeat()
             {
               c->reconnect_count--;
               c->reconnect_time = 0;
+              c->reconnects++;
 
               dist_manager->log(_("Reconnecting to %s."),
                                 c->id == NULL ? "Unknown" : c->id);
 
-              if (c->socket != NULL)
-                {
-                  c->socket->close();
-                  delete c->socket;
-                }
+              connect_client(c, c->hostname, c->port);
+            }
+          else if (!c->send_queue.is_empty())
+            {
+              // Retry, in case the socket driver does not notify that
+              // the connection accepts more data.
+              flush_client(c);
+            }
 
-              ISocket *socket = socket_driver->create_socket();
-              socket->set_data(c);
-              socket->set_listener(this);
-              socket->connect(c->hostname, c->port);
+          update_telemetry(c, current_time);
 
-              c->socket = socket;
+          if (c->type == CLIENTTYPE_DIRECT && heartbeat_count % TELEMETRY_PING_INTERVAL == 0)
+            {
+              send_ping(c);
             }
           i++;
         }
 
+      expire_pending_acks();
+
+      if (discovery != NULL)
+        {
+          discovery->heartbeat(current_time);
+        }
+
+      if (capture != NULL)
+        {
+          capture->flush();
+        }
+
       // Periodically distribute state, in case the master crashes.
       if (heartbeat_count % 30 == 0 && i_am_master)
         {
@@ -335,19 +398,31 @@ DistributionSocketLink::claim()
   TRACE_ENTER("DistributionSocketLink::claim");
   bool ret = true;
 
-  if (master_client != NULL)
+  if (master_client != NULL && master_lease)
+    {
+      if (get_time() < master_lease_expiry)
+        {
+          // Another client holds the master lease. Wait until it is
+          // released or expires.
+          ret = false;
+        }
+      else
+        {
+          start_master_term();
+        }
+    }
+  else if (master_client != NULL)
     {
-      // Another client is master. Politely request to become
-      // master client.
+      // Another client is master, but does not support leases.
+      // Politely request to become master client.
       send_claim(master_client);
       ret = false;
     }
   else if (!i_am_master && clients.size() > 0)
     {
-      // No one is master. Just force to be master
-      // potential problem when more client do this simultaneously...
-      send_new_master();
-      i_am_master = true;
+      // No one is master. Take over. If other clients do this
+      // simultaneously, the client with the lowest ID wins.
+      start_master_term();
     }
   else
     {
@@ -363,6 +438,33 @@ DistributionSocketLink::claim()
 bool
 DistributionSocketLink::set_lock_master(bool lock)
 {
+  if (i_am_master)
+    {
+      time_t current_time = get_time();
+
+      if (lock && !master_lease)
+        {
+          // Became master without a lease. Start a new term.
+          master_term++;
+          master_lease = true;
+          master_lease_expiry = 0;
+        }
+
+      if (lock && master_lease_expiry - current_time < MASTER_LEASE_RENEW_TIME)
+        {
+          // Still active. Renew the lease.
+          master_lease_expiry = current_time + MASTER_LEASE_TIME;
+          send_master_lease();
+        }
+      else if (!lock && master_locked && master_lease && master_lease_expiry > current_time)
+        {
+          // No longer active. Release the lease, so that another
+          // active client can take over immediately.
+          master_lease_expiry = current_time;
+          send_master_lease();
+        }
+    }
+
   master_locked = lock;
   return true;
 }
@@ -407,6 +509,8 @@ DistributionSocketLink::set_network_enabled(bool enabled)
       set_server_enabled(server_enabled);
     }
 
+  update_discovery();
+
   return network_enabled;
 }
 
@@ -447,6 +551,7 @@ DistributionSocketLink::set_server_enabled(bool enabled)
     }
 
   server_enabled = enabled;
+  update_discovery();
   TRACE_EXIT();
   return ret;
 }
@@ -484,21 +589,347 @@ DistributionSocketLink::broadcast_client_message(DistributionClientMessageID dsi
 {
   TRACE_ENTER("DistributionSocketLink::broadcast_client_message");
 
+  PendingClientMessage message;
+  message.id = dsid;
+  message.buffer = &buffer;
+
+  PendingClientMessages messages;
+  messages.push_back(message);
+
+  bool ret = broadcast_client_messages(messages);
+
+  TRACE_EXIT();
+  return ret;
+}
+
+
+//! Sends several client messages in a single packet.
+bool
+DistributionSocketLink::broadcast_client_messages(const PendingClientMessages &messages)
+{
+  return send_client_messages(messages, false);
+}
+
+
+//! Sends a time critical client message, and requests an acknowledgement.
+bool
+DistributionSocketLink::broadcast_urgent_client_message(DistributionClientMessageID dsid,
+                                                        PacketBuffer &buffer)
+{
+  TRACE_ENTER("DistributionSocketLink::broadcast_urgent_client_message");
+
+  PendingClientMessage message;
+  message.id = dsid;
+  message.buffer = &buffer;
+
+  PendingClientMessages messages;
+  messages.push_back(message);
+
+  bool ret = send_client_messages(messages, true);
+
+  TRACE_EXIT();
+  return ret;
+}
+
+
+//! Sends a client message to the specified remote client only.
+bool
+DistributionSocketLink::send_client_message_to(const string &client_id, DistributionClientMessageID dsid,
+                                               PacketBuffer &buffer)
+{
+  TRACE_ENTER_MSG("DistributionSocketLink::send_client_message_to", client_id);
+  bool ret = false;
+
+  Client *client = find_client_by_id((gchar *)client_id.c_str());
+  if (client != NULL)
+    {
+      PendingClientMessage message;
+      message.id = dsid;
+      message.buffer = &buffer;
+
+      PendingClientMessages messages;
+      messages.push_back(message);
+
+      ret = send_client_messages(messages, false, client);
+    }
+
+  TRACE_RETURN(ret);
+  return ret;
+}
+
+
+//! Sends several client messages in a single packet.
+/*!
+ *  \param acknowledge whether all receivers must acknowledge the packet.
+ *  \param dest client to send the packet to, or NULL to send it to all.
+ */
+bool
+DistributionSocketLink::send_client_messages(const PendingClientMessages &messages, bool acknowledge,
+                                             Client *dest)
+{
+  TRACE_ENTER_MSG("DistributionSocketLink::send_client_messages", messages.size());
+
   PacketBuffer packet;
   packet.create();
   init_packet(packet, PACKET_CLIENTMSG);
 
+  if (acknowledge && dest == NULL)
+    {
+      packet.poke_byte(3, PACKETFLAG_MSGID | PACKETFLAG_ACK);
+
+      // Version 1 clients do not acknowledge, and neither do the
+      // clients behind them.
+      PendingAck ack;
+      ack.message_id = next_message_id;
+      ack.time = get_timestamp_ms();
+
+      for (list<Client *>::iterator i = clients.begin(); i != clients.end(); i++)
+        {
+          Client *c = *i;
+          Client *direct = c->type == CLIENTTYPE_ROUTED ? c->peer : c;
+
+          if (c->id != NULL && direct != NULL &&
+              (c->type == CLIENTTYPE_DIRECT || c->type == CLIENTTYPE_ROUTED) &&
+              direct->socket != NULL && direct->protocol >= PROTOCOL_V2)
+            {
+              ack.clients.push_back(c->handle);
+            }
+        }
+
+      if (!ack.clients.empty())
+        {
+          pending_acks.push_back(ack);
+          expire_pending_acks();
+        }
+    }
+
   string id = get_master();
   packet.pack_string(id);
 
-  packet.pack_ushort(1);
-  packet.pack_ushort(dsid);
-  packet.pack_ushort(buffer.bytes_written());
-  packet.pack_raw((unsigned char *)buffer.get_buffer(),
-                  buffer.bytes_written());
+  packet.pack_varint(messages.size());
+
+  for (PendingClientMessages::const_iterator i = messages.begin(); i != messages.end(); i++)
+    {
+      PacketBuffer *buffer = i->buffer;
+
+      packet.pack_varint(i->id);
+      packet.pack_varint(buffer->bytes_written());
+      packet.pack_raw((unsigned char *)buffer->get_buffer(),
+                      buffer->bytes_written());
+    }
+
+  if (dest != NULL)
+    {
+      // Address the packet also if the client is connected directly, so
+      // that it does not forward the packet to its other peers.
+      if (dest->id != NULL && dest->type != CLIENTTYPE_ROUTED)
+        {
+          packet.restart_read();
+          packet.poke_byte(3, packet.peek_byte(3) | PACKETFLAG_DEST);
+          packet.insert(6, strlen(dest->id) + 2);
+          packet.poke_string(6, dest->id);
+        }
+      send_packet(dest, packet);
+    }
+  else
+    {
+      send_packet_broadcast(packet);
+    }
+  TRACE_EXIT();
+  return true;
+}
+
+
+//! Returns the network statistics of all known clients.
+/*!
+ *  Rates and round-trip times are taken over the last TELEMETRY_WINDOW
+ *  seconds. Round-trip times include the time both clients need to
+ *  process the packets. Traffic is only measured for direct
+ *  connections; routed clients only report acknowledgement latencies.
+ */
+DistributionPeerStatisticsList
+DistributionSocketLink::get_peer_statistics()
+{
+  TRACE_ENTER("DistributionSocketLink::get_peer_statistics");
+  DistributionPeerStatisticsList ret;
+  time_t current_time = get_time();
+
+  for (list<Client *>::iterator i = clients.begin(); i != clients.end(); i++)
+    {
+      Client *c = *i;
+
+      if (c->type == CLIENTTYPE_DIRECT || (c->type == CLIENTTYPE_ROUTED && c->id != NULL))
+        {
+          DistributionPeerStatistics stats;
+
+          stats.id = c->id != NULL ? c->id : "";
+          stats.direct = c->type == CLIENTTYPE_DIRECT;
+          if (c->hostname != NULL)
+            {
+              gchar *address = g_strdup_printf("%s:%d", c->hostname, c->port);
+              stats.address = address;
+              g_free(address);
+            }
+
+          stats.connected = stats.direct ? c->socket != NULL && !c->connecting : c->peer != NULL;
+          stats.bytes_in = c->bytes_in;
+          stats.bytes_out = c->bytes_out;
+          stats.packets_in = c->packets_in;
+          stats.packets_out = c->packets_out;
+          stats.queue_size = c->send_queue.get_size();
+          stats.reconnects = c->reconnects;
+
+          stats.rate_in = 0;
+          stats.rate_out = 0;
+          if (!c->traffic_history.empty())
+            {
+              const TrafficSample &oldest = c->traffic_history.front();
+              time_t elapsed = current_time - oldest.time;
+
+              if (elapsed > 0)
+                {
+                  stats.rate_in = (guint32) ((c->bytes_in - oldest.bytes_in) / elapsed);
+                  stats.rate_out = (guint32) ((c->bytes_out - oldest.bytes_out) / elapsed);
+                }
+            }
+
+          stats.rtt = c->rtt;
+          stats.rtt_average = -1;
+          stats.rtt_max = -1;
+          if (!c->rtt_history.empty())
+            {
+              int total = 0;
+              for (list<RttSample>::iterator j = c->rtt_history.begin(); j != c->rtt_history.end(); j++)
+                {
+                  total += j->rtt;
+                  if (j->rtt > stats.rtt_max)
+                    {
+                      stats.rtt_max = j->rtt;
+                    }
+                }
+              stats.rtt_average = total / (int) c->rtt_history.size();
+            }
+
+          stats.ack_latency = c->ack_latency;
+          stats.ack_latency_max = -1;
+          for (list<RttSample>::iterator j = c->ack_history.begin(); j != c->ack_history.end(); j++)
+            {
+              if (j->rtt > stats.ack_latency_max)
+                {
+                  stats.ack_latency_max = j->rtt;
+                }
+            }
+          stats.acks_missed = c->acks_missed;
+
+          ret.push_back(stats);
+        }
+    }
 
-  send_packet_broadcast(packet);
   TRACE_EXIT();
+  return ret;
+}
+
+
+//! Processes the received frames of a capture file as fast as possible.
+/*!
+ *  Each client in the capture is replaced by a client without a
+ *  connection, so that the frames go through the same decoding and
+ *  dispatching as frames received from the network. Replies are
+ *  discarded. The replay clients are removed afterwards.
+ *
+ *  The frames are handled as if they were received now, so they are
+ *  forwarded to the other clients and dispatched to the registered
+ *  client messages. Only replay on a link that is not connected to a
+ *  network and that is not used by a core.
+ *
+ *  \param filename capture file written with WORKRAVE_CAPTURE.
+ *  \param frames returns the number of frames processed.
+ *  \param duration returns the processing time in microseconds.
+ */
+bool
+DistributionSocketLink::replay_capture(const string &filename, int &frames, gint64 &duration)
+{
+  TRACE_ENTER_MSG("DistributionSocketLink::replay_capture", filename);
+
+  PacketCapture replay;
+  if (!replay.open(filename))
+    {
+      dist_manager->log(_("Could not open capture file %s."), filename.c_str());
+      TRACE_RETURN(false);
+      return false;
+    }
+
+  // Do not capture the replay itself.
+  PacketCapture *saved_capture = capture;
+  capture = NULL;
+
+  // Handle of the replay client of each client in the capture.
+  map<guint32, guint32> replay_clients;
+
+  frames = 0;
+  duration = 0;
+
+  PacketCapture::Frame frame;
+  while (replay.read_frame(frame))
+    {
+      if (frame.direction != PacketCapture::DIRECTION_IN || frame.data.empty())
+        {
+          continue;
+        }
+
+      Client *client = NULL;
+      map<guint32, guint32>::iterator i = replay_clients.find(frame.client);
+      if (i != replay_clients.end())
+        {
+          client = find_client_by_handle(i->second);
+        }
+
+      if (client == NULL)
+        {
+          // First frame of this client, or the client was removed while
+          // processing a previous frame.
+          client = new Client;
+          client->type = CLIENTTYPE_DIRECT;
+          client->receive_buffer.create(RECEIVE_READ_SIZE);
+          client->hostname = g_strdup_printf("replay-%u", frame.client);
+
+          register_client(client);
+          replay_clients[frame.client] = client->handle;
+        }
+
+      gint64 start = g_get_monotonic_time();
+
+      PacketBuffer &input = client->receive_buffer;
+      input.compact();
+      input.pack_raw((const guint8 *)frame.data.data(), frame.data.size());
+      client->bytes_in += frame.data.size();
+
+      bool ok = process_client_data(client);
+
+      duration += g_get_monotonic_time() - start;
+      frames++;
+
+      if (!ok && find_client_by_handle(replay_clients[frame.client]) == client)
+        {
+          dist_manager->log(_("Client %s sent an invalid packet, closing."),
+                            client->id == NULL ? "Unknown" : client->id);
+          remove_client(client);
+        }
+    }
+
+  for (map<guint32, guint32>::iterator i = replay_clients.begin(); i != replay_clients.end(); i++)
+    {
+      Client *client = find_client_by_handle(i->second);
+      if (client != NULL)
+        {
+          remove_client(client);
+        }
+    }
+
+  capture = saved_capture;
+
+  dist_manager->log(_("Replayed %d frames in %d ms."), frames, (int)(duration / 1000));
+  TRACE_RETURN(frames);
   return true;
 }
 
@@ -556,18 +987,7 @@ DistributionSocketLink::add_client(gchar *id, gchar *host, gint port, ClientType
       c->type = type;
       dist_manager->log(_("Connecting to %s."), host);
 
-      if (c->socket != NULL)
-        {
-          c->socket->close();
-          delete c->socket;
-        }
-
-      ISocket *socket = socket_driver->create_socket();
-      socket->set_data(c);
-      socket->set_listener(this);
-      socket->connect(host, port);
-
-      c->socket = socket;
+      connect_client(c, host, port);
     }
   else
     {
@@ -577,34 +997,30 @@ DistributionSocketLink::add_client(gchar *id, gchar *host, gint port, ClientType
 
       client->type = type;
       client->peer = peer;
-      client->packet.create();
+      client->receive_buffer.create(RECEIVE_READ_SIZE);
       client->hostname = g_strdup(host);
       client->id = g_strdup(id);
       client->port = port;
 
-      clients.push_back(client);
+      register_client(client);
 
       if (client->id != NULL)
         {
           dist_manager->signon_remote_client(client->id);
         }
 
+      if (type == CLIENTTYPE_ROUTED && peer != NULL && client->id != NULL)
+        {
+          // The peer may have been asked not to forward broadcasts of this
+          // client while it was reachable through another route.
+          send_prune(peer, client->id, false);
+        }
+
       if (type == CLIENTTYPE_DIRECT)
         {
           dist_manager->log(_("Connecting to %s."), host);
 
-          if (client->socket != NULL)
-            {
-              client->socket->close();
-              delete client->socket;
-            }
-
-          ISocket *socket = socket_driver->create_socket();
-          socket->set_data(client);
-          socket->set_listener(this);
-          socket->connect(host, port);
-
-          client->socket = socket;
+          connect_client(client, host, port);
         }
     }
   g_free(canonical_host);
@@ -670,11 +1086,18 @@ DistributionSocketLink::set_client_id(Client *client, gchar *id)
   if (ret)
     {
       // No duplicate, so change the canonical name.
+      unindex_client(client);
       g_free(client->id);
-      g_free(client->hostname);
       client->id = g_strdup(id);
-      client->hostname = NULL;
-      client->port = 0;
+
+      if (!client->outbound)
+        {
+          // Keep the address of outbound connections for reconnecting.
+          g_free(client->hostname);
+          client->hostname = NULL;
+          client->port = 0;
+        }
+      index_client(client);
 
       if (client->id != NULL)
         {
@@ -711,6 +1134,7 @@ DistributionSocketLink::remove_client(Client *client)
 
           dist_manager->log(_("Removing client %s."),
                             (*i)->id == NULL ? "Unknown" : (*i)->id);
+          unregister_client(*i);
           delete *i;
           i = clients.erase(i);
         }
@@ -757,6 +1181,7 @@ DistributionSocketLink::remove_peer_clients(Client *client)
               set_master(NULL);
             }
 
+          unregister_client(*i);
           delete *i;
           i = clients.erase(i);
         }
@@ -801,14 +1226,14 @@ DistributionSocketLink::close_client(Client *client, bool reconnect /* = false*/
         {
           TRACE_MSG("Still connected");
           // Still connected. Disconect.
-          delete client->socket;
-          client->socket = NULL;
+          set_client_socket(client, NULL);
 
           if (reconnect)
             {
               TRACE_MSG("must reconnected");
               client->reconnect_count = reconnect_attempts;
-              client->reconnect_time = time(NULL) + 5;
+              client->reconnect_time = get_time() + get_reconnect_delay(client);
+              client->reconnect_backoff++;
             }
           else
             {
@@ -830,8 +1255,7 @@ DistributionSocketLink::close_client(Client *client, bool reconnect /* = false*/
           TRACE_MSG("still connected");
 
           // Still connected. Disconect.
-          delete client->socket;
-          client->socket = NULL;
+          set_client_socket(client, NULL);
 
           client->reconnect_count = 0;
           client->reconnect_time = 0;
@@ -843,58 +1267,282 @@ DistributionSocketLink::close_client(Client *client, bool reconnect /* = false*/
 }
 
 
-//! Check if a client point is stil valid....
-bool
-DistributionSocketLink::is_client_valid(Client *client)
+//! Sets up an outbound connection to a client.
+void
+DistributionSocketLink::connect_client(Client *client, const gchar *host, gint port)
 {
-  list<Client *>::iterator i = clients.begin();
-  bool ret = false;
+  TRACE_ENTER_MSG("DistributionSocketLink::connect_client", host << ":" << port);
 
-  while (!ret && i != clients.end())
+  if (client->socket != NULL)
     {
-      if (*i == client)
-        {
-          ret = true;
-        }
-      i++;
+      client->socket->close();
     }
 
-  return ret;
+  ISocket *socket = socket_driver->create_socket();
+  socket->set_data(GUINT_TO_POINTER(client->handle));
+  socket->set_listener(this);
+  socket->connect(host, port);
+
+  set_client_socket(client, socket);
+  client->connecting = true;
+
+  TRACE_EXIT();
 }
 
 
-//! Finds a remote client by its canonical name and port.
-DistributionSocketLink::Client *
-DistributionSocketLink::find_client_by_canonicalname(gchar *name, gint port)
+//! Handles an outbound connection that could not be set up.
+/*!
+ *  The link to the client was not up, so nothing is signed off. The next
+ *  attempt is scheduled while reconnect attempts remain.
+ */
+void
+DistributionSocketLink::connect_failed(Client *client)
 {
-  Client *ret = NULL;
-  list<Client *>::iterator i = clients.begin();
+  TRACE_ENTER_MSG("DistributionSocketLink::connect_failed", client->reconnect_count);
 
-  while (i != clients.end())
+  set_client_socket(client, NULL);
+
+  if (client->reconnect_count > 0)
     {
-      if ((*i)->port == port && (*i)->hostname != NULL && strcmp((*i)->hostname, name) == 0)
-        {
-          ret = *i;
-        }
-      i++;
+      client->reconnect_time = get_time() + get_reconnect_delay(client);
+      client->reconnect_backoff++;
     }
-  return ret;
+  else if (client->discovered)
+    {
+      // Forget the peer, so that it is connected again when discovered again.
+      remove_client(client);
+    }
+  else
+    {
+      client->reconnect_time = 0;
+      client->type = CLIENTTYPE_SIGNEDOFF;
+    }
+
+  TRACE_EXIT();
 }
 
-//! Finds a remote client by its id.
-DistributionSocketLink::Client *
+
+//! Closes the connections to all clients that do not read the data we send.
+void
+DistributionSocketLink::close_stalled_clients()
+{
+  TRACE_ENTER("DistributionSocketLink::close_stalled_clients");
+
+  list<guint32> stalled;
+  for (list<Client *>::iterator i = clients.begin(); i != clients.end(); i++)
+    {
+      if ((*i)->stalled)
+        {
+          stalled.push_back((*i)->handle);
+        }
+    }
+
+  // Closing a client may remove other clients.
+  for (list<guint32>::iterator i = stalled.begin(); i != stalled.end(); i++)
+    {
+      Client *c = find_client_by_handle(*i);
+      if (c != NULL && c->stalled)
+        {
+          dist_manager->log(_("Client %s is not reading data, closing."),
+                            c->id == NULL ? "Unknown" : c->id);
+
+          TRACE_MSG("queued " << c->send_queue.get_size()
+                    << " dropped " << c->send_queue.get_packets_dropped());
+          close_client(c, c->outbound);
+        }
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Sets the connection of a client, and discards the data queued for the previous one.
+void
+DistributionSocketLink::set_client_socket(Client *client, ISocket *socket)
+{
+  if (client->socket != socket)
+    {
+      delete client->socket;
+      client->socket = socket;
+    }
+
+  client->connecting = false;
+  client->send_queue.clear();
+  client->stalled = false;
+  client->receive_buffer.clear();
+  client->protocol = PROTOCOL_V1;
+  client->compression = false;
+  client->last_message_id = 0;
+  client->message_window = 0;
+  client->pruned_origins.clear();
+}
+
+
+//! Adds a client to the registry and to the list of clients.
+void
+DistributionSocketLink::register_client(Client *client)
+{
+  int slot;
+
+  if (!free_client_slots.empty())
+    {
+      slot = free_client_slots.back();
+      free_client_slots.pop_back();
+    }
+  else
+    {
+      slot = client_slots.size();
+      client_slots.push_back(ClientSlot());
+    }
+
+  ClientSlot &cs = client_slots[slot];
+  cs.client = client;
+  cs.generation++;
+  if (cs.generation == 0)
+    {
+      cs.generation++;
+    }
+
+  client->handle = ((guint32)cs.generation << 16) | (guint32)slot;
+
+  clients.push_back(client);
+  index_client(client);
+}
+
+
+//! Removes a client from the registry.
+/*!
+ *  The caller must remove the client from the list of clients. The handle
+ *  of the client becomes invalid.
+ */
+void
+DistributionSocketLink::unregister_client(Client *client)
+{
+  unindex_client(client);
+
+  int slot = client->handle & 0xffff;
+  if (slot < (int)client_slots.size() && client_slots[slot].client == client)
+    {
+      client_slots[slot].client = NULL;
+      free_client_slots.push_back(slot);
+    }
+  client->handle = 0;
+}
+
+
+//! Adds a client to the ID and address indices.
+void
+DistributionSocketLink::index_client(Client *client)
+{
+  if (client->id != NULL)
+    {
+      clients_by_id.insert(ClientIndex::value_type(client->id, client));
+    }
+
+  if (client->hostname != NULL)
+    {
+      gchar *address = g_strdup_printf("%s:%d", client->hostname, client->port);
+      clients_by_address.insert(ClientIndex::value_type(address, client));
+      g_free(address);
+    }
+}
+
+
+//! Removes a client from the ID and address indices.
+/*!
+ *  Must be called before the ID, host name or port of the client changes.
+ */
+void
+DistributionSocketLink::unindex_client(Client *client)
+{
+  if (client->id != NULL)
+    {
+      pair<ClientIndexIter, ClientIndexIter> range = clients_by_id.equal_range(client->id);
+      for (ClientIndexIter i = range.first; i != range.second; i++)
+        {
+          if (i->second == client)
+            {
+              clients_by_id.erase(i);
+              break;
+            }
+        }
+    }
+
+  if (client->hostname != NULL)
+    {
+      gchar *address = g_strdup_printf("%s:%d", client->hostname, client->port);
+      pair<ClientIndexIter, ClientIndexIter> range = clients_by_address.equal_range(address);
+      for (ClientIndexIter i = range.first; i != range.second; i++)
+        {
+          if (i->second == client)
+            {
+              clients_by_address.erase(i);
+              break;
+            }
+        }
+      g_free(address);
+    }
+}
+
+
+//! Returns the client with the specified handle, or NULL if it no longer exists.
+DistributionSocketLink::Client *
+DistributionSocketLink::find_client_by_handle(guint32 handle)
+{
+  Client *ret = NULL;
+  int slot = handle & 0xffff;
+
+  if (slot < (int)client_slots.size())
+    {
+      ClientSlot &cs = client_slots[slot];
+      if (cs.client != NULL && cs.generation == (handle >> 16))
+        {
+          ret = cs.client;
+        }
+    }
+
+  return ret;
+}
+
+
+//! Finds a remote client by its canonical name and port.
+/*!
+ *  If several clients match, the most recently added one is returned.
+ */
+DistributionSocketLink::Client *
+DistributionSocketLink::find_client_by_canonicalname(gchar *name, gint port)
+{
+  Client *ret = NULL;
+
+  if (name != NULL)
+    {
+      gchar *address = g_strdup_printf("%s:%d", name, port);
+      ClientIndexIter i = clients_by_address.upper_bound(address);
+      if (i != clients_by_address.begin() && (--i)->first == address)
+        {
+          ret = i->second;
+        }
+      g_free(address);
+    }
+  return ret;
+}
+
+//! Finds a remote client by its id.
+/*!
+ *  If several clients match, the most recently added one is returned.
+ */
+DistributionSocketLink::Client *
 DistributionSocketLink::find_client_by_id(gchar *id)
 {
   Client *ret = NULL;
-  list<Client *>::iterator i = clients.begin();
 
-  while (i != clients.end())
+  if (id != NULL)
     {
-      if ((*i)->id != NULL && strcmp((*i)->id, id) == 0)
+      ClientIndexIter i = clients_by_id.upper_bound(id);
+      if (i != clients_by_id.begin() && (--i)->first == id)
         {
-          ret = *i;
+          ret = i->second;
         }
-      i++;
     }
   return ret;
 }
@@ -925,6 +1573,7 @@ DistributionSocketLink::set_master(Client *client)
   TRACE_ENTER("DistributionSocketLink::set_master")
   master_client = client;
   i_am_master = false;
+  master_lease = false;
 
   if (dist_manager != NULL)
     {
@@ -941,6 +1590,7 @@ DistributionSocketLink::set_me_master()
   TRACE_ENTER("DistributionSocketLink::set_me_master");
   master_client = NULL;
   i_am_master = true;
+  master_lease = false;
 
   if (dist_manager != NULL)
     {
@@ -950,6 +1600,24 @@ DistributionSocketLink::set_me_master()
 }
 
 
+//! Takes over the master status with a new term and lease.
+void
+DistributionSocketLink::start_master_term()
+{
+  TRACE_ENTER("DistributionSocketLink::start_master_term");
+
+  master_term++;
+  set_me_master();
+
+  master_lease = true;
+  master_lease_expiry = get_time() + MASTER_LEASE_TIME;
+
+  TRACE_MSG("term " << master_term);
+  send_new_master();
+  TRACE_EXIT();
+}
+
+
 //! Sets the specified client master.
 void
 DistributionSocketLink::set_master_by_id(gchar *id)
@@ -988,11 +1656,20 @@ DistributionSocketLink::init_packet(PacketBuffer &packet, PacketCommand cmd)
   // Length.
   packet.pack_ushort(0);
   // Version
-  packet.pack_byte(2);
+  packet.pack_byte(PACKETFORMAT_V2);
   // Flags
-  packet.pack_byte(0);
+  packet.pack_byte(PACKETFLAG_MSGID);
   // Command
   packet.pack_ushort(cmd);
+
+  // Message ID, used by receivers to suppress duplicates. It stays
+  // behind the source and destination that are inserted when routing.
+  next_message_id++;
+  if (next_message_id == 0)
+    {
+      next_message_id++;
+    }
+  packet.pack_ulong(next_message_id);
 }
 
 
@@ -1009,36 +1686,59 @@ DistributionSocketLink::send_packet_broadcast(PacketBuffer &packet)
 
 
 //! Sends the specified packet to all clients with the exception of one client.
+/*!
+ *  \param origin client that originally sent the packet, or NULL if this
+ *  client did. Clients that pruned this origin do not receive the packet.
+ */
 void
-DistributionSocketLink::send_packet_except(PacketBuffer &packet, Client *client)
+DistributionSocketLink::send_packet_except(PacketBuffer &packet, Client *client, Client *origin)
 {
   TRACE_ENTER("DistributionSocketLink::send_packet_except");
 
   gint size = packet.bytes_written();
 
-  // Length.
-  packet.poke_ushort(0, size);
+  // Length, or 0 if it does not fit.
+  packet.poke_ushort(0, size <= G_MAXUINT16 ? size : 0);
+
+  // All clients with the same protocol version and compression share the same copy.
+  SharedPacket *shared[PROTOCOL_V2 + 1][2] = { { NULL, NULL }, { NULL, NULL }, { NULL, NULL } };
+  bool encoded[PROTOCOL_V2 + 1][2] = { { false, false }, { false, false }, { false, false } };
 
   list<Client *>::iterator i = clients.begin();
   while (i != clients.end())
     {
       Client *c = *i;
 
-      if (c != client && c->socket != NULL)
+      if (c != client && c->socket != NULL && !is_pruned(c, origin))
         {
-          int bytes_written = 0;
-          try
+          int protocol = c->protocol >= PROTOCOL_V2 ? PROTOCOL_V2 : PROTOCOL_V1;
+          int compress = (protocol >= PROTOCOL_V2 && c->compression) ? 1 : 0;
+
+          if (!encoded[protocol][compress])
             {
-              c->socket->write(packet.get_buffer(), size, bytes_written);
+              shared[protocol][compress] = encode_packet(packet, protocol, compress != 0);
+              encoded[protocol][compress] = true;
             }
-          catch (SocketException)
+
+          if (shared[protocol][compress] != NULL)
             {
-              TRACE_MSG("Failed to send");
+              queue_packet(c, shared[protocol][compress]);
             }
         }
       i++;
     }
 
+  for (int p = PROTOCOL_V1; p <= PROTOCOL_V2; p++)
+    {
+      for (int z = 0; z < 2; z++)
+        {
+          if (shared[p][z] != NULL)
+            {
+              shared[p][z]->unref();
+            }
+        }
+    }
+
   TRACE_EXIT();
 }
 
@@ -1069,7 +1769,7 @@ DistributionSocketLink::send_packet(Client *client, PacketBuffer &packet)
 
           packet.poke_byte(3, flags | PACKETFLAG_DEST);
 
-          packet.insert(4, strlen(client->id) + 2);
+          packet.insert(6, strlen(client->id) + 2);
           packet.poke_string(6, client->id);
         }
       client = client->peer;
@@ -1084,35 +1784,591 @@ DistributionSocketLink::send_packet(Client *client, PacketBuffer &packet)
 
       gint size = packet.bytes_written();
 
-      // Length.
-      packet.poke_ushort(0, size);
+      // Length, or 0 if it does not fit.
+      packet.poke_ushort(0, size <= G_MAXUINT16 ? size : 0);
+
+      SharedPacket *shared = encode_packet(packet, client->protocol, client->compression);
+      if (shared != NULL)
+        {
+          queue_packet(client, shared);
+          shared->unref();
+        }
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Encodes a packet for a client that uses the specified protocol version.
+/*!
+ *  Version 2 packets are preceded by a 16-bit zero and a 32-bit length, so
+ *  that a receiver can tell them apart from version 1 packets, which start
+ *  with a non-zero 16-bit length. If \a compress is set, large version 2
+ *  packets are compressed. Returns NULL if the packet cannot be encoded for
+ *  a version 1 client.
+ */
+SharedPacket *
+DistributionSocketLink::encode_packet(PacketBuffer &packet, int protocol, bool compress)
+{
+  TRACE_ENTER_MSG("DistributionSocketLink::encode_packet", protocol << " " << compress);
+  SharedPacket *ret = NULL;
+
+  if (protocol >= PROTOCOL_V2)
+    {
+      PacketBuffer compressed;
+      PacketBuffer *source = &packet;
+
+      if (compress && compress_packet(packet, compressed))
+        {
+          source = &compressed;
+        }
+
+      int size = source->bytes_written();
+
+      PacketBuffer header;
+      header.create(PACKET_V2_PREFIX_SIZE);
+      header.pack_ushort(0);
+      header.pack_ulong(size - 2 + PACKET_V2_PREFIX_SIZE);
+
+      ret = new SharedPacket(header.buffer, header.bytes_written(),
+                             source->buffer + 2, size - 2);
+    }
+  else
+    {
+      PacketBuffer out;
+      if (downgrade_packet(packet, out))
+        {
+          ret = new SharedPacket(out);
+        }
+      else
+        {
+          TRACE_MSG("Packet too large for version 1 client, dropping");
+        }
+    }
+
+  TRACE_EXIT();
+  return ret;
+}
+
+
+//! Converts a packet to the version 1 format.
+bool
+DistributionSocketLink::downgrade_packet(PacketBuffer &packet, PacketBuffer &out)
+{
+  int size = packet.bytes_written();
+  int header_size = get_header_size(packet);
+
+  packet.restart_read();
+  int format = packet.peek_byte(2);
+  int flags = packet.peek_byte(3);
+  int type = packet.peek_ushort(4);
+
+  // Version 1 clients do not know the message ID and acknowledgements.
+  out.create(size);
+  out.pack_raw(packet.buffer, (flags & PACKETFLAG_MSGID) ? header_size - 4 : header_size);
+  out.poke_byte(2, PACKETFORMAT_V1);
+  out.poke_byte(3, flags & ~(PACKETFLAG_MSGID | PACKETFLAG_ACK));
+
+  if (format == PACKETFORMAT_V2 && type == PACKET_CLIENTMSG)
+    {
+      packet.skip(header_size);
+
+      gchar *master = packet.unpack_string();
+      out.pack_string(master);
+      g_free(master);
+
+      guint32 count = packet.unpack_varint();
+      int count_pos = out.bytes_written();
+      int out_count = 0;
+      out.pack_ushort(0);
+
+      for (guint32 i = 0; i < count; i++)
+        {
+          guint32 id = packet.unpack_varint();
+          guint32 datalen = packet.unpack_varint();
+
+          if (datalen > (guint32) packet.bytes_available())
+            {
+              break;
+            }
+
+          if (id <= G_MAXUINT16 && datalen <= G_MAXUINT16)
+            {
+              out.pack_ushort(id);
+              out.pack_ushort(datalen);
+              out.pack_raw(packet.read_ptr, datalen);
+              out_count++;
+            }
+          packet.skip(datalen);
+        }
+
+      out.poke_ushort(count_pos, out_count);
+      packet.restart_read();
+    }
+  else
+    {
+      out.pack_raw(packet.buffer + header_size, size - header_size);
+    }
+
+  int out_size = out.bytes_written();
+  out.poke_ushort(0, out_size <= G_MAXUINT16 ? out_size : 0);
+
+  return out_size <= G_MAXUINT16;
+}
+
+
+//! Compresses the body of a packet.
+/*!
+ *  The header is copied, and the compressed flag is set. The compressed
+ *  body starts with the 32-bit size of the original body. Returns false if
+ *  the body is too small to compress, or does not become smaller.
+ */
+bool
+DistributionSocketLink::compress_packet(PacketBuffer &packet, PacketBuffer &out)
+{
+  bool ret = false;
+
+#ifdef HAVE_PACKET_COMPRESSION
+  int size = packet.bytes_written();
+  int header_size = get_header_size(packet);
+  int body_size = size - header_size;
+
+  if (body_size >= PACKET_COMPRESSION_THRESHOLD)
+    {
+      GConverter *compressor = G_CONVERTER(g_zlib_compressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB, -1));
+
+      // Compressed data that is not smaller than the body is useless.
+      gsize capacity = body_size - 4;
+      guint8 *data = (guint8 *) g_malloc(capacity);
+
+      const guint8 *in = packet.buffer + header_size;
+      gsize in_size = body_size;
+      gsize out_size = 0;
+      gsize bytes_read = 0;
+      gsize bytes_written = 0;
+      GConverterResult result;
+
+      do
+        {
+          bytes_read = bytes_written = 0;
+          result = g_converter_convert(compressor, in, in_size, data + out_size, capacity - out_size,
+                                       G_CONVERTER_INPUT_AT_END, &bytes_read, &bytes_written, NULL);
+          in += bytes_read;
+          in_size -= bytes_read;
+          out_size += bytes_written;
+        }
+      while (result == G_CONVERTER_CONVERTED && out_size < capacity &&
+             (bytes_read > 0 || bytes_written > 0));
+
+      if (result == G_CONVERTER_FINISHED)
+        {
+          out.create(header_size + 4 + out_size);
+          out.pack_raw(packet.buffer, header_size);
+          out.pack_ulong(body_size);
+          out.pack_raw(data, out_size);
+          out.poke_byte(3, packet.peek_byte(3) | PACKETFLAG_COMPRESSED);
+
+          int out_packet_size = out.bytes_written();
+          out.poke_ushort(0, out_packet_size <= G_MAXUINT16 ? out_packet_size : 0);
+          ret = true;
+        }
+
+      g_free(data);
+      g_object_unref(compressor);
+    }
+#else
+  (void) packet;
+  (void) out;
+#endif
+
+  return ret;
+}
+
+
+//! Decompresses the body of a compressed packet.
+/*!
+ *  Returns false if the packet is malformed.
+ */
+bool
+DistributionSocketLink::decompress_packet(PacketBuffer &packet, PacketBuffer &out)
+{
+  bool ret = false;
+
+#ifdef HAVE_PACKET_COMPRESSION
+  int size = packet.bytes_written();
+  int header_size = get_header_size(packet);
+
+  if (size < header_size + 4)
+    {
+      return false;
+    }
+
+  guint32 body_size = packet.peek_ulong(header_size);
+  if (body_size > PACKET_V2_MAX_SIZE)
+    {
+      return false;
+    }
+
+  GConverter *decompressor = G_CONVERTER(g_zlib_decompressor_new(G_ZLIB_COMPRESSOR_FORMAT_ZLIB));
+
+  // One spare byte, so that data beyond the announced size is detected.
+  gsize capacity = body_size + 1;
+  guint8 *data = (guint8 *) g_malloc(capacity);
+
+  const guint8 *in = packet.buffer + header_size + 4;
+  gsize in_size = size - header_size - 4;
+  gsize out_size = 0;
+  gsize bytes_read = 0;
+  gsize bytes_written = 0;
+  GConverterResult result;
+
+  do
+    {
+      bytes_read = bytes_written = 0;
+      result = g_converter_convert(decompressor, in, in_size, data + out_size, capacity - out_size,
+                                   G_CONVERTER_INPUT_AT_END, &bytes_read, &bytes_written, NULL);
+      in += bytes_read;
+      in_size -= bytes_read;
+      out_size += bytes_written;
+    }
+  while (result == G_CONVERTER_CONVERTED && out_size < capacity &&
+         (bytes_read > 0 || bytes_written > 0));
+
+  if (result == G_CONVERTER_FINISHED && out_size == body_size)
+    {
+      out.create(header_size + body_size);
+      out.pack_raw(packet.buffer, header_size);
+      out.pack_raw(data, body_size);
+      out.poke_byte(3, packet.peek_byte(3) & ~PACKETFLAG_COMPRESSED);
+
+      int out_packet_size = out.bytes_written();
+      out.poke_ushort(0, out_packet_size <= G_MAXUINT16 ? out_packet_size : 0);
+      ret = true;
+    }
+
+  g_free(data);
+  g_object_unref(decompressor);
+#else
+  (void) packet;
+  (void) out;
+#endif
+
+  return ret;
+}
+
+
+//! Returns the size of the header of a packet, including source and destination.
+int
+DistributionSocketLink::get_header_size(PacketBuffer &packet)
+{
+  packet.restart_read();
+
+  int flags = packet.peek_byte(3);
+  int size = 6;
+
+  if (flags & PACKETFLAG_SOURCE)
+    {
+      size += 2 + packet.peek_ushort(size);
+    }
+  if (flags & PACKETFLAG_DEST)
+    {
+      size += 2 + packet.peek_ushort(size);
+    }
+  if (flags & PACKETFLAG_MSGID)
+    {
+      size += 4;
+    }
+
+  return size;
+}
+
+
+//! Queues a packet for the specified client, and writes as much as possible.
+void
+DistributionSocketLink::queue_packet(Client *client, SharedPacket *packet)
+{
+  if (client->stalled)
+    {
+      // Client will be closed during the next heartbeat.
+      client->send_queue.drop();
+      return;
+    }
+
+  if (capture != NULL)
+    {
+      capture->write_frame(PacketCapture::DIRECTION_OUT, client->handle, packet->get_data(), packet->get_size());
+    }
+
+  client->send_queue.push(packet);
+  client->packets_out++;
+  flush_client(client);
+
+  if (client->send_queue.get_size() > SEND_QUEUE_HIGH_WATER_MARK)
+    {
+      TRACE_MSG("Client stalled " << client->send_queue.get_size());
+      client->stalled = true;
+    }
+}
+
+
+//! Returns whether a message of the specified origin was already received.
+/*!
+ *  The IDs of the most recent messages of each origin are remembered in a
+ *  sliding window. Messages older than the window are considered
+ *  duplicates. Messages without ID are never considered duplicates.
+ *
+ *  The window is reset when the origin connects again or announces a new
+ *  session in the client list, i.e. when it restarted.
+ */
+bool
+DistributionSocketLink::is_duplicate_message(Client *origin, guint32 message_id)
+{
+  bool ret = false;
+  gint32 diff = (gint32)(message_id - origin->last_message_id);
+
+  if (message_id == 0)
+    {
+      // No message ID.
+    }
+  else if (origin->last_message_id == 0)
+    {
+      // First message.
+      origin->last_message_id = message_id;
+      origin->message_window = 1;
+    }
+  else if (diff <= -MESSAGE_ID_WINDOW)
+    {
+      // Too old to remember.
+      ret = true;
+    }
+  else if (diff > 0)
+    {
+      origin->message_window = diff >= MESSAGE_ID_WINDOW ? 0 : origin->message_window << diff;
+      origin->message_window |= 1;
+      origin->last_message_id = message_id;
+    }
+  else
+    {
+      guint32 bit = (guint32)1 << (-diff);
+      ret = (origin->message_window & bit) != 0;
+      origin->message_window |= bit;
+    }
+
+  return ret;
+}
+
+
+//! Sets the session of a client, as announced in a client list.
+/*!
+ *  A different session means that the client restarted, so the IDs of
+ *  its messages start over.
+ */
+void
+DistributionSocketLink::set_client_session(Client *client, guint32 session)
+{
+  TRACE_ENTER_MSG("DistributionSocketLink::set_client_session", session);
+
+  if (client != NULL && session != 0 && client->session != session)
+    {
+      if (client->session != 0)
+        {
+          TRACE_MSG("Client " << client->id << " restarted");
+          client->last_message_id = 0;
+          client->message_window = 0;
+        }
+      client->session = session;
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Returns whether a client asked not to receive broadcasts of the specified origin.
+bool
+DistributionSocketLink::is_pruned(Client *client, Client *origin)
+{
+  bool ret = false;
+
+  if (origin != NULL && origin->id != NULL)
+    {
+      map<string, time_t>::iterator i = client->pruned_origins.find(origin->id);
+      if (i != client->pruned_origins.end())
+        {
+          if (i->second > get_time())
+            {
+              ret = true;
+            }
+          else
+            {
+              client->pruned_origins.erase(i);
+            }
+        }
+    }
+
+  return ret;
+}
+
+
+//! Writes as much queued data to the specified client as possible.
+void
+DistributionSocketLink::flush_client(Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::flush_client");
+
+  PacketQueue &queue = client->send_queue;
+
+  if (client->socket == NULL)
+    {
+      queue.clear();
+    }
+
+  bool blocked = false;
+  while (!queue.is_empty() && !blocked)
+    {
+      SocketVector vectors[SEND_QUEUE_MAX_VECTORS];
+      int count = queue.get_vectors(vectors, SEND_QUEUE_MAX_VECTORS);
+
+      int size = 0;
+      for (int i = 0; i < count; i++)
+        {
+          size += vectors[i].size;
+        }
 
       int bytes_written = 0;
       try
         {
-          client->socket->write(packet.get_buffer(), size, bytes_written);
+          client->socket->writev(vectors, count, bytes_written);
         }
       catch (SocketException)
         {
           TRACE_MSG("Failed to send");
+          queue.clear();
+          break;
         }
+
+      queue.consume(bytes_written);
+      client->bytes_out += bytes_written;
+      blocked = bytes_written < size;
     }
 
+  if (client->socket != NULL)
+    {
+      client->socket->watch_writable(!queue.is_empty());
+    }
+
+  TRACE_MSG("queued " << queue.get_size() << " sent " << queue.get_bytes_sent());
   TRACE_EXIT();
 }
 
 
+//! Processes all complete packets in the receive buffer of a client.
+/*!
+ *  Each packet is passed as a view on the receive buffer, so no data is
+ *  copied. The receive buffer keeps headroom in front of the data, so
+ *  routing a packet does not move its payload either. Returns false if
+ *  the client sent a malformed packet.
+ */
+bool
+DistributionSocketLink::process_client_data(Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::process_client_data");
+  PacketBuffer &input = client->receive_buffer;
+  ISocket *socket = client->socket;
+  guint32 handle = client->handle;
+  bool ret = true;
+  int count = 0;
+
+  while (ret && input.bytes_available() >= 4)
+    {
+      int size = input.peek_ushort(0);
+      int prefix_size = 0;
+
+      if (size == 0)
+        {
+          // Version 2 packet, with 32-bit length.
+          if (input.bytes_available() < PACKET_V2_PREFIX_SIZE)
+            {
+              break;
+            }
+
+          guint32 length = input.peek_ulong(2);
+          size = length <= PACKET_V2_MAX_SIZE ? (int) length : -1;
+          prefix_size = PACKET_V2_PREFIX_SIZE - 2;
+        }
+
+      if (size - prefix_size < 4)
+        {
+          TRACE_MSG("Illegal packet size " << size);
+          ret = false;
+        }
+      else if (input.bytes_available() < size)
+        {
+          // Incomplete packet.
+          break;
+        }
+      else
+        {
+          // Strip the version 2 prefix, so that the packet looks like a
+          // version 1 packet.
+          int packet_size = size - prefix_size;
+
+          if (capture != NULL)
+            {
+              capture->write_frame(PacketCapture::DIRECTION_IN, client->handle, input.read_ptr, size);
+            }
+
+          // The data before the packet has been processed, so it can be
+          // used as headroom when routing information is inserted.
+          guint8 *data = input.read_ptr + prefix_size;
+          int headroom = input.storage != NULL ? data - input.storage : 0;
+
+          PacketBuffer packet;
+          packet.attach(data, packet_size, headroom);
+          packet.poke_ushort(0, packet_size <= G_MAXUINT16 ? packet_size : 0);
+          input.skip(size);
+          client->packets_in++;
+          count++;
+
+          if (packet.peek_byte(3) & PACKETFLAG_COMPRESSED)
+            {
+              PacketBuffer decompressed;
+              if (!decompress_packet(packet, decompressed))
+                {
+                  TRACE_MSG("Illegal compressed packet");
+                  ret = false;
+                  break;
+                }
+              process_client_packet(client, decompressed);
+            }
+          else
+            {
+              process_client_packet(client, packet);
+            }
+
+          if (find_client_by_handle(handle) == NULL || client->socket != socket)
+            {
+              // Client was closed while processing the packet.
+              break;
+            }
+        }
+    }
+
+  TRACE_MSG("processed " << count << " packets");
+  TRACE_RETURN(ret);
+  return ret;
+}
+
+
 //! Processed an incoming packet.
 void
-DistributionSocketLink::process_client_packet(Client *client)
+DistributionSocketLink::process_client_packet(Client *client, PacketBuffer &packet)
 {
   TRACE_ENTER("DistributionSocketLink::process_client_packet");
-  PacketBuffer &packet = client->packet;
 
   client->claim_count = 0;
 
   gint size = packet.unpack_ushort();
-  g_assert(size == packet.bytes_written());
+  g_assert(size == 0 || size == packet.bytes_written());
 
   gint version = packet.unpack_byte();
   gint flags = packet.unpack_byte();
@@ -1144,6 +2400,13 @@ DistributionSocketLink::process_client_packet(Client *client)
             {
               TRACE_MSG("Illegal source in routing.");
               source = NULL;
+
+              if (!(flags & PACKETFLAG_DEST))
+                {
+                  // The client is not on my route to the origin of this
+                  // broadcast, so it does not need to forward it to me.
+                  send_prune(client, id, true);
+                }
             }
         }
       else
@@ -1179,12 +2442,30 @@ DistributionSocketLink::process_client_packet(Client *client)
 
           source = NULL;
         }
+      else
+        {
+          // Addressed to me, do not broadcast it any further.
+          forward = false;
+        }
         g_free(id);
     }
 
+  bool duplicate = false;
+  guint32 message_id = 0;
+  if (flags & PACKETFLAG_MSGID)
+    {
+      message_id = packet.unpack_ulong();
+
+      if (source != NULL && is_duplicate_message(source, message_id))
+        {
+          TRACE_MSG("Duplicate message " << message_id);
+          duplicate = true;
+        }
+    }
+
   TRACE_MSG("size = " << size << ", version = " << version << ", flags = " << flags);
 
-  if (source != NULL || type == PACKET_CLIENT_LIST)
+  if (!duplicate && (source != NULL || type == PACKET_CLIENT_LIST))
     {
       switch (type)
         {
@@ -1211,11 +2492,12 @@ DistributionSocketLink::process_client_packet(Client *client)
           break;
 
         case PACKET_NEW_MASTER:
+        case PACKET_MASTER_LEASE:
           handle_new_master(packet, source);
           break;
 
         case PACKET_CLIENTMSG:
-          handle_client_message(packet, source);
+          handle_client_message(packet, source, version);
           break;
 
         case PACKET_DUPLICATE:
@@ -1226,16 +2508,41 @@ DistributionSocketLink::process_client_packet(Client *client)
         case PACKET_CLAIM_REJECT:
           handle_claim_reject(packet, source);
           break;
+
+        case PACKET_PRUNE:
+          handle_prune(packet, source);
+          forward = false;
+          break;
+
+        case PACKET_PING:
+          handle_ping(packet, source);
+          forward = false;
+          break;
+
+        case PACKET_PONG:
+          handle_pong(packet, source);
+          forward = false;
+          break;
+
+        case PACKET_ACK:
+          handle_ack(packet, source);
+          forward = false;
+          break;
         }
 
       if (forward)
         {
           forward_packet_except(packet, client, source);
         }
+
+      // Acknowledge after forwarding, so that the next hop is not delayed.
+      if ((flags & PACKETFLAG_ACK) && (flags & PACKETFLAG_MSGID) &&
+          type == PACKET_CLIENTMSG && source != NULL)
+        {
+          send_ack(source, message_id);
+        }
     }
 
-  packet.clear();
-  packet.resize(0);
   TRACE_EXIT();
 }
 
@@ -1251,10 +2558,10 @@ DistributionSocketLink::forward_packet_except(PacketBuffer &packet, Client *clie
     {
       TRACE_MSG("Add source " << source->id);
       packet.poke_byte(3, flags | PACKETFLAG_SOURCE);
-      packet.insert(4, strlen(source->id) + 2);
+      packet.insert(6, strlen(source->id) + 2);
       packet.poke_string(6, source->id);
     }
-  send_packet_except(packet, client);
+  send_packet_except(packet, client, source);
 
   TRACE_EXIT();
 }
@@ -1271,7 +2578,7 @@ DistributionSocketLink::forward_packet(PacketBuffer &packet, Client *dest, Clien
     {
       TRACE_MSG("Add source " << source->id);
       packet.poke_byte(3, flags | PACKETFLAG_SOURCE);
-      packet.insert(4, strlen(source->id) + 2);
+      packet.insert(6, strlen(source->id) + 2);
       packet.poke_string(6, source->id);
     }
   send_packet(dest, packet);
@@ -1295,6 +2602,7 @@ DistributionSocketLink::send_hello(Client *client)
   packet.pack_string(get_my_id());
   packet.pack_string(get_my_id()); // was: hostname
   packet.pack_ushort(server_port);
+  pack_capabilities(packet);
 
   send_packet(client, packet);
   TRACE_EXIT();
@@ -1312,41 +2620,109 @@ DistributionSocketLink::handle_hello(PacketBuffer &packet, Client *client)
   gchar *id = packet.unpack_string();
   /* gchar *name = */ packet.unpack_string();
   /* int port = */ packet.unpack_ushort();
+  unpack_capabilities(packet, client);
+
+  dist_manager->log(_("Client %s saying hello."), id != NULL ? id : "Unknown");
+
+  if ( (username == NULL || (user != NULL && strcmp(username, user) == 0)) &&
+       (password == NULL || (pass != NULL && strcmp(password, pass) == 0)))
+    {
+      bool ok = set_client_id(client, id);
+
+      if (ok)
+        {
+          // Welcome!
+          send_welcome(client);
+        }
+      else
+        {
+          // Duplicate client. inform client that it's bogus and close.
+          dist_manager->log(_("Client %s is duplicate."),
+                            id != NULL ? id : "Unknown");
+
+          send_duplicate(client);
+          remove_client(client);
+        }
+    }
+  else
+    {
+      // Incorrect password.
+      dist_manager->log(_("Client %s access denied."),
+                        id != NULL ? id : "Unknown");
+      remove_client(client);
+    }
+
+  g_free(user);
+  g_free(id);
+  g_free(pass);
+
+  TRACE_EXIT();
+}
+
+
+//! Appends the capabilities of this client to a hello or welcome packet.
+/*!
+ *  Capabilities are type-length-value fields. Version 1 clients ignore
+ *  them, and unknown fields are skipped.
+ */
+void
+DistributionSocketLink::pack_capabilities(PacketBuffer &packet)
+{
+  packet.pack_tlv_varint(CAPABILITY_PROTOCOL, PROTOCOL_V2);
+#ifdef HAVE_PACKET_COMPRESSION
+  packet.pack_tlv_varint(CAPABILITY_COMPRESSION, COMPRESSION_ZLIB);
+#endif
+}
+
+
+//! Reads the capabilities of a client from a hello or welcome packet.
+void
+DistributionSocketLink::unpack_capabilities(PacketBuffer &packet, Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::unpack_capabilities");
 
-  dist_manager->log(_("Client %s saying hello."), id != NULL ? id : "Unknown");
+  int protocol = PROTOCOL_V1;
+  guint32 compression = 0;
 
-  if ( (username == NULL || (user != NULL && strcmp(username, user) == 0)) &&
-       (password == NULL || (pass != NULL && strcmp(password, pass) == 0)))
+  while (packet.bytes_available() > 0)
     {
-      bool ok = set_client_id(client, id);
+      guint32 tag = 0;
+      int size = packet.unpack_tlv(tag);
 
-      if (ok)
+      if (size < 0)
         {
-          // Welcome!
-          send_welcome(client);
+          TRACE_MSG("Truncated capability");
+          break;
         }
-      else
+
+      int pos = packet.bytes_read() + size;
+
+      switch (tag)
         {
-          // Duplicate client. inform client that it's bogus and close.
-          dist_manager->log(_("Client %s is duplicate."),
-                            id != NULL ? id : "Unknown");
+        case CAPABILITY_PROTOCOL:
+          protocol = packet.unpack_varint();
+          break;
 
-          send_duplicate(client);
-          remove_client(client);
+        case CAPABILITY_COMPRESSION:
+          compression = packet.unpack_varint();
+          break;
+
+        default:
+          TRACE_MSG("Unknown capability " << tag);
+          break;
         }
-    }
-  else
-    {
-      // Incorrect password.
-      dist_manager->log(_("Client %s access denied."),
-                        id != NULL ? id : "Unknown");
-      remove_client(client);
+
+      packet.skip(pos - packet.bytes_read());
     }
 
-  g_free(user);
-  g_free(id);
-  g_free(pass);
+  client->protocol = protocol >= PROTOCOL_V2 ? PROTOCOL_V2 : PROTOCOL_V1;
+#ifdef HAVE_PACKET_COMPRESSION
+  client->compression = (compression & COMPRESSION_ZLIB) != 0;
+#else
+  (void) compression;
+#endif
 
+  TRACE_MSG("protocol = " << client->protocol << " compression = " << client->compression);
   TRACE_EXIT();
 }
 
@@ -1419,8 +2795,7 @@ DistributionSocketLink::handle_signoff(PacketBuffer &packet, Client *client)
           if (c->socket != NULL)
             {
               TRACE_MSG("Remove connection");
-              delete c->socket;
-              c->socket = NULL;
+              set_client_socket(c, NULL);
             }
 
           remove_client(c);
@@ -1481,6 +2856,7 @@ DistributionSocketLink::send_welcome(Client *client)
   packet.pack_string(get_my_id());
   packet.pack_string(get_my_id()); // was: hostname
   packet.pack_ushort(server_port);
+  pack_capabilities(packet);
 
   send_packet(client, packet);
   TRACE_EXIT();
@@ -1496,6 +2872,7 @@ DistributionSocketLink::handle_welcome(PacketBuffer &packet, Client *client)
   gchar *id = packet.unpack_string();
   gchar *name = packet.unpack_string();
   /*gint port = */ packet.unpack_ushort();
+  unpack_capabilities(packet, client);
 
   dist_manager->log(_("Client %s is welcoming us."),
                     id == NULL ? "Unknown" : id);
@@ -1555,6 +2932,7 @@ DistributionSocketLink::send_client_list(Client *client, bool except)
       packet.pack_string(get_my_id());         // ID
       packet.pack_string(get_my_id());         // Canonical name
       packet.pack_ushort(server_port);         // Listen port.
+      packet.pack_ulong(session);              // Session, ignored by version 1.
 
       // Size of the client data.
       packet.poke_ushort(pos, packet.bytes_written() - pos);
@@ -1583,6 +2961,7 @@ DistributionSocketLink::send_client_list(Client *client, bool except)
               packet.pack_string(c->id);        // ID
               packet.pack_string(c->hostname);  // Canonical name
               packet.pack_ushort(c->port);      // Listen port.
+              packet.pack_ulong(c->session);    // Session, or 0 if unknown.
 
               // Size of the client data.
               packet.poke_ushort(pos, packet.bytes_written() - pos);
@@ -1623,6 +3002,7 @@ DistributionSocketLink::handle_client_list(PacketBuffer &packet, Client *client,
   gchar **names = new gchar*[num_clients];
   gchar **ids = new gchar*[num_clients];
   gint *ports = new gint[num_clients];
+  guint32 *sessions = new guint32[num_clients];
 
   bool ok = true;
 
@@ -1632,6 +3012,7 @@ DistributionSocketLink::handle_client_list(PacketBuffer &packet, Client *client,
       names[i] = NULL;
       ids[i] = NULL;
       ports[i] = 0;
+      sessions[i] = 0;
 
       // Extract data.
       gint pos = packet.bytes_read();
@@ -1640,6 +3021,11 @@ DistributionSocketLink::handle_client_list(PacketBuffer &packet, Client *client,
       gchar *id = packet.unpack_string();
       gchar *name = packet.unpack_string();
       gint port = packet.unpack_ushort();
+      guint32 session = 0;
+      if (packet.bytes_read() - pos + 4 <= size)
+        {
+          session = packet.unpack_ulong();
+        }
 
       if (flags & CLIENTLIST_MASTER)
         {
@@ -1656,12 +3042,22 @@ DistributionSocketLink::handle_client_list(PacketBuffer &packet, Client *client,
               names[i] = name;
               ids[i] = id;
               ports[i] = port;
+              sessions[i] = session;
+              name = NULL;
+              id = NULL;
             }
-          else if (client != NULL && direct == client && !client_is_me(id) && strcmp(client->id, id) != 0)
+          else if (client != NULL && direct == client && !client_is_me(id) && strcmp(client->id, id) != 0 &&
+                   find_client_by_id(id)->peer != direct)
             {
+              // Known through another link, so the networks overlap. Clients
+              // already learned from a list forwarded by this link are fine.
               TRACE_MSG("Strange client: " << id);
               ok = false;
             }
+          else if (session != 0)
+            {
+              set_client_session(find_client_by_id(id), session);
+            }
         }
 
       // Skip trailing junk...
@@ -1688,6 +3084,7 @@ DistributionSocketLink::handle_client_list(PacketBuffer &packet, Client *client,
           if (ids[i] != NULL && names[i] != NULL)
             {
               add_client(ids[i], names[i], ports[i], CLIENTTYPE_ROUTED, direct);
+              set_client_session(find_client_by_id(ids[i]), sessions[i]);
             }
         }
 
@@ -1722,6 +3119,7 @@ DistributionSocketLink::handle_client_list(PacketBuffer &packet, Client *client,
   delete [] names;
   delete [] ids;
   delete [] ports;
+  delete [] sessions;
 
   TRACE_EXIT();
   return ok;
@@ -1734,7 +3132,7 @@ DistributionSocketLink::send_claim(Client *client)
 {
   TRACE_ENTER("DistributionSocketLink::send_claim");
 
-  if (client->next_claim_time == 0 || time(NULL) >= client->next_claim_time)
+  if (client->next_claim_time == 0 || get_time() >= client->next_claim_time)
     {
       PacketBuffer packet;
 
@@ -1746,7 +3144,7 @@ DistributionSocketLink::send_claim(Client *client)
 
       packet.pack_ushort(0);
 
-      client->next_claim_time = time(NULL) + 10;
+      client->next_claim_time = get_time() + 10;
 
       send_packet(client, packet);
 
@@ -1757,112 +3155,409 @@ DistributionSocketLink::send_claim(Client *client)
 
           close_client(client, client->outbound);
         }
-      client->claim_count++;
-    }
+      client->claim_count++;
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Handles a request from a remote client to become master.
+void
+DistributionSocketLink::handle_claim(PacketBuffer &packet, Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::handle_claim");
+
+  /*gint count = */ packet.unpack_ushort();
+
+  if (i_am_master && master_locked)
+    {
+      dist_manager->log(_("Rejecting master request from client %s."),
+                        client->id == NULL ? "Unknown" : client->id);
+      send_claim_reject(client);
+    }
+  else
+    {
+      dist_manager->log(_("Acknowledging master request from client %s."),
+                        client->id == NULL ? "Unknown" : client->id);
+
+      bool was_master = i_am_master;
+
+      // Marks client as master
+      set_master(client);
+      assert(!i_am_master);
+
+      // If I was previously master, distribute state.
+      if (was_master)
+        {
+          //dist_manager->log(_("Transferring state to client %s:%d."),
+          //                  client->hostname, client->port);
+          send_client_message(DCMT_MASTER);
+        }
+
+      // And tell everyone we have a new master.
+      send_new_master();
+    }
+
+  TRACE_EXIT();
+}
+
+
+
+//! Inform that the claim has been rejected.
+void
+DistributionSocketLink::send_claim_reject(Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::send_claim_reject");
+
+  PacketBuffer packet;
+
+  packet.create();
+  init_packet(packet, PACKET_CLAIM_REJECT);
+
+  send_packet(client, packet);
+  TRACE_EXIT();
+}
+
+
+//! Handles a rejection of my claim.
+void
+DistributionSocketLink::handle_claim_reject(PacketBuffer &packet, Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::handle_claim");
+  (void) packet;
+
+  if (client != master_client)
+    {
+      dist_manager->log(_("Non-master client %s rejected master request."),
+                        client->id == NULL ? "Unknown" : client->id);
+    }
+  else
+    {
+      dist_manager->log(_("Client %s rejected master request, delaying."),
+                        client->id == NULL ? "Unknown" : client->id);
+      client->reject_count++;
+      int count = client->reject_count;
+
+      if (count > 6)
+        {
+          count = 6;
+        }
+
+      client->next_claim_time = get_time() + 5 * count;
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Asks a direct client to stop or resume forwarding broadcasts of an origin.
+void
+DistributionSocketLink::send_prune(Client *client, const gchar *origin, bool prune)
+{
+  TRACE_ENTER_MSG("DistributionSocketLink::send_prune", origin << " " << prune);
+
+  // Version 1 clients do not know this packet and would forward it.
+  if (client->protocol >= PROTOCOL_V2)
+    {
+      PacketBuffer packet;
+
+      packet.create();
+      init_packet(packet, PACKET_PRUNE);
+
+      packet.pack_string(origin);
+      packet.pack_byte(prune ? 1 : 0);
+
+      send_packet(client, packet);
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Handles a prune from the specified client.
+void
+DistributionSocketLink::handle_prune(PacketBuffer &packet, Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::handle_prune");
+
+  gchar *origin = packet.unpack_string();
+  bool prune = packet.unpack_byte() != 0;
+
+  if (origin != NULL && client->socket != NULL)
+    {
+      TRACE_MSG(origin << " " << prune);
+      if (prune)
+        {
+          client->pruned_origins[origin] = get_time() + PRUNE_LIFETIME;
+        }
+      else
+        {
+          client->pruned_origins.erase(origin);
+        }
+    }
+
+  g_free(origin);
+  TRACE_EXIT();
+}
+
+
+//! Measures the round-trip time to a directly connected client.
+void
+DistributionSocketLink::send_ping(Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::send_ping");
+
+  // Version 1 clients do not know this packet and would forward it.
+  if (client->socket != NULL && client->id != NULL && client->protocol >= PROTOCOL_V2)
+    {
+      PacketBuffer packet;
+
+      packet.create();
+      init_packet(packet, PACKET_PING);
+
+      packet.pack_ulong(get_timestamp_ms());
+
+      send_packet(client, packet);
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Handles a round-trip time measurement from a remote client.
+void
+DistributionSocketLink::handle_ping(PacketBuffer &packet, Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::handle_ping");
+
+  guint32 timestamp = packet.unpack_ulong();
+
+  if (client->socket != NULL)
+    {
+      PacketBuffer reply;
+
+      reply.create();
+      init_packet(reply, PACKET_PONG);
+
+      reply.pack_ulong(timestamp);
+
+      send_packet(client, reply);
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Handles the reply to a round-trip time measurement.
+void
+DistributionSocketLink::handle_pong(PacketBuffer &packet, Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::handle_pong");
+
+  guint32 rtt = get_timestamp_ms() - packet.unpack_ulong();
+
+  if (client->socket != NULL && rtt <= TELEMETRY_WINDOW * 1000)
+    {
+      TRACE_MSG("rtt = " << rtt);
+
+      RttSample sample;
+      sample.time = get_time();
+      sample.rtt = rtt;
+
+      client->rtt = rtt;
+      client->rtt_history.push_back(sample);
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Acknowledges an urgent message to its origin.
+void
+DistributionSocketLink::send_ack(Client *client, guint32 message_id)
+{
+  TRACE_ENTER_MSG("DistributionSocketLink::send_ack", message_id);
+
+  if (client->id != NULL)
+    {
+      PacketBuffer packet;
+
+      packet.create();
+      init_packet(packet, PACKET_ACK);
+
+      packet.pack_ulong(message_id);
+
+      send_packet(client, packet);
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Handles the acknowledgement of an urgent message by a remote client.
+void
+DistributionSocketLink::handle_ack(PacketBuffer &packet, Client *client)
+{
+  TRACE_ENTER("DistributionSocketLink::handle_ack");
+
+  guint32 message_id = packet.unpack_ulong();
+
+  for (list<PendingAck>::iterator i = pending_acks.begin(); i != pending_acks.end(); i++)
+    {
+      if (i->message_id == message_id)
+        {
+          list<guint32>::iterator j = find(i->clients.begin(), i->clients.end(), client->handle);
+          if (j != i->clients.end())
+            {
+              guint32 latency = get_timestamp_ms() - i->time;
+              TRACE_MSG("latency = " << latency);
+
+              RttSample sample;
+              sample.time = get_time();
+              sample.rtt = latency;
+
+              client->ack_latency = latency;
+              client->ack_history.push_back(sample);
+
+              i->clients.erase(j);
+              if (i->clients.empty())
+                {
+                  pending_acks.erase(i);
+                }
+            }
+          break;
+        }
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Counts the clients that did not acknowledge an urgent message in time.
+void
+DistributionSocketLink::expire_pending_acks()
+{
+  guint32 now = get_timestamp_ms();
+
+  while (!pending_acks.empty() &&
+         (pending_acks.size() > ACK_MAX_PENDING || now - pending_acks.front().time > ACK_TIMEOUT))
+    {
+      PendingAck &ack = pending_acks.front();
+
+      for (list<guint32>::iterator i = ack.clients.begin(); i != ack.clients.end(); i++)
+        {
+          Client *c = find_client_by_handle(*i);
+          if (c != NULL)
+            {
+              c->acks_missed++;
+              dist_manager->log(_("Client %s did not acknowledge an urgent message."),
+                                c->id == NULL ? "Unknown" : c->id);
+            }
+        }
 
-  TRACE_EXIT();
+      pending_acks.pop_front();
+    }
 }
 
 
-//! Handles a request from a remote client to become master.
+//! Records the traffic counters of a client, and forgets samples outside the window.
 void
-DistributionSocketLink::handle_claim(PacketBuffer &packet, Client *client)
+DistributionSocketLink::update_telemetry(Client *client, time_t current_time)
 {
-  TRACE_ENTER("DistributionSocketLink::handle_claim");
+  if (client->type == CLIENTTYPE_DIRECT)
+    {
+      TrafficSample sample;
+      sample.time = current_time;
+      sample.bytes_in = client->bytes_in;
+      sample.bytes_out = client->bytes_out;
 
-  /*gint count = */ packet.unpack_ushort();
+      client->traffic_history.push_back(sample);
+    }
 
-  if (i_am_master && master_locked)
+  while (!client->traffic_history.empty() &&
+         client->traffic_history.front().time < current_time - TELEMETRY_WINDOW)
     {
-      dist_manager->log(_("Rejecting master request from client %s."),
-                        client->id == NULL ? "Unknown" : client->id);
-      send_claim_reject(client);
+      client->traffic_history.pop_front();
     }
-  else
-    {
-      dist_manager->log(_("Acknowledging master request from client %s."),
-                        client->id == NULL ? "Unknown" : client->id);
-
-      bool was_master = i_am_master;
-
-      // Marks client as master
-      set_master(client);
-      assert(!i_am_master);
-
-      // If I was previously master, distribute state.
-      if (was_master)
-        {
-          //dist_manager->log(_("Transferring state to client %s:%d."),
-          //                  client->hostname, client->port);
-          send_client_message(DCMT_MASTER);
-        }
 
-      // And tell everyone we have a new master.
-      send_new_master();
+  while (!client->rtt_history.empty() &&
+         client->rtt_history.front().time < current_time - TELEMETRY_WINDOW)
+    {
+      client->rtt_history.pop_front();
     }
 
-  TRACE_EXIT();
+  while (!client->ack_history.empty() &&
+         client->ack_history.front().time < current_time - TELEMETRY_WINDOW)
+    {
+      client->ack_history.pop_front();
+    }
 }
 
 
+//! Returns the monotonic time in milliseconds, modulo 2^32.
+/*!
+ *  The timestamps are only compared with each other, so changes of the
+ *  wall clock do not disturb round-trip and latency measurements.
+ */
+guint32
+DistributionSocketLink::get_timestamp_ms()
+{
+  return (guint32) (g_get_monotonic_time() / 1000);
+}
 
-//! Inform that the claim has been rejected.
+//! Informs the specified client (or all remote clients) that a new client is now master.
 void
-DistributionSocketLink::send_claim_reject(Client *client)
+DistributionSocketLink::send_new_master(Client *client)
 {
-  TRACE_ENTER("DistributionSocketLink::send_claim_reject");
+  TRACE_ENTER("DistributionSocketLink::send_new_master");
 
   PacketBuffer packet;
 
   packet.create();
-  init_packet(packet, PACKET_CLAIM_REJECT);
-
-  send_packet(client, packet);
-  TRACE_EXIT();
-}
-
-
-//! Handles a rejection of my claim.
-void
-DistributionSocketLink::handle_claim_reject(PacketBuffer &packet, Client *client)
-{
-  TRACE_ENTER("DistributionSocketLink::handle_claim");
-  (void) packet;
+  init_packet(packet, PACKET_NEW_MASTER);
+  pack_new_master(packet);
 
-  if (client != master_client)
+  if (client != NULL)
     {
-      dist_manager->log(_("Non-master client %s rejected master request."),
-                        client->id == NULL ? "Unknown" : client->id);
+      send_packet(client, packet);
     }
   else
     {
-      dist_manager->log(_("Client %s rejected master request, delaying."),
-                        client->id == NULL ? "Unknown" : client->id);
-      client->reject_count++;
-      int count = client->reject_count;
-
-      if (count > 6)
-        {
-          count = 6;
-        }
-
-      client->next_claim_time = time(NULL) + 5 * count;
+      send_packet_broadcast(packet);
     }
 
   TRACE_EXIT();
 }
 
-//! Informs the specified client (or all remote clients) that a new client is now master.
+
+//! Informs all remote clients that the master renewed or released its lease.
+/*!
+ *  The lease is sent in a separate packet type, so that version 1
+ *  clients, which ignore leases, do not see a new master every time the
+ *  lease is renewed.
+ */
 void
-DistributionSocketLink::send_new_master(Client *client)
+DistributionSocketLink::send_master_lease()
 {
-  TRACE_ENTER("DistributionSocketLink::send_new_master");
+  TRACE_ENTER("DistributionSocketLink::send_master_lease");
 
   PacketBuffer packet;
 
   packet.create();
-  init_packet(packet, PACKET_NEW_MASTER);
+  init_packet(packet, PACKET_MASTER_LEASE);
+  pack_new_master(packet);
+
+  send_packet_broadcast(packet);
 
+  TRACE_EXIT();
+}
+
+
+//! Packs the ID of the master, its term and its remaining lease time.
+void
+DistributionSocketLink::pack_new_master(PacketBuffer &packet)
+{
   string id;
 
   if (master_client == NULL)
@@ -1879,21 +3574,18 @@ DistributionSocketLink::send_new_master(Client *client)
   packet.pack_string(id);
   packet.pack_ushort(0);
 
-  if (client != NULL)
-    {
-      send_packet(client, packet);
-    }
-  else
+  if (master_lease)
     {
-      send_packet_broadcast(packet);
-    }
-
-  TRACE_EXIT();
+      // Term and remaining lease time. Version 1 clients ignore these.
+      time_t remaining = master_lease_expiry - get_time();
 
+      packet.pack_ulong(master_term);
+      packet.pack_ushort(remaining > 0 ? remaining : 0);
+    }
 }
 
 
-//! Handles a new master event.
+//! Handles a new master event, or a renewal of the lease of the master.
 void
 DistributionSocketLink::handle_new_master(PacketBuffer &packet, Client *client)
 {
@@ -1907,15 +3599,60 @@ DistributionSocketLink::handle_new_master(PacketBuffer &packet, Client *client)
   gchar *id = packet.unpack_string();
   /* gint count = */ packet.unpack_ushort();
 
-  dist_manager->log(_("Client %s is now the new master."),
-                    id == NULL ? "Unknown" : id);
-
   if (client->id != NULL)
     {
       TRACE_MSG("new master from " << client->id << " -> " << id);
     }
 
-  set_master_by_id(id);
+  if (packet.bytes_available() >= 6)
+    {
+      guint32 term = packet.unpack_ulong();
+      gint lease = packet.unpack_ushort();
+
+      string master = get_master();
+      bool same = id != NULL && master == id;
+
+      TRACE_MSG("term " << term << " lease " << lease << " current " << master_term);
+
+      if (term < master_term)
+        {
+          TRACE_MSG("Stale term");
+          if (i_am_master)
+            {
+              send_new_master(client);
+            }
+        }
+      else if (term == master_term && !same && master_lease &&
+               id != NULL && master < id)
+        {
+          // Simultaneous take-over. The client with the lowest ID wins.
+          TRACE_MSG("Lost tie-break");
+        }
+      else if (i_am_master && same)
+        {
+          // My own lease. Ignore.
+        }
+      else
+        {
+          if (!same)
+            {
+              dist_manager->log(_("Client %s is now the new master."),
+                                id == NULL ? "Unknown" : id);
+              set_master_by_id(id);
+            }
+
+          master_term = term;
+          master_lease = true;
+          master_lease_expiry = get_time() + lease;
+        }
+    }
+  else
+    {
+      dist_manager->log(_("Client %s is now the new master."),
+                        id == NULL ? "Unknown" : id);
+
+      set_master_by_id(id);
+    }
 
   g_free(id);
 
@@ -1936,7 +3673,10 @@ DistributionSocketLink::send_client_message(DistributionClientMessageType type)
   string id = get_master();
   packet.pack_string(id);
 
-  packet.pack_ushort(client_message_map.size());
+  packet.pack_varint(client_message_map.size());
+
+  PacketBuffer data;
+  data.create();
 
   ClientMessageMap::iterator i = client_message_map.begin();
   while (i != client_message_map.end())
@@ -1946,17 +3686,16 @@ DistributionSocketLink::send_client_message(DistributionClientMessageType type)
 
       IDistributionClientMessage *itf = sl.listener;
 
-      int pos = 0;
-      packet.pack_ushort(id);
-      packet.reserve_size(pos);
-
+      data.clear();
       if ((sl.type & type) != 0)
         {
           TRACE_MSG("request " << id << " " << type);
-          itf->request_client_message(id, packet);
+          itf->request_client_message(id, data);
         }
 
-      packet.update_size(pos);
+      packet.pack_varint(id);
+      packet.pack_varint(data.bytes_written());
+      packet.pack_raw((unsigned char *)data.get_buffer(), data.bytes_written());
 
       i++;
     }
@@ -1968,7 +3707,7 @@ DistributionSocketLink::send_client_message(DistributionClientMessageType type)
 
 //! Handles client message  from a remote client.
 void
-DistributionSocketLink::handle_client_message(PacketBuffer &packet, Client *client)
+DistributionSocketLink::handle_client_message(PacketBuffer &packet, Client *client, int format)
 {
   TRACE_ENTER("DistributionSocketLink:handle_client_message");
   (void) client;
@@ -1987,14 +3726,32 @@ DistributionSocketLink::handle_client_message(PacketBuffer &packet, Client *clie
       g_free(id);
     }
 
-  gint size = packet.unpack_ushort();
+  bool v2 = (format == PACKETFORMAT_V2);
+  gint size = v2 ? packet.unpack_varint() : packet.unpack_ushort();
   int pos;
 
   TRACE_MSG("size = " << size);
   for (int i = 0; i < size; i++)
     {
-      DistributionClientMessageID id = (DistributionClientMessageID) packet.unpack_ushort();
-      gint datalen = packet.read_size(pos);
+      DistributionClientMessageID id;
+      gint datalen;
+
+      if (v2)
+        {
+          id = (DistributionClientMessageID) packet.unpack_varint();
+          datalen = packet.unpack_varint();
+          if (datalen < 0 || datalen > packet.bytes_available())
+            {
+              TRACE_MSG("Truncated client message");
+              break;
+            }
+          pos = packet.bytes_read() + datalen;
+        }
+      else
+        {
+          id = (DistributionClientMessageID) packet.unpack_ushort();
+          datalen = packet.read_size(pos);
+        }
 
       TRACE_MSG("len = " << datalen << " " << id);
 
@@ -2047,6 +3804,93 @@ DistributionSocketLink::start_async_server()
 }
 
 
+//! Starts or stops the discovery of peers according to the configuration.
+void
+DistributionSocketLink::update_discovery(bool restart)
+{
+  TRACE_ENTER_MSG("DistributionSocketLink::update_discovery", restart);
+  bool enabled = network_enabled && server_enabled && discovery_enabled;
+
+  if (discovery != NULL && (!enabled || restart))
+    {
+      delete discovery;
+      discovery = NULL;
+    }
+
+  if (discovery == NULL && enabled)
+    {
+      discovery = Discovery::create(discovery_interface);
+      if (discovery == NULL)
+        {
+          dist_manager->log(_("Automatic discovery of peers is not supported."));
+        }
+      else
+        {
+          discovery->set_listener(this);
+          if (!discovery->start(get_my_id(), server_port, PROTOCOL_V2, get_time()))
+            {
+              dist_manager->log(_("Could not start automatic discovery of peers."));
+              delete discovery;
+              discovery = NULL;
+            }
+        }
+    }
+  TRACE_EXIT();
+}
+
+
+//! Returns the number of direct clients found by discovery.
+int
+DistributionSocketLink::get_number_of_discovered_clients()
+{
+  int count = 0;
+
+  for (list<Client *>::iterator i = clients.begin(); i != clients.end(); i++)
+    {
+      if ((*i)->discovered && (*i)->type == CLIENTTYPE_DIRECT)
+        {
+          count++;
+        }
+    }
+
+  return count;
+}
+
+
+//! Returns the number of seconds to wait before reconnecting to a client.
+/*!
+ *  The delay starts at the reconnect interval and doubles with each failed
+ *  attempt, up to RECONNECT_MAX_INTERVAL. A random part of up to half the
+ *  delay is subtracted, so that clients that lost their connections at the
+ *  same time do not reconnect in lockstep.
+ */
+time_t
+DistributionSocketLink::get_reconnect_delay(Client *client)
+{
+  time_t delay = reconnect_interval > 0 ? reconnect_interval : 1;
+
+  for (int i = 0; i < client->reconnect_backoff && delay < RECONNECT_MAX_INTERVAL; i++)
+    {
+      delay *= 2;
+    }
+
+  if (delay > RECONNECT_MAX_INTERVAL)
+    {
+      delay = RECONNECT_MAX_INTERVAL;
+    }
+
+  return delay - g_random_int_range(0, delay / 2 + 1);
+}
+
+
+//! Returns the current time.
+time_t
+DistributionSocketLink::get_time() const
+{
+  return time_source != NULL ? time_source->get_time() : time(NULL);
+}
+
+
 void
 DistributionSocketLink::socket_accepted(ISocketServer *scon, ISocket *ccon)
 {
@@ -2060,9 +3904,8 @@ DistributionSocketLink::socket_accepted(ISocketServer *scon, ISocket *ccon)
       Client *client =  new Client;
       client->type = CLIENTTYPE_DIRECT;
       client->peer = NULL;
-      client->packet.create();
+      client->receive_buffer.create(RECEIVE_READ_SIZE);
 
-      TRACE_RETURN(client->packet.bytes_available());
       client->socket = ccon;
       client->hostname = NULL;
       client->id = NULL;
@@ -2070,9 +3913,9 @@ DistributionSocketLink::socket_accepted(ISocketServer *scon, ISocket *ccon)
       client->reconnect_count = 0;
       client->reconnect_time = 0;
 
-      ccon->set_data(client);
+      register_client(client);
+      ccon->set_data(GUINT_TO_POINTER(client->handle));
       ccon->set_listener(this);
-      clients.push_back(client);
     }
   TRACE_EXIT();
 }
@@ -2084,43 +3927,31 @@ DistributionSocketLink::socket_io(ISocket *con, void *data)
   TRACE_ENTER("DistributionSocketLink::socket_io");
   bool ret = true;
 
-  Client *client = (Client *)data;
-  g_assert(client != NULL);
-
-  TRACE_MSG("1");
+  guint32 handle = GPOINTER_TO_UINT(data);
+  Client *client = find_client_by_handle(handle);
 
-  if (!is_client_valid(client) && client->type == CLIENTTYPE_DIRECT)
+  if (client == NULL)
     {
       TRACE_RETURN("Invalid client");
       return;
     }
 
-  int bytes_read = 0;
-  int bytes_to_read = 4;
-
-  TRACE_MSG("2 " << client->packet.bytes_available() );
+  PacketBuffer &input = client->receive_buffer;
 
-  if (client->packet.bytes_available() >= 4)
+  // Make room for as much data as the socket has available.
+  input.compact();
+  if (input.get_buffer_size() - input.bytes_written() < RECEIVE_READ_SIZE)
     {
-      TRACE_MSG("3");
-
-      bytes_to_read = client->packet.peek_ushort(0) - 4;
-
-      TRACE_MSG("4 " << bytes_to_read);
-
-      if (bytes_to_read + 4 > client->packet.get_buffer_size())
-        {
-          TRACE_MSG("5 " << bytes_to_read << " " << client->packet.get_buffer_size());
-          // FIXME: the 1024 is lame...
-          client->packet.resize(bytes_to_read + 4 + 1024);
-        }
+      input.resize(input.bytes_written() + RECEIVE_READ_SIZE);
     }
 
-  TRACE_MSG("5");
+  int bytes_read = 0;
+  int bytes_to_read = input.get_buffer_size() - input.bytes_written();
+
   bool ok = true;
   try
     {
-      con->read(client->packet.get_write_ptr(), bytes_to_read, bytes_read);
+      con->read(input.get_write_ptr(), bytes_to_read, bytes_read);
     }
   catch (SocketException)
     {
@@ -2142,11 +3973,21 @@ DistributionSocketLink::socket_io(ISocket *con, void *data)
   else
     {
       g_assert(bytes_read > 0);
-      client->packet.write_ptr += bytes_read;
+      input.write_ptr += bytes_read;
+      client->bytes_in += bytes_read;
+
+      TRACE_MSG("read " << bytes_read << " available " << input.bytes_available());
 
-      if (client->packet.peek_ushort(0) == client->packet.bytes_written())
+      if (!process_client_data(client))
+        {
+          dist_manager->log(_("Client %s sent an invalid packet, closing."),
+                            client->id == NULL ? "Unknown" : client->id);
+          ret = false;
+        }
+      else if (find_client_by_handle(handle) == NULL || client->socket != con)
         {
-          process_client_packet(client);
+          TRACE_RETURN("Client closed");
+          return;
         }
     }
 
@@ -2160,17 +4001,38 @@ DistributionSocketLink::socket_io(ISocket *con, void *data)
 }
 
 
+void
+DistributionSocketLink::socket_writable(ISocket *con, void *data)
+{
+  TRACE_ENTER("DistributionSocketLink::socket_writable");
+
+  Client *client = find_client_by_handle(GPOINTER_TO_UINT(data));
+
+  g_assert(con != NULL);
+
+  if (client == NULL)
+    {
+      con->watch_writable(false);
+      TRACE_RETURN("Invalid client");
+      return;
+    }
+
+  flush_client(client);
+
+  TRACE_EXIT();
+}
+
+
 void
 DistributionSocketLink::socket_connected(ISocket *con, void *data)
 {
   TRACE_ENTER("DistributionSocketLink::socket_connected");
 
-  Client *client = (Client *)data;
+  Client *client = find_client_by_handle(GPOINTER_TO_UINT(data));
 
-  g_assert(client != NULL);
   g_assert(con != NULL);
 
-  if (!is_client_valid(client) && client->type == CLIENTTYPE_DIRECT)
+  if (client == NULL)
     {
       TRACE_RETURN("Invalid client");
       return;
@@ -2181,8 +4043,11 @@ DistributionSocketLink::socket_connected(ISocket *con, void *data)
 
   client->reconnect_count = 0;
   client->reconnect_time = 0;
+  client->reconnect_backoff = 0;
   client->outbound = true;
-  client->socket = con;
+
+  // Discard data that was queued while connecting.
+  set_client_socket(client, con);
 
   send_hello(client);
 
@@ -2196,18 +4061,23 @@ DistributionSocketLink::socket_closed(ISocket *con, void *data)
   TRACE_ENTER("DistributionSocketLink::socket_closed");
   (void) con;
 
-  Client *client = (Client *)data;
-  assert(client != NULL);
+  Client *client = find_client_by_handle(GPOINTER_TO_UINT(data));
 
-  if (!is_client_valid(client) && client->type == CLIENTTYPE_DIRECT)
+  if (client == NULL)
     {
       TRACE_RETURN("Invalid client");
       return;
     }
 
-  // Socket error. Disable client.
-  if (client->socket != NULL)
+  if (client->connecting)
+    {
+      dist_manager->log(_("Could not connect to client %s."),
+                        client->id != NULL ? client->id : "Unknown");
+      connect_failed(client);
+    }
+  else if (client->socket != NULL)
     {
+      // Socket error. Disable client.
       dist_manager->log(_("Client %s closed connection."),
                         client->id != NULL ? client->id : "Unknown");
       close_client(client, client->outbound);
@@ -2223,6 +4093,50 @@ DistributionSocketLink::socket_closed(ISocket *con, void *data)
 }
 
 
+//! Connects to a peer that announced itself on the local network.
+/*!
+ *  The number of connections made to discovered peers is limited to
+ *  DISCOVERY_MAX_CONNECTIONS. The other nodes still reach me through
+ *  the peers I am connected to.
+ */
+void
+DistributionSocketLink::peer_discovered(const string &id, const string &host, int port, int protocol)
+{
+  TRACE_ENTER_MSG("DistributionSocketLink::peer_discovered", id << " " << host << ":" << port);
+
+  if (protocol < PROTOCOL_V1)
+    {
+      TRACE_RETURN("Unsupported protocol");
+      return;
+    }
+
+  if (exists_client((gchar *)id.c_str()) ||
+      find_client_by_canonicalname((gchar *)host.c_str(), port) != NULL)
+    {
+      TRACE_RETURN("Already known");
+      return;
+    }
+
+  if (get_number_of_discovered_clients() >= DISCOVERY_MAX_CONNECTIONS)
+    {
+      TRACE_RETURN("Too many discovered clients");
+      return;
+    }
+
+  dist_manager->log(_("Discovered %s at %s:%d."), id.c_str(), host.c_str(), port);
+
+  add_client(NULL, (gchar *)host.c_str(), port, CLIENTTYPE_DIRECT);
+
+  Client *client = find_client_by_canonicalname((gchar *)host.c_str(), port);
+  if (client != NULL)
+    {
+      client->discovered = true;
+    }
+
+  TRACE_EXIT();
+}
+
+
 //! Read the configuration from the configurator.
 void
 DistributionSocketLink::read_configuration()
@@ -2246,6 +4160,13 @@ DistributionSocketLink::read_configuration()
       set_server_enabled(true);
     }
 
+  string old_interface = discovery_interface;
+  discovery_enabled = dist_manager->get_discovery();
+  discovery_interface = dist_manager->get_discovery_interface();
+
+  // Announcements contain my port, so restart discovery when it changes.
+  update_discovery(old_port != server_port || old_interface != discovery_interface);
+
   reconnect_interval = dist_manager->get_reconnect_interval();
   reconnect_attempts = dist_manager->get_reconnect_attempts();
 
@@ -21,6 +21,7 @@
 
 #include <list>
 #include <map>
+#include <vector>
 
 #if TIME_WITH_SYS_TIME
 # include <sys/time.h>
@@ -37,21 +38,74 @@
 #include "IDistributionClientMessage.hh"
 #include "IConfiguratorListener.hh"
 #include "PacketBuffer.hh"
+#include "PacketCapture.hh"
+#include "PacketQueue.hh"
 
+#include "Discovery.hh"
 #include "SocketDriver.hh"
+#include "TimeSource.hh"
 #include "WRID.hh"
 
 #define DEFAULT_PORT (27273)
 #define DEFAULT_INTERVAL (15)
 #define DEFAULT_ATTEMPTS (5)
 
+//! Maximum number of seconds between reconnect attempts.
+#define RECONNECT_MAX_INTERVAL (15 * 60)
+
+//! Maximum number of bytes queued to a client before it is considered stalled.
+#define SEND_QUEUE_HIGH_WATER_MARK (1024 * 1024)
+
+//! Maximum number of packets written at once.
+#define SEND_QUEUE_MAX_VECTORS (16)
+
+//! Minimum number of bytes read from a client at once.
+#define RECEIVE_READ_SIZE (16384)
+
+//! Size of the escape and 32-bit length that precede a version 2 packet.
+#define PACKET_V2_PREFIX_SIZE (6)
+
+//! Maximum size of a received version 2 packet.
+#define PACKET_V2_MAX_SIZE (16 * 1024 * 1024)
+
+//! Number of recent message IDs per origin remembered for duplicate suppression.
+#define MESSAGE_ID_WINDOW (32)
+
+//! Time in seconds after which a prune of a broadcast origin expires.
+#define PRUNE_LIFETIME (120)
+
+//! Duration in seconds of a master lease.
+#define MASTER_LEASE_TIME (10)
+
+//! An active master renews its lease when less than this number of seconds remain.
+#define MASTER_LEASE_RENEW_TIME (5)
+
+//! Number of seconds over which telemetry rates and round-trip times are reported.
+#define TELEMETRY_WINDOW (60)
+
+//! Number of seconds between round-trip time measurements.
+#define TELEMETRY_PING_INTERVAL (5)
+
+//! Minimum size of a packet body that is compressed.
+#define PACKET_COMPRESSION_THRESHOLD (512)
+
+//! Time in milliseconds after which a missing acknowledgement is counted as lost.
+#define ACK_TIMEOUT (5000)
+
+//! Maximum number of urgent messages of which acknowledgements are awaited.
+#define ACK_MAX_PENDING (32)
+
+//! Maximum number of connections made to peers found by discovery.
+#define DISCOVERY_MAX_CONNECTIONS (3)
+
 class Configurator;
 
 class DistributionSocketLink :
   public DistributionLink,
   public IConfiguratorListener,
   public ISocketServerListener,
-  public ISocketListener
+  public ISocketListener,
+  public IDiscoveryListener
 {
 public:
 private:
@@ -65,11 +119,48 @@ private:
     PACKET_DUPLICATE    = 0x0007,
     PACKET_CLAIM_REJECT = 0x0008,
     PACKET_SIGNOFF      = 0x0009,
+    PACKET_PRUNE        = 0x000A,
+    PACKET_PING         = 0x000B,
+    PACKET_PONG         = 0x000C,
+    PACKET_ACK          = 0x000D,
+    PACKET_MASTER_LEASE = 0x000E,
   };
 
   enum PacketFlags {
     PACKETFLAG_SOURCE   = 0x0001,
     PACKETFLAG_DEST     = 0x0002,
+    PACKETFLAG_MSGID    = 0x0004,
+    PACKETFLAG_COMPRESSED = 0x0008,
+    PACKETFLAG_ACK      = 0x0010,
+  };
+
+  //! Encoding of the packet body, stored in the version byte of a packet.
+  enum PacketFormat {
+    PACKETFORMAT_V1     = 2,
+    PACKETFORMAT_V2     = 3,
+  };
+
+  //! Protocol version supported by a client.
+  /*!
+   *  Version 1 uses 16-bit packet lengths. Version 2 adds 32-bit packet
+   *  lengths and LEB128 varint counts, IDs and sizes in the client message
+   *  container. The payloads are opaque to the link; the statistics and
+   *  timer updates encode their own values as varints.
+   */
+  enum ProtocolVersion {
+    PROTOCOL_V1         = 1,
+    PROTOCOL_V2         = 2,
+  };
+
+  //! Type-length-value fields appended to a hello and welcome packet.
+  enum CapabilityTag {
+    CAPABILITY_PROTOCOL = 1,
+    CAPABILITY_COMPRESSION = 2,
+  };
+
+  //! Compression algorithms, advertised as a bitmask in CAPABILITY_COMPRESSION.
+  enum CompressionAlgorithm {
+    COMPRESSION_ZLIB    = 1,
   };
 
   enum ClientListFlags
@@ -90,6 +181,34 @@ private:
     }
   };
 
+  //! Traffic counters of a client at a moment in time.
+  struct TrafficSample
+  {
+    time_t time;
+    guint64 bytes_in;
+    guint64 bytes_out;
+  };
+
+  //! Round-trip time measured at a moment in time.
+  struct RttSample
+  {
+    time_t time;
+    int rtt;
+  };
+
+  //! Urgent message of which acknowledgements are awaited.
+  struct PendingAck
+  {
+    //! Message ID of the packet.
+    guint32 message_id;
+
+    //! Time the packet was sent, in milliseconds.
+    guint32 time;
+
+    //! Handles of the clients that did not acknowledge yet.
+    list<guint32> clients;
+  };
+
   enum ClientType
     {
       CLIENTTYPE_UNKNOWN    = 1,
@@ -110,10 +229,28 @@ private:
       sent_client_list(false),
       reconnect_count(0),
       reconnect_time(0),
+      reconnect_backoff(0),
       next_claim_time(0),
       reject_count(0),
       claim_count(0),
-      outbound(false)
+      outbound(false),
+      connecting(false),
+      discovered(false),
+      stalled(false),
+      protocol(PROTOCOL_V1),
+      compression(false),
+      handle(0),
+      last_message_id(0),
+      message_window(0),
+      session(0),
+      bytes_in(0),
+      bytes_out(0),
+      packets_in(0),
+      packets_out(0),
+      reconnects(0),
+      rtt(-1),
+      ack_latency(-1),
+      acks_missed(0)
     {
     }
 
@@ -151,8 +288,8 @@ private:
     //!
     bool sent_client_list;
 
-    //!
-    PacketBuffer packet;
+    //! Data received from the client that is not yet processed.
+    PacketBuffer receive_buffer;
 
     //! Reconnect counter;
     int reconnect_count;
@@ -160,6 +297,9 @@ private:
     //! Last reconnect attempt time;
     time_t reconnect_time;
 
+    //! Number of reconnect attempts since the last successful connect.
+    int reconnect_backoff;
+
     //! Next time we can try to claim from this client;
     time_t next_claim_time;
 
@@ -171,11 +311,96 @@ private:
 
     //! Is this an outbound connection
     bool outbound;
+
+    //! Is an outbound connection being set up?
+    bool connecting;
+
+    //! Was the connection made to a peer found by discovery.
+    bool discovered;
+
+    //! Packets waiting to be written.
+    PacketQueue send_queue;
+
+    //! Is the client not reading the data we send?
+    bool stalled;
+
+    //! Protocol version used to send packets to this client.
+    int protocol;
+
+    //! Whether the client accepts compressed packets.
+    bool compression;
+
+    //! Handle that identifies this client in the registry.
+    guint32 handle;
+
+    //! Most recent message ID received from this client as origin.
+    guint32 last_message_id;
+
+    //! Bitmap of the message IDs received before last_message_id.
+    guint32 message_window;
+
+    //! Random value chosen by the client at startup, or 0 if unknown.
+    guint32 session;
+
+    //! Origins of which this client does not want broadcasts, with expiry time.
+    map<string, time_t> pruned_origins;
+
+    //! Number of bytes received.
+    guint64 bytes_in;
+
+    //! Number of bytes sent.
+    guint64 bytes_out;
+
+    //! Number of packets received.
+    guint32 packets_in;
+
+    //! Number of packets queued for sending.
+    guint32 packets_out;
+
+    //! Number of reconnect attempts.
+    int reconnects;
+
+    //! Most recent round-trip time in milliseconds, or -1 if unknown.
+    int rtt;
+
+    //! Traffic counters of the last TELEMETRY_WINDOW seconds, oldest first.
+    list<TrafficSample> traffic_history;
+
+    //! Round-trip times of the last TELEMETRY_WINDOW seconds, oldest first.
+    list<RttSample> rtt_history;
+
+    //! Most recent acknowledgement latency in milliseconds, or -1 if unknown.
+    int ack_latency;
+
+    //! Acknowledgement latencies of the last TELEMETRY_WINDOW seconds, oldest first.
+    list<RttSample> ack_history;
+
+    //! Number of urgent messages that were not acknowledged in time.
+    guint32 acks_missed;
+  };
+
+  //! Entry in the client registry.
+  struct ClientSlot
+  {
+    ClientSlot() :
+      client(NULL),
+      generation(0)
+    {
+    }
+
+    //! The client, or NULL if the slot is free.
+    Client *client;
+
+    //! Incremented each time the slot is reused.
+    guint16 generation;
   };
 
+  typedef multimap<string, Client *> ClientIndex;
+  typedef ClientIndex::iterator ClientIndexIter;
+
 
 public:
-  DistributionSocketLink(Configurator *conf);
+  DistributionSocketLink(Configurator *conf, SocketDriver *driver = NULL, const TimeSource *time_source = NULL);
   virtual ~DistributionSocketLink();
 
   void init_my_id();
@@ -198,18 +423,34 @@ public:
                                IDistributionClientMessage *callback);
   bool unregister_client_message(DistributionClientMessageID id);
   bool broadcast_client_message(DistributionClientMessageID id, PacketBuffer &buffer);
+  bool broadcast_client_messages(const PendingClientMessages &messages);
+  bool broadcast_urgent_client_message(DistributionClientMessageID id, PacketBuffer &buffer);
+  bool send_client_message_to(const string &client_id, DistributionClientMessageID id, PacketBuffer &buffer);
+  DistributionPeerStatisticsList get_peer_statistics();
+  bool replay_capture(const std::string &filename, int &frames, gint64 &duration);
 
   void socket_accepted(ISocketServer *server, ISocket *con);
   void socket_connected(ISocket *con, void *data);
   void socket_io(ISocket *con, void *data);
+  void socket_writable(ISocket *con, void *data);
   void socket_closed(ISocket *con, void *data);
 
+  void peer_discovered(const std::string &id, const std::string &host, int port, int protocol);
+
 private:
-  bool is_client_valid(Client *client);
+  void register_client(Client *client);
+  void unregister_client(Client *client);
+  void index_client(Client *client);
+  void unindex_client(Client *client);
+  Client *find_client_by_handle(guint32 handle);
   bool add_client(gchar *id, gchar *host, gint port, ClientType type, Client *peer = NULL);
   void remove_client(Client *client);
   void remove_peer_clients(Client *client);
   void close_client(Client *client, bool reconnect = false);
+  void close_stalled_clients();
+  void connect_client(Client *client, const gchar *host, gint port);
+  void connect_failed(Client *client);
+  void set_client_socket(Client *client, ISocket *socket);
   Client *find_client_by_canonicalname(gchar *name, gint port);
   Client *find_client_by_id(gchar *id);
   bool client_is_me(gchar *id);
@@ -221,15 +462,27 @@ private:
   void set_master_by_id(gchar *id);
   void set_master(Client *client);
   void set_me_master();
+  void start_master_term();
 
   void init_packet(PacketBuffer &packet, PacketCommand cmd);
   void send_packet_broadcast(PacketBuffer &packet);
-  void send_packet_except(PacketBuffer &packet, Client *client);
+  void send_packet_except(PacketBuffer &packet, Client *client, Client *origin = NULL);
   void send_packet(Client *client, PacketBuffer &packet);
   void forward_packet_except(PacketBuffer &packet, Client *client, Client *source);
   void forward_packet(PacketBuffer &packet, Client *dest, Client *source);
-
-  void process_client_packet(Client *client);
+  SharedPacket *encode_packet(PacketBuffer &packet, int protocol, bool compress);
+  bool downgrade_packet(PacketBuffer &packet, PacketBuffer &out);
+  bool compress_packet(PacketBuffer &packet, PacketBuffer &out);
+  bool decompress_packet(PacketBuffer &packet, PacketBuffer &out);
+  int get_header_size(PacketBuffer &packet);
+  void queue_packet(Client *client, SharedPacket *packet);
+  void flush_client(Client *client);
+  bool is_duplicate_message(Client *origin, guint32 message_id);
+  void set_client_session(Client *client, guint32 session);
+  bool is_pruned(Client *client, Client *origin);
+
+  bool process_client_data(Client *client);
+  void process_client_packet(Client *client, PacketBuffer &packet);
   void handle_hello(PacketBuffer &packet, Client *client);
   void handle_signoff(PacketBuffer &packet, Client *client);
   void handle_welcome(PacketBuffer &packet, Client *client);
@@ -237,8 +490,12 @@ private:
   bool handle_client_list(PacketBuffer &packet, Client *client, Client *direct);
   void handle_claim(PacketBuffer &packet, Client *client);
   void handle_new_master(PacketBuffer &packet, Client *client);
-  void handle_client_message(PacketBuffer &packet, Client *client);
+  void handle_client_message(PacketBuffer &packet, Client *client, int format);
   void handle_claim_reject(PacketBuffer &packet, Client *client);
+  void handle_prune(PacketBuffer &packet, Client *client);
+  void handle_ping(PacketBuffer &packet, Client *client);
+  void handle_pong(PacketBuffer &packet, Client *client);
+  void handle_ack(PacketBuffer &packet, Client *client);
 
   void send_hello(Client *client);
   void send_signoff(Client *to, Client *signedoff_client);
@@ -247,10 +504,26 @@ private:
   void send_client_list(Client *client, bool except = false);
   void send_claim(Client *client);
   void send_new_master(Client *client = NULL);
+  void send_master_lease();
+  void pack_new_master(PacketBuffer &packet);
   void send_claim_reject(Client *client);
   void send_client_message(DistributionClientMessageType type);
+  void send_prune(Client *client, const gchar *origin, bool prune);
+  void send_ping(Client *client);
+  void send_ack(Client *client, guint32 message_id);
+
+  bool send_client_messages(const PendingClientMessages &messages, bool acknowledge, Client *dest = NULL);
+  void expire_pending_acks();
+  void update_telemetry(Client *client, time_t current_time);
+  static guint32 get_timestamp_ms();
+  void pack_capabilities(PacketBuffer &packet);
+  void unpack_capabilities(PacketBuffer &packet, Client *client);
 
   bool start_async_server();
+  void update_discovery(bool restart = false);
+  int get_number_of_discovered_clients();
+  time_t get_reconnect_delay(Client *client);
+  time_t get_time() const;
 
   void read_configuration();
   void config_changed_notify(const string &key);
@@ -263,6 +536,9 @@ private:
 
   SocketDriver *socket_driver;
 
+  //! Source of the current time, or NULL to use the system clock.
+  const TimeSource *time_source;
+
   //! The configuration access.
   Configurator *configurator;
 
@@ -278,6 +554,18 @@ private:
   //! All clients.
   list<Client *> clients;
 
+  //! Registry of all clients, indexed by the slot number of their handle.
+  vector<ClientSlot> client_slots;
+
+  //! Unused slots in the registry.
+  vector<int> free_client_slots;
+
+  //! All clients with an ID, by ID.
+  ClientIndex clients_by_id;
+
+  //! All clients with a host name, by host name and port.
+  ClientIndex clients_by_address;
+
   //! Active client
   Client *master_client;
 
@@ -287,6 +575,15 @@ private:
   //! Whether the master status is locked by me.
   bool master_locked;
 
+  //! Term of the current master, incremented on each take-over.
+  guint32 master_term;
+
+  //! Whether the current master holds a lease.
+  bool master_lease;
+
+  //! Time at which the lease of the current master expires.
+  time_t master_lease_expiry;
+
   //! My name
   //gchar *myname;
 
@@ -299,6 +596,15 @@ private:
   //! The server socket.
   ISocketServer *server_socket;
 
+  //! Discovery of peers on the local network, or NULL if not running.
+  Discovery *discovery;
+
+  //! Whether peers are discovered automatically.
+  bool discovery_enabled;
+
+  //! Network interface used for discovery, or empty for the default.
+  string discovery_interface;
+
   //! Whether distribution is enabled.
   bool network_enabled;
   bool server_enabled;
@@ -314,6 +620,18 @@ private:
 
   //!
   int heartbeat_count;
+
+  //! ID of the next packet sent by me.
+  guint32 next_message_id;
+
+  //! Random value that identifies this run, to detect restarts.
+  guint32 session;
+
+  //! Urgent messages of which acknowledgements are awaited, oldest first.
+  list<PendingAck> pending_acks;
+
+  //! Capture of all frames sent and received, or NULL if not capturing.
+  PacketCapture *capture;
 };
 
 #endif // DISTRIBUTIONSOCKETLINK_HH
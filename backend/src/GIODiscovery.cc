@@ -0,0 +1,190 @@
+// GIODiscovery.cc --- Peer discovery using GIO multicast sockets
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_GIO_NET) && defined(HAVE_DISTRIBUTION)
+
+#include "debug.hh"
+#include "GIODiscovery.hh"
+#include "PacketBuffer.hh"
+
+// Multicast group membership requires GLib 2.32.
+#if GLIB_CHECK_VERSION(2,32,0)
+
+using namespace std;
+
+
+//! Constructs a discovery on the specified network interface.
+GIODiscovery::GIODiscovery(const string &interface) :
+  interface(interface),
+  socket(NULL),
+  group(NULL),
+  group_address(NULL)
+{
+}
+
+
+//! Destructs the discovery.
+GIODiscovery::~GIODiscovery()
+{
+  stop();
+}
+
+
+//! Joins the multicast group.
+bool
+GIODiscovery::open()
+{
+  TRACE_ENTER_MSG("GIODiscovery::open", interface);
+  GError *error = NULL;
+
+  group = g_inet_address_new_from_string(DISCOVERY_GROUP);
+  group_address = g_inet_socket_address_new(group, DISCOVERY_PORT);
+
+  socket = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, &error);
+  if (socket != NULL)
+    {
+      // Allow other instances on this host to bind the same port.
+      GInetAddress *any = g_inet_address_new_any(G_SOCKET_FAMILY_IPV4);
+      GSocketAddress *address = g_inet_socket_address_new(any, DISCOVERY_PORT);
+
+      if (g_socket_bind(socket, address, TRUE, &error))
+        {
+          g_socket_join_multicast_group(socket, group, FALSE,
+                                        interface != "" ? interface.c_str() : NULL,
+                                        &error);
+        }
+
+      g_object_unref(address);
+      g_object_unref(any);
+    }
+
+  if (error != NULL)
+    {
+      TRACE_MSG("Failed to join multicast group: " << error->message);
+      g_error_free(error);
+      close();
+
+      TRACE_RETURN(false);
+      return false;
+    }
+
+  g_socket_set_blocking(socket, FALSE);
+  g_socket_set_multicast_ttl(socket, 1);
+  g_socket_set_multicast_loopback(socket, TRUE);
+
+  TRACE_RETURN(true);
+  return true;
+}
+
+
+//! Leaves the multicast group.
+void
+GIODiscovery::close()
+{
+  TRACE_ENTER("GIODiscovery::close");
+  if (socket != NULL)
+    {
+      g_socket_close(socket, NULL);
+      g_object_unref(socket);
+      socket = NULL;
+    }
+
+  if (group_address != NULL)
+    {
+      g_object_unref(group_address);
+      group_address = NULL;
+    }
+
+  if (group != NULL)
+    {
+      g_object_unref(group);
+      group = NULL;
+    }
+  TRACE_EXIT();
+}
+
+
+//! Sends a datagram to the multicast group.
+bool
+GIODiscovery::send(PacketBuffer &packet)
+{
+  GError *error = NULL;
+
+  if (socket == NULL)
+    {
+      return false;
+    }
+
+  g_socket_send_to(socket, group_address, packet.get_buffer(), packet.bytes_written(), NULL, &error);
+  if (error != NULL)
+    {
+      TRACE_ENTER("GIODiscovery::send");
+      TRACE_MSG("Failed to send announcement: " << error->message);
+      g_error_free(error);
+      TRACE_EXIT();
+      return false;
+    }
+
+  return true;
+}
+
+
+//! Receives a datagram without blocking.
+bool
+GIODiscovery::receive(PacketBuffer &packet, string &host)
+{
+  GError *error = NULL;
+  GSocketAddress *address = NULL;
+  gchar buffer[DISCOVERY_MAX_SIZE];
+
+  if (socket == NULL)
+    {
+      return false;
+    }
+
+  gssize size = g_socket_receive_from(socket, &address, buffer, sizeof(buffer), NULL, &error);
+  if (error != NULL)
+    {
+      // Nothing to read, or an error that is reported again on the
+      // next heartbeat. Either way, stop reading for now.
+      g_error_free(error);
+      return false;
+    }
+
+  packet.create(size);
+  packet.pack_raw((guint8 *)buffer, size);
+
+  host = "";
+  if (address != NULL)
+    {
+      gchar *name = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(address)));
+      host = name;
+      g_free(name);
+      g_object_unref(address);
+    }
+
+  return true;
+}
+
+#endif
+#endif
@@ -0,0 +1,68 @@
+// GIODiscovery.hh --- Peer discovery using GIO multicast sockets
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef GIODISCOVERY_HH
+#define GIODISCOVERY_HH
+
+#if defined(HAVE_GIO_NET) && defined(HAVE_DISTRIBUTION)
+
+#include <string>
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "Discovery.hh"
+
+//! Discovery on an IPv4 multicast group using a GIO datagram socket.
+/*!
+ *  Announcements are sent with a TTL of 1, so they never leave the
+ *  local network, and are looped back to the sending host, so that
+ *  several instances on one host can discover each other.
+ */
+class GIODiscovery
+  : public Discovery
+{
+public:
+  GIODiscovery(const std::string &interface);
+  virtual ~GIODiscovery();
+
+protected:
+  // Discovery interface
+  virtual bool open();
+  virtual void close();
+  virtual bool send(PacketBuffer &packet);
+  virtual bool receive(PacketBuffer &packet, std::string &host);
+
+private:
+  //! Network interface on which the group is joined, or empty for the default.
+  std::string interface;
+
+  //! The datagram socket.
+  GSocket *socket;
+
+  //! Address of the multicast group.
+  GInetAddress *group;
+
+  //! Address and port of the multicast group.
+  GSocketAddress *group_address;
+};
+
+#endif
+#endif // GIODISCOVERY_HH
@@ -23,6 +23,17 @@
 
 #if defined(HAVE_GIO_NET) && defined(HAVE_DISTRIBUTION)
 
+#include <time.h>
+
+#if defined(PLATFORM_OS_WIN32)
+#include <winsock2.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
 #include "debug.hh"
 #include "GIOSocketDriver.hh"
 
@@ -101,6 +112,12 @@ GIOSocketServer::static_socket_incoming(GSocketService *service,
 
 
 
+//! Handles the result of a connection attempt.
+/*!
+ *  The first attempt that succeeds wins, and the other attempts are
+ *  cancelled. If all attempts fail, the listener is notified that the
+ *  socket is closed.
+ */
 void
 GIOSocket::static_connected_callback(GObject *source_object,
                                      GAsyncResult *result,
@@ -108,29 +125,53 @@ GIOSocket::static_connected_callback(GObject *source_object,
 {
   TRACE_ENTER("GIOSocketServer::static_connected_callback");
 
-  GIOSocket *socket = (GIOSocket *)user_data;
+  PendingRequest *request = (PendingRequest *)user_data;
+  GIOSocket *socket = request->socket;
   GError *error = NULL;
 
   GSocketConnection *socket_connection =
     g_socket_client_connect_finish(G_SOCKET_CLIENT(source_object), result, &error);
+  g_object_unref(source_object);
+
+  if (socket != NULL)
+    {
+      socket->connect_requests.remove(request);
+    }
+  free_request(request);
 
   if (error != NULL)
     {
       TRACE_MSG("failed to connect");
       g_error_free(error);
     }
-  else if (socket_connection != NULL)
+
+  if (socket == NULL)
+    {
+      // Socket was destroyed, or another attempt already succeeded.
+      if (socket_connection != NULL)
+        {
+          g_object_unref(socket_connection);
+        }
+    }
+  else if (socket_connection == NULL)
+    {
+      // Do not wait for the timer to try the next address.
+      socket->start_next_attempt();
+    }
+  else
     {
+      socket->cancel_requests();
+      socket->clear_addresses();
+
       socket->connection = socket_connection;
       socket->socket = g_socket_connection_get_socket(socket->connection);
-      g_socket_set_blocking(socket->socket, FALSE);
-      g_socket_set_keepalive(socket->socket, TRUE);
+      set_socket_options(socket->socket);
 
       socket->source = g_socket_create_source(socket->socket,
                                               (GIOCondition) (G_IO_IN | G_IO_ERR | G_IO_HUP),
                                               NULL);
       g_source_set_callback(socket->source, (GSourceFunc) static_data_callback, (void*)socket, NULL);
-      g_source_attach(socket->source, NULL);
+      g_source_attach(socket->source, g_main_context_get_thread_default());
       // g_source_unref(source);
 
       if (socket->listener != NULL)
@@ -188,33 +229,72 @@ GIOSocket::static_data_callback(GSocket *socket,
   return ret;
 }
 
+
+gboolean
+GIOSocket::static_writable_callback(GSocket *socket,
+                                    GIOCondition condition,
+                                    gpointer user_data)
+{
+  TRACE_ENTER_MSG("GIOSocket::static_writable_callback", (int)condition);
+
+  GIOSocket *giosocket = (GIOSocket *)user_data;
+  gboolean ret = TRUE;
+
+  (void) socket;
+
+  try
+    {
+      if (giosocket->listener != NULL)
+        {
+          giosocket->listener->socket_writable(giosocket, giosocket->user_data);
+        }
+    }
+  catch(...)
+    {
+      // Make sure that no exception reach the glib mainloop.
+      TRACE_MSG("Exception");
+    }
+
+  // The listener disables the notification using watch_writable(), which
+  // destroys this source. The socket may no longer exist at this point.
+  TRACE_EXIT();
+  return ret;
+}
+
+
 //! Creates a new connection.
 GIOSocket::GIOSocket(GSocketConnection *connection) :
+  driver(NULL),
   connection(connection),
-  resolver(NULL)
+  write_source(NULL),
+  port(0),
+  resolve_request(NULL),
+  attempt_timer(NULL)
 {
   TRACE_ENTER("GIOSocket::GIOSocket(con)");
   socket = g_socket_connection_get_socket(connection);
   g_object_ref(connection);
 
-  g_socket_set_blocking(socket, FALSE);
-  g_socket_set_keepalive(socket, TRUE);
+  set_socket_options(socket);
 
   source = g_socket_create_source(socket, (GIOCondition)G_IO_IN, NULL);
   g_source_set_callback(source, (GSourceFunc) static_data_callback, (void*)this, NULL);
-  g_source_attach(source, NULL);
+  g_source_attach(source, g_main_context_get_thread_default());
   g_source_unref(source);
   TRACE_EXIT();
 }
 
 
 //! Creates a new connection.
-GIOSocket::GIOSocket() :
+GIOSocket::GIOSocket(GIOSocketDriver *driver) :
+  driver(driver),
   connection(NULL),
   socket(NULL),
-  resolver(NULL),
   source(NULL),
-  port(0)
+  write_source(NULL),
+  port(0),
+  resolve_request(NULL),
+  attempt_timer(NULL)
 {
   TRACE_ENTER("GIOSocket::GIOSocket()");
   TRACE_EXIT();
@@ -225,91 +305,329 @@ GIOSocket::GIOSocket() :
 GIOSocket::~GIOSocket()
 {
   TRACE_ENTER("GIOSocket::~GIOSocket");
+  cancel_requests();
+  clear_addresses();
   if (connection != NULL)
     {
       g_object_unref(connection);
     }
-  if (resolver != NULL)
-    {
-      g_object_unref(resolver);
-    }
   if (source != NULL)
     {
       g_source_destroy(source);
     }
+  watch_writable(false);
   TRACE_EXIT();
 }
 
 
 //! Connects to the specified host.
+/*!
+ *  Resolved addresses are cached by the driver. If a host has several
+ *  addresses, a new attempt is started every GIO_CONNECT_ATTEMPT_DELAY
+ *  milliseconds, alternating between address families, until one of the
+ *  attempts succeeds.
+ */
 void
 GIOSocket::connect(const string &host, int port)
 {
   TRACE_ENTER_MSG("GIOSocket::connect", host << " " << port);
+  this->hostname = host;
   this->port = port;
 
+  cancel_requests();
+  clear_addresses();
+
+  list<GInetAddress *> resolved;
+
   GInetAddress *inet_addr = g_inet_address_new_from_string(host.c_str());
   if (inet_addr != NULL)
     {
-      connect(inet_addr, port);
+      resolved.push_back(inet_addr);
+      set_addresses(resolved);
       g_object_unref(inet_addr);
+
+      start_next_attempt();
+    }
+  else if (driver != NULL && driver->lookup_addresses(host, resolved))
+    {
+      TRACE_MSG("cached");
+      set_addresses(resolved);
+      start_next_attempt();
     }
   else
     {
-      resolver = g_resolver_get_default();
+      resolve_request = create_request();
+
+      GResolver *resolver = g_resolver_get_default();
       g_resolver_lookup_by_name_async(resolver,
                                       host.c_str(),
-                                      NULL,
+                                      resolve_request->cancellable,
                                       static_connect_after_resolve,
-                                      this);
+                                      resolve_request);
+      g_object_unref(resolver);
+    }
+  TRACE_EXIT();
+}
+
+
+//! Handles the result of a host name resolution.
+void
+GIOSocket::static_connect_after_resolve(GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  TRACE_ENTER("GIOSocket::static_connect_after_resolve");
+  PendingRequest *request = (PendingRequest *) user_data;
+  GIOSocket *socket = request->socket;
+  GError *error = NULL;
+
+  GList *addresses = g_resolver_lookup_by_name_finish((GResolver *)source_object, res, &error);
+  free_request(request);
 
+  if (error != NULL)
+    {
+      TRACE_MSG("failed");
+      g_error_free(error);
+    }
+
+  if (socket != NULL)
+    {
+      socket->resolve_request = NULL;
+
+      list<GInetAddress *> resolved;
+      for (GList *i = addresses; i != NULL; i = i->next)
+        {
+          resolved.push_back((GInetAddress *) i->data);
+        }
+
+      if (!resolved.empty() && socket->driver != NULL)
+        {
+          socket->driver->cache_addresses(socket->hostname, resolved);
+        }
+
+      socket->set_addresses(resolved);
+    }
+
+  if (addresses != NULL)
+    {
+      g_resolver_free_addresses(addresses);
+    }
+
+  if (socket != NULL)
+    {
+      socket->start_next_attempt();
     }
   TRACE_EXIT();
 }
 
+
+//! Creates a request for an asynchronous operation of this socket.
+GIOSocket::PendingRequest *
+GIOSocket::create_request()
+{
+  PendingRequest *request = new PendingRequest;
+  request->socket = this;
+  request->cancellable = g_cancellable_new();
+  return request;
+}
+
+
+//! Frees a request after its callback is invoked.
 void
-GIOSocket::connect(GInetAddress *inet_addr, int port)
+GIOSocket::free_request(PendingRequest *request)
 {
-  TRACE_ENTER_MSG("GIOSocket::connect", port);
+  g_object_unref(request->cancellable);
+  delete request;
+}
+
+
+//! Cancels all resolve and connect requests in progress.
+/*!
+ *  The callbacks of the requests are still invoked, but no longer refer
+ *  to this socket.
+ */
+void
+GIOSocket::cancel_requests()
+{
+  if (resolve_request != NULL)
+    {
+      resolve_request->socket = NULL;
+      g_cancellable_cancel(resolve_request->cancellable);
+      resolve_request = NULL;
+    }
+
+  for (list<PendingRequest *>::iterator i = connect_requests.begin(); i != connect_requests.end(); i++)
+    {
+      (*i)->socket = NULL;
+      g_cancellable_cancel((*i)->cancellable);
+    }
+  connect_requests.clear();
+
+  if (attempt_timer != NULL)
+    {
+      g_source_destroy(attempt_timer);
+      attempt_timer = NULL;
+    }
+}
+
+
+//! Sets the addresses to try, alternating between address families.
+void
+GIOSocket::set_addresses(const list<GInetAddress *> &resolved)
+{
+  clear_addresses();
+
+  if (resolved.empty())
+    {
+      return;
+    }
+
+  // The resolver returns the addresses in order of preference. Keep that
+  // order within each family, starting with the family of the first address.
+  GSocketFamily first_family = g_inet_address_get_family(resolved.front());
+  list<GInetAddress *> first;
+  list<GInetAddress *> other;
+
+  for (list<GInetAddress *>::const_iterator i = resolved.begin(); i != resolved.end(); i++)
+    {
+      if (g_inet_address_get_family(*i) == first_family)
+        {
+          first.push_back(*i);
+        }
+      else
+        {
+          other.push_back(*i);
+        }
+    }
+
+  while (!first.empty() || !other.empty())
+    {
+      if (!first.empty())
+        {
+          addresses.push_back((GInetAddress *) g_object_ref(first.front()));
+          first.pop_front();
+        }
+      if (!other.empty())
+        {
+          addresses.push_back((GInetAddress *) g_object_ref(other.front()));
+          other.pop_front();
+        }
+    }
+}
+
+
+//! Forgets the addresses that have not been tried.
+void
+GIOSocket::clear_addresses()
+{
+  for (list<GInetAddress *>::iterator i = addresses.begin(); i != addresses.end(); i++)
+    {
+      g_object_unref(*i);
+    }
+  addresses.clear();
+}
+
+
+//! Starts a connection attempt to the next address.
+void
+GIOSocket::start_next_attempt()
+{
+  TRACE_ENTER_MSG("GIOSocket::start_next_attempt", addresses.size());
+
+  if (attempt_timer != NULL)
+    {
+      g_source_destroy(attempt_timer);
+      attempt_timer = NULL;
+    }
+
+  if (addresses.empty())
+    {
+      if (connect_requests.empty() && resolve_request == NULL)
+        {
+          connect_failed();
+        }
+      TRACE_RETURN("No more addresses");
+      return;
+    }
+
+  GInetAddress *inet_addr = addresses.front();
+  addresses.pop_front();
+
+  PendingRequest *request = create_request();
+  connect_requests.push_back(request);
+
   GSocketAddress *socket_address = g_inet_socket_address_new(inet_addr, port);
   GSocketClient *socket_client = g_socket_client_new();
 
   g_socket_client_connect_async(socket_client,
                                 G_SOCKET_CONNECTABLE(socket_address),
-                                NULL,
+                                request->cancellable,
                                 static_connected_callback,
-                                this);
+                                request);
+
+  g_object_unref(socket_address);
+  g_object_unref(inet_addr);
+
+  if (!addresses.empty())
+    {
+      attempt_timer = g_timeout_source_new(GIO_CONNECT_ATTEMPT_DELAY);
+      g_source_set_callback(attempt_timer, static_attempt_timeout, (void*)this, NULL);
+      g_source_attach(attempt_timer, g_main_context_get_thread_default());
+      g_source_unref(attempt_timer);
+    }
+
   TRACE_EXIT();
 }
 
+
+//! Starts the next connection attempt while the previous ones are in progress.
+gboolean
+GIOSocket::static_attempt_timeout(gpointer user_data)
+{
+  GIOSocket *socket = (GIOSocket *) user_data;
+
+  // Destroyed when returning FALSE.
+  socket->attempt_timer = NULL;
+  socket->start_next_attempt();
+
+  return FALSE;
+}
+
+
+//! Notifies the listener that the host cannot be reached.
 void
-GIOSocket::static_connect_after_resolve(GObject *source_object, GAsyncResult *res, gpointer user_data)
+GIOSocket::connect_failed()
 {
-  TRACE_ENTER("GIOSocket::static_connect_after_resolve");
-  GError *error = NULL;
-  GList *addresses = g_resolver_lookup_by_name_finish((GResolver *)source_object, res, &error);
+  TRACE_ENTER("GIOSocket::connect_failed");
 
-  if (error != NULL)
+  if (driver != NULL)
     {
-      TRACE_MSG("failed");
-      g_error_free(error);
+      // The host may have moved.
+      driver->forget_addresses(hostname);
     }
 
-  if (addresses != NULL)
+  // The listener may destroy this socket.
+  if (listener != NULL)
     {
-      // Take first result
-      if (addresses->data != NULL)
-        {
-          GInetAddress *a = (GInetAddress *) addresses->data;
-          GIOSocket *socket = (GIOSocket *) user_data;
-          socket->connect(a, socket->port);
-        }
-       g_resolver_free_addresses(addresses);
+      listener->socket_closed(this, user_data);
     }
+
   TRACE_EXIT();
 }
 
 
+//! Configures a connected socket.
+void
+GIOSocket::set_socket_options(GSocket *socket)
+{
+  g_socket_set_blocking(socket, FALSE);
+  g_socket_set_keepalive(socket, TRUE);
+
+  // Packets are small and often time critical (e.g. break control), so
+  // do not let TCP hold them back while waiting for an ack.
+  int on = 1;
+  setsockopt(g_socket_get_fd(socket), IPPROTO_TCP, TCP_NODELAY, (const char *) &on, sizeof(on));
+}
+
+
 //! Read from the connection.
 void
 GIOSocket::read(void *buf, int count, int &bytes_read)
@@ -342,22 +660,92 @@ GIOSocket::write(void *buf, int count, int &bytes_written)
   gsize num_written = 0;
   if (socket != NULL)
     {
-      num_written = g_socket_send(socket, (char *)buf, count, NULL, &error);
+      gssize rc = g_socket_send(socket, (char *)buf, count, NULL, &error);
       if (error != NULL)
         {
-          throw SocketException(string("socket write error: ") + error->message);
+          if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+            {
+              string msg = string("socket write error: ") + error->message;
+              g_error_free(error);
+              throw SocketException(msg);
+            }
+          g_error_free(error);
+        }
+      else
+        {
+          num_written = rc;
         }
     }
   bytes_written = (int) num_written;
 }
 
 
+//! Write multiple buffers to the connection.
+void
+GIOSocket::writev(const SocketVector *vectors, int count, int &bytes_written)
+{
+  GError *error = NULL;
+  gsize num_written = 0;
+
+  if (socket != NULL && count > 0)
+    {
+      GOutputVector *output = g_new(GOutputVector, count);
+      for (int i = 0; i < count; i++)
+        {
+          output[i].buffer = vectors[i].buffer;
+          output[i].size = vectors[i].size;
+        }
+
+      gssize rc = g_socket_send_message(socket, NULL, output, count, NULL, 0, 0, NULL, &error);
+      g_free(output);
+
+      if (error != NULL)
+        {
+          if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+            {
+              string msg = string("socket write error: ") + error->message;
+              g_error_free(error);
+              throw SocketException(msg);
+            }
+          g_error_free(error);
+        }
+      else
+        {
+          num_written = rc;
+        }
+    }
+  bytes_written = (int) num_written;
+}
+
+
+//! Enable/disable notification that the connection can accept more data.
+void
+GIOSocket::watch_writable(bool enable)
+{
+  if (enable && write_source == NULL && socket != NULL)
+    {
+      write_source = g_socket_create_source(socket, G_IO_OUT, NULL);
+      g_source_set_callback(write_source, (GSourceFunc) static_writable_callback, (void*)this, NULL);
+      g_source_attach(write_source, g_main_context_get_thread_default());
+    }
+  else if (!enable && write_source != NULL)
+    {
+      g_source_destroy(write_source);
+      g_source_unref(write_source);
+      write_source = NULL;
+    }
+}
+
+
 //! Close the connection.
 void
 GIOSocket::close()
 {
   TRACE_ENTER("GIOSocket::close");
   GError *error = NULL;
+  cancel_requests();
+  clear_addresses();
+  watch_writable(false);
   if (socket != NULL)
     {
       g_socket_shutdown(socket, TRUE, TRUE, &error);
@@ -371,7 +759,7 @@ GIOSocket::close()
 ISocket *
 GIOSocketDriver::create_socket()
 {
-  return new GIOSocket();
+  return new GIOSocket(this);
 }
 
 
@@ -382,4 +770,68 @@ GIOSocketDriver::create_server()
   return new GIOSocketServer();
 }
 
+
+//! Destructs the driver.
+GIOSocketDriver::~GIOSocketDriver()
+{
+  while (!address_cache.empty())
+    {
+      forget_addresses(address_cache.begin()->first);
+    }
+}
+
+
+//! Returns the cached addresses of a host, if they have not expired.
+bool
+GIOSocketDriver::lookup_addresses(const string &host, list<GInetAddress *> &addresses)
+{
+  map<string, ResolvedHost>::iterator i = address_cache.find(host);
+  if (i == address_cache.end())
+    {
+      return false;
+    }
+
+  if (g_get_monotonic_time() >= i->second.expiry)
+    {
+      forget_addresses(host);
+      return false;
+    }
+
+  addresses = i->second.addresses;
+  return true;
+}
+
+
+//! Caches the resolved addresses of a host.
+void
+GIOSocketDriver::cache_addresses(const string &host, const list<GInetAddress *> &addresses)
+{
+  forget_addresses(host);
+
+  ResolvedHost &entry = address_cache[host];
+  entry.expiry = g_get_monotonic_time() + (gint64) GIO_ADDRESS_CACHE_TTL * G_USEC_PER_SEC;
+
+  for (list<GInetAddress *>::const_iterator i = addresses.begin(); i != addresses.end(); i++)
+    {
+      entry.addresses.push_back((GInetAddress *) g_object_ref(*i));
+    }
+}
+
+
+//! Removes the cached addresses of a host.
+void
+GIOSocketDriver::forget_addresses(const string &host)
+{
+  map<string, ResolvedHost>::iterator i = address_cache.find(host);
+  if (i != address_cache.end())
+    {
+      list<GInetAddress *> &addresses = i->second.addresses;
+      for (list<GInetAddress *>::iterator j = addresses.begin(); j != addresses.end(); j++)
+        {
+          g_object_unref(*j);
+        }
+      address_cache.erase(i);
+    }
+}
+
 #endif
@@ -21,14 +21,26 @@
 
 #if defined(HAVE_GIO_NET) && defined(HAVE_DISTRIBUTION)
 
+#include <string>
+#include <list>
+#include <map>
+
 #include <glib.h>
 #include <glib-object.h>
 #include <gio/gio.h>
 
 #include "SocketDriver.hh"
 
+//! Delay before the next address is tried while a connect is in progress, in milliseconds.
+#define GIO_CONNECT_ATTEMPT_DELAY (250)
+
+//! Number of seconds a resolved host name is cached.
+#define GIO_ADDRESS_CACHE_TTL (300)
+
 using namespace workrave;
 
+class GIOSocketDriver;
+
 //! Listen socket implementation using GIO
 class GIOSocketServer
   : public ISocketServer
@@ -57,7 +69,7 @@ class GIOSocket
   : public ISocket
 {
 public:
-  GIOSocket();
+  GIOSocket(GIOSocketDriver *driver);
   GIOSocket(GSocketConnection *connection);
   virtual ~GIOSocket();
 
@@ -65,12 +77,32 @@ public:
   virtual void connect(const std::string &hostname, int port);
   virtual void read(void *buf, int count, int &bytes_read);
   virtual void write(void *buf, int count, int &bytes_written);
+  virtual void writev(const SocketVector *vectors, int count, int &bytes_written);
+  virtual void watch_writable(bool enable);
   virtual void close();
 
 private:
-  void connect(GInetAddress *inet_addr, int port);
-
+  //! Asynchronous resolve or connect that is in progress.
+  struct PendingRequest
+  {
+    //! Socket that waits for the result, or NULL if it no longer does.
+    GIOSocket *socket;
+
+    //! Cancels the request.
+    GCancellable *cancellable;
+  };
+
+  PendingRequest *create_request();
+  static void free_request(PendingRequest *request);
+  void cancel_requests();
+  void set_addresses(const std::list<GInetAddress *> &addresses);
+  void clear_addresses();
+  void start_next_attempt();
+  void connect_failed();
+
+  static void set_socket_options(GSocket *socket);
   static void static_connect_after_resolve(GObject *source_object, GAsyncResult *res, gpointer user_data);
+  static gboolean static_attempt_timeout(gpointer user_data);
 
   static void static_connected_callback(GObject *source_object,
                                         GAsyncResult *result,
@@ -80,23 +112,64 @@ private:
                                    GIOCondition condition,
                                    gpointer user_data);
 
+  static gboolean static_writable_callback(GSocket *socket,
+                                           GIOCondition condition,
+                                           gpointer user_data);
+
 private:
+  GIOSocketDriver *driver;
   GSocketConnection *connection;
   GSocket *socket;
-  GResolver *resolver;
   GSource *source;
+  GSource *write_source;
+  std::string hostname;
   int port;
+
+  //! Host name resolution in progress, or NULL.
+  PendingRequest *resolve_request;
+
+  //! Connection attempts in progress.
+  std::list<PendingRequest *> connect_requests;
+
+  //! Addresses that have not been tried yet.
+  std::list<GInetAddress *> addresses;
+
+  //! Starts the next connection attempt, or NULL.
+  GSource *attempt_timer;
 };
 
 
 class GIOSocketDriver
   : public SocketDriver
 {
+public:
+  virtual ~GIOSocketDriver();
+
   //! Create a new socket
   ISocket *create_socket();
 
   //! Create a new listen socket
   ISocketServer *create_server();
+
+private:
+  friend class GIOSocket;
+
+  //! Resolved addresses of a host.
+  struct ResolvedHost
+  {
+    std::list<GInetAddress *> addresses;
+
+    //! Monotonic time in microseconds at which the addresses expire.
+    gint64 expiry;
+  };
+
+  bool lookup_addresses(const std::string &host, std::list<GInetAddress *> &addresses);
+  void cache_addresses(const std::string &host, const std::list<GInetAddress *> &addresses);
+  void forget_addresses(const std::string &host);
+
+private:
+  //! Resolved addresses by host name.
+  std::map<std::string, ResolvedHost> address_cache;
 };
 
 #endif
@@ -119,6 +119,32 @@ GNetSocket::static_async_io(GIOChannel *iochannel, GIOCondition condition,
 }
 
 
+//! GNet reports that data can be written.
+gboolean
+GNetSocket::static_async_writable(GIOChannel *iochannel, GIOCondition condition,
+                                  gpointer data)
+{
+  (void) iochannel;
+  (void) condition;
+
+  GNetSocket *con =  (GNetSocket *)data;
+  try
+    {
+      if (con->listener != NULL)
+        {
+          con->listener->socket_writable(con, con->user_data);
+        }
+    }
+  catch(...)
+    {
+      // Make sure that no exception reach the glib mainloop.
+    }
+
+  // The listener disables the notification using watch_writable().
+  return TRUE;
+}
+
+
 //! GNet reports that data is ready to be read.
 bool
 GNetSocket::async_io(GIOChannel *iochannel, GIOCondition condition)
@@ -218,7 +244,8 @@ GNetSocket::static_async_connected(GTcpSocket *socket,
 
 //! Creates a new connection.
 GNetSocket::GNetSocket(GTcpSocket *socket) :
-  socket(socket)
+  socket(socket),
+  write_watch(0)
 {
   iochannel = gnet_tcp_socket_get_io_channel(socket);
   watch_flags = G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
@@ -231,7 +258,8 @@ GNetSocket::GNetSocket() :
   socket(NULL),
   iochannel(NULL),
   watch_flags(0),
-  watch(0)
+  watch(0),
+  write_watch(0)
 {
 }
 
@@ -239,6 +267,7 @@ GNetSocket::GNetSocket() :
 //! Destructs the connection.
 GNetSocket::~GNetSocket()
 {
+  watch_writable(false);
 
   if (socket != NULL)
     {
@@ -293,7 +322,11 @@ GNetSocket::write(void *buf, int count, int &bytes_written)
   gsize num_written = 0;
   GIOError error = g_io_channel_write(iochannel, (char *)buf, (gsize)count, &num_written);
 
-  if (error != G_IO_ERROR_NONE)
+  if (error == G_IO_ERROR_AGAIN)
+    {
+      num_written = 0;
+    }
+  else if (error != G_IO_ERROR_NONE)
     {
       throw SocketException("write error");
     }
@@ -302,10 +335,28 @@ GNetSocket::write(void *buf, int count, int &bytes_written)
 }
 
 
+//! Enable/disable notification that the connection can accept more data.
+void
+GNetSocket::watch_writable(bool enable)
+{
+  if (enable && write_watch == 0 && iochannel != NULL)
+    {
+      write_watch = g_io_add_watch(iochannel, G_IO_OUT, static_async_writable, this);
+    }
+  else if (!enable && write_watch != 0)
+    {
+      g_source_remove(write_watch);
+      write_watch = 0;
+    }
+}
+
+
 //! Close the connection.
 void
 GNetSocket::close()
 {
+  watch_writable(false);
+
 #ifndef HAVE_GNET2
   if (iochannel != NULL)
     {
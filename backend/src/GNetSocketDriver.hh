@@ -71,11 +71,13 @@ public:
   virtual void connect(const std::string &hostname, int port);
   virtual void read(void *buf, int count, int &bytes_read);
   virtual void write(void *buf, int count, int &bytes_written);
+  virtual void watch_writable(bool enable);
   virtual void close();
 
 private:
   // GNET callbacks
   bool async_io(GIOChannel* iochannel, GIOCondition condition);
+  static gboolean static_async_writable(GIOChannel* iochannel, GIOCondition condition, gpointer data);
   void async_connected(GTcpSocket *socket, GInetAddr *ia, GTcpSocketConnectAsyncStatus status);
   static gboolean static_async_io(GIOChannel* iochannel, GIOCondition condition, gpointer data);
   static void static_async_connected(GTcpSocket *socket, GTcpSocketConnectAsyncStatus status, gpointer data);
@@ -92,6 +94,9 @@ private:
 
   //! Our watch ID
   guint watch;
+
+  //! Our watch ID for output.
+  guint write_watch;
 };
 
 
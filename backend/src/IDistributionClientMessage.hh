@@ -28,6 +28,8 @@ enum DistributionClientMessageID
     DCM_IDLELOG = 0x0012,
     DCM_SCRIPT  = 0x0013,
     DCM_CONFIG  = 0x0014,
+    DCM_TIMERS_DELTA = 0x0015,
+    DCM_TIMERS_ACK = 0x0016,
     DCM_BREAKS  = 0x0020,
     DCM_STATS   = 0x0030,
     DCM_BREAKCONTROL = 0x0040,
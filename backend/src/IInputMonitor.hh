@@ -46,6 +46,19 @@ public:
 
   //! Unsubscribe for statistics monitor.
   virtual void unsubscribe_statistics(IInputMonitorListener *listener) = 0;
+
+  //! Sets the minimum number of milliseconds between mouse movement reports.
+  virtual void set_mouse_interval(int interval) = 0;
+
+  //! Sets the thresholds of the activity monitor, in milliseconds.
+  virtual void set_activity_parameters(int noise, int activity, int idle) = 0;
+
+  //! Reports the queued input events to the listeners.
+  /*!
+   *  Must be called from the main thread, which also processes the
+   *  queue when the monitor wakes it up.
+   */
+  virtual void process_events() = 0;
 };
 
 #endif // IINPUTMONITOR_HH
@@ -22,6 +22,10 @@
 
 #include <string>
 
+#include <glib.h>
+
+#include "InputEvent.hh"
+
 //! Listener for events from the input monitor.
 class IInputMonitorListener
 {
@@ -34,11 +38,62 @@ public:
   //! Reports mouse movement activity
   virtual void mouse_notify(int x, int y, int wheel = 0) = 0;
 
+  //! Reports the mouse movement of several samples at once.
+  /*!
+   *  \param x last horizontal position.
+   *  \param y last vertical position.
+   *  \param wheel sum of the wheel movement.
+   *  \param distance sum of the distance moved per sample.
+   *  \param movement_time time in microseconds spent moving.
+   */
+  virtual void mouse_motion_notify(int x, int y, int wheel, int distance, gint64 movement_time)
+  {
+    (void) distance;
+    (void) movement_time;
+    mouse_notify(x, y, wheel);
+  }
+
   //! Reports mouse button activity
   virtual void button_notify(bool is_press) = 0;
 
   //! Reports keyboard activity
   virtual void keyboard_notify(bool repeat) = 0;
+
+  //! Reports a batch of input events, in the order in which they occurred.
+  /*!
+   *  Listeners that need the time of the events, or that want to lock
+   *  only once per batch, override this method.
+   */
+  virtual void input_notify(const InputEvent *events, int count)
+  {
+    for (int i = 0; i < count; i++)
+      {
+        const InputEvent &event = events[i];
+
+        switch (event.type)
+          {
+          case InputEvent::INPUT_ACTION:
+            action_notify();
+            break;
+
+          case InputEvent::INPUT_MOUSE:
+            mouse_notify(event.x, event.y, event.wheel);
+            break;
+
+          case InputEvent::INPUT_MOUSE_MOTION:
+            mouse_motion_notify(event.x, event.y, event.wheel, event.distance, event.movement_time);
+            break;
+
+          case InputEvent::INPUT_BUTTON:
+            button_notify(event.flag != 0);
+            break;
+
+          case InputEvent::INPUT_KEYBOARD:
+            keyboard_notify(event.flag != 0);
+            break;
+          }
+      }
+  }
 };
 
 #endif // IINPUTMONITORLISTENER_HH
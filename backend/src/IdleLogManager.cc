@@ -27,10 +27,22 @@
 #include <sstream>
 #include <assert.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 
+#ifdef PLATFORM_OS_WIN32
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 #include "Util.hh"
 #include "IdleLogManager.hh"
 #include "TimeSource.hh"
@@ -39,8 +51,49 @@
 #define IDLELOG_MAXSIZE     (4000)
 #define IDLELOG_MAXAGE    (12 * 60 * 60)
 #define IDLELOG_INTERVAL    (30 * 60)
-#define IDLELOG_VERSION   (3)
+#define IDLELOG_VERSION   (4)
+#define IDLELOG_LEGACY_VERSION (3)
 #define IDLELOG_INTERVAL_SIZE (17)
+#define IDLELOG_MAGIC     (0x57524c47)
+#define IDLELOG_HEADER_SIZE (10)
+#define IDLELOG_STORAGE_INFO_SIZE (16)
+
+
+//! Updates an Adler-32 checksum with the specified data.
+static guint32
+update_checksum(guint32 checksum, const guint8 *data, int size)
+{
+  guint32 a = checksum & 0xffff;
+  guint32 b = (checksum >> 16) & 0xffff;
+
+  for (int i = 0; i < size; i++)
+    {
+      a = (a + data[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+
+  return (b << 16) | a;
+}
+
+
+//! Returns the big-endian 16 bit value at the specified location.
+static guint16
+get_ushort(const guint8 *data)
+{
+  return (((guint16)(data[0]) << 8) +
+          ((guint16)(data[1])));
+}
+
+
+//! Returns the big-endian 32 bit value at the specified location.
+static guint32
+get_ulong(const guint8 *data)
+{
+  return (((guint32)(data[0]) << 24) +
+          ((guint32)(data[1]) << 16) +
+          ((guint32)(data[2]) << 8) +
+          ((guint32)(data[3])));
+}
 
 
 //! Constructs a new idlelog manager.
@@ -238,6 +291,10 @@ IdleLogManager::update_idlelog(ClientInfo &info, ActivityState state, bool maste
 
           // Push current
           info.current_interval.to_be_saved = true;
+          if (info.client_id == myid)
+            {
+              info.current_interval.sequence = ++info.sequence;
+            }
           info.idlelog.push_front(info.current_interval);
 
           // create a new (empty) idle interval.
@@ -281,6 +338,12 @@ IdleLogManager::update_idlelog(ClientInfo &info, ActivityState state, bool maste
 
               if (oldidle.to_be_saved)
                 {
+                  if (info.client_id == myid && oldidle.sequence == info.sequence)
+                    {
+                      // Sequence number is reused when the interval is pushed again.
+                      info.sequence--;
+                    }
+
                   info.current_interval = oldidle;
                   info.idlelog.pop_front();
                   idle = &(info.current_interval);
@@ -532,7 +595,8 @@ IdleLogManager::unpack_idle_interval(PacketBuffer &buffer, IdleInterval &idle, t
 
 //! Packs the idlelog header to the buffer.
 void
-IdleLogManager::pack_idlelog(PacketBuffer &buffer, const ClientInfo &ci) const
+IdleLogManager::pack_idlelog(PacketBuffer &buffer, const ClientInfo &ci, int num_intervals,
+                             const IdleLogSync *sync) const
 {
   time_t current_time = time_source->get_time();
 
@@ -546,7 +610,21 @@ IdleLogManager::pack_idlelog(PacketBuffer &buffer, const ClientInfo &ci) const
   buffer.pack_ulong((guint32)ci.total_active_time);
   buffer.pack_byte(ci.master);
   buffer.pack_byte(ci.state);
-  buffer.pack_ushort(ci.idlelog.size());
+  buffer.pack_ushort(num_intervals);
+
+  if (sync != NULL)
+    {
+      // Older versions skip this trailer.
+      buffer.pack_ulong(sync->sequence);
+      buffer.pack_ulong(sync->first_sequence);
+      buffer.pack_ushort(sync->known.size());
+
+      for (SequenceMap::const_iterator i = sync->known.begin(); i != sync->known.end(); i++)
+        {
+          buffer.pack_string(i->first.c_str());
+          buffer.pack_ulong(i->second);
+        }
+    }
 
   buffer.update_size(pos);
 }
@@ -555,7 +633,8 @@ IdleLogManager::pack_idlelog(PacketBuffer &buffer, const ClientInfo &ci) const
 //! Unpacks the idlelog header from the buffer.
 void
 IdleLogManager::unpack_idlelog(PacketBuffer &buffer, ClientInfo &ci,
-                               time_t &pack_time, int &num_intervals) const
+                               time_t &pack_time, int &num_intervals,
+                               IdleLogSync *sync) const
 {
   int pos = 0;
   int size = buffer.read_size(pos);
@@ -577,6 +656,26 @@ IdleLogManager::unpack_idlelog(PacketBuffer &buffer, ClientInfo &ci,
 
       num_intervals = buffer.unpack_ushort();
 
+      if (sync != NULL && buffer.bytes_read() < pos)
+        {
+          sync->valid = true;
+          sync->sequence = buffer.unpack_ulong();
+          sync->first_sequence = buffer.unpack_ulong();
+
+          int num_known = buffer.unpack_ushort();
+          for (int i = 0; i < num_known; i++)
+            {
+              char *known_id = buffer.unpack_string();
+              guint32 known_sequence = buffer.unpack_ulong();
+
+              if (known_id != NULL)
+                {
+                  sync->known[known_id] = known_sequence;
+                  g_free(known_id);
+                }
+            }
+        }
+
       g_free(id);
 
       buffer.skip_size(pos);
@@ -604,14 +703,12 @@ IdleLogManager::unlink_idlelog(PacketBuffer &buffer) const
 
       if (id != NULL)
         {
-          stringstream ss;
-          ss << Util::get_home_directory();
-          ss << "idlelog." << id << ".log" << ends;
+          string filename = get_idlelog_filename(id);
 
 #ifdef PLATFORM_OS_WIN32
-          _unlink(ss.str().c_str());
+          _unlink(filename.c_str());
 #else
-          unlink(ss.str().c_str());
+          unlink(filename.c_str());
 #endif
 
           g_free(id);
@@ -627,6 +724,149 @@ IdleLogManager::unlink_idlelog(PacketBuffer &buffer) const
 }
 
 
+//! Packs the description of the stored idle log to the buffer.
+void
+IdleLogManager::pack_storage_info(PacketBuffer &buffer, const ClientInfo &ci) const
+{
+  int pos = 0;
+  buffer.reserve_size(pos);
+
+  int start = buffer.bytes_written();
+  buffer.pack_ulong(ci.stored_count);
+  buffer.pack_ulong((guint32)ci.stored_time);
+  buffer.pack_ulong(ci.generation);
+  buffer.pack_ulong(ci.stored_checksum);
+
+  guint8 *data = (guint8 *)buffer.get_buffer() + start;
+  buffer.pack_ulong(update_checksum(1, data, IDLELOG_STORAGE_INFO_SIZE));
+
+  buffer.update_size(pos);
+}
+
+
+//! Unpacks the description of the stored idle log from the buffer.
+void
+IdleLogManager::unpack_storage_info(PacketBuffer &buffer, ClientInfo &ci) const
+{
+  int pos = 0;
+  int size = buffer.read_size(pos);
+
+  if (size >= IDLELOG_STORAGE_INFO_SIZE + 4 && buffer.bytes_available() >= size)
+    {
+      const guint8 *data = buffer.read_ptr;
+
+      ci.stored_count = buffer.unpack_ulong();
+      ci.stored_time = buffer.unpack_ulong();
+      ci.generation = buffer.unpack_ulong();
+      ci.stored_checksum = buffer.unpack_ulong();
+
+      guint32 checksum = buffer.unpack_ulong();
+      ci.stored_valid = (checksum == update_checksum(1, data, IDLELOG_STORAGE_INFO_SIZE));
+
+      buffer.skip_size(pos);
+    }
+  else
+    {
+      buffer.clear();
+    }
+}
+
+
+//! Returns the filename of the idlelog index.
+string
+IdleLogManager::get_index_filename() const
+{
+  stringstream ss;
+  ss << Util::get_home_directory();
+  ss << "idlelog.idx";
+  return ss.str();
+}
+
+
+//! Returns the filename of the idlelog of the specified client.
+string
+IdleLogManager::get_idlelog_filename(const string &client_id) const
+{
+  stringstream ss;
+  ss << Util::get_home_directory();
+  ss << "idlelog." << client_id << ".log";
+  return ss.str();
+}
+
+
+//! Atomically replaces the specified file with the contents of the buffer.
+bool
+IdleLogManager::write_file(const string &filename, PacketBuffer &buffer) const
+{
+  TRACE_ENTER_MSG("IdleLogManager::write_file", filename);
+
+  string tmp_filename = filename + ".tmp";
+
+  int fd = g_open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+  bool ret = fd != -1;
+
+  const gchar *data = buffer.get_buffer();
+  gsize remaining = buffer.bytes_written();
+  while (ret && remaining > 0)
+    {
+      gssize written = write(fd, data, remaining);
+      if (written > 0)
+        {
+          data += written;
+          remaining -= written;
+        }
+      else if (written == -1 && errno != EINTR)
+        {
+          ret = false;
+        }
+    }
+
+  // Make sure the contents are on disk before the new file replaces the old
+  // one, otherwise a crash may leave an empty or truncated idle log behind.
+  if (ret)
+    {
+#ifdef PLATFORM_OS_WIN32
+      ret = _commit(fd) == 0;
+#else
+      ret = fsync(fd) == 0;
+#endif
+    }
+
+  if (fd != -1 && close(fd) != 0)
+    {
+      ret = false;
+    }
+
+  if (ret)
+    {
+      ret = g_rename(tmp_filename.c_str(), filename.c_str()) == 0;
+    }
+
+  if (!ret)
+    {
+      TRACE_MSG("Failed to write " << tmp_filename << ": " << g_strerror(errno));
+      g_unlink(tmp_filename.c_str());
+    }
+#ifndef PLATFORM_OS_WIN32
+  else
+    {
+      // Persist the rename itself.
+      gchar *dirname = g_path_get_dirname(filename.c_str());
+      int dir_fd = open(dirname, O_RDONLY);
+      if (dir_fd != -1)
+        {
+          fsync(dir_fd);
+          close(dir_fd);
+        }
+      g_free(dirname);
+    }
+#endif
+
+  TRACE_RETURN(ret);
+  return ret;
+}
+
+
 //! Saves the idlelog index.
 void
 IdleLogManager::save_index()
@@ -645,16 +885,11 @@ IdleLogManager::save_index()
       info.update_active_time(time_source->get_time());
       TRACE_MSG("Saving " << i->first << " " << info.client_id);
 
-      pack_idlelog(buffer, info);
+      pack_idlelog(buffer, info, info.idlelog.size());
+      pack_storage_info(buffer, info);
     }
 
-  stringstream ss;
-  ss << Util::get_home_directory();
-  ss << "idlelog.idx" << ends;
-
-  ofstream file(ss.str().c_str(), ios::binary);
-  file.write(buffer.get_buffer(), buffer.bytes_written());
-  file.close();
+  write_file(get_index_filename(), buffer);
 
   TRACE_EXIT();
 }
@@ -667,18 +902,16 @@ IdleLogManager::load_index()
 {
   TRACE_ENTER("IdleLogManager::load()");
 
-  stringstream ss;
-  ss << Util::get_home_directory();
-  ss << "idlelog.idx" << ends;
+  string filename = get_index_filename();
 
-  bool exists = Util::file_exists(ss.str());
+  bool exists = Util::file_exists(filename);
 
   if (exists)
     {
       TRACE_MSG("File exists - ok");
 
       // Open file
-      ifstream file(ss.str().c_str(), ios::binary);
+      ifstream file(filename.c_str(), ios::binary);
 
       // get file size using buffer's members
       filebuf *pbuf=file.rdbuf();
@@ -698,7 +931,7 @@ IdleLogManager::load_index()
       int version = buffer.unpack_ushort();
       TRACE_MSG("Version - " << version);
 
-      if (version == IDLELOG_VERSION)
+      if (version == IDLELOG_VERSION || version == IDLELOG_LEGACY_VERSION)
         {
           TRACE_MSG("Version - ok");
 
@@ -716,6 +949,11 @@ IdleLogManager::load_index()
               time_t pack_time;
 
               unpack_idlelog(buffer, info, pack_time, num_intervals);
+              if (version == IDLELOG_VERSION)
+                {
+                  unpack_storage_info(buffer, info);
+                }
+
               info.master = false;
               info.state = ACTIVITY_IDLE;
               info.last_update_time = pack_time;
@@ -750,6 +988,10 @@ IdleLogManager::load_index()
 
 
 //! Saves the idlelog for the specified client.
+/*!
+ *  The file is rewritten completely under a new generation. The index must
+ *  be saved afterwards to describe the new file.
+ */
 void
 IdleLogManager::save_idlelog(ClientInfo &info)
 {
@@ -758,6 +1000,12 @@ IdleLogManager::save_idlelog(ClientInfo &info)
   PacketBuffer buffer;
   buffer.create();
 
+  info.generation++;
+
+  buffer.pack_ulong(IDLELOG_MAGIC);
+  buffer.pack_ushort(IDLELOG_VERSION);
+  buffer.pack_ulong(info.generation);
+
   for (IdleLogRIter i = info.idlelog.rbegin(); i != info.idlelog.rend(); i++)
     {
       IdleInterval &idle = *i;
@@ -765,13 +1013,19 @@ IdleLogManager::save_idlelog(ClientInfo &info)
       pack_idle_interval(buffer, idle);
     }
 
-  stringstream ss;
-  ss << Util::get_home_directory();
-  ss << "idlelog." << info.client_id << ".log" << ends;
+  const guint8 *data = (const guint8 *)buffer.get_buffer() + IDLELOG_HEADER_SIZE;
 
-  ofstream file(ss.str().c_str(), ios::binary);
-  file.write(buffer.get_buffer(), buffer.bytes_written());
-  file.close();
+  info.stored_count = info.idlelog.size();
+  info.stored_time = 0;
+  info.stored_checksum = update_checksum(1, data, buffer.bytes_written() - IDLELOG_HEADER_SIZE);
+
+  if (info.idlelog.size() > 0)
+    {
+      IdleInterval &idle = info.idlelog.front();
+      info.stored_time = idle.end_time != 0 ? idle.end_time : idle.end_idle_time;
+    }
+
+  info.stored_valid = write_file(get_idlelog_filename(info.client_id), buffer);
 }
 
 
@@ -781,38 +1035,154 @@ IdleLogManager::load_idlelog(ClientInfo &info)
 {
   TRACE_ENTER("IdleLogManager::load_idlelog()");
 
+  if (map_idlelog(info))
+    {
+      // Only add the period in which we were not running.
+      time_t current_time = time_source->get_time();
+      info.idlelog.push_front(IdleInterval(info.stored_time, current_time));
+    }
+  else
+    {
+      read_idlelog(info);
+
+      dump_idlelog(info);
+      fix_idlelog(info);
+
+      // Store the repaired idlelog.
+      save_idlelog(info);
+    }
+
+  number_idlelog(info);
+  dump_idlelog(info);
+  TRACE_EXIT();
+}
+
+
+//! Loads a valid idlelog for the specified client directly from a memory mapped file.
+/*!
+ *  \return false if the file does not match its description in the index.
+ */
+bool
+IdleLogManager::map_idlelog(ClientInfo &info)
+{
+  TRACE_ENTER_MSG("IdleLogManager::map_idlelog()", info.client_id);
+
+  if (!info.stored_valid || info.stored_count == 0)
+    {
+      TRACE_RETURN("No valid index");
+      return false;
+    }
+
+  string filename = get_idlelog_filename(info.client_id);
+  GMappedFile *file = g_mapped_file_new(filename.c_str(), FALSE, NULL);
+  if (file == NULL)
+    {
+      TRACE_RETURN("Cannot map file");
+      return false;
+    }
+
+  bool ret = false;
+
+  gsize size = g_mapped_file_get_length(file);
+  const guint8 *data = (const guint8 *) g_mapped_file_get_contents(file);
+  int records_size = info.stored_count * IDLELOG_INTERVAL_SIZE;
+
+  if (data != NULL &&
+      size == (gsize)(IDLELOG_HEADER_SIZE + records_size) &&
+      get_ulong(data) == IDLELOG_MAGIC &&
+      get_ushort(data + 4) == IDLELOG_VERSION &&
+      get_ulong(data + 6) == info.generation &&
+      update_checksum(1, data + IDLELOG_HEADER_SIZE, records_size) == info.stored_checksum)
+    {
+      time_t current_time = time_source->get_time();
+
+      int first = 0;
+      if (info.stored_count > IDLELOG_MAXSIZE)
+        {
+          TRACE_MSG("Skipping " << (info.stored_count - IDLELOG_MAXSIZE) << " intervals");
+          first = info.stored_count - IDLELOG_MAXSIZE;
+        }
+
+      for (int i = first; i < (int)info.stored_count; i++)
+        {
+          const guint8 *record = data + IDLELOG_HEADER_SIZE + i * IDLELOG_INTERVAL_SIZE;
+
+          // Skip size and version.
+          IdleInterval idle;
+          idle.begin_time = get_ulong(record + 3);
+          idle.end_idle_time = get_ulong(record + 7);
+          idle.end_time = get_ulong(record + 11);
+          idle.active_time = get_ushort(record + 15);
+
+          if (idle.end_idle_time >= current_time - IDLELOG_MAXAGE)
+            {
+              info.idlelog.push_front(idle);
+            }
+        }
+
+      if (info.idlelog.size() > 0)
+        {
+          IdleInterval &idle = info.idlelog.back();
+          idle.begin_time = 1;
+        }
+
+      ret = true;
+    }
+
+  g_mapped_file_unref(file);
+
+  TRACE_RETURN(ret);
+  return ret;
+}
+
+
+//! Loads the idlelog for the specified client, skipping damaged data.
+void
+IdleLogManager::read_idlelog(ClientInfo &info)
+{
+  TRACE_ENTER("IdleLogManager::read_idlelog()");
+
   time_t current_time = time_source->get_time();
 
-  stringstream ss;
-  ss << Util::get_home_directory();
-  ss << "idlelog." << info.client_id << ".log" << ends;
+  string filename = get_idlelog_filename(info.client_id);
 
   // Open file
-  ifstream file(ss.str().c_str(), ios::binary);
+  ifstream file(filename.c_str(), ios::binary);
 
   // get file size using buffer's members
   filebuf *pbuf=file.rdbuf();
   int size=pbuf->pubseekoff (0,ios::end,ios::in);
   pbuf->pubseekpos (0,ios::in);
 
-  // Process it.
-  int num_intervals = size / IDLELOG_INTERVAL_SIZE;
-  if (num_intervals * IDLELOG_INTERVAL_SIZE == size)
+  // Skip header, if any. Legacy idlelogs do not have one.
+  int offset = 0;
+  if (size >= IDLELOG_HEADER_SIZE)
     {
-      if (num_intervals > IDLELOG_MAXSIZE)
+      guint8 header[IDLELOG_HEADER_SIZE];
+      file.read((char *)header, IDLELOG_HEADER_SIZE);
+      if (get_ulong(header) == IDLELOG_MAGIC)
         {
-          TRACE_MSG("Skipping " << (num_intervals - IDLELOG_MAXSIZE) << " intervals");
-          int skip = (num_intervals - IDLELOG_MAXSIZE) * IDLELOG_INTERVAL_SIZE;
-          file.seekg(skip);
-          size -= skip;
-          num_intervals = IDLELOG_MAXSIZE;
+          offset = IDLELOG_HEADER_SIZE;
         }
+    }
 
+  // Ignore partially written interval.
+  int num_intervals = size > offset ? (size - offset) / IDLELOG_INTERVAL_SIZE : 0;
+  if (num_intervals > IDLELOG_MAXSIZE)
+    {
+      TRACE_MSG("Skipping " << (num_intervals - IDLELOG_MAXSIZE) << " intervals");
+      offset += (num_intervals - IDLELOG_MAXSIZE) * IDLELOG_INTERVAL_SIZE;
+      num_intervals = IDLELOG_MAXSIZE;
+    }
+  size = num_intervals * IDLELOG_INTERVAL_SIZE;
+
+  if (num_intervals > 0)
+    {
       // Create buffer and load data.
       PacketBuffer buffer;
       buffer.create(size);
+      file.seekg(offset);
       file.read(buffer.get_buffer(), size);
-      file.close();
       buffer.write_ptr += size;
 
       TRACE_MSG("loading " << num_intervals << " intervals");
@@ -827,16 +1197,14 @@ IdleLogManager::load_idlelog(ClientInfo &info)
             }
         }
 
-	  if (info.idlelog.size() > 0)
-	    {
-           IdleInterval &idle = info.idlelog.back();
-           idle.begin_time = 1;
-	    }
+      if (info.idlelog.size() > 0)
+        {
+          IdleInterval &idle = info.idlelog.back();
+          idle.begin_time = 1;
+        }
     }
 
-  dump_idlelog(info);
-  fix_idlelog(info);
-  dump_idlelog(info);
+  file.close();
   TRACE_EXIT();
 }
 
@@ -852,6 +1220,9 @@ IdleLogManager::load()
       ClientInfo &info = (*i).second;
       load_idlelog(info);
     }
+
+  // Describe the repaired idlelogs.
+  save_index();
 }
 
 
@@ -860,13 +1231,13 @@ IdleLogManager::load()
 void
 IdleLogManager::save()
 {
-  save_index();
-
   for (ClientMapIter i = clients.begin(); i != clients.end(); i++)
     {
       ClientInfo &info = (*i).second;
       save_idlelog(info);
     }
+
+  save_index();
 }
 
 
@@ -876,24 +1247,48 @@ IdleLogManager::update_idlelog(ClientInfo &info, const IdleInterval &idle)
 {
   info.update_active_time(time_source->get_time());
 
+  if (!info.stored_valid)
+    {
+      // Cannot append to a file that is not known to be consistent.
+      save_idlelog(info);
+      save_index();
+      return;
+    }
+
   PacketBuffer buffer;
   buffer.create();
 
   pack_idle_interval(buffer, idle);
 
-  stringstream ss;
-  ss << Util::get_home_directory();
-  ss << "idlelog." << info.client_id << ".log" << ends;
+  string filename = get_idlelog_filename(info.client_id);
 
-  ofstream file(ss.str().c_str(), ios::app | ios::binary);
+  ofstream file(filename.c_str(), ios::app | ios::binary);
   file.write(buffer.get_buffer(), buffer.bytes_written());
   file.close();
 
+  if (file.good())
+    {
+      const guint8 *data = (const guint8 *)buffer.get_buffer();
+
+      info.stored_count++;
+      info.stored_time = idle.end_time != 0 ? idle.end_time : idle.end_idle_time;
+      info.stored_checksum = update_checksum(info.stored_checksum, data, buffer.bytes_written());
+    }
+  else
+    {
+      info.stored_valid = false;
+    }
+
   save_index();
 }
 
 
 
+//! Packs my idle log for remote clients.
+/*!
+ *  Only the intervals that are not yet known by all signed on clients are
+ *  packed, unless a client did not report what it knows of my idle log.
+ */
 void
 IdleLogManager::get_idlelog(PacketBuffer &buffer)
 {
@@ -905,48 +1300,198 @@ IdleLogManager::get_idlelog(PacketBuffer &buffer)
   // First make sure that all data is up-to-date.
   myinfo.update_active_time(time_source->get_time());
 
-  // Pack header.
-  pack_idlelog(buffer, myinfo);
+  IdleLogSync sync;
+  sync.valid = true;
+  sync.sequence = myinfo.sequence;
+  sync.first_sequence = get_sync_sequence(myinfo);
+
+  for (ClientMapIter i = clients.begin(); i != clients.end(); i++)
+    {
+      if (i->first != myid)
+        {
+          sync.known[i->first] = i->second.sequence;
+        }
+    }
 
+  int num_intervals = 0;
   for (IdleLogIter i = myinfo.idlelog.begin(); i != myinfo.idlelog.end(); i++)
     {
-      pack_idle_interval(buffer, *i);
+      if (sync.first_sequence != 0 && i->sequence < sync.first_sequence)
+        {
+          break;
+        }
+      num_intervals++;
+    }
+
+  TRACE_MSG("sending " << num_intervals << " of " << myinfo.idlelog.size()
+            << " from " << sync.first_sequence);
+
+  // Pack header.
+  pack_idlelog(buffer, myinfo, num_intervals, &sync);
+
+  IdleLogIter it = myinfo.idlelog.begin();
+  for (int i = 0; i < num_intervals; i++, it++)
+    {
+      pack_idle_interval(buffer, *it);
     }
 
   TRACE_EXIT();
 }
 
 
-void
+//! Processes the idle log of a remote client.
+/*!
+ *  \return true if the remote client misses part of my idle log, or if
+ *  part of its idle log is missing here. Either way, my idle log should be
+ *  sent again.
+ */
+bool
 IdleLogManager::set_idlelog(PacketBuffer &buffer)
 {
   TRACE_ENTER("IdleLogManager::set_idlelog");
 
+  bool resync = false;
   time_t delta_time = 0;
   time_t pack_time = 0;
   int num_intervals = 0;
 
   ClientInfo info;
-  unpack_idlelog(buffer, info, pack_time, num_intervals);
+  IdleLogSync sync;
+  unpack_idlelog(buffer, info, pack_time, num_intervals, &sync);
 
   delta_time = pack_time - time_source->get_time();
-  clients[info.client_id] = info;
-  info.last_update_time = 0;
 
+  guint32 sequence = sync.sequence;
   for (int i = 0; i < num_intervals; i++)
     {
       IdleInterval idle;
       unpack_idle_interval(buffer, idle, delta_time);
 
+      if (sync.valid)
+        {
+          idle.sequence = sequence--;
+        }
+
       TRACE_MSG(info.client_id << " " << idle.begin_time << " " << idle.end_idle_time << " " << idle.active_time);
-      clients[info.client_id].idlelog.push_back(idle);
+      info.idlelog.push_back(idle);
     }
 
-  fix_idlelog(info);
+  ClientInfo &ci = clients[info.client_id];
+
+  info.online = ci.online;
+  info.acked = ci.acked;
+  info.acked_sequence = ci.acked_sequence;
+  info.sequence = sync.sequence;
+
+  if (sync.valid && sync.first_sequence != 0)
+    {
+      if (ci.sequence + 1 < sync.first_sequence)
+        {
+          TRACE_MSG("Missing intervals " << ci.sequence << " " << sync.first_sequence);
+
+          // Keep what we have, and report that we need the entire log.
+          info.idlelog.swap(ci.idlelog);
+          info.sequence = 0;
+          resync = true;
+        }
+      else
+        {
+          // Replace the intervals that are included in the message.
+          IdleLogIter i = ci.idlelog.begin();
+          while (i != ci.idlelog.end() && (i->sequence == 0 || i->sequence >= sync.first_sequence))
+            {
+              i++;
+            }
+          info.idlelog.insert(info.idlelog.end(), i, ci.idlelog.end());
+        }
+    }
+
+  if (sync.valid)
+    {
+      SequenceMap::iterator it = sync.known.find(myid);
+      guint32 known_sequence = (it != sync.known.end()) ? it->second : 0;
+
+      if (info.acked && known_sequence < info.acked_sequence)
+        {
+          TRACE_MSG("Remote client lost intervals " << known_sequence << " " << info.acked_sequence);
+          resync = true;
+        }
+
+      info.acked = true;
+      info.acked_sequence = known_sequence;
+    }
+
+  info.generation = ci.generation;
+
+  ci = info;
+  ci.last_update_time = 0;
+
+  save_idlelog(ci);
   save_index();
-  save_idlelog(clients[info.client_id]);
 
-  TRACE_EXIT();
+  TRACE_RETURN(resync);
+  return resync;
+}
+
+
+//! Returns the oldest sequence number that must be sent to all remote clients.
+/*!
+ *  Returns 0 if the entire idle log must be sent.
+ */
+guint32
+IdleLogManager::get_sync_sequence(const ClientInfo &myinfo) const
+{
+  guint32 ret = 0;
+  bool found = false;
+
+  for (ClientMap::const_iterator i = clients.begin(); i != clients.end(); i++)
+    {
+      const ClientInfo &info = i->second;
+
+      if (i->first != myid && info.online)
+        {
+          if (!info.acked)
+            {
+              // Client does not support incremental updates, or never reported.
+              return 0;
+            }
+
+          if (!found || info.acked_sequence < ret)
+            {
+              ret = info.acked_sequence;
+              found = true;
+            }
+        }
+    }
+
+  if (myinfo.idlelog.size() == 0 ||
+      ret <= myinfo.idlelog.back().sequence ||
+      ret > myinfo.sequence)
+    {
+      ret = 0;
+    }
+
+  return ret;
+}
+
+
+//! Assigns sequence numbers to the loaded idlelog.
+/*!
+ *  Sequence numbers are not stored. The idle logs of remote clients are
+ *  left unnumbered so that they are synchronized completely.
+ */
+void
+IdleLogManager::number_idlelog(ClientInfo &info)
+{
+  info.sequence = 0;
+
+  if (info.client_id == myid)
+    {
+      for (IdleLogRIter i = info.idlelog.rbegin(); i != info.idlelog.rend(); i++)
+        {
+          i->sequence = ++info.sequence;
+        }
+    }
 }
 
 
@@ -961,9 +1506,10 @@ IdleLogManager::signon_remote_client(string client_id)
   ClientInfo &info = clients[client_id];
   info.idlelog.push_front(IdleInterval(1, current_time));
   info.client_id = client_id;
+  info.online = true;
 
-  save_index();
   save_idlelog(info);
+  save_index();
 
   TRACE_EXIT();
 }
@@ -977,6 +1523,7 @@ IdleLogManager::signoff_remote_client(string client_id)
 
   clients[client_id].state = ACTIVITY_IDLE;
   clients[client_id].master = false;
+  clients[client_id].online = false;
 
   TRACE_EXIT();
 }
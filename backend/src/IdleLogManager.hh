@@ -58,6 +58,7 @@ private:
       end_idle_time(0),
       end_time(0),
       active_time(0),
+      sequence(0),
       to_be_saved(false)
     {
     }
@@ -67,6 +68,7 @@ private:
       end_idle_time(e),
       end_time(e),
       active_time(0),
+      sequence(0),
       to_be_saved(false)
     {
     }
@@ -83,6 +85,9 @@ private:
     //! Elapsed active time AFTER the idle interval.
     time_t active_time;
 
+    //! Sequence number in the idle log of the owning client (0 if unknown).
+    guint32 sequence;
+
     //! Yet to be saved
     bool to_be_saved;
   };
@@ -92,6 +97,31 @@ private:
   typedef IdleLog::iterator IdleLogIter;
   typedef IdleLog::reverse_iterator IdleLogRIter;
 
+  typedef map<string, guint32> SequenceMap;
+
+  //! Synchronization information of an idle log sent to remote clients.
+  struct IdleLogSync
+  {
+    IdleLogSync() :
+      valid(false),
+      sequence(0),
+      first_sequence(0)
+    {
+    }
+
+    //! Whether the sender supports incremental synchronization.
+    bool valid;
+
+    //! Sequence number of the most recent interval of the sender.
+    guint32 sequence;
+
+    //! Sequence number of the oldest interval in the message, or 0 if the entire log is sent.
+    guint32 first_sequence;
+
+    //! Most recent sequence number of each idle log known by the sender.
+    SequenceMap known;
+  };
+
   //! Idle information of a single client.
   struct ClientInfo
   {
@@ -101,7 +131,16 @@ private:
       total_active_time(0),
       last_active_begin_time(0),
       last_active_time(0),
-      last_update_time()
+      last_update_time(),
+      sequence(0),
+      online(false),
+      acked(false),
+      acked_sequence(0),
+      generation(0),
+      stored_count(0),
+      stored_time(0),
+      stored_checksum(0),
+      stored_valid(false)
     {
     }
 
@@ -132,6 +171,33 @@ private:
     //! Last time this idle log was updated.
     time_t last_update_time;
 
+    //! Sequence number of the most recent interval in the idle log.
+    guint32 sequence;
+
+    //! Is this client currently signed on?
+    bool online;
+
+    //! Did this client report which part of my idle log it knows?
+    bool acked;
+
+    //! Sequence number of the most recent interval of my idle log known by this client.
+    guint32 acked_sequence;
+
+    //! Generation of the stored idle log, incremented on each rewrite.
+    guint32 generation;
+
+    //! Number of intervals in the stored idle log.
+    guint32 stored_count;
+
+    //! End time of the most recent stored interval.
+    time_t stored_time;
+
+    //! Checksum of the stored intervals.
+    guint32 stored_checksum;
+
+    //! Is the stored idle log described correctly by the above?
+    bool stored_valid;
+
     //! Update the active time of the most recent idle interval.
     void update_active_time(time_t current_time)
     {
@@ -174,7 +240,7 @@ public:
   void signoff_remote_client(string client_id);
 
   void get_idlelog(PacketBuffer &buffer);
-  void set_idlelog(PacketBuffer &buffer);
+  bool set_idlelog(PacketBuffer &buffer);
 
   time_t compute_total_active_time();
   time_t compute_active_time(int length);
@@ -188,14 +254,27 @@ private:
   void pack_idle_interval(PacketBuffer &buffer, const IdleInterval &idle) const;
   void unpack_idle_interval(PacketBuffer &buffer, IdleInterval &idle, time_t delta_time) const;
 
-  void pack_idlelog(PacketBuffer &buffer, const ClientInfo &ci) const;
-  void unpack_idlelog(PacketBuffer &buffer, ClientInfo &ci, time_t &pack_time, int &num_intervals) const;
+  void pack_idlelog(PacketBuffer &buffer, const ClientInfo &ci, int num_intervals,
+                    const IdleLogSync *sync = NULL) const;
+  void unpack_idlelog(PacketBuffer &buffer, ClientInfo &ci, time_t &pack_time, int &num_intervals,
+                      IdleLogSync *sync = NULL) const;
+  guint32 get_sync_sequence(const ClientInfo &myinfo) const;
+  void number_idlelog(ClientInfo &info);
   void unlink_idlelog(PacketBuffer &buffer) const;
 
+  void pack_storage_info(PacketBuffer &buffer, const ClientInfo &ci) const;
+  void unpack_storage_info(PacketBuffer &buffer, ClientInfo &ci) const;
+
+  string get_index_filename() const;
+  string get_idlelog_filename(const string &client_id) const;
+  bool write_file(const string &filename, PacketBuffer &buffer) const;
+
   void save_index();
   void load_index();
   void save_idlelog(ClientInfo &info);
   void load_idlelog(ClientInfo &info);
+  bool map_idlelog(ClientInfo &info);
+  void read_idlelog(ClientInfo &info);
 
   void save();
   void load();
@@ -0,0 +1,67 @@
+// InputEvent.hh --- Event reported by an input monitor
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef INPUTEVENT_HH
+#define INPUTEVENT_HH
+
+#include <glib.h>
+
+//! Input activity, as queued from the monitor thread to the listeners.
+struct InputEvent
+{
+  enum Type
+    {
+      //! Generic user activity.
+      INPUT_ACTION,
+
+      //! A single mouse sample.
+      INPUT_MOUSE,
+
+      //! Combined mouse samples, with the distance already measured.
+      INPUT_MOUSE_MOTION,
+
+      //! Mouse button press or release.
+      INPUT_BUTTON,
+
+      //! Key press.
+      INPUT_KEYBOARD
+    };
+
+  //! Monotonic time of the event, in microseconds.
+  gint64 time;
+
+  //! Mouse position.
+  gint32 x;
+  gint32 y;
+
+  //! Distance in pixels and time in microseconds moved, for INPUT_MOUSE_MOTION.
+  gint32 distance;
+  gint32 movement_time;
+
+  //! Wheel movement.
+  gint16 wheel;
+
+  //! Type of the event.
+  guint8 type;
+
+  //! Button pressed, or key repeated.
+  guint8 flag;
+};
+
+#endif // INPUTEVENT_HH
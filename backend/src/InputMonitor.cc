@@ -23,18 +23,55 @@
 
 #include <assert.h>
 
+#include "debug.hh"
 #include "InputMonitor.hh"
 
+GSourceFuncs InputMonitor::event_source_funcs =
+  {
+    InputMonitor::event_prepare,
+    InputMonitor::event_check,
+    InputMonitor::event_dispatch,
+    NULL,
+    NULL,
+    NULL
+  };
+
 
 InputMonitor::InputMonitor()
   : activity_listener(NULL),
-    statistics_listener(NULL)
+    statistics_listener(NULL),
+    mouse_interval(0),
+    noise_threshold(1000),
+    activity_threshold(2000),
+    idle_threshold(5000),
+    mouse_decimation(false),
+    mouse_main_loop(false),
+    mouse_pending(false),
+    mouse_x(-1),
+    mouse_y(-1),
+    mouse_wheel(0),
+    mouse_distance(0),
+    mouse_movement_time(0),
+    mouse_report_time(0),
+    main_loop_polling(0),
+    next_process_time(0),
+    dropped_events(0)
 {
+  // The monitor is created in the main thread.
+  main_context = g_main_context_default();
+  g_main_context_ref(main_context);
+
+  event_source = g_source_new(&event_source_funcs, sizeof(EventSource));
+  ((EventSource *)event_source)->monitor = this;
+  g_source_attach(event_source, main_context);
 }
 
 
 InputMonitor::~InputMonitor()
 {
+  g_source_destroy(event_source);
+  g_source_unref(event_source);
+  g_main_context_unref(main_context);
 }
 
 
@@ -70,3 +107,374 @@ InputMonitor::unsubscribe_statistics(IInputMonitorListener *listener)
   assert(statistics_listener != NULL);
   statistics_listener = NULL;
 }
+
+
+//! Sets the minimum number of milliseconds between mouse movement reports.
+/*!
+ *  Only monitors that enabled decimation combine mouse movement. Zero
+ *  reports every sample.
+ */
+void
+InputMonitor::set_mouse_interval(int interval)
+{
+  g_atomic_int_set(&mouse_interval, interval > 0 ? interval : 0);
+}
+
+
+//! Sets the thresholds of the activity monitor, in milliseconds.
+/*!
+ *  Monitors that poll use these to decide when to check for activity.
+ */
+void
+InputMonitor::set_activity_parameters(int noise, int activity, int idle)
+{
+  g_atomic_int_set(&noise_threshold, noise);
+  g_atomic_int_set(&activity_threshold, activity);
+  g_atomic_int_set(&idle_threshold, idle);
+}
+
+
+//! Returns the thresholds of the activity monitor, in milliseconds.
+void
+InputMonitor::get_activity_parameters(int &noise, int &activity, int &idle)
+{
+  noise = g_atomic_int_get(&noise_threshold);
+  activity = g_atomic_int_get(&activity_threshold);
+  idle = g_atomic_int_get(&idle_threshold);
+}
+
+
+//! Combines the mouse movement of samples that arrive within the interval.
+/*!
+ *  The monitor must call get_mouse_timeout() before it waits for input,
+ *  and flush_mouse() when the timeout expires, so that movement is never
+ *  reported later than the interval. Monitors that cannot wait with a
+ *  timeout pass main_loop, and the main loop reports the movement
+ *  instead. Must be called before the monitor thread starts.
+ */
+void
+InputMonitor::enable_mouse_decimation(bool main_loop)
+{
+  mouse_decimation = true;
+  mouse_main_loop = main_loop;
+}
+
+
+//! Returns the number of milliseconds until pending movement must be reported.
+/*!
+ *  \return -1 if no movement is pending.
+ */
+int
+InputMonitor::get_mouse_timeout()
+{
+  if (!mouse_pending)
+    {
+      return -1;
+    }
+
+  gint64 due = mouse_report_time + (gint64) g_atomic_int_get(&mouse_interval) * 1000;
+  gint64 now = g_get_monotonic_time();
+
+  if (due <= now)
+    {
+      return 0;
+    }
+  return (int) ((due - now + 999) / 1000);
+}
+
+
+//! Reports the pending mouse movement.
+void
+InputMonitor::flush_mouse()
+{
+  if (!mouse_pending)
+    {
+      return;
+    }
+
+  InputEvent event;
+  get_mouse_event(event);
+  push_event(event);
+}
+
+
+//! Removes the pending mouse movement, and returns it as an event.
+void
+InputMonitor::get_mouse_event(InputEvent &event)
+{
+  mouse_pending = false;
+  mouse_report_time = g_get_monotonic_time();
+
+  event.type = InputEvent::INPUT_MOUSE_MOTION;
+  event.x = mouse_x;
+  event.y = mouse_y;
+  event.wheel = mouse_wheel;
+  event.flag = 0;
+  event.distance = mouse_distance;
+  event.movement_time = (gint32) mouse_movement_time;
+  event.time = mouse_report_time;
+
+  mouse_wheel = 0;
+  mouse_distance = 0;
+  mouse_movement_time = 0;
+}
+
+
+//! Removes the pending mouse movement if the main loop must report it now.
+/*!
+ *  \return the number of queued events that occurred before the
+ *          movement, or -1 if no movement is due.
+ */
+int
+InputMonitor::take_mouse(InputEvent &event)
+{
+  int queued = -1;
+
+  if (mouse_main_loop)
+    {
+      lock_mouse();
+      if (mouse_pending && get_mouse_timeout() == 0)
+        {
+          get_mouse_event(event);
+
+          // Everything the monitor queues from now on is newer.
+          queued = events.get_size();
+        }
+      unlock_mouse();
+    }
+
+  return queued;
+}
+
+
+//! Adds a mouse sample to the pending movement.
+/*!
+ *  Distance and movement time are measured per sample, in the same way as
+ *  the statistics do for individual reports, so that combining samples
+ *  does not change the totals.
+ */
+void
+InputMonitor::decimate_mouse(int x, int y, int wheel)
+{
+  gint64 now = g_get_monotonic_time();
+  int distance;
+  gint64 movement_time;
+
+  if (mouse_movement.add_sample(x, y, wheel, now, distance, movement_time))
+    {
+      mouse_distance += distance;
+      mouse_movement_time += movement_time;
+    }
+
+  bool was_pending = mouse_pending;
+
+  mouse_x = x;
+  mouse_y = y;
+  mouse_wheel += wheel;
+  mouse_pending = true;
+
+  if (now - mouse_report_time >= (gint64) g_atomic_int_get(&mouse_interval) * 1000)
+    {
+      flush_mouse();
+    }
+  else if (mouse_main_loop && !was_pending)
+    {
+      // Let the main loop wait until the movement is due.
+      wakeup_main_loop();
+    }
+}
+
+
+//! Reports the queued input events to the listeners.
+void
+InputMonitor::process_events()
+{
+  InputEvent batch[INPUT_EVENT_BATCH_SIZE];
+
+  next_process_time = g_get_monotonic_time() + INPUT_EVENT_INTERVAL * 1000;
+
+  int count;
+  InputEvent motion;
+  int queued = take_mouse(motion);
+  if (queued != -1)
+    {
+      // Report the events that occurred before the movement first.
+      while (queued > 0 &&
+             (count = events.pop(batch, MIN(queued, INPUT_EVENT_BATCH_SIZE))) > 0)
+        {
+          notify_listeners(batch, count);
+          queued -= count;
+        }
+      notify_listeners(&motion, 1);
+    }
+
+  while ((count = events.pop(batch, INPUT_EVENT_BATCH_SIZE)) > 0)
+    {
+      notify_listeners(batch, count);
+    }
+
+  int dropped = g_atomic_int_get(&dropped_events);
+  if (dropped > 0)
+    {
+      TRACE_ENTER("InputMonitor::process_events");
+      TRACE_MSG("Dropped " << dropped << " events");
+      g_atomic_int_add(&dropped_events, -dropped);
+      TRACE_EXIT();
+    }
+}
+
+
+//! Reports a batch of input events to the listeners.
+void
+InputMonitor::notify_listeners(const InputEvent *batch, int count)
+{
+  if (activity_listener != NULL)
+    {
+      activity_listener->input_notify(batch, count);
+    }
+  if (statistics_listener != NULL)
+    {
+      statistics_listener->input_notify(batch, count);
+    }
+}
+
+
+//! Queues an input event of the monitor thread.
+/*!
+ *  \param time monotonic time at which the event occurred, or 0 for now.
+ */
+void
+InputMonitor::queue_event(InputEvent::Type type, int x, int y, int wheel, bool flag, gint64 time)
+{
+  InputEvent event;
+  event.type = type;
+  event.x = x;
+  event.y = y;
+  event.wheel = wheel;
+  event.flag = flag;
+  event.distance = 0;
+  event.movement_time = 0;
+  event.time = time != 0 ? time : g_get_monotonic_time();
+  push_event(event);
+}
+
+
+//! Queues an input event of the monitor thread, and wakes up the main loop if needed.
+void
+InputMonitor::push_event(const InputEvent &event)
+{
+  if (!events.push(event))
+    {
+      // The main loop is not keeping up. Activity is still reported
+      // by the events that are already queued.
+      g_atomic_int_inc(&dropped_events);
+    }
+
+  wakeup_main_loop();
+}
+
+
+//! Wakes up the main loop, unless it already checks the queue by itself.
+void
+InputMonitor::wakeup_main_loop()
+{
+  if (g_atomic_int_compare_and_exchange(&main_loop_polling, 0, 1))
+    {
+      g_main_context_wakeup(main_context);
+    }
+}
+
+
+//! Returns the number of milliseconds until the main loop must process the queue.
+/*!
+ *  The main loop keeps checking the queue every INPUT_EVENT_INTERVAL
+ *  milliseconds until an interval passes without input. It then waits
+ *  until the monitor thread wakes it up again.
+ *
+ *  \return -1 if the main loop must wait until it is woken up.
+ */
+int
+InputMonitor::get_process_timeout()
+{
+  gint64 now = g_get_monotonic_time();
+  int timeout = 0;
+  if (next_process_time > now)
+    {
+      timeout = (int) ((next_process_time - now + 999) / 1000);
+    }
+
+  if (!events.is_empty())
+    {
+      return timeout;
+    }
+
+  int mouse_timeout = get_main_loop_mouse_timeout();
+  if (mouse_timeout != -1)
+    {
+      return MAX(timeout, mouse_timeout);
+    }
+
+  if (timeout > 0 && g_atomic_int_get(&main_loop_polling))
+    {
+      return timeout;
+    }
+
+  // Input queued from now on wakes up the main loop. Check again for
+  // input that was queued without a wakeup in the meantime.
+  g_atomic_int_set(&main_loop_polling, 0);
+  if (!events.is_empty() || get_main_loop_mouse_timeout() != -1)
+    {
+      g_atomic_int_set(&main_loop_polling, 1);
+      return 0;
+    }
+
+  return -1;
+}
+
+
+//! Returns the number of milliseconds until the main loop must report the mouse movement.
+/*!
+ *  \return -1 if the monitor reports the movement itself, or no movement
+ *          is pending.
+ */
+int
+InputMonitor::get_main_loop_mouse_timeout()
+{
+  int timeout = -1;
+
+  if (mouse_main_loop)
+    {
+      lock_mouse();
+      timeout = get_mouse_timeout();
+      unlock_mouse();
+    }
+
+  return timeout;
+}
+
+
+gboolean
+InputMonitor::event_prepare(GSource *source, gint *timeout)
+{
+  *timeout = ((EventSource *)source)->monitor->get_process_timeout();
+  return *timeout == 0;
+}
+
+
+gboolean
+InputMonitor::event_check(GSource *source)
+{
+  gint timeout;
+  return event_prepare(source, &timeout);
+}
+
+
+gboolean
+InputMonitor::event_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  (void) callback;
+  (void) user_data;
+
+  ((EventSource *)source)->monitor->process_events();
+  return TRUE;
+}
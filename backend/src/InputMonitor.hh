@@ -21,13 +21,44 @@
 #define INPUTMONITOR_HH
 
 #include <stdlib.h>
+#include <glib.h>
+
 #include "IInputMonitor.hh"
 #include "IInputMonitorListener.hh"
+#include "InputEvent.hh"
+#include "MouseMovement.hh"
+#include "Mutex.hh"
+#include "SPSCRing.hh"
+
+//! Number of input events that can be queued, must be a power of two.
+#define INPUT_EVENT_QUEUE_SIZE (4096)
+
+//! Maximum number of input events reported to the listeners at once.
+#define INPUT_EVENT_BATCH_SIZE (256)
+
+//! Milliseconds between two times the main loop processes the queue.
+#define INPUT_EVENT_INTERVAL (10)
 
 // Forward declarion of internal interfaces.
 class IInputMonitorListener;
 
 //!  Base for activity monitors.
+/*!
+ *  Input events are queued by the monitor thread and reported to the
+ *  listeners in batches by the main thread, so that the monitor thread
+ *  never waits for the listeners. The main loop is woken up by the first
+ *  event after a period without input. While input keeps arriving, the
+ *  main loop checks the queue every INPUT_EVENT_INTERVAL milliseconds
+ *  by itself, so that the monitor thread does not wake it up per event.
+ *  Listeners may also process the queue at any other time using
+ *  process_events().
+ *
+ *  Monitors that cannot wake up on a timeout let the main loop report
+ *  the combined mouse movement when it is due; the pending movement is
+ *  then protected by a lock.
+ *
+ *  All events must be fired from the same thread.
+ */
 class InputMonitor
   : public IInputMonitor
 {
@@ -39,19 +70,107 @@ public:
   virtual void subscribe_statistics(IInputMonitorListener *listener);
   virtual void unsubscribe_activity(IInputMonitorListener *listener);
   virtual void unsubscribe_statistics(IInputMonitorListener *listener);
+  virtual void set_mouse_interval(int interval);
+  virtual void set_activity_parameters(int noise, int activity, int idle);
+  virtual void process_events();
 
 protected:
   void fire_action();
+  void fire_action(gint64 time);
   void fire_mouse(int x, int y, int wheel = 0);
   void fire_button(bool is_press);
   void fire_keyboard(bool repeat);
 
+  void enable_mouse_decimation(bool main_loop = false);
+  int get_mouse_timeout();
+  void flush_mouse();
+
+  void get_activity_parameters(int &noise, int &activity, int &idle);
+
+private:
+  void decimate_mouse(int x, int y, int wheel);
+  void get_mouse_event(InputEvent &event);
+  int take_mouse(InputEvent &event);
+  void lock_mouse();
+  void unlock_mouse();
+  void notify_listeners(const InputEvent *batch, int count);
+  void queue_event(InputEvent::Type type, int x = 0, int y = 0, int wheel = 0, bool flag = false, gint64 time = 0);
+  void push_event(const InputEvent &event);
+  void wakeup_main_loop();
+  int get_process_timeout();
+  int get_main_loop_mouse_timeout();
+
+  struct EventSource
+  {
+    GSource source;
+    InputMonitor *monitor;
+  };
+
+  static gboolean event_prepare(GSource *source, gint *timeout);
+  static gboolean event_check(GSource *source);
+  static gboolean event_dispatch(GSource *source, GSourceFunc callback, gpointer user_data);
+
 private:
   //!
   IInputMonitorListener *activity_listener;
 
   //!
   IInputMonitorListener *statistics_listener;
+
+  //! Minimum number of milliseconds between mouse reports, updated atomically.
+  volatile gint mouse_interval;
+
+  //! Thresholds of the activity monitor in milliseconds, updated atomically.
+  volatile gint noise_threshold;
+  volatile gint activity_threshold;
+  volatile gint idle_threshold;
+
+  //! Whether the monitor reports pending mouse movement in time.
+  bool mouse_decimation;
+
+  //! Whether the main loop reports pending mouse movement in time.
+  bool mouse_main_loop;
+
+  //! Protects the pending mouse movement if the main loop reports it.
+  Mutex mouse_lock;
+
+  //! Whether mouse movement is waiting to be reported.
+  bool mouse_pending;
+
+  //! Last position and total wheel movement waiting to be reported.
+  int mouse_x;
+  int mouse_y;
+  int mouse_wheel;
+
+  //! Distance in pixels and time in microseconds moved, waiting to be reported.
+  int mouse_distance;
+  gint64 mouse_movement_time;
+
+  //! Time of the last report, in microseconds.
+  gint64 mouse_report_time;
+
+  //! Distance and time of the individual mouse samples.
+  MouseMovement mouse_movement;
+
+  //! Events from the monitor thread to the main thread.
+  SPSCRing<InputEvent, INPUT_EVENT_QUEUE_SIZE> events;
+
+  //! Whether the main loop checks the queue by itself, updated atomically.
+  volatile gint main_loop_polling;
+
+  //! Earliest time at which the main loop processes the queue again, in microseconds.
+  gint64 next_process_time;
+
+  //! Number of events that did not fit in the queue.
+  volatile gint dropped_events;
+
+  //! The main loop that processes the events.
+  GMainContext *main_context;
+
+  //! Source that processes the events in the main loop.
+  GSource *event_source;
+
+  static GSourceFuncs event_source_funcs;
 };
 
 #include "InputMonitor.icc"
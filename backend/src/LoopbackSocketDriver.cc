@@ -0,0 +1,608 @@
+// LoopbackSocketDriver.cc --- In-process simulated network
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_DISTRIBUTION)
+
+#include <string.h>
+#include <stdio.h>
+
+#include "debug.hh"
+#include "LoopbackSocketDriver.hh"
+
+using namespace std;
+
+
+//! Creates a network without latency, bandwidth limit or loss.
+/*!
+ *  \param seed seed of the random generator that decides which segments are lost.
+ */
+LoopbackNetwork::LoopbackNetwork(guint32 seed) :
+  now(0),
+  event_count(0),
+  last_socket_id(0),
+  latency(LOOPBACK_DEFAULT_LATENCY),
+  bandwidth(0),
+  loss(0.0)
+{
+  rand = g_rand_new_with_seed(seed);
+}
+
+
+//! Destructs the network.
+/*!
+ *  All drivers and their sockets must be deleted before the network.
+ */
+LoopbackNetwork::~LoopbackNetwork()
+{
+  for (EventQueue::iterator i = events.begin(); i != events.end(); i++)
+    {
+      delete i->second;
+    }
+  g_rand_free(rand);
+}
+
+
+//! Creates a socket driver for the specified host.
+SocketDriver *
+LoopbackNetwork::create_driver(const string &hostname)
+{
+  return new LoopbackSocketDriver(this, hostname);
+}
+
+
+//! Sets the one-way latency in milliseconds.
+void
+LoopbackNetwork::set_latency(int ms)
+{
+  latency = ms;
+}
+
+
+//! Sets the bandwidth of each direction of a connection, or 0 for unlimited.
+void
+LoopbackNetwork::set_bandwidth(int bytes_per_second)
+{
+  bandwidth = bytes_per_second;
+}
+
+
+//! Sets the probability that a segment must be retransmitted.
+void
+LoopbackNetwork::set_loss(double probability)
+{
+  loss = probability;
+}
+
+
+//! Makes two hosts unreachable, or reachable again, for each other.
+void
+LoopbackNetwork::set_partitioned(const string &host1, const string &host2, bool partitioned)
+{
+  pair<string, string> hosts = host1 < host2 ? make_pair(host1, host2) : make_pair(host2, host1);
+
+  if (partitioned)
+    {
+      partitions.insert(hosts);
+    }
+  else
+    {
+      partitions.erase(hosts);
+    }
+}
+
+
+//! Returns whether two hosts cannot reach each other.
+bool
+LoopbackNetwork::is_partitioned(const string &host1, const string &host2) const
+{
+  pair<string, string> hosts = host1 < host2 ? make_pair(host1, host2) : make_pair(host2, host1);
+  return partitions.find(hosts) != partitions.end();
+}
+
+
+//! Advances the virtual clock, and processes all events until the new time.
+void
+LoopbackNetwork::advance(int ms)
+{
+  TRACE_ENTER_MSG("LoopbackNetwork::advance", ms);
+  gint64 target = now + ms;
+
+  while (!events.empty() && events.begin()->first.first <= target)
+    {
+      EventQueue::iterator i = events.begin();
+      Event *event = i->second;
+
+      now = i->first.first;
+      events.erase(i);
+
+      process(event);
+    }
+
+  now = target;
+  TRACE_EXIT();
+}
+
+
+//! Returns the virtual time in milliseconds.
+gint64
+LoopbackNetwork::get_time_ms() const
+{
+  return now;
+}
+
+
+//! Returns the virtual time.
+time_t
+LoopbackNetwork::get_time() const
+{
+  return LOOPBACK_EPOCH + (time_t)(now / 1000);
+}
+
+
+//! Registers a socket, and returns its ID.
+guint64
+LoopbackNetwork::add_socket(LoopbackSocket *socket)
+{
+  last_socket_id++;
+  sockets[last_socket_id] = socket;
+  return last_socket_id;
+}
+
+
+//! Unregisters a socket. Pending events of the socket are ignored.
+void
+LoopbackNetwork::remove_socket(guint64 id)
+{
+  sockets.erase(id);
+}
+
+
+//! Returns the socket with the specified ID, or NULL if it no longer exists.
+LoopbackSocket *
+LoopbackNetwork::find_socket(guint64 id) const
+{
+  map<guint64, LoopbackSocket *>::const_iterator i = sockets.find(id);
+  return i != sockets.end() ? i->second : NULL;
+}
+
+
+//! Registers a listen socket.
+void
+LoopbackNetwork::add_server(const string &hostname, int port, LoopbackSocketServer *server)
+{
+  gchar *address = g_strdup_printf("%s:%d", hostname.c_str(), port);
+  bool used = servers.find(address) != servers.end();
+
+  if (!used)
+    {
+      servers[address] = server;
+    }
+  g_free(address);
+
+  if (used)
+    {
+      throw SocketException("Failed to listen: address already in use");
+    }
+}
+
+
+//! Unregisters a listen socket.
+void
+LoopbackNetwork::remove_server(LoopbackSocketServer *server)
+{
+  map<string, LoopbackSocketServer *>::iterator i = servers.begin();
+  while (i != servers.end())
+    {
+      if (i->second == server)
+        {
+          servers.erase(i++);
+        }
+      else
+        {
+          i++;
+        }
+    }
+}
+
+
+//! Schedules an event at the specified virtual time.
+/*!
+ *  Events scheduled at the same time are processed in the order in which
+ *  they were scheduled.
+ */
+void
+LoopbackNetwork::schedule(gint64 time, Event *event)
+{
+  events[make_pair(time, event_count++)] = event;
+}
+
+
+//! Processes an event, and deletes it unless it is scheduled again.
+void
+LoopbackNetwork::process(Event *event)
+{
+  LoopbackSocket *socket = find_socket(event->socket_id);
+
+  if (socket == NULL)
+    {
+      // Socket was deleted.
+      delete event;
+      return;
+    }
+
+  if (event->type == EVENT_DATA || event->type == EVENT_EOF)
+    {
+      if (!socket->held.empty() ||
+          is_partitioned(socket->hostname, socket->remote_hostname))
+        {
+          // Retransmitted after the partition is removed, after earlier held data.
+          if (socket->held.empty())
+            {
+              schedule(now + LOOPBACK_RETRANSMIT_TIME, new Event(EVENT_RETRY, socket->id));
+            }
+          socket->held.push_back(event);
+        }
+      else
+        {
+          receive(socket, event);
+        }
+      return;
+    }
+
+  switch (event->type)
+    {
+    case EVENT_CONNECT:
+      {
+        gchar *address = g_strdup_printf("%s:%d", event->data.c_str(), event->port);
+        map<string, LoopbackSocketServer *>::iterator i = servers.find(address);
+        g_free(address);
+
+        if (is_partitioned(socket->hostname, event->data))
+          {
+            schedule(now + LOOPBACK_CONNECT_TIMEOUT, new Event(EVENT_REFUSED, socket->id));
+          }
+        else if (i == servers.end() || i->second->listener == NULL)
+          {
+            schedule(now + latency, new Event(EVENT_REFUSED, socket->id));
+          }
+        else
+          {
+            LoopbackSocketServer *server = i->second;
+            LoopbackSocket *accepted = new LoopbackSocket(this, server->hostname);
+
+            accepted->remote_hostname = socket->hostname;
+            accepted->peer_id = socket->id;
+            socket->peer_id = accepted->id;
+
+            schedule(now + latency, new Event(EVENT_CONNECTED, socket->id));
+            server->listener->socket_accepted(server, accepted);
+          }
+      }
+      break;
+
+    case EVENT_CONNECTED:
+      if (socket->listener != NULL)
+        {
+          socket->listener->socket_connected(socket, socket->user_data);
+        }
+      break;
+
+    case EVENT_REFUSED:
+      if (socket->listener != NULL)
+        {
+          socket->listener->socket_closed(socket, socket->user_data);
+        }
+      break;
+
+    case EVENT_SENT:
+      socket->pending -= event->size;
+      if (socket->watching && socket->listener != NULL)
+        {
+          socket->listener->socket_writable(socket, socket->user_data);
+        }
+      break;
+
+    case EVENT_RETRY:
+      if (is_partitioned(socket->hostname, socket->remote_hostname))
+        {
+          schedule(now + LOOPBACK_RETRANSMIT_TIME, new Event(EVENT_RETRY, socket->id));
+        }
+      else
+        {
+          guint64 id = socket->id;
+          while (socket != NULL && !socket->held.empty())
+            {
+              Event *held = socket->held.front();
+              socket->held.pop_front();
+              receive(socket, held);
+
+              socket = find_socket(id);
+            }
+        }
+      break;
+
+    default:
+      break;
+    }
+
+  delete event;
+}
+
+
+//! Passes received data or EOF to a socket, and deletes the event.
+void
+LoopbackNetwork::receive(LoopbackSocket *socket, Event *event)
+{
+  if (event->type == EVENT_DATA)
+    {
+      socket->input.append(event->data);
+    }
+  else
+    {
+      socket->eof = true;
+      socket->peer_id = 0;
+    }
+
+  delete event;
+  deliver_input(socket->id);
+}
+
+
+//! Lets the listener of a socket read all received data.
+void
+LoopbackNetwork::deliver_input(guint64 socket_id)
+{
+  LoopbackSocket *socket = find_socket(socket_id);
+
+  while (socket != NULL && socket->listener != NULL &&
+         (!socket->input.empty() || socket->eof))
+    {
+      size_t size = socket->input.size();
+
+      socket->listener->socket_io(socket, socket->user_data);
+
+      socket = find_socket(socket_id);
+      if (socket == NULL || socket->input.size() == size)
+        {
+          // Socket deleted, or listener did not read.
+          break;
+        }
+    }
+}
+
+
+//! Returns the time needed to transmit the specified number of bytes.
+gint64
+LoopbackNetwork::get_transmit_time(int size) const
+{
+  return bandwidth > 0 ? ((gint64) size * 1000) / bandwidth : 0;
+}
+
+
+//! Returns the time after which a transmitted segment arrives.
+gint64
+LoopbackNetwork::get_delivery_delay()
+{
+  gint64 delay = latency;
+
+  while (loss > 0.0 && g_rand_double(rand) < loss)
+    {
+      delay += LOOPBACK_RETRANSMIT_TIME;
+    }
+
+  return delay;
+}
+
+
+//! Creates a driver for the specified host.
+LoopbackSocketDriver::LoopbackSocketDriver(LoopbackNetwork *network, const string &hostname) :
+  network(network),
+  hostname(hostname)
+{
+}
+
+
+//! Creates a new socket.
+ISocket *
+LoopbackSocketDriver::create_socket()
+{
+  return new LoopbackSocket(network, hostname);
+}
+
+
+//! Creates a new listen socket.
+ISocketServer *
+LoopbackSocketDriver::create_server()
+{
+  return new LoopbackSocketServer(network, hostname);
+}
+
+
+//! Creates a socket on the specified host.
+LoopbackSocket::LoopbackSocket(LoopbackNetwork *network, const string &hostname) :
+  network(network),
+  hostname(hostname),
+  peer_id(0),
+  eof(false),
+  watching(false),
+  pending(0),
+  busy_until(0),
+  last_delivery(0)
+{
+  user_data = NULL;
+  id = network->add_socket(this);
+}
+
+
+//! Closes and destructs the socket.
+LoopbackSocket::~LoopbackSocket()
+{
+  close();
+  network->remove_socket(id);
+
+  for (list<LoopbackNetwork::Event *>::iterator i = held.begin(); i != held.end(); i++)
+    {
+      delete *i;
+    }
+}
+
+
+//! Connects to the specified host.
+void
+LoopbackSocket::connect(const string &host, int port)
+{
+  TRACE_ENTER_MSG("LoopbackSocket::connect", host << " " << port);
+
+  LoopbackNetwork::Event *event = new LoopbackNetwork::Event(LoopbackNetwork::EVENT_CONNECT, id);
+  event->data = host;
+  event->port = port;
+
+  remote_hostname = host;
+  eof = false;
+
+  network->schedule(network->now + network->latency, event);
+  TRACE_EXIT();
+}
+
+
+//! Reads received data.
+/*!
+ *  Returns 0 bytes if the peer closed the connection.
+ */
+void
+LoopbackSocket::read(void *buf, int count, int &bytes_read)
+{
+  bytes_read = (int) input.size() < count ? (int) input.size() : count;
+  memcpy(buf, input.data(), bytes_read);
+  input.erase(0, bytes_read);
+}
+
+
+//! Writes to the connection.
+/*!
+ *  Accepts as much data as fits in the send buffer.
+ */
+void
+LoopbackSocket::write(void *buf, int count, int &bytes_written)
+{
+  bytes_written = 0;
+
+  if (peer_id == 0)
+    {
+      if (eof)
+        {
+          throw SocketException("socket write error: connection closed");
+        }
+      return;
+    }
+
+  int size = LOOPBACK_SEND_BUFFER_SIZE - pending;
+  if (size > count)
+    {
+      size = count;
+    }
+
+  if (size > 0)
+    {
+      LoopbackNetwork::Event *sent = new LoopbackNetwork::Event(LoopbackNetwork::EVENT_SENT, id);
+      LoopbackNetwork::Event *data = new LoopbackNetwork::Event(LoopbackNetwork::EVENT_DATA, peer_id);
+
+      data->data.assign((const char *)buf, size);
+      sent->size = size;
+      pending += size;
+
+      if (busy_until < network->now)
+        {
+          busy_until = network->now;
+        }
+      busy_until += network->get_transmit_time(size);
+
+      gint64 delivery = busy_until + network->get_delivery_delay();
+      if (delivery < last_delivery)
+        {
+          delivery = last_delivery;
+        }
+      last_delivery = delivery;
+
+      network->schedule(busy_until, sent);
+      network->schedule(delivery, data);
+
+      bytes_written = size;
+    }
+}
+
+
+//! Enables/disables notification that the send buffer has room.
+void
+LoopbackSocket::watch_writable(bool enable)
+{
+  watching = enable;
+}
+
+
+//! Closes the connection.
+/*!
+ *  The peer is notified after all written data has arrived.
+ */
+void
+LoopbackSocket::close()
+{
+  if (peer_id != 0)
+    {
+      gint64 delivery = (busy_until > network->now ? busy_until : network->now) + network->latency;
+      if (delivery < last_delivery)
+        {
+          delivery = last_delivery;
+        }
+
+      network->schedule(delivery, new LoopbackNetwork::Event(LoopbackNetwork::EVENT_EOF, peer_id));
+      peer_id = 0;
+    }
+
+  watching = false;
+}
+
+
+//! Creates a listen socket on the specified host.
+LoopbackSocketServer::LoopbackSocketServer(LoopbackNetwork *network, const string &hostname) :
+  network(network),
+  hostname(hostname)
+{
+}
+
+
+//! Stops listening.
+LoopbackSocketServer::~LoopbackSocketServer()
+{
+  network->remove_server(this);
+}
+
+
+//! Listens at the specified port.
+void
+LoopbackSocketServer::listen(int port)
+{
+  network->add_server(hostname, port, this);
+}
+
+#endif
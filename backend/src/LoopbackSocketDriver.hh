@@ -0,0 +1,260 @@
+// LoopbackSocketDriver.hh --- In-process simulated network
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef LOOPBACKSOCKETDRIVER_HH
+#define LOOPBACKSOCKETDRIVER_HH
+
+#if defined(HAVE_DISTRIBUTION)
+
+#include <string>
+#include <list>
+#include <map>
+#include <set>
+
+#include <glib.h>
+
+#include "SocketDriver.hh"
+#include "TimeSource.hh"
+
+//! Default one-way latency of the simulated network, in milliseconds.
+#define LOOPBACK_DEFAULT_LATENCY (1)
+
+//! Delay added to a segment for each time it is lost, in milliseconds.
+#define LOOPBACK_RETRANSMIT_TIME (200)
+
+//! Time after which a connect across a partition fails, in milliseconds.
+#define LOOPBACK_CONNECT_TIMEOUT (5000)
+
+//! Number of bytes a socket accepts before its data is transmitted.
+#define LOOPBACK_SEND_BUFFER_SIZE (64 * 1024)
+
+//! Wall clock time at which the virtual clock starts.
+#define LOOPBACK_EPOCH (1325376000)
+
+class LoopbackSocket;
+class LoopbackSocketServer;
+
+//! Simulated network that connects the sockets of several drivers in one process.
+/*!
+ *  The network has a virtual clock that only moves forward in advance().
+ *  Data written to a socket is transmitted according to the bandwidth of
+ *  the network, and arrives at the peer after the latency. Lost segments
+ *  are retransmitted, and data between partitioned hosts is held until
+ *  the partition is removed, so each connection remains a reliable,
+ *  ordered byte stream, as with TCP. Losses are drawn from a seeded
+ *  random generator, so a simulation is deterministic.
+ */
+class LoopbackNetwork :
+  public TimeSource
+{
+public:
+  LoopbackNetwork(guint32 seed = 0);
+  virtual ~LoopbackNetwork();
+
+  SocketDriver *create_driver(const std::string &hostname);
+
+  void set_latency(int ms);
+  void set_bandwidth(int bytes_per_second);
+  void set_loss(double probability);
+  void set_partitioned(const std::string &host1, const std::string &host2, bool partitioned);
+  bool is_partitioned(const std::string &host1, const std::string &host2) const;
+
+  void advance(int ms);
+  gint64 get_time_ms() const;
+
+  // TimeSource interface
+  virtual time_t get_time() const;
+
+private:
+  friend class LoopbackSocket;
+  friend class LoopbackSocketServer;
+
+  enum EventType
+    {
+      EVENT_CONNECT,
+      EVENT_CONNECTED,
+      EVENT_REFUSED,
+      EVENT_DATA,
+      EVENT_SENT,
+      EVENT_EOF,
+      EVENT_RETRY,
+    };
+
+  //! Something that happens at a specific virtual time.
+  struct Event
+  {
+    Event(EventType type, guint64 socket_id) :
+      type(type),
+      socket_id(socket_id),
+      size(0),
+      port(0)
+    {
+    }
+
+    EventType type;
+    guint64 socket_id;
+    std::string data;
+    int size;
+    int port;
+  };
+
+  //! Events by time and order of scheduling.
+  typedef std::map<std::pair<gint64, guint64>, Event *> EventQueue;
+
+  guint64 add_socket(LoopbackSocket *socket);
+  void remove_socket(guint64 id);
+  LoopbackSocket *find_socket(guint64 id) const;
+  void add_server(const std::string &hostname, int port, LoopbackSocketServer *server);
+  void remove_server(LoopbackSocketServer *server);
+
+  void schedule(gint64 time, Event *event);
+  void process(Event *event);
+  void receive(LoopbackSocket *socket, Event *event);
+  void deliver_input(guint64 socket_id);
+  gint64 get_transmit_time(int size) const;
+  gint64 get_delivery_delay();
+
+private:
+  //! Current virtual time in milliseconds.
+  gint64 now;
+
+  //! Pending events.
+  EventQueue events;
+
+  //! Number of scheduled events, used to keep events in order.
+  guint64 event_count;
+
+  //! Sockets by ID.
+  std::map<guint64, LoopbackSocket *> sockets;
+
+  //! Last assigned socket ID.
+  guint64 last_socket_id;
+
+  //! Listen sockets by "host:port".
+  std::map<std::string, LoopbackSocketServer *> servers;
+
+  //! Pairs of hosts that cannot reach each other.
+  std::set<std::pair<std::string, std::string> > partitions;
+
+  //! One-way latency in milliseconds.
+  int latency;
+
+  //! Bandwidth of each direction of a connection in bytes per second, or 0 if unlimited.
+  int bandwidth;
+
+  //! Probability that a segment is lost.
+  double loss;
+
+  //! Random generator for losses.
+  GRand *rand;
+};
+
+
+//! Socket driver of a single host in a LoopbackNetwork.
+class LoopbackSocketDriver
+  : public SocketDriver
+{
+public:
+  LoopbackSocketDriver(LoopbackNetwork *network, const std::string &hostname);
+
+  // SocketDriver interface
+  virtual ISocket *create_socket();
+  virtual ISocketServer *create_server();
+
+private:
+  LoopbackNetwork *network;
+  std::string hostname;
+};
+
+
+//! Socket in a LoopbackNetwork.
+class LoopbackSocket
+  : public ISocket
+{
+public:
+  LoopbackSocket(LoopbackNetwork *network, const std::string &hostname);
+  virtual ~LoopbackSocket();
+
+  // ISocket interface
+  virtual void connect(const std::string &hostname, int port);
+  virtual void read(void *buf, int count, int &bytes_read);
+  virtual void write(void *buf, int count, int &bytes_written);
+  virtual void watch_writable(bool enable);
+  virtual void close();
+
+private:
+  friend class LoopbackNetwork;
+
+  LoopbackNetwork *network;
+
+  //! ID in the network.
+  guint64 id;
+
+  //! Host of this socket.
+  std::string hostname;
+
+  //! Host of the peer.
+  std::string remote_hostname;
+
+  //! ID of the connected peer, or 0.
+  guint64 peer_id;
+
+  //! Received data that is not yet read.
+  std::string input;
+
+  //! Whether the peer closed the connection.
+  bool eof;
+
+  //! Whether the listener wants to know that the socket is writable.
+  bool watching;
+
+  //! Number of bytes in the send buffer.
+  int pending;
+
+  //! Time at which the data in the send buffer is transmitted.
+  gint64 busy_until;
+
+  //! Time at which the last written data arrives at the peer.
+  gint64 last_delivery;
+
+  //! Received data and EOF held while the peer is unreachable, in order.
+  std::list<LoopbackNetwork::Event *> held;
+};
+
+
+//! Listen socket in a LoopbackNetwork.
+class LoopbackSocketServer
+  : public ISocketServer
+{
+public:
+  LoopbackSocketServer(LoopbackNetwork *network, const std::string &hostname);
+  virtual ~LoopbackSocketServer();
+
+  // ISocketServer interface
+  virtual void listen(int port);
+
+private:
+  friend class LoopbackNetwork;
+
+  LoopbackNetwork *network;
+  std::string hostname;
+};
+
+#endif
+#endif // LOOPBACKSOCKETDRIVER_HH
@@ -0,0 +1,108 @@
+// MouseMovement.cc --- Measures the distance and time of mouse movement
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "MouseMovement.hh"
+
+
+MouseMovement::MouseMovement() :
+  prev_x(-1),
+  prev_y(-1),
+  move_time(0)
+{
+}
+
+
+//! Adds a mouse sample at the specified monotonic time.
+/*!
+ *  A sample counts as movement if it moved at least MOUSE_SENSITIVITY
+ *  pixels or moved the wheel, and did not jump MOUSE_MAX_JUMP pixels or
+ *  more. The first sample counts as a movement of MOUSE_SENSITIVITY
+ *  pixels.
+ *
+ *  \param distance distance moved in pixels.
+ *  \param movement_time time since the previous movement in microseconds,
+ *                       or 0 if that was a second or more ago.
+ *  \return whether the sample counts as movement.
+ */
+bool
+MouseMovement::add_sample(int x, int y, int wheel, gint64 now, int &distance, gint64 &movement_time)
+{
+  distance = 0;
+  movement_time = 0;
+
+  if (x < 0 || y < 0)
+    {
+      return false;
+    }
+
+  int delta_x = MOUSE_SENSITIVITY;
+  int delta_y = MOUSE_SENSITIVITY;
+
+  if (prev_x != -1 && prev_y != -1)
+    {
+      delta_x = abs(x - prev_x);
+      delta_y = abs(y - prev_y);
+    }
+
+  prev_x = x;
+  prev_y = y;
+
+  // Sanity checks, ignore unreasonable large jumps...
+  if (delta_x >= MOUSE_MAX_JUMP || delta_y >= MOUSE_MAX_JUMP ||
+      (delta_x < MOUSE_SENSITIVITY && delta_y < MOUSE_SENSITIVITY && wheel == 0))
+    {
+      return false;
+    }
+
+  distance = get_distance(delta_x, delta_y);
+
+  gint64 gap = now - move_time;
+  if (move_time != 0 && gap >= 0 && gap < G_USEC_PER_SEC)
+    {
+      movement_time = gap;
+    }
+  move_time = now;
+
+  return true;
+}
+
+
+//! Sets the position and time of movement that was measured elsewhere.
+void
+MouseMovement::set_position(int x, int y, gint64 now)
+{
+  prev_x = x;
+  prev_y = y;
+  move_time = now;
+}
+
+
+//! Returns the distance in pixels of a movement.
+int
+MouseMovement::get_distance(int delta_x, int delta_y)
+{
+  return int(sqrt((double)(delta_x * delta_x + delta_y * delta_y)));
+}
@@ -0,0 +1,74 @@
+// MouseMovement.hh --- Measures the distance and time of mouse movement
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef MOUSEMOVEMENT_HH
+#define MOUSEMOVEMENT_HH
+
+#include <glib.h>
+
+//! Minimum movement in pixels per sample.
+#define MOUSE_SENSITIVITY (3)
+
+//! Larger jumps in position are not counted as movement.
+#define MOUSE_MAX_JUMP (10000)
+
+//! Measures the distance and time of mouse movement, sample by sample.
+/*!
+ *  Used by both the statistics and the input monitors that combine
+ *  samples, so that combining samples does not change the totals.
+ */
+class MouseMovement
+{
+public:
+  MouseMovement();
+
+  bool add_sample(int x, int y, int wheel, gint64 now, int &distance, gint64 &movement_time);
+  void set_position(int x, int y, gint64 now);
+
+  int get_x() const;
+  int get_y() const;
+
+  static int get_distance(int delta_x, int delta_y);
+
+private:
+  //! Position of the last sample, or -1.
+  int prev_x;
+  int prev_y;
+
+  //! Monotonic time of the last movement in microseconds, or 0.
+  gint64 move_time;
+};
+
+
+//! Returns the horizontal position of the last sample, or -1.
+inline int
+MouseMovement::get_x() const
+{
+  return prev_x;
+}
+
+
+//! Returns the vertical position of the last sample, or -1.
+inline int
+MouseMovement::get_y() const
+{
+  return prev_y;
+}
+
+#endif // MOUSEMOVEMENT_HH
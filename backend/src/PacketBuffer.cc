@@ -28,6 +28,7 @@
 #include <assert.h>
 
 #include "PacketBuffer.hh"
+#include "PacketBufferPool.hh"
 
 PacketBuffer::PacketBuffer() :
   buffer(NULL),
@@ -35,7 +36,10 @@ PacketBuffer::PacketBuffer() :
   write_ptr(NULL),
   buffer_size(0),
   original_buffer(NULL),
-  original_buffer_size(0)
+  original_buffer_size(0),
+  storage(NULL),
+  storage_size(0),
+  head(NULL)
 {
 }
 
@@ -43,30 +47,51 @@ PacketBuffer::PacketBuffer() :
 PacketBuffer::~PacketBuffer()
 {
   narrow(0, -1);
-  if (buffer != NULL)
-    {
-      g_free(buffer);
-    }
+  PacketBufferPool::release(storage, storage_size);
 }
 
 void
 PacketBuffer::create(int size)
 {
   narrow(0, -1);
-
-  if (buffer != NULL)
-    {
-      g_free(buffer);
-    }
+  PacketBufferPool::release(storage, storage_size);
 
   if (size == 0)
     {
       size = 1024;
     }
 
-  buffer = g_new(guint8, size);
+  storage_size = size + PACKET_HEADROOM;
+  storage = PacketBufferPool::allocate(storage_size);
+
+  buffer = storage + PACKET_HEADROOM;
+  head = storage;
   read_ptr = buffer;
   write_ptr = buffer;
+  buffer_size = storage_size - PACKET_HEADROOM;
+}
+
+
+//! Uses the specified data without copying it.
+/*!
+ *  The data must remain valid during the lifetime of this buffer, or until
+ *  it is resized. Resizing the buffer makes a private copy of the data.
+ *
+ *  \param headroom number of bytes before the data that may be overwritten
+ *                  when data is inserted near the start of the packet.
+ */
+void
+PacketBuffer::attach(guint8 *data, int size, int headroom)
+{
+  narrow(0, -1);
+  PacketBufferPool::release(storage, storage_size);
+  storage = NULL;
+  storage_size = 0;
+
+  head = headroom > 0 ? data - headroom : NULL;
+  buffer = data;
+  read_ptr = buffer;
+  write_ptr = buffer + size;
   buffer_size = size;
 }
 
@@ -99,13 +124,23 @@ PacketBuffer::resize(int size)
 
       //TRACE_MSG(read_offset << " " << write_offset);
 
-      buffer = g_renew(guint8, buffer, size);
+      int new_storage_size = size + PACKET_HEADROOM;
+      guint8 *new_storage = PacketBufferPool::allocate(new_storage_size);
+      guint8 *new_buffer = new_storage + PACKET_HEADROOM;
+
+      memcpy(new_buffer, buffer, size < buffer_size ? size : buffer_size);
+      PacketBufferPool::release(storage, storage_size);
+
+      storage = new_storage;
+      storage_size = new_storage_size;
+      head = new_storage;
+      buffer = new_buffer;
 
       //TRACE_MSG(buffer);
 
       read_ptr = buffer + read_offset;
       write_ptr = buffer + write_offset;
-      buffer_size = size;
+      buffer_size = storage_size - PACKET_HEADROOM;
     }
   //TRACE_EXIT();
 }
@@ -252,6 +287,43 @@ PacketBuffer::pack_byte(guint8 data)
 }
 
 
+//! Packs an unsigned integer as LEB128: 7 bits per byte, least significant first.
+void
+PacketBuffer::pack_varint(guint32 data)
+{
+  if (write_ptr + 5 >= buffer + buffer_size)
+    {
+      grow(5);
+    }
+
+  while (data >= 0x80)
+    {
+      write_ptr[0] = (data & 0x7f) | 0x80;
+      write_ptr ++;
+      data >>= 7;
+    }
+
+  write_ptr[0] = data;
+  write_ptr ++;
+}
+
+
+//! Packs a type-length-value field containing a varint.
+void
+PacketBuffer::pack_tlv_varint(guint32 tag, guint32 data)
+{
+  int size = 1;
+  for (guint32 d = data; d >= 0x80; d >>= 7)
+    {
+      size++;
+    }
+
+  pack_varint(tag);
+  pack_varint(size);
+  pack_varint(data);
+}
+
+
 void
 PacketBuffer::poke_byte(int pos, guint8 data)
 {
@@ -399,6 +471,51 @@ PacketBuffer::unpack_byte()
 }
 
 
+//! Unpacks an LEB128 encoded unsigned integer.
+guint32
+PacketBuffer::unpack_varint()
+{
+  guint32 ret = 0;
+  int shift = 0;
+
+  while (read_ptr < write_ptr && shift < 35)
+    {
+      guint8 b = read_ptr[0];
+      read_ptr ++;
+
+      ret |= (guint32)(b & 0x7f) << shift;
+      shift += 7;
+
+      if ((b & 0x80) == 0)
+        {
+          break;
+        }
+    }
+
+  return ret;
+}
+
+
+//! Unpacks the tag and length of a type-length-value field.
+/*!
+ *  Returns the size of the value, which starts at the read pointer, or -1
+ *  if the field is truncated.
+ */
+int
+PacketBuffer::unpack_tlv(guint32 &tag)
+{
+  tag = unpack_varint();
+  guint32 size = unpack_varint();
+
+  if (size > (guint32) bytes_available())
+    {
+      return -1;
+    }
+
+  return size;
+}
+
+
 int
 PacketBuffer::peek(int pos, guint8 **data)
 {
@@ -517,6 +634,12 @@ PacketBuffer::skip_size(int &pos)
 }
 
 
+//! Inserts space at the specified position.
+/*!
+ *  If the space is inserted near the start of the packet, e.g. routing
+ *  information after the header, the data before the position is moved
+ *  into the headroom of the buffer instead of moving the remaining data.
+ */
 void
 PacketBuffer::insert(int pos, int size)
 {
@@ -524,9 +647,45 @@ PacketBuffer::insert(int pos, int size)
     {
       int move = bytes_written() - pos;
 
-      memmove(buffer + pos + size, buffer + pos, move);
+      if (head != NULL && original_buffer == NULL &&
+          buffer - head >= size && pos <= move)
+        {
+          int read_offset = read_ptr - buffer;
+          int write_offset = write_ptr - buffer;
 
-      write_ptr += size;
+          memmove(buffer - size, buffer, pos);
+
+          buffer -= size;
+          buffer_size += size;
+          read_ptr = buffer + read_offset;
+          write_ptr = buffer + write_offset + size;
+        }
+      else
+        {
+          if (write_ptr + size > buffer + buffer_size)
+            {
+              grow(size);
+            }
+
+          memmove(buffer + pos + size, buffer + pos, move);
+
+          write_ptr += size;
+        }
+    }
+}
+
+
+//! Removes the data that has been read, and moves the unread data to the front.
+void
+PacketBuffer::compact()
+{
+  int size = bytes_available();
+
+  if (read_ptr != buffer)
+    {
+      memmove(buffer, read_ptr, size);
+      read_ptr = buffer;
+      write_ptr = buffer + size;
     }
 }
 
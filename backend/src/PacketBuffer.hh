@@ -26,6 +26,9 @@
 
 #define GROW_SIZE (4096)
 
+//! Space reserved before the packet for inserting routing information.
+#define PACKET_HEADROOM (64)
+
 class PacketBuffer
 {
 public:
@@ -34,6 +37,7 @@ public:
   ~PacketBuffer();
 
   void create(int size = 0);
+  void attach(guint8 *data, int size, int headroom = 0);
   void resize(int size);
   void grow(int size);
   void narrow(int pos, int size);
@@ -41,6 +45,7 @@ public:
   void clear() { narrow(0, -1); write_ptr = read_ptr = buffer; }
   void skip(int size) { read_ptr += size; }
   void insert(int pos, int size);
+  void compact();
 
   void pack(const guint8 *data, int size);
   void pack_raw(const guint8 *data, int size);
@@ -50,6 +55,8 @@ public:
   void pack_ushort(guint16 data);
   void pack_ulong(guint32 data);
   void pack_byte(guint8 data);
+  void pack_varint(guint32 data);
+  void pack_tlv_varint(guint32 tag, guint32 data);
 
   void poke_byte(int pos, guint8 data);
   void poke_ushort(int pos, guint16 data);
@@ -61,6 +68,8 @@ public:
   guint32 unpack_ulong();
   guint16 unpack_ushort();
   guint8 unpack_byte();
+  guint32 unpack_varint();
+  int unpack_tlv(guint32 &tag);
 
   int peek(int pos, guint8 **data);
   gchar *peek_string(int pos);
@@ -89,6 +98,13 @@ public:
 
   guint8 *original_buffer;
   int original_buffer_size;
+
+  //! Memory allocated from the pool, or NULL if the data is owned by someone else.
+  guint8 *storage;
+  int storage_size;
+
+  //! Start of the writable space before the buffer, or NULL if there is none.
+  guint8 *head;
 };
 
 
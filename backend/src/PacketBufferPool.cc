@@ -0,0 +1,139 @@
+// PacketBufferPool.cc --- Pool of packet buffer memory
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "PacketBufferPool.hh"
+#include "Mutex.hh"
+
+PacketBufferPool::FreeBlock *PacketBufferPool::free_blocks[POOL_SIZE_CLASSES];
+
+//! Protects the free lists.
+static Mutex pool_mutex;
+
+
+//! Returns the size of the blocks in a size class.
+static inline int
+get_block_size(int size_class)
+{
+  return POOL_MIN_BLOCK_SIZE << size_class;
+}
+
+
+//! Allocates a block of at least the specified size.
+/*!
+ *  \param size requested size; updated with the actual size of the block.
+ */
+guint8 *
+PacketBufferPool::allocate(int &size)
+{
+  int size_class = get_size_class(size);
+
+  if (size_class == -1)
+    {
+      return g_new(guint8, size);
+    }
+
+  pool_mutex.lock();
+
+  if (free_blocks[size_class] == NULL)
+    {
+      add_arena(size_class);
+    }
+
+  FreeBlock *block = free_blocks[size_class];
+  free_blocks[size_class] = block->next;
+
+  pool_mutex.unlock();
+
+  size = get_block_size(size_class);
+  return (guint8 *)block;
+}
+
+
+//! Returns a block to the pool.
+/*!
+ *  \param data block returned by allocate.
+ *  \param size size of the block as returned by allocate.
+ */
+void
+PacketBufferPool::release(guint8 *data, int size)
+{
+  if (data == NULL)
+    {
+      return;
+    }
+
+  int size_class = get_size_class(size);
+
+  if (size_class == -1 || get_block_size(size_class) != size)
+    {
+      g_free(data);
+      return;
+    }
+
+  pool_mutex.lock();
+
+  FreeBlock *block = (FreeBlock *)data;
+  block->next = free_blocks[size_class];
+  free_blocks[size_class] = block;
+
+  pool_mutex.unlock();
+}
+
+
+//! Returns the smallest size class that fits the size, or -1 if none does.
+int
+PacketBufferPool::get_size_class(int size)
+{
+  for (int i = 0; i < POOL_SIZE_CLASSES; i++)
+    {
+      if (size <= get_block_size(i))
+        {
+          return i;
+        }
+    }
+
+  return -1;
+}
+
+
+//! Allocates a new arena, and adds its blocks to a free list.
+void
+PacketBufferPool::add_arena(int size_class)
+{
+  int block_size = get_block_size(size_class);
+  int count = POOL_ARENA_SIZE / block_size;
+
+  if (count < 1)
+    {
+      count = 1;
+    }
+
+  guint8 *arena = g_new(guint8, block_size * count);
+
+  for (int i = count - 1; i >= 0; i--)
+    {
+      FreeBlock *block = (FreeBlock *)(arena + i * block_size);
+      block->next = free_blocks[size_class];
+      free_blocks[size_class] = block;
+    }
+}
@@ -0,0 +1,61 @@
+// PacketBufferPool.hh --- Pool of packet buffer memory
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef PACKETBUFFERPOOL_HH
+#define PACKETBUFFERPOOL_HH
+
+#include "glib.h"
+
+//! Number of size classes.
+#define POOL_SIZE_CLASSES (9)
+
+//! Size of the smallest size class.
+#define POOL_MIN_BLOCK_SIZE (256)
+
+//! Number of bytes allocated at once for a size class.
+#define POOL_ARENA_SIZE (64 * 1024)
+
+//! Thread-safe pool of memory blocks for packet buffers.
+/*!
+ *  Blocks are grouped in power of two size classes from 256 bytes to 64K.
+ *  Blocks of a size class are carved from arenas and are never returned
+ *  to the system, so a steady-state workload does not allocate memory.
+ *  Larger blocks are allocated directly.
+ */
+class PacketBufferPool
+{
+public:
+  static guint8 *allocate(int &size);
+  static void release(guint8 *data, int size);
+
+private:
+  static int get_size_class(int size);
+  static void add_arena(int size_class);
+
+  //! A free block.
+  struct FreeBlock
+  {
+    FreeBlock *next;
+  };
+
+  //! Free blocks of each size class.
+  static FreeBlock *free_blocks[POOL_SIZE_CLASSES];
+};
+
+#endif // PACKETBUFFERPOOL_HH
@@ -0,0 +1,198 @@
+// PacketCapture.cc --- Capture file of distribution traffic
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_DISTRIBUTION)
+
+#include "debug.hh"
+
+#include "PacketCapture.hh"
+
+using namespace std;
+
+
+//! Constructs a capture that is not associated with a file.
+PacketCapture::PacketCapture() :
+  file(NULL)
+{
+}
+
+
+//! Closes the capture file.
+PacketCapture::~PacketCapture()
+{
+  close();
+}
+
+
+//! Creates a capture file for writing.
+bool
+PacketCapture::create(const string &filename)
+{
+  TRACE_ENTER_MSG("PacketCapture::create", filename);
+  close();
+
+  file = fopen(filename.c_str(), "wb");
+  if (file != NULL)
+    {
+      header.create(PACKET_CAPTURE_FRAME_HEADER_SIZE);
+      header.pack_ulong(PACKET_CAPTURE_MAGIC);
+      header.pack_ushort(PACKET_CAPTURE_VERSION);
+      header.pack_ushort(0);
+
+      if (fwrite(header.get_buffer(), header.bytes_written(), 1, file) != 1)
+        {
+          close();
+        }
+    }
+
+  TRACE_RETURN(file != NULL);
+  return file != NULL;
+}
+
+
+//! Opens a capture file for reading.
+bool
+PacketCapture::open(const string &filename)
+{
+  TRACE_ENTER_MSG("PacketCapture::open", filename);
+  close();
+
+  file = fopen(filename.c_str(), "rb");
+  if (file != NULL)
+    {
+      guint8 data[PACKET_CAPTURE_HEADER_SIZE];
+      PacketBuffer buffer;
+
+      bool ok = fread(data, sizeof(data), 1, file) == 1;
+      if (ok)
+        {
+          buffer.attach(data, sizeof(data));
+          ok = (buffer.unpack_ulong() == PACKET_CAPTURE_MAGIC &&
+                buffer.unpack_ushort() == PACKET_CAPTURE_VERSION);
+        }
+
+      if (!ok)
+        {
+          TRACE_MSG("Not a capture file");
+          close();
+        }
+    }
+
+  TRACE_RETURN(file != NULL);
+  return file != NULL;
+}
+
+
+//! Closes the capture file.
+void
+PacketCapture::close()
+{
+  if (file != NULL)
+    {
+      fclose(file);
+      file = NULL;
+    }
+}
+
+
+//! Writes the buffered frames to the capture file.
+void
+PacketCapture::flush()
+{
+  if (file != NULL)
+    {
+      fflush(file);
+    }
+}
+
+
+//! Appends a frame to the capture file.
+void
+PacketCapture::write_frame(Direction direction, guint32 client, const guint8 *data, int size)
+{
+  if (file == NULL)
+    {
+      return;
+    }
+
+  GTimeVal now;
+  g_get_current_time(&now);
+  gint64 time = (gint64) now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+
+  header.clear();
+  header.pack_ulong((guint32)(time >> 32));
+  header.pack_ulong((guint32)time);
+  header.pack_byte(direction);
+  header.pack_ulong(client);
+  header.pack_ulong(size);
+
+  if (fwrite(header.get_buffer(), header.bytes_written(), 1, file) != 1 ||
+      fwrite(data, size, 1, file) != 1)
+    {
+      // Stop capturing rather than writing a corrupt file.
+      TRACE_ENTER("PacketCapture::write_frame");
+      TRACE_MSG("Failed to write frame");
+      close();
+      TRACE_EXIT();
+    }
+}
+
+
+//! Reads the next frame from the capture file.
+/*!
+ *  Returns false at the end of the file or if the file is corrupt.
+ */
+bool
+PacketCapture::read_frame(Frame &frame)
+{
+  if (file == NULL)
+    {
+      return false;
+    }
+
+  guint8 data[PACKET_CAPTURE_FRAME_HEADER_SIZE];
+  if (fread(data, sizeof(data), 1, file) != 1)
+    {
+      return false;
+    }
+
+  PacketBuffer buffer;
+  buffer.attach(data, sizeof(data));
+
+  guint32 time_high = buffer.unpack_ulong();
+  guint32 time_low = buffer.unpack_ulong();
+  frame.time = ((gint64)time_high << 32) | time_low;
+  frame.direction = buffer.unpack_byte() == DIRECTION_OUT ? DIRECTION_OUT : DIRECTION_IN;
+  frame.client = buffer.unpack_ulong();
+
+  guint32 size = buffer.unpack_ulong();
+  if (size > PACKET_CAPTURE_MAX_FRAME_SIZE)
+    {
+      return false;
+    }
+
+  frame.data.resize(size);
+  return size == 0 || fread(&frame.data[0], size, 1, file) == 1;
+}
+
+#endif
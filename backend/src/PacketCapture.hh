@@ -0,0 +1,111 @@
+// PacketCapture.hh --- Capture file of distribution traffic
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef PACKETCAPTURE_HH
+#define PACKETCAPTURE_HH
+
+#if defined(HAVE_DISTRIBUTION)
+
+#include <stdio.h>
+#include <string>
+
+#include <glib.h>
+
+#include "PacketBuffer.hh"
+
+//! First four bytes of a capture file.
+#define PACKET_CAPTURE_MAGIC (0x57524350)
+
+//! Format of a capture file.
+#define PACKET_CAPTURE_VERSION (1)
+
+//! Size of the header of a capture file.
+#define PACKET_CAPTURE_HEADER_SIZE (8)
+
+//! Size of the header of a frame in a capture file.
+#define PACKET_CAPTURE_FRAME_HEADER_SIZE (17)
+
+//! Maximum size of a frame in a capture file.
+#define PACKET_CAPTURE_MAX_FRAME_SIZE (16 * 1024 * 1024 + 6)
+
+//! Binary file with timestamped frames sent and received by the distribution link.
+/*!
+ *  The file starts with a header of PACKET_CAPTURE_HEADER_SIZE bytes:
+ *  the magic number (32 bits) and the format version (16 bits),
+ *  followed by 16 reserved bits.
+ *
+ *  Each frame is stored as the wall clock time in microseconds (64
+ *  bits), the direction (8 bits), the handle of the client (32 bits)
+ *  and the size (32 bits), followed by the frame exactly as it was sent
+ *  or received on the connection. All numbers are big-endian.
+ */
+class PacketCapture
+{
+public:
+  //! Direction of a frame.
+  enum Direction
+    {
+      DIRECTION_IN      = 0,
+      DIRECTION_OUT     = 1,
+    };
+
+  //! A frame read from a capture file.
+  struct Frame
+  {
+    Frame() :
+      time(0),
+      direction(DIRECTION_IN),
+      client(0)
+    {
+    }
+
+    //! Wall clock time in microseconds.
+    gint64 time;
+
+    //! Whether the frame was received or sent.
+    Direction direction;
+
+    //! Handle of the client that sent or received the frame.
+    guint32 client;
+
+    //! The frame.
+    std::string data;
+  };
+
+  PacketCapture();
+  ~PacketCapture();
+
+  bool create(const std::string &filename);
+  bool open(const std::string &filename);
+  void close();
+  void flush();
+
+  void write_frame(Direction direction, guint32 client, const guint8 *data, int size);
+  bool read_frame(Frame &frame);
+
+private:
+  //! The capture file.
+  FILE *file;
+
+  //! Buffer in which the header of a frame is written.
+  PacketBuffer header;
+};
+
+#endif
+#endif // PACKETCAPTURE_HH
@@ -0,0 +1,193 @@
+// PacketQueue.cc --- Queue of outgoing packets
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "debug.hh"
+
+#include <string.h>
+
+#include "PacketQueue.hh"
+#include "PacketBuffer.hh"
+#include "PacketBufferPool.hh"
+#include "SocketDriver.hh"
+
+
+//! Creates a shared copy of the written part of the specified packet.
+SharedPacket::SharedPacket(PacketBuffer &packet) :
+  data(NULL),
+  size(packet.bytes_written()),
+  capacity(size > 0 ? size : 1),
+  ref_count(1)
+{
+  data = PacketBufferPool::allocate(capacity);
+  memcpy(data, packet.get_buffer(), size);
+}
+
+
+//! Creates a shared packet from a header followed by a body.
+SharedPacket::SharedPacket(const guint8 *header, int header_size, const guint8 *body, int body_size) :
+  data(NULL),
+  size(header_size + body_size),
+  capacity(size > 0 ? size : 1),
+  ref_count(1)
+{
+  data = PacketBufferPool::allocate(capacity);
+  memcpy(data, header, header_size);
+  memcpy(data + header_size, body, body_size);
+}
+
+
+//! Destructs the shared packet.
+SharedPacket::~SharedPacket()
+{
+  PacketBufferPool::release(data, capacity);
+}
+
+
+//! Adds a reference.
+void
+SharedPacket::ref()
+{
+  g_atomic_int_inc(&ref_count);
+}
+
+
+//! Removes a reference, and destroys the packet if it was the last one.
+void
+SharedPacket::unref()
+{
+  if (g_atomic_int_dec_and_test(&ref_count))
+    {
+      delete this;
+    }
+}
+
+
+//! Creates an empty queue.
+PacketQueue::PacketQueue() :
+  offset(0),
+  size(0),
+  peak_size(0),
+  packets_sent(0),
+  packets_dropped(0),
+  bytes_sent(0)
+{
+}
+
+
+//! Destructs the queue.
+PacketQueue::~PacketQueue()
+{
+  clear();
+}
+
+
+//! Appends a packet to the queue.
+void
+PacketQueue::push(SharedPacket *packet)
+{
+  packet->ref();
+  packets.push_back(packet);
+
+  size += packet->get_size();
+  if (size > peak_size)
+    {
+      peak_size = size;
+    }
+}
+
+
+//! Removes all packets from the queue.
+void
+PacketQueue::clear()
+{
+  for (std::deque<SharedPacket *>::iterator i = packets.begin(); i != packets.end(); i++)
+    {
+      (*i)->unref();
+    }
+
+  packets.clear();
+  offset = 0;
+  size = 0;
+}
+
+
+//! Fills the vectors with the data that is waiting to be written.
+/*!
+ *  \return the number of vectors used.
+ */
+int
+PacketQueue::get_vectors(SocketVector *vectors, int max_count) const
+{
+  int count = 0;
+  int skip = offset;
+
+  for (std::deque<SharedPacket *>::const_iterator i = packets.begin();
+       i != packets.end() && count < max_count;
+       i++)
+    {
+      vectors[count].buffer = (*i)->get_data() + skip;
+      vectors[count].size = (*i)->get_size() - skip;
+      count++;
+      skip = 0;
+    }
+
+  return count;
+}
+
+
+//! Removes the specified number of written bytes from the queue.
+void
+PacketQueue::consume(int bytes)
+{
+  bytes_sent += bytes;
+  size -= bytes;
+
+  while (bytes > 0 && !packets.empty())
+    {
+      SharedPacket *packet = packets.front();
+      int remaining = packet->get_size() - offset;
+
+      if (bytes >= remaining)
+        {
+          bytes -= remaining;
+          offset = 0;
+
+          packets.pop_front();
+          packet->unref();
+          packets_sent++;
+        }
+      else
+        {
+          offset += bytes;
+          bytes = 0;
+        }
+    }
+}
+
+
+//! Records that a packet was not queued.
+void
+PacketQueue::drop()
+{
+  packets_dropped++;
+}
@@ -0,0 +1,109 @@
+// PacketQueue.hh --- Queue of outgoing packets
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef PACKETQUEUE_HH
+#define PACKETQUEUE_HH
+
+#include <deque>
+
+#include "glib.h"
+
+class PacketBuffer;
+struct SocketVector;
+
+//! Immutable, reference counted copy of a packet.
+/*!
+ *  A single SharedPacket can be queued to several clients.
+ */
+class SharedPacket
+{
+public:
+  SharedPacket(PacketBuffer &packet);
+  SharedPacket(const guint8 *header, int header_size, const guint8 *body, int body_size);
+
+  void ref();
+  void unref();
+
+  const guint8 *get_data() const { return data; }
+  int get_size() const { return size; }
+
+private:
+  ~SharedPacket();
+
+  //! Packet data.
+  guint8 *data;
+
+  //! Size of the packet data.
+  int size;
+
+  //! Size of the memory block allocated for the data.
+  int capacity;
+
+  //! Reference count.
+  volatile gint ref_count;
+};
+
+
+//! Queue of packets waiting to be written to a single connection.
+class PacketQueue
+{
+public:
+  PacketQueue();
+  ~PacketQueue();
+
+  void push(SharedPacket *packet);
+  void clear();
+
+  int get_vectors(SocketVector *vectors, int max_count) const;
+  void consume(int bytes);
+  void drop();
+
+  bool is_empty() const { return packets.empty(); }
+  int get_size() const { return size; }
+  int get_count() const { return packets.size(); }
+
+  int get_peak_size() const { return peak_size; }
+  guint32 get_packets_sent() const { return packets_sent; }
+  guint32 get_packets_dropped() const { return packets_dropped; }
+  guint64 get_bytes_sent() const { return bytes_sent; }
+
+private:
+  //! Queued packets.
+  std::deque<SharedPacket *> packets;
+
+  //! Number of bytes of the first packet that are already written.
+  int offset;
+
+  //! Total number of bytes waiting to be written.
+  int size;
+
+  //! Maximum number of bytes that were waiting to be written.
+  int peak_size;
+
+  //! Number of packets written completely.
+  guint32 packets_sent;
+
+  //! Number of packets that were dropped.
+  guint32 packets_dropped;
+
+  //! Number of bytes written.
+  guint64 bytes_sent;
+};
+
+#endif // PACKETQUEUE_HH
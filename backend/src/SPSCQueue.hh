@@ -0,0 +1,107 @@
+// SPSCQueue.hh --- Lock-free single-producer single-consumer queue
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SPSCQUEUE_HH
+#define SPSCQUEUE_HH
+
+#include <glib.h>
+
+//! Unbounded lock-free queue between one producer and one consumer thread.
+/*!
+ *  The queue is a linked list that always contains a dummy node at the
+ *  head. The producer only touches the tail, and the consumer only touches
+ *  the head. A node is published by atomically setting the next pointer of
+ *  the tail.
+ */
+template<class T>
+class SPSCQueue
+{
+public:
+  SPSCQueue()
+  {
+    head = tail = new Node;
+  }
+
+  ~SPSCQueue()
+  {
+    while (head != NULL)
+      {
+        Node *next = head->next;
+        delete head;
+        head = next;
+      }
+  }
+
+  //! Adds a value at the tail of the queue. Called by the producer only.
+  void push(const T &value)
+  {
+    Node *node = new Node;
+    node->value = value;
+
+    g_atomic_pointer_set(&tail->next, node);
+    tail = node;
+  }
+
+  //! Removes the value at the head of the queue. Called by the consumer only.
+  bool pop(T &value)
+  {
+    Node *next = (Node *) g_atomic_pointer_get(&head->next);
+    if (next == NULL)
+      {
+        return false;
+      }
+
+    value = next->value;
+    next->value = T();
+
+    delete head;
+    head = next;
+    return true;
+  }
+
+  //! Returns whether the queue is empty. Called by the consumer only.
+  bool is_empty() const
+  {
+    return g_atomic_pointer_get(&head->next) == NULL;
+  }
+
+private:
+  struct Node
+  {
+    Node() :
+      value(),
+      next(NULL)
+    {
+    }
+
+    T value;
+    Node * volatile next;
+  };
+
+  //! Dummy node before the first value, owned by the consumer.
+  Node *head;
+
+  //! Last node, owned by the producer.
+  Node *tail;
+
+  SPSCQueue(const SPSCQueue &);
+  SPSCQueue &operator=(const SPSCQueue &);
+};
+
+#endif // SPSCQUEUE_HH
@@ -0,0 +1,107 @@
+// SPSCRing.hh --- Lock-free bounded single-producer single-consumer queue
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SPSCRING_HH
+#define SPSCRING_HH
+
+#include <glib.h>
+
+//! Bounded lock-free queue between one producer and one consumer thread.
+/*!
+ *  The values are stored in a preallocated ring, so unlike SPSCQueue no
+ *  memory is allocated per value. The producer only writes the tail index,
+ *  and the consumer only writes the head index. Both indices keep counting
+ *  up; the size must be a power of two.
+ */
+template<class T, int Size>
+class SPSCRing
+{
+public:
+  SPSCRing() :
+    head(0),
+    tail(0)
+  {
+  }
+
+  //! Adds a value at the tail. Called by the producer only.
+  /*!
+   *  \return false if the ring is full.
+   */
+  bool push(const T &value)
+  {
+    guint t = (guint) g_atomic_int_get(&tail);
+    if (t - (guint) g_atomic_int_get(&head) >= (guint) Size)
+      {
+        return false;
+      }
+
+    values[t & (Size - 1)] = value;
+    g_atomic_int_set(&tail, (gint) (t + 1));
+    return true;
+  }
+
+  //! Removes up to max values from the head. Called by the consumer only.
+  /*!
+   *  \return the number of values removed.
+   */
+  int pop(T *out, int max)
+  {
+    guint h = (guint) g_atomic_int_get(&head);
+    int count = (int) ((guint) g_atomic_int_get(&tail) - h);
+    if (count > max)
+      {
+        count = max;
+      }
+
+    for (int i = 0; i < count; i++)
+      {
+        out[i] = values[(h + i) & (Size - 1)];
+      }
+
+    g_atomic_int_set(&head, (gint) (h + count));
+    return count;
+  }
+
+  //! Returns the number of values in the ring. Called by the consumer only.
+  int get_size() const
+  {
+    return (int) ((guint) g_atomic_int_get(&tail) - (guint) g_atomic_int_get(&head));
+  }
+
+  //! Returns whether the ring is empty.
+  bool is_empty() const
+  {
+    return g_atomic_int_get(&head) == g_atomic_int_get(&tail);
+  }
+
+private:
+  //! Index of the first value, owned by the consumer.
+  volatile gint head;
+
+  //! Index after the last value, owned by the producer.
+  volatile gint tail;
+
+  //! The values.
+  T values[Size];
+
+  SPSCRing(const SPSCRing &);
+  SPSCRing &operator=(const SPSCRing &);
+};
+
+#endif // SPSCRING_HH
@@ -28,6 +28,7 @@ static const char rcsid[] = "$Id: GNetSocketDriver.cc 1184 2007-05-12 09:16:31Z
 
 #if defined(HAVE_GIO_NET)
 #include "GIOSocketDriver.hh"
+#include "ThreadedSocketDriver.hh"
 #endif
 
 #if defined(HAVE_GNET)
@@ -39,7 +40,7 @@ SocketDriver *
 SocketDriver::create()
 {
 #if defined(HAVE_GIO_NET)
-  return new GIOSocketDriver();
+  return new ThreadedSocketDriver(new GIOSocketDriver());
 #elif defined(HAVE_GNET)
   return new GNetSocketDriver();
 #else
@@ -47,3 +48,49 @@ SocketDriver::create()
 #endif
 }
 
+
+//! Deliver pending socket events to the listeners.
+/*!
+ *  Drivers deliver their events from the main loop as soon as they arrive,
+ *  so this only flushes events that are still pending. Default
+ *  implementation for drivers that call the listeners directly.
+ */
+void
+SocketDriver::dispatch()
+{
+}
+
+
+//! Write multiple buffers to the connection.
+/*!
+ *  Default implementation that writes the buffers one by one, until the
+ *  connection does not accept more data.
+ */
+void
+ISocket::writev(const SocketVector *vectors, int count, int &bytes_written)
+{
+  bytes_written = 0;
+
+  for (int i = 0; i < count; i++)
+    {
+      int written = 0;
+      write((void *)vectors[i].buffer, vectors[i].size, written);
+
+      bytes_written += written;
+      if (written < vectors[i].size)
+        {
+          break;
+        }
+    }
+}
+
+
+//! Enable/disable notification that the connection can accept more data.
+/*!
+ *  Default implementation that never notifies.
+ */
+void
+ISocket::watch_writable(bool enable)
+{
+  (void) enable;
+}
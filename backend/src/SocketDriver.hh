@@ -27,6 +27,13 @@ class ISocketServer;
 
 using namespace workrave;
 
+//! Buffer for scatter-gather output.
+struct SocketVector
+{
+  const void *buffer;
+  int size;
+};
+
 //! Asynchronous socket callbacks.
 class ISocketListener
 {
@@ -40,6 +47,9 @@ public:
   //! The specified socket has data ready to be read.
   virtual void socket_io(ISocket *con, void *data) = 0;
 
+  //! The specified socket can accept more data.
+  virtual void socket_writable(ISocket *con, void *data) = 0;
+
   //! The specified socket closed its connection.
   virtual void socket_closed(ISocket *con, void *data) = 0;
 };
@@ -77,6 +87,12 @@ public:
   //! Write data to the connection
   virtual void write(void *buf, int count, int &bytes_written) = 0;
 
+  //! Write multiple buffers to the connection.
+  virtual void writev(const SocketVector *vectors, int count, int &bytes_written);
+
+  //! Enable/disable notification that the connection can accept more data.
+  virtual void watch_writable(bool enable);
+
   //! Close the connection.
   virtual void close() = 0;
 
@@ -133,6 +149,9 @@ public:
 
   //! Create a new listen socket
   virtual ISocketServer *create_server() = 0;
+
+  //! Deliver pending socket events to the listeners.
+  virtual void dispatch();
 };
 
 
@@ -25,7 +25,6 @@
 #include <cstring>
 #include <sstream>
 #include <assert.h>
-#include <math.h>
 
 #include "debug.hh"
 
@@ -46,20 +45,14 @@
 const char *WORKRAVESTATS="WorkRaveStats";
 const int STATSVERSION = 4;
 
-#define MAX_JUMP (10000)
-
 //! Constructor
 Statistics::Statistics() :
   core(NULL),
   current_day(NULL),
   been_active(false),
-  prev_x(-1),
-  prev_y(-1),
   click_x(-1),
   click_y(-1)
 {
-  last_mouse_time.tv_sec = 0;
-  last_mouse_time.tv_usec = 0;
 }
 
 
@@ -801,25 +794,25 @@ Statistics::pack_stats(PacketBuffer &buf, const DailyStatsImpl *stats)
     {
       BreakStats &bs = current_day->break_stats[i];
 
-      buf.pack_byte(STATS_MARKER_BREAK_STATS);
+      buf.pack_byte(STATS_MARKER_BREAK_STATS_VARINT);
       buf.reserve_size(pos);
       buf.pack_byte(i);
-      buf.pack_ushort(STATS_BREAKVALUE_SIZEOF);
+      buf.pack_varint(STATS_BREAKVALUE_SIZEOF);
 
       for(int j = 0; j < STATS_BREAKVALUE_SIZEOF; j++)
         {
-          buf.pack_ulong(bs[j]);
+          buf.pack_varint(bs[j]);
         }
       buf.update_size(pos);
     }
 
-  buf.pack_byte(STATS_MARKER_MISC_STATS);
+  buf.pack_byte(STATS_MARKER_MISC_STATS_VARINT);
   buf.reserve_size(pos);
-  buf.pack_ushort(STATS_VALUE_SIZEOF);
+  buf.pack_varint(STATS_VALUE_SIZEOF);
 
   for(int j = 0; j < STATS_VALUE_SIZEOF; j++)
     {
-      buf.pack_ulong(current_day->misc_stats[j]);
+      buf.pack_varint(current_day->misc_stats[j]);
     }
   buf.update_size(pos);
 
@@ -885,14 +878,16 @@ Statistics::client_message(DistributionClientMessageID id, bool master, const ch
           break;
 
         case STATS_MARKER_BREAK_STATS:
+        case STATS_MARKER_BREAK_STATS_VARINT:
           {
+            bool varint = (marker == STATS_MARKER_BREAK_STATS_VARINT);
             int size = buffer.read_size(pos);
             int bt = buffer.unpack_byte();
             (void) size;
 
             BreakStats &bs = stats->break_stats[bt];
 
-            int count = buffer.unpack_ushort();
+            int count = varint ? buffer.unpack_varint() : buffer.unpack_ushort();
 
             if (count > STATS_BREAKVALUE_SIZEOF)
               {
@@ -901,7 +896,7 @@ Statistics::client_message(DistributionClientMessageID id, bool master, const ch
 
             for(int j = 0; j < count; j++)
               {
-                bs[j] = buffer.unpack_ulong();
+                bs[j] = varint ? buffer.unpack_varint() : buffer.unpack_ulong();
               }
 
             buffer.skip_size(pos);
@@ -909,9 +904,11 @@ Statistics::client_message(DistributionClientMessageID id, bool master, const ch
           break;
 
         case STATS_MARKER_MISC_STATS:
+        case STATS_MARKER_MISC_STATS_VARINT:
           {
+            bool varint = (marker == STATS_MARKER_MISC_STATS_VARINT);
             int size = buffer.read_size(pos);
-            int count = buffer.unpack_ushort();
+            int count = varint ? buffer.unpack_varint() : buffer.unpack_ushort();
             (void) size;
 
             if (count > STATS_VALUE_SIZEOF)
@@ -921,7 +918,7 @@ Statistics::client_message(DistributionClientMessageID id, bool master, const ch
 
             for(int j = 0; j < count; j++)
               {
-                stats->misc_stats[j] = buffer.unpack_ulong();
+                stats->misc_stats[j] = varint ? buffer.unpack_varint() : buffer.unpack_ulong();
               }
 
             buffer.skip_size(pos);
@@ -993,73 +990,147 @@ Statistics::action_notify()
 void
 Statistics::mouse_notify(int x, int y, int wheel_delta)
 {
-  static const int sensitivity = 3;
+  lock.lock();
+  process_mouse(x, y, wheel_delta, g_get_monotonic_time());
+
+  lock.unlock();
+}
+
+
+//! Combined mouse activity is reported by the input monitor.
+/*!
+ *  The input monitor already measured the distance and movement time of
+ *  the individual samples.
+ */
+void
+Statistics::mouse_motion_notify(int x, int y, int wheel_delta, int distance, gint64 movement_time)
+{
+  (void) wheel_delta;
+
+  lock.lock();
+  process_mouse_motion(x, y, distance, movement_time, g_get_monotonic_time());
+
+  lock.unlock();
+}
+
+
+//! Mouse button activity is reported by the input monitor.
+void
+Statistics::button_notify(bool is_press)
+{
+  lock.lock();
+  process_button(is_press);
+  lock.unlock();
+}
+
 
+//! Keyboard activity is reported by the input monitor.
+void
+Statistics::keyboard_notify(bool repeat)
+{
   lock.lock();
+  process_keyboard(repeat);
+  lock.unlock();
+}
+
 
-  if (current_day != NULL && x >=0 && y >= 0)
+//! A batch of input events is reported by the input monitor.
+void
+Statistics::input_notify(const InputEvent *events, int count)
+{
+  lock.lock();
+  for (int i = 0; i < count; i++)
     {
-      int delta_x = sensitivity;
-      int delta_y = sensitivity;
+      const InputEvent &event = events[i];
 
-      if (prev_x != -1 && prev_y != -1)
+      switch (event.type)
         {
-          delta_x = abs(x - prev_x);
-          delta_y = abs(y - prev_y);
+        case InputEvent::INPUT_MOUSE:
+          process_mouse(event.x, event.y, event.wheel, event.time);
+          break;
+
+        case InputEvent::INPUT_MOUSE_MOTION:
+          process_mouse_motion(event.x, event.y, event.distance, event.movement_time, event.time);
+          break;
+
+        case InputEvent::INPUT_BUTTON:
+          process_button(event.flag != 0);
+          break;
+
+        case InputEvent::INPUT_KEYBOARD:
+          process_keyboard(event.flag != 0);
+          break;
+
+        case InputEvent::INPUT_ACTION:
+          break;
         }
+    }
+  lock.unlock();
+}
 
-      prev_x = x;
-      prev_y = y;
 
-      // Sanity checks, ignore unreasonable large jumps...
-      if ( delta_x < MAX_JUMP && delta_y < MAX_JUMP &&
-          (delta_x >= sensitivity || delta_y >= sensitivity || wheel_delta != 0 ))
+//! Updates the mouse statistics for a mouse sample at the specified monotonic time.
+void
+Statistics::process_mouse(int x, int y, int wheel_delta, gint64 now)
+{
+  int distance;
+  gint64 movement_time;
+
+  if (current_day != NULL &&
+      mouse_movement.add_sample(x, y, wheel_delta, now, distance, movement_time))
+    {
+      process_mouse_motion(x, y, distance, movement_time, now);
+    }
+}
+
+
+//! Updates the mouse statistics for combined mouse samples.
+void
+Statistics::process_mouse_motion(int x, int y, int distance, gint64 movement_time, gint64 now)
+{
+  if (current_day != NULL && x >= 0 && y >= 0)
+    {
+      mouse_movement.set_position(x, y, now);
+
+      if (distance > 0)
         {
           int64_t movement = current_day->misc_stats[STATS_VALUE_TOTAL_MOUSE_MOVEMENT];
-          int distance = int(sqrt((double)(delta_x * delta_x + delta_y * delta_y)));
 
           movement += distance;
           if (movement > 0)
             {
               current_day->misc_stats[STATS_VALUE_TOTAL_MOUSE_MOVEMENT] = movement;
             }
+        }
 
-          GTimeVal now, tv;
-
-          g_get_current_time(&now);
-          tvSUBTIME(tv, now, last_mouse_time);
-
-          if (!tvTIMEEQ0(last_mouse_time) && tv.tv_sec < 1 && tv.tv_sec >= 0 && tv.tv_usec >= 0)
-            {
-              tvADDTIME(current_day->total_mouse_time, current_day->total_mouse_time, tv);
+      if (movement_time > 0)
+        {
+          GTimeVal tv;
 
-              current_day->misc_stats[STATS_VALUE_TOTAL_MOVEMENT_TIME] =
-                current_day->total_mouse_time.tv_sec;
-            }
+          tv.tv_sec = movement_time / G_USEC_PER_SEC;
+          tv.tv_usec = movement_time % G_USEC_PER_SEC;
+          tvADDTIME(current_day->total_mouse_time, current_day->total_mouse_time, tv);
 
-          last_mouse_time = now;
+          current_day->misc_stats[STATS_VALUE_TOTAL_MOVEMENT_TIME] =
+            current_day->total_mouse_time.tv_sec;
         }
     }
-
-  lock.unlock();
 }
 
 
-//! Mouse button activity is reported by the input monitor.
+//! Updates the click statistics for a mouse button event.
 void
-Statistics::button_notify(bool is_press)
+Statistics::process_button(bool is_press)
 {
-  lock.lock();
   if (current_day != NULL)
     {
-      if (click_x != -1 && click_y != -1 &&
-          prev_x != -1  && prev_y != -1)
-        {
-          int delta_x = click_x - prev_x;
-          int delta_y = click_y - prev_y;
+      int x = mouse_movement.get_x();
+      int y = mouse_movement.get_y();
 
+      if (click_x != -1 && click_y != -1 && x != -1 && y != -1)
+        {
           int64_t movement = current_day->misc_stats[STATS_VALUE_TOTAL_CLICK_MOVEMENT];
-          int64_t distance = int(sqrt((double)(delta_x * delta_x + delta_y * delta_y)));
+          int64_t distance = MouseMovement::get_distance(click_x - x, click_y - y);
 
           movement += distance;
           if (movement > 0)
@@ -1068,29 +1139,26 @@ Statistics::button_notify(bool is_press)
             }
         }
 
-      click_x = prev_x;
-      click_y = prev_y;
+      click_x = x;
+      click_y = y;
 
       if (is_press)
         {
           current_day->misc_stats[STATS_VALUE_TOTAL_CLICKS]++;
         }
     }
-  lock.unlock();
 }
 
 
-//! Keyboard activity is reported by the input monitor.
+//! Updates the keystroke statistics for a key press.
 void
-Statistics::keyboard_notify(bool repeat)
+Statistics::process_keyboard(bool repeat)
 {
   if (repeat)
     return;
 
-  lock.lock();
   if (current_day != NULL)
     {
       current_day->misc_stats[STATS_VALUE_TOTAL_KEYSTROKES]++;
     }
-  lock.unlock();
 }
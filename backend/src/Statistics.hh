@@ -29,6 +29,7 @@
 #include "IStatistics.hh"
 #include "IInputMonitorListener.hh"
 #include "Mutex.hh"
+#include "MouseMovement.hh"
 
 // Forward declarion of external interface.
 namespace workrave {
@@ -66,6 +67,8 @@ private:
       STATS_MARKER_STOPTIME,
       STATS_MARKER_BREAK_STATS,
       STATS_MARKER_MISC_STATS,
+      STATS_MARKER_BREAK_STATS_VARINT,
+      STATS_MARKER_MISC_STATS_VARINT,
     };
 
 
@@ -141,8 +144,15 @@ public:
 private:
   void action_notify();
   void mouse_notify(int x, int y, int wheel = 0);
+  void mouse_motion_notify(int x, int y, int wheel, int distance, gint64 movement_time);
   void button_notify(bool is_press);
   void keyboard_notify(bool repeat);
+  void input_notify(const InputEvent *events, int count);
+
+  void process_mouse(int x, int y, int wheel, gint64 now);
+  void process_mouse_motion(int x, int y, int distance, gint64 movement_time, gint64 now);
+  void process_button(bool is_press);
+  void process_keyboard(bool repeat);
 
   bool load_current_day();
   void update_current_day(bool active);
@@ -173,9 +183,6 @@ private:
   //! Mouse/Keyboard monitoring.
   IInputMonitor *input_monitor;
 
-  //! Last time a mouse event was received.
-  GTimeVal last_mouse_time;
-
   //! Statistics of current day.
   DailyStatsImpl *current_day;
 
@@ -188,11 +195,8 @@ private:
   //! Internal locking
   Mutex lock;
 
-  //! Previous X coordinate
-  int prev_x;
-
-  //! Previous Y coordinate
-  int prev_y;
+  //! Distance and time of the mouse movement.
+  MouseMovement mouse_movement;
 
   //! Previous X-click coordinate
   int click_x;
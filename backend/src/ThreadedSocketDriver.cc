@@ -0,0 +1,1011 @@
+// ThreadedSocketDriver.cc --- Socket driver with a networking thread
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_GIO_NET) && defined(HAVE_DISTRIBUTION)
+
+#include <string.h>
+
+#include "debug.hh"
+#include "ThreadedSocketDriver.hh"
+#include "Thread.hh"
+
+using namespace std;
+
+
+//! Proxy of a socket in the networking thread.
+class ThreadedSocket
+  : public ISocket
+{
+public:
+  typedef ThreadedSocketDriver::Channel Channel;
+
+  ThreadedSocket(ThreadedSocketDriver *driver, Channel *channel);
+  virtual ~ThreadedSocket();
+
+  // ISocket interface
+  virtual void connect(const std::string &hostname, int port);
+  virtual void read(void *buf, int count, int &bytes_read);
+  virtual void write(void *buf, int count, int &bytes_written);
+  virtual void writev(const SocketVector *vectors, int count, int &bytes_written);
+  virtual void watch_writable(bool enable);
+  virtual void close();
+
+  void receive(gchar *data, int size);
+  void set_eof();
+  void set_error();
+  int get_input_size() const;
+  bool has_input() const;
+
+  void notify_connected();
+  void notify_io();
+  void notify_writable();
+  void notify_closed();
+
+private:
+  ThreadedSocketDriver *driver;
+  Channel *channel;
+
+  //! Received data that is not yet read.
+  string input;
+
+  //! Whether the connection was closed by the remote end.
+  bool eof;
+
+  //! Whether the connection failed.
+  bool error;
+
+  //! Whether the listener wants to know that the socket is writable.
+  bool watching;
+};
+
+
+//! Proxy of a listen socket in the networking thread.
+class ThreadedSocketServer
+  : public ISocketServer
+{
+public:
+  typedef ThreadedSocketDriver::Channel Channel;
+
+  ThreadedSocketServer(ThreadedSocketDriver *driver, Channel *channel);
+  virtual ~ThreadedSocketServer();
+
+  // ISocketServer  interface
+  virtual void listen(int port);
+
+  void notify_accepted(ISocket *socket);
+
+private:
+  ThreadedSocketDriver *driver;
+  Channel *channel;
+};
+
+
+GSourceFuncs ThreadedSocketDriver::command_source_funcs =
+  {
+    ThreadedSocketDriver::command_prepare,
+    ThreadedSocketDriver::command_check,
+    ThreadedSocketDriver::command_dispatch,
+    NULL,
+    NULL,
+    NULL
+  };
+
+
+GSourceFuncs ThreadedSocketDriver::event_source_funcs =
+  {
+    ThreadedSocketDriver::event_prepare,
+    ThreadedSocketDriver::event_check,
+    ThreadedSocketDriver::event_dispatch,
+    NULL,
+    NULL,
+    NULL
+  };
+
+
+//! Creates a driver that runs the sockets of the specified driver in a networking thread.
+ThreadedSocketDriver::ThreadedSocketDriver(SocketDriver *driver) :
+  driver(driver),
+  running(1)
+{
+  TRACE_ENTER("ThreadedSocketDriver::ThreadedSocketDriver");
+
+  context = g_main_context_new();
+
+  command_source = g_source_new(&command_source_funcs, sizeof(CommandSource));
+  ((CommandSource *)command_source)->driver = this;
+  g_source_attach(command_source, context);
+
+  // Deliver events as soon as they arrive, instead of waiting for the
+  // next heartbeat. The driver is created in the main thread.
+  main_context = g_main_context_default();
+  g_main_context_ref(main_context);
+
+  event_source = g_source_new(&event_source_funcs, sizeof(EventSource));
+  ((EventSource *)event_source)->driver = this;
+  g_source_attach(event_source, main_context);
+
+  thread = new Thread(this);
+  thread->start();
+
+  TRACE_EXIT();
+}
+
+
+//! Stops the networking thread.
+/*!
+ *  All sockets must be deleted before the driver.
+ */
+ThreadedSocketDriver::~ThreadedSocketDriver()
+{
+  TRACE_ENTER("ThreadedSocketDriver::~ThreadedSocketDriver");
+
+  g_source_destroy(event_source);
+  g_source_unref(event_source);
+
+  g_atomic_int_set(&running, 0);
+  g_main_context_wakeup(context);
+  thread->wait();
+  delete thread;
+
+  // The networking thread no longer runs, so the remaining commands
+  // can be processed here.
+  process_commands();
+
+  Event *event = NULL;
+  while (events.pop(event))
+    {
+      if (event->accepted != NULL)
+        {
+          Channel *accepted = event->accepted;
+          close_channel(accepted);
+          delete accepted->socket;
+          accepted->socket = NULL;
+
+          // Release the references of the event and the networking thread.
+          unref(accepted);
+          unref(accepted);
+        }
+      unref(event->channel);
+      g_free(event->data);
+      delete event;
+    }
+
+  g_source_destroy(command_source);
+  g_source_unref(command_source);
+  g_main_context_unref(context);
+  g_main_context_unref(main_context);
+
+  delete driver;
+  TRACE_EXIT();
+}
+
+
+//! Creates a new socket.
+ISocket *
+ThreadedSocketDriver::create_socket()
+{
+  return new ThreadedSocket(this, new Channel);
+}
+
+
+//! Creates a new listen socket.
+ISocketServer *
+ThreadedSocketDriver::create_server()
+{
+  return new ThreadedSocketServer(this, new Channel);
+}
+
+
+//! Delivers the events of the networking thread to the listeners.
+/*!
+ *  Called from the main loop of the main thread when events arrive.
+ */
+void
+ThreadedSocketDriver::dispatch()
+{
+  TRACE_ENTER("ThreadedSocketDriver::dispatch");
+
+  Event *event = NULL;
+  while (events.pop(event))
+    {
+      Channel *channel = event->channel;
+      ThreadedSocket *proxy = channel->proxy;
+
+      switch (event->type)
+        {
+        case EVENT_CONNECTED:
+          if (proxy != NULL)
+            {
+              proxy->notify_connected();
+            }
+          break;
+
+        case EVENT_DATA:
+          if (proxy != NULL)
+            {
+              proxy->receive(event->data, event->size);
+              deliver_input(channel);
+            }
+          break;
+
+        case EVENT_EOF:
+          if (proxy != NULL)
+            {
+              proxy->set_eof();
+              deliver_input(channel);
+            }
+          break;
+
+        case EVENT_ERROR:
+          if (proxy != NULL)
+            {
+              proxy->set_error();
+              deliver_input(channel);
+            }
+          break;
+
+        case EVENT_WRITABLE:
+          if (proxy != NULL)
+            {
+              proxy->notify_writable();
+            }
+          break;
+
+        case EVENT_CLOSED:
+          if (proxy != NULL)
+            {
+              proxy->notify_closed();
+            }
+          break;
+
+        case EVENT_ACCEPTED:
+          if (channel->server_proxy != NULL)
+            {
+              ISocket *socket = new ThreadedSocket(this, event->accepted);
+              channel->server_proxy->notify_accepted(socket);
+            }
+          else
+            {
+              post_command(new Command(COMMAND_DESTROY, ref(event->accepted)));
+            }
+          unref(event->accepted);
+          break;
+        }
+
+      unref(channel);
+      g_free(event->data);
+      delete event;
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Passes a request to the networking thread.
+void
+ThreadedSocketDriver::post_command(Command *command)
+{
+  commands.push(command);
+  g_main_context_wakeup(context);
+}
+
+
+//! Passes a request to the networking thread and waits until it is processed.
+/*!
+ *  Releases the reference to the channel of the command. The caller
+ *  deletes the command.
+ */
+void
+ThreadedSocketDriver::execute_command(Command *command)
+{
+  command->reply = g_async_queue_new();
+  post_command(command);
+
+  g_async_queue_pop(command->reply);
+  g_async_queue_unref(command->reply);
+  command->reply = NULL;
+
+  unref(command->channel);
+  command->channel = NULL;
+}
+
+
+//! Lets the listener of a socket read all received data.
+void
+ThreadedSocketDriver::deliver_input(Channel *channel)
+{
+  ThreadedSocket *proxy = channel->proxy;
+
+  while (proxy != NULL && proxy->has_input())
+    {
+      int size = proxy->get_input_size();
+
+      proxy->notify_io();
+
+      if (channel->proxy != proxy || proxy->get_input_size() == size)
+        {
+          // Socket deleted, or listener did not read.
+          break;
+        }
+      proxy = channel->proxy;
+    }
+}
+
+
+//! Runs the main loop of the networking thread.
+void
+ThreadedSocketDriver::run()
+{
+  TRACE_ENTER("ThreadedSocketDriver::run");
+
+  // Asynchronous operations of the wrapped driver use this context.
+  g_main_context_push_thread_default(context);
+
+  while (g_atomic_int_get(&running))
+    {
+      g_main_context_iteration(context, TRUE);
+    }
+
+  g_main_context_pop_thread_default(context);
+
+  TRACE_EXIT();
+}
+
+
+//! Processes all pending requests of the main thread.
+void
+ThreadedSocketDriver::process_commands()
+{
+  Command *command = NULL;
+  while (commands.pop(command))
+    {
+      process_command(command);
+
+      if (command->reply != NULL)
+        {
+          // The waiting main thread releases the command.
+          g_async_queue_push(command->reply, command);
+          continue;
+        }
+
+      unref(command->channel);
+      g_free(command->chunk.data);
+      delete command;
+    }
+}
+
+
+//! Processes a request of the main thread.
+void
+ThreadedSocketDriver::process_command(Command *command)
+{
+  TRACE_ENTER_MSG("ThreadedSocketDriver::process_command", command->type);
+  Channel *channel = command->channel;
+
+  try
+    {
+      switch (command->type)
+        {
+        case COMMAND_CONNECT:
+          if (channel->socket == NULL)
+            {
+              channel->socket = driver->create_socket();
+              channel->socket->set_listener(this);
+              channel->socket->set_data(channel);
+            }
+          channel->closed = false;
+          channel->socket->connect(command->host, command->port);
+          break;
+
+        case COMMAND_WRITE:
+          channel->output.push_back(command->chunk);
+          command->chunk.data = NULL;
+          flush(channel);
+          break;
+
+        case COMMAND_FLUSH:
+          flush(channel);
+          break;
+
+        case COMMAND_CLOSE:
+          close_channel(channel);
+          break;
+
+        case COMMAND_LISTEN:
+          if (channel->server == NULL)
+            {
+              channel->server = driver->create_server();
+              channel->server->set_listener(this);
+              servers[channel->server] = channel;
+            }
+          channel->server->listen(command->port);
+          break;
+
+        case COMMAND_DESTROY:
+          close_channel(channel);
+          delete channel->socket;
+          channel->socket = NULL;
+          servers.erase(channel->server);
+          delete channel->server;
+          channel->server = NULL;
+
+          // Release the reference of the networking thread.
+          unref(channel);
+          break;
+        }
+    }
+  catch (SocketException &e)
+    {
+      TRACE_MSG("Exception " << e.details());
+      command->failed = true;
+      command->error = e.details();
+
+      if (command->type != COMMAND_LISTEN && command->type != COMMAND_DESTROY)
+        {
+          close_channel(channel);
+          post_event(EVENT_ERROR, channel);
+        }
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Passes a notification to the main thread.
+void
+ThreadedSocketDriver::post_event(EventType type, Channel *channel, gchar *data, int size)
+{
+  Event *event = new Event(type, ref(channel));
+  event->data = data;
+  event->size = size;
+
+  events.push(event);
+  g_main_context_wakeup(main_context);
+}
+
+
+//! Writes as much pending output of a channel as possible.
+void
+ThreadedSocketDriver::flush(Channel *channel)
+{
+  ISocket *socket = channel->socket;
+
+  while (!channel->output.empty() && socket != NULL && !channel->closed)
+    {
+      Chunk &chunk = channel->output.front();
+
+      int bytes_written = 0;
+      socket->write(chunk.data + chunk.offset, chunk.size - chunk.offset, bytes_written);
+
+      chunk.offset += bytes_written;
+      g_atomic_int_add(&channel->queued, -bytes_written);
+
+      if (chunk.offset < chunk.size)
+        {
+          break;
+        }
+
+      g_free(chunk.data);
+      channel->output.pop_front();
+    }
+
+  if (socket != NULL && !channel->closed)
+    {
+      socket->watch_writable(!channel->output.empty());
+    }
+
+  if (channel->output.empty() &&
+      g_atomic_int_compare_and_exchange(&channel->notify_writable, 1, 0))
+    {
+      post_event(EVENT_WRITABLE, channel);
+    }
+}
+
+
+//! Closes the connection of a channel, and discards pending output.
+void
+ThreadedSocketDriver::close_channel(Channel *channel)
+{
+  if (channel->socket != NULL && !channel->closed)
+    {
+      channel->socket->close();
+    }
+  channel->closed = true;
+
+  for (list<Chunk>::iterator i = channel->output.begin(); i != channel->output.end(); i++)
+    {
+      g_atomic_int_add(&channel->queued, -(i->size - i->offset));
+      g_free(i->data);
+    }
+  channel->output.clear();
+}
+
+
+//! The specified socket is now connected.
+void
+ThreadedSocketDriver::socket_connected(ISocket *con, void *data)
+{
+  (void) con;
+  post_event(EVENT_CONNECTED, (Channel *)data);
+}
+
+
+//! Reads the available data of a socket and passes it to the main thread.
+void
+ThreadedSocketDriver::socket_io(ISocket *con, void *data)
+{
+  Channel *channel = (Channel *)data;
+
+  if (channel->closed)
+    {
+      return;
+    }
+
+  gchar *buffer = (gchar *) g_malloc(THREADED_SOCKET_READ_SIZE);
+  int bytes_read = 0;
+
+  try
+    {
+      con->read(buffer, THREADED_SOCKET_READ_SIZE, bytes_read);
+    }
+  catch (SocketException)
+    {
+      g_free(buffer);
+      close_channel(channel);
+      post_event(EVENT_ERROR, channel);
+      return;
+    }
+
+  if (bytes_read == 0)
+    {
+      g_free(buffer);
+
+      // Stop polling the socket, the main thread closes the connection.
+      close_channel(channel);
+      post_event(EVENT_EOF, channel);
+    }
+  else
+    {
+      post_event(EVENT_DATA, channel, buffer, bytes_read);
+    }
+}
+
+
+//! Writes pending output when the socket accepts more data.
+void
+ThreadedSocketDriver::socket_writable(ISocket *con, void *data)
+{
+  (void) con;
+  Channel *channel = (Channel *)data;
+
+  try
+    {
+      flush(channel);
+    }
+  catch (SocketException)
+    {
+      close_channel(channel);
+      post_event(EVENT_ERROR, channel);
+    }
+}
+
+
+//! The specified socket closed its connection.
+void
+ThreadedSocketDriver::socket_closed(ISocket *con, void *data)
+{
+  (void) con;
+  Channel *channel = (Channel *)data;
+
+  if (!channel->closed)
+    {
+      close_channel(channel);
+      post_event(EVENT_CLOSED, channel);
+    }
+}
+
+
+//! Passes an accepted connection to the main thread.
+void
+ThreadedSocketDriver::socket_accepted(ISocketServer *server, ISocket *con)
+{
+  map<ISocketServer *, Channel *>::iterator i = servers.find(server);
+  if (i == servers.end())
+    {
+      delete con;
+      return;
+    }
+
+  Channel *channel = i->second;
+  Channel *accepted = new Channel;
+  accepted->socket = con;
+  con->set_listener(this);
+  con->set_data(accepted);
+
+  Event *event = new Event(EVENT_ACCEPTED, ref(channel));
+  event->accepted = ref(accepted);
+  events.push(event);
+  g_main_context_wakeup(main_context);
+}
+
+
+//! Adds a reference to a channel.
+ThreadedSocketDriver::Channel *
+ThreadedSocketDriver::ref(Channel *channel)
+{
+  g_atomic_int_inc(&channel->ref_count);
+  return channel;
+}
+
+
+//! Removes a reference from a channel, and deletes it when unused.
+void
+ThreadedSocketDriver::unref(Channel *channel)
+{
+  if (g_atomic_int_dec_and_test(&channel->ref_count))
+    {
+      g_assert(channel->socket == NULL && channel->server == NULL);
+      delete channel;
+    }
+}
+
+
+gboolean
+ThreadedSocketDriver::command_prepare(GSource *source, gint *timeout)
+{
+  *timeout = -1;
+  return !((CommandSource *)source)->driver->commands.is_empty();
+}
+
+
+gboolean
+ThreadedSocketDriver::command_check(GSource *source)
+{
+  return !((CommandSource *)source)->driver->commands.is_empty();
+}
+
+
+gboolean
+ThreadedSocketDriver::command_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  (void) callback;
+  (void) user_data;
+
+  ((CommandSource *)source)->driver->process_commands();
+  return TRUE;
+}
+
+
+gboolean
+ThreadedSocketDriver::event_prepare(GSource *source, gint *timeout)
+{
+  *timeout = -1;
+  return !((EventSource *)source)->driver->events.is_empty();
+}
+
+
+gboolean
+ThreadedSocketDriver::event_check(GSource *source)
+{
+  return !((EventSource *)source)->driver->events.is_empty();
+}
+
+
+gboolean
+ThreadedSocketDriver::event_dispatch(GSource *source, GSourceFunc callback, gpointer user_data)
+{
+  (void) callback;
+  (void) user_data;
+
+  ((EventSource *)source)->driver->dispatch();
+  return TRUE;
+}
+
+
+//! Creates a proxy socket.
+ThreadedSocket::ThreadedSocket(ThreadedSocketDriver *driver, Channel *channel) :
+  driver(driver),
+  channel(ThreadedSocketDriver::ref(channel)),
+  eof(false),
+  error(false),
+  watching(false)
+{
+  channel->proxy = this;
+}
+
+
+//! Destructs the proxy, and the socket in the networking thread.
+ThreadedSocket::~ThreadedSocket()
+{
+  channel->proxy = NULL;
+
+  driver->post_command(new ThreadedSocketDriver::Command(ThreadedSocketDriver::COMMAND_DESTROY,
+                                                         ThreadedSocketDriver::ref(channel)));
+  ThreadedSocketDriver::unref(channel);
+}
+
+
+//! Connects to the specified host.
+void
+ThreadedSocket::connect(const string &host, int port)
+{
+  ThreadedSocketDriver::Command *command =
+    new ThreadedSocketDriver::Command(ThreadedSocketDriver::COMMAND_CONNECT,
+                                      ThreadedSocketDriver::ref(channel));
+  command->host = host;
+  command->port = port;
+
+  input.clear();
+  eof = false;
+  error = false;
+
+  driver->post_command(command);
+}
+
+
+//! Reads received data.
+/*!
+ *  Returns 0 bytes if the connection was closed.
+ */
+void
+ThreadedSocket::read(void *buf, int count, int &bytes_read)
+{
+  if (input.empty() && error)
+    {
+      throw SocketException("socket read error");
+    }
+
+  bytes_read = (int) input.size() < count ? (int) input.size() : count;
+  memcpy(buf, input.data(), bytes_read);
+  input.erase(0, bytes_read);
+}
+
+
+//! Writes to the connection.
+void
+ThreadedSocket::write(void *buf, int count, int &bytes_written)
+{
+  SocketVector vector;
+  vector.buffer = buf;
+  vector.size = count;
+
+  writev(&vector, 1, bytes_written);
+}
+
+
+//! Writes multiple buffers to the connection.
+/*!
+ *  The data is copied and written by the networking thread. No data is
+ *  accepted while too much data is pending.
+ */
+void
+ThreadedSocket::writev(const SocketVector *vectors, int count, int &bytes_written)
+{
+  bytes_written = 0;
+
+  if (eof || error || g_atomic_int_get(&channel->queued) >= THREADED_SOCKET_MAX_QUEUED)
+    {
+      return;
+    }
+
+  int size = 0;
+  for (int i = 0; i < count; i++)
+    {
+      size += vectors[i].size;
+    }
+
+  if (size > 0)
+    {
+      ThreadedSocketDriver::Command *command =
+        new ThreadedSocketDriver::Command(ThreadedSocketDriver::COMMAND_WRITE,
+                                          ThreadedSocketDriver::ref(channel));
+
+      command->chunk.data = (gchar *) g_malloc(size);
+      command->chunk.size = size;
+
+      int offset = 0;
+      for (int i = 0; i < count; i++)
+        {
+          memcpy(command->chunk.data + offset, vectors[i].buffer, vectors[i].size);
+          offset += vectors[i].size;
+        }
+
+      g_atomic_int_add(&channel->queued, size);
+      driver->post_command(command);
+
+      bytes_written = size;
+    }
+}
+
+
+//! Enables/disables notification that all written data was sent.
+void
+ThreadedSocket::watch_writable(bool enable)
+{
+  watching = enable;
+  g_atomic_int_set(&channel->notify_writable, enable ? 1 : 0);
+
+  // The networking thread may have sent all data before the flag was
+  // set, in which case it no longer notifies by itself.
+  if (enable && g_atomic_int_get(&channel->queued) == 0)
+    {
+      driver->post_command(new ThreadedSocketDriver::Command(ThreadedSocketDriver::COMMAND_FLUSH,
+                                                             ThreadedSocketDriver::ref(channel)));
+    }
+}
+
+
+//! Closes the connection.
+void
+ThreadedSocket::close()
+{
+  watch_writable(false);
+  driver->post_command(new ThreadedSocketDriver::Command(ThreadedSocketDriver::COMMAND_CLOSE,
+                                                         ThreadedSocketDriver::ref(channel)));
+}
+
+
+//! Stores data received by the networking thread.
+void
+ThreadedSocket::receive(gchar *data, int size)
+{
+  input.append(data, size);
+}
+
+
+//! Marks the connection as closed by the remote end.
+void
+ThreadedSocket::set_eof()
+{
+  eof = true;
+}
+
+
+//! Marks the connection as failed.
+void
+ThreadedSocket::set_error()
+{
+  error = true;
+}
+
+
+//! Returns the number of received bytes that are not yet read.
+int
+ThreadedSocket::get_input_size() const
+{
+  return input.size();
+}
+
+
+//! Returns whether the listener must be notified of input.
+bool
+ThreadedSocket::has_input() const
+{
+  return !input.empty() || eof || error;
+}
+
+
+void
+ThreadedSocket::notify_connected()
+{
+  if (listener != NULL)
+    {
+      listener->socket_connected(this, user_data);
+    }
+}
+
+
+void
+ThreadedSocket::notify_io()
+{
+  if (listener != NULL)
+    {
+      listener->socket_io(this, user_data);
+    }
+}
+
+
+void
+ThreadedSocket::notify_writable()
+{
+  if (listener != NULL && watching)
+    {
+      watching = false;
+      listener->socket_writable(this, user_data);
+    }
+}
+
+
+void
+ThreadedSocket::notify_closed()
+{
+  if (listener != NULL)
+    {
+      listener->socket_closed(this, user_data);
+    }
+}
+
+
+//! Creates a proxy listen socket.
+ThreadedSocketServer::ThreadedSocketServer(ThreadedSocketDriver *driver, Channel *channel) :
+  driver(driver),
+  channel(ThreadedSocketDriver::ref(channel))
+{
+  channel->server_proxy = this;
+}
+
+
+//! Destructs the proxy, and the listen socket in the networking thread.
+ThreadedSocketServer::~ThreadedSocketServer()
+{
+  channel->server_proxy = NULL;
+
+  driver->post_command(new ThreadedSocketDriver::Command(ThreadedSocketDriver::COMMAND_DESTROY,
+                                                         ThreadedSocketDriver::ref(channel)));
+  ThreadedSocketDriver::unref(channel);
+}
+
+
+//! Listens at the specified port.
+/*!
+ *  Waits until the networking thread listens, so that a failure to bind
+ *  the port is reported to the caller.
+ *
+ *  	hrow SocketException if the networking thread cannot listen.
+ */
+void
+ThreadedSocketServer::listen(int port)
+{
+  ThreadedSocketDriver::Command *command =
+    new ThreadedSocketDriver::Command(ThreadedSocketDriver::COMMAND_LISTEN,
+                                      ThreadedSocketDriver::ref(channel));
+  command->port = port;
+
+  driver->execute_command(command);
+
+  bool failed = command->failed;
+  std::string error = command->error;
+  delete command;
+
+  if (failed)
+    {
+      throw SocketException(error);
+    }
+}
+
+
+//! Passes an accepted connection to the listener.
+void
+ThreadedSocketServer::notify_accepted(ISocket *socket)
+{
+  if (listener != NULL)
+    {
+      listener->socket_accepted(this, socket);
+    }
+  else
+    {
+      delete socket;
+    }
+}
+
+#endif
@@ -0,0 +1,279 @@
+// ThreadedSocketDriver.hh --- Socket driver with a networking thread
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef THREADEDSOCKETDRIVER_HH
+#define THREADEDSOCKETDRIVER_HH
+
+#if defined(HAVE_GIO_NET) && defined(HAVE_DISTRIBUTION)
+
+#include <string>
+#include <list>
+#include <map>
+
+#include <glib.h>
+
+#include "SocketDriver.hh"
+#include "SPSCQueue.hh"
+#include "Runnable.hh"
+
+//! Number of bytes read from a socket at once by the networking thread.
+#define THREADED_SOCKET_READ_SIZE (16384)
+
+//! Maximum number of bytes written to a socket that are not yet sent.
+#define THREADED_SOCKET_MAX_QUEUED (256 * 1024)
+
+class Thread;
+class ThreadedSocket;
+class ThreadedSocketServer;
+
+//! Socket driver that performs all socket I/O on a networking thread.
+/*!
+ *  The sockets of the wrapped driver run in a private GMainContext on the
+ *  networking thread, so that socket I/O is not delayed by the user
+ *  interface and vice versa. The sockets created by this driver are
+ *  proxies that are used from the main thread. Requests are passed to the
+ *  networking thread, and events back to the main thread, through
+ *  lock-free single-producer single-consumer queues. Events are delivered
+ *  to the listeners by dispatch(), which runs as soon as the main loop of
+ *  the main thread wakes up for them.
+ */
+class ThreadedSocketDriver :
+  public SocketDriver,
+  public ISocketListener,
+  public ISocketServerListener,
+  public Runnable
+{
+public:
+  ThreadedSocketDriver(SocketDriver *driver);
+  virtual ~ThreadedSocketDriver();
+
+  // SocketDriver interface
+  virtual ISocket *create_socket();
+  virtual ISocketServer *create_server();
+  virtual void dispatch();
+
+private:
+  friend class ThreadedSocket;
+  friend class ThreadedSocketServer;
+
+  //! Data written to a socket.
+  struct Chunk
+  {
+    gchar *data;
+    int size;
+    int offset;
+  };
+
+  //! State of a socket, shared by the main thread and the networking thread.
+  struct Channel
+  {
+    Channel() :
+      ref_count(1),
+      proxy(NULL),
+      server_proxy(NULL),
+      socket(NULL),
+      server(NULL),
+      closed(false),
+      queued(0),
+      notify_writable(0)
+    {
+    }
+
+    //! Reference count, updated atomically.
+    volatile gint ref_count;
+
+    //! Proxy of the socket, used by the main thread only.
+    ThreadedSocket *proxy;
+
+    //! Proxy of the listen socket, used by the main thread only.
+    ThreadedSocketServer *server_proxy;
+
+    //! Socket of the wrapped driver, used by the networking thread only.
+    ISocket *socket;
+
+    //! Listen socket of the wrapped driver, used by the networking thread only.
+    ISocketServer *server;
+
+    //! Data not yet written, used by the networking thread only.
+    std::list<Chunk> output;
+
+    //! Whether the connection was closed, used by the networking thread only.
+    bool closed;
+
+    //! Number of bytes in output, updated atomically.
+    volatile gint queued;
+
+    //! Whether the main thread wants to know that output is empty, updated atomically.
+    volatile gint notify_writable;
+  };
+
+  enum CommandType
+    {
+      COMMAND_CONNECT,
+      COMMAND_WRITE,
+      COMMAND_FLUSH,
+      COMMAND_CLOSE,
+      COMMAND_LISTEN,
+      COMMAND_DESTROY,
+    };
+
+  //! Request from the main thread to the networking thread.
+  struct Command
+  {
+    Command(CommandType type, Channel *channel) :
+      type(type),
+      channel(channel),
+      port(0),
+      reply(NULL),
+      failed(false)
+    {
+      chunk.data = NULL;
+      chunk.size = 0;
+      chunk.offset = 0;
+    }
+
+    CommandType type;
+    Channel *channel;
+    std::string host;
+    int port;
+    Chunk chunk;
+
+    //! Queue on which the main thread waits for the processed command, or NULL.
+    GAsyncQueue *reply;
+
+    //! Whether the command failed, and why.
+    bool failed;
+    std::string error;
+  };
+
+  enum EventType
+    {
+      EVENT_CONNECTED,
+      EVENT_DATA,
+      EVENT_EOF,
+      EVENT_ERROR,
+      EVENT_WRITABLE,
+      EVENT_CLOSED,
+      EVENT_ACCEPTED,
+    };
+
+  //! Notification from the networking thread to the main thread.
+  struct Event
+  {
+    Event(EventType type, Channel *channel) :
+      type(type),
+      channel(channel),
+      accepted(NULL),
+      data(NULL),
+      size(0)
+    {
+    }
+
+    EventType type;
+    Channel *channel;
+    Channel *accepted;
+    gchar *data;
+    int size;
+  };
+
+  //! Source that dispatches commands in the networking thread.
+  struct CommandSource
+  {
+    GSource source;
+    ThreadedSocketDriver *driver;
+  };
+
+  //! Source that dispatches events in the main thread.
+  struct EventSource
+  {
+    GSource source;
+    ThreadedSocketDriver *driver;
+  };
+
+private:
+  // Main thread
+  void post_command(Command *command);
+  void execute_command(Command *command);
+  void deliver_input(Channel *channel);
+
+  // Networking thread
+  virtual void run();
+  void process_commands();
+  void process_command(Command *command);
+  void post_event(EventType type, Channel *channel, gchar *data = NULL, int size = 0);
+  void flush(Channel *channel);
+  void close_channel(Channel *channel);
+
+  // ISocketListener, called in the networking thread.
+  virtual void socket_connected(ISocket *con, void *data);
+  virtual void socket_io(ISocket *con, void *data);
+  virtual void socket_writable(ISocket *con, void *data);
+  virtual void socket_closed(ISocket *con, void *data);
+
+  // ISocketServerListener, called in the networking thread.
+  virtual void socket_accepted(ISocketServer *server, ISocket *con);
+
+  static Channel *ref(Channel *channel);
+  static void unref(Channel *channel);
+
+  static gboolean command_prepare(GSource *source, gint *timeout);
+  static gboolean command_check(GSource *source);
+  static gboolean command_dispatch(GSource *source, GSourceFunc callback, gpointer user_data);
+
+  static gboolean event_prepare(GSource *source, gint *timeout);
+  static gboolean event_check(GSource *source);
+  static gboolean event_dispatch(GSource *source, GSourceFunc callback, gpointer user_data);
+
+private:
+  //! The wrapped driver, used by the networking thread only.
+  SocketDriver *driver;
+
+  //! Main context of the networking thread.
+  GMainContext *context;
+
+  //! Source that processes the commands.
+  GSource *command_source;
+
+  //! Main context of the main thread.
+  GMainContext *main_context;
+
+  //! Source that delivers the events.
+  GSource *event_source;
+
+  //! The networking thread.
+  Thread *thread;
+
+  //! Whether the networking thread must keep running, updated atomically.
+  volatile gint running;
+
+  //! Requests from the main thread.
+  SPSCQueue<Command *> commands;
+
+  //! Notifications for the main thread.
+  SPSCQueue<Event *> events;
+
+  //! Channels of the listen sockets, used by the networking thread only.
+  std::map<ISocketServer *, Channel *> servers;
+
+  static GSourceFuncs command_source_funcs;
+  static GSourceFuncs event_source_funcs;
+};
+
+#endif
+#endif // THREADEDSOCKETDRIVER_HH
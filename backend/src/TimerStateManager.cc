@@ -0,0 +1,491 @@
+// TimerStateManager.cc --- Distribution of timer state
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "debug.hh"
+
+#include <time.h>
+
+#include "TimerStateManager.hh"
+#include "Break.hh"
+#include "Timer.hh"
+#include "PacketBuffer.hh"
+
+
+//! Encodes a signed difference for a varint.
+static inline guint32
+zigzag_encode(guint32 value, guint32 base)
+{
+  gint32 diff = (gint32)(value - base);
+  return ((guint32) diff << 1) ^ (guint32)(diff >> 31);
+}
+
+
+//! Decodes a signed difference from a varint.
+static inline guint32
+zigzag_decode(guint32 data, guint32 base)
+{
+  guint32 diff = (data >> 1) ^ (guint32)(-(gint32)(data & 1));
+  return base + diff;
+}
+
+
+//! Constructs a new timer state manager.
+TimerStateManager::TimerStateManager(string myid, Break *breaks) :
+  myid(myid),
+  breaks(breaks),
+  sequence((guint32) time(NULL)),
+  updates_since_keyframe(0),
+  remote_sequence(0)
+{
+}
+
+
+//! A remote client has signed on.
+void
+TimerStateManager::signon_remote_client(string client_id)
+{
+  acks[client_id] = 0;
+}
+
+
+//! A remote client has signed off.
+void
+TimerStateManager::signoff_remote_client(string client_id)
+{
+  acks.erase(client_id);
+
+  if (client_id == remote_owner)
+    {
+      remote_owner = "";
+      remote_sequence = 0;
+    }
+}
+
+
+//! Packs the full state of all timers.
+void
+TimerStateManager::get_timer_state(PacketBuffer &buffer)
+{
+  TRACE_ENTER("TimerStateManager::get_timer_state");
+
+  for (int i = TIMER_KEYFRAME_HISTORY - 1; i > 0; i--)
+    {
+      keyframes[i] = keyframes[i - 1];
+    }
+
+  TimerState &state = keyframes[0];
+  capture(state);
+  state.sequence = ++sequence;
+  updates_since_keyframe = 0;
+
+  pack_keyframe(buffer, state);
+
+  TRACE_MSG("keyframe " << state.sequence);
+  TRACE_EXIT();
+}
+
+
+//! Packs the changes in the state of all timers.
+/*!
+ *  Returns the ID of the client message to send: DCM_TIMERS_DELTA if only
+ *  the changes are packed, or DCM_TIMERS if the full state is packed.
+ */
+DistributionClientMessageID
+TimerStateManager::get_timer_update(PacketBuffer &buffer)
+{
+  TRACE_ENTER("TimerStateManager::get_timer_update");
+
+  const TimerState *base = find_acked_keyframe();
+
+  if (base == NULL || updates_since_keyframe >= TIMER_KEYFRAME_INTERVAL)
+    {
+      get_timer_state(buffer);
+      TRACE_EXIT();
+      return DCM_TIMERS;
+    }
+
+  TimerState state;
+  capture(state);
+  state.sequence = ++sequence;
+  updates_since_keyframe++;
+
+  pack_delta(buffer, *base, state);
+
+  TRACE_MSG("delta " << state.sequence << " base " << base->sequence);
+  TRACE_EXIT();
+  return DCM_TIMERS_DELTA;
+}
+
+
+//! Sets the state of all timers from a full state.
+/*!
+ *  Returns true if the acknowledgement in ack must be sent.
+ */
+bool
+TimerStateManager::set_timer_state(const string &client_id, PacketBuffer &buffer, PacketBuffer &ack)
+{
+  TRACE_ENTER_MSG("TimerStateManager::set_timer_state", client_id);
+
+  TimerState state;
+
+  int num_breaks = buffer.unpack_ushort();
+
+  TRACE_MSG("numtimer = " << num_breaks);
+  for (int i = 0; i < num_breaks; i++)
+    {
+      gchar *id = buffer.unpack_string();
+      TRACE_MSG("id = " << id);
+
+      if (id == NULL)
+        {
+          TRACE_EXIT();
+          return false;
+        }
+
+      buffer.unpack_ushort();
+
+      guint32 fields[TIMER_STATE_FIELDS];
+      for (int f = 0; f < TIMER_STATE_FIELDS - 1; f++)
+        {
+          fields[f] = buffer.unpack_ulong();
+        }
+      fields[TIMER_STATE_FIELDS - 1] = buffer.unpack_ushort();
+
+      if (state.count < BREAK_ID_SIZEOF)
+        {
+          state.ids[state.count] = id;
+          for (int f = 0; f < TIMER_STATE_FIELDS; f++)
+            {
+              state.fields[state.count][f] = fields[f];
+            }
+          state.count++;
+        }
+
+      g_free(id);
+    }
+
+  apply(state);
+
+  bool ret = false;
+  if (buffer.bytes_available() >= 4)
+    {
+      // Sender supports updates.
+      state.sequence = buffer.unpack_ulong();
+
+      if (client_id != remote_owner)
+        {
+          for (int i = 0; i < TIMER_KEYFRAME_HISTORY; i++)
+            {
+              remote_keyframes[i] = TimerState();
+            }
+          remote_owner = client_id;
+        }
+
+      for (int i = TIMER_KEYFRAME_HISTORY - 1; i > 0; i--)
+        {
+          remote_keyframes[i] = remote_keyframes[i - 1];
+        }
+      remote_keyframes[0] = state;
+      remote_sequence = state.sequence;
+
+      pack_ack(ack, client_id, state.sequence);
+      ret = true;
+    }
+
+  TRACE_EXIT();
+  return ret;
+}
+
+
+//! Sets the state of all timers from the changes since a keyframe.
+/*!
+ *  Returns true if the acknowledgement in ack must be sent.
+ */
+bool
+TimerStateManager::set_timer_delta(const string &client_id, PacketBuffer &buffer, PacketBuffer &ack)
+{
+  TRACE_ENTER_MSG("TimerStateManager::set_timer_delta", client_id);
+
+  guint32 seq = buffer.unpack_ulong();
+  guint32 base_seq = buffer.unpack_ulong();
+
+  const TimerState *base = NULL;
+  if (client_id == remote_owner)
+    {
+      for (int i = 0; i < TIMER_KEYFRAME_HISTORY; i++)
+        {
+          if (remote_keyframes[i].sequence == base_seq && base_seq != 0)
+            {
+              base = &remote_keyframes[i];
+              break;
+            }
+        }
+    }
+
+  if (base == NULL)
+    {
+      // Unknown keyframe, request a new one.
+      TRACE_MSG("Unknown keyframe " << base_seq);
+      pack_ack(ack, client_id, 0);
+      TRACE_EXIT();
+      return true;
+    }
+
+  if ((gint32)(seq - remote_sequence) <= 0)
+    {
+      TRACE_MSG("Old update " << seq);
+      TRACE_EXIT();
+      return false;
+    }
+
+  TimerState state = *base;
+  state.sequence = seq;
+
+  int num_changed = buffer.unpack_varint();
+  for (int i = 0; i < num_changed; i++)
+    {
+      int index = buffer.unpack_varint();
+      guint32 mask = buffer.unpack_varint();
+
+      if (index >= state.count)
+        {
+          TRACE_MSG("Illegal timer " << index);
+          pack_ack(ack, client_id, 0);
+          TRACE_EXIT();
+          return true;
+        }
+
+      for (int f = 0; f < TIMER_STATE_FIELDS; f++)
+        {
+          if (mask & (1 << f))
+            {
+              state.fields[index][f] = zigzag_decode(buffer.unpack_varint(), base->fields[index][f]);
+            }
+        }
+    }
+
+  apply(state);
+  remote_sequence = seq;
+
+  TRACE_EXIT();
+  return false;
+}
+
+
+//! Processes the acknowledgement of a keyframe by a remote client.
+/*!
+ *  Returns true if the remote client needs a keyframe.
+ */
+bool
+TimerStateManager::set_timer_ack(const string &client_id, PacketBuffer &buffer)
+{
+  TRACE_ENTER_MSG("TimerStateManager::set_timer_ack", client_id);
+  bool ret = false;
+
+  gchar *owner = buffer.unpack_string();
+  guint32 seq = buffer.unpack_ulong();
+
+  if (owner != NULL && myid == owner)
+    {
+      AckMapIter it = acks.find(client_id);
+      if (it != acks.end())
+        {
+          TRACE_MSG("ack " << seq);
+          it->second = seq;
+          ret = (seq == 0);
+        }
+    }
+
+  g_free(owner);
+  TRACE_RETURN(ret);
+  return ret;
+}
+
+
+//! Retrieves the state of all timers.
+void
+TimerStateManager::capture(TimerState &state) const
+{
+  state.count = BREAK_ID_SIZEOF;
+
+  for (int i = 0; i < BREAK_ID_SIZEOF; i++)
+    {
+      Timer *t = breaks[i].get_timer();
+      state.ids[i] = t->get_id();
+
+      Timer::TimerStateData state_data;
+      t->get_state_data(state_data);
+
+      guint32 *fields = state.fields[i];
+      fields[0] = (guint32)state_data.current_time;
+      fields[1] = (guint32)state_data.elapsed_time;
+      fields[2] = (guint32)state_data.elapsed_idle_time;
+      fields[3] = (guint32)state_data.last_pred_reset_time;
+      fields[4] = (guint32)state_data.total_overdue_time;
+      fields[5] = (guint32)state_data.last_limit_time;
+      fields[6] = (guint32)state_data.last_limit_elapsed;
+      fields[7] = (guint16)state_data.snooze_inhibited;
+    }
+}
+
+
+//! Sets the state of all timers.
+void
+TimerStateManager::apply(const TimerState &state) const
+{
+  for (int i = 0; i < state.count; i++)
+    {
+      Timer *t = NULL;
+      for (int b = 0; b < BREAK_ID_SIZEOF; b++)
+        {
+          if (breaks[b].get_timer()->get_id() == state.ids[i])
+            {
+              t = breaks[b].get_timer();
+              break;
+            }
+        }
+
+      const guint32 *fields = state.fields[i];
+
+      Timer::TimerStateData state_data;
+      state_data.current_time = fields[0];
+      state_data.elapsed_time = fields[1];
+      state_data.elapsed_idle_time = fields[2];
+      state_data.last_pred_reset_time = fields[3];
+      state_data.total_overdue_time = fields[4];
+      state_data.last_limit_time = fields[5];
+      state_data.last_limit_elapsed = fields[6];
+      state_data.snooze_inhibited = fields[7];
+
+      if (t != NULL)
+        {
+          t->set_state_data(state_data);
+        }
+    }
+}
+
+
+//! Returns the most recent keyframe that is acknowledged by all remote clients.
+const TimerStateManager::TimerState *
+TimerStateManager::find_acked_keyframe() const
+{
+  for (int i = 0; i < TIMER_KEYFRAME_HISTORY; i++)
+    {
+      const TimerState &kf = keyframes[i];
+      bool acked = (kf.sequence != 0);
+
+      for (AckMap::const_iterator it = acks.begin(); acked && it != acks.end(); it++)
+        {
+          acked = (it->second != 0 && (gint32)(it->second - kf.sequence) >= 0);
+        }
+
+      if (acked)
+        {
+          return &kf;
+        }
+    }
+
+  return NULL;
+}
+
+
+//! Packs a keyframe in the format of DCM_TIMERS.
+void
+TimerStateManager::pack_keyframe(PacketBuffer &buffer, const TimerState &state) const
+{
+  buffer.pack_ushort(state.count);
+
+  for (int i = 0; i < state.count; i++)
+    {
+      buffer.pack_string(state.ids[i].c_str());
+
+      int pos = buffer.bytes_written();
+
+      buffer.pack_ushort(0);
+      for (int f = 0; f < TIMER_STATE_FIELDS - 1; f++)
+        {
+          buffer.pack_ulong(state.fields[i][f]);
+        }
+      buffer.pack_ushort((guint16)state.fields[i][TIMER_STATE_FIELDS - 1]);
+
+      buffer.poke_ushort(pos, buffer.bytes_written() - pos);
+    }
+
+  // Ignored by clients that do not support updates.
+  buffer.pack_ulong(state.sequence);
+}
+
+
+//! Packs the fields that differ between a keyframe and the current state.
+void
+TimerStateManager::pack_delta(PacketBuffer &buffer, const TimerState &base, const TimerState &state) const
+{
+  guint32 masks[BREAK_ID_SIZEOF];
+  int num_changed = 0;
+
+  for (int i = 0; i < state.count; i++)
+    {
+      masks[i] = 0;
+      for (int f = 0; f < TIMER_STATE_FIELDS; f++)
+        {
+          if (state.fields[i][f] != base.fields[i][f])
+            {
+              masks[i] |= (1 << f);
+            }
+        }
+
+      if (masks[i] != 0)
+        {
+          num_changed++;
+        }
+    }
+
+  buffer.pack_ulong(state.sequence);
+  buffer.pack_ulong(base.sequence);
+  buffer.pack_varint(num_changed);
+
+  for (int i = 0; i < state.count; i++)
+    {
+      if (masks[i] != 0)
+        {
+          buffer.pack_varint(i);
+          buffer.pack_varint(masks[i]);
+
+          for (int f = 0; f < TIMER_STATE_FIELDS; f++)
+            {
+              if (masks[i] & (1 << f))
+                {
+                  buffer.pack_varint(zigzag_encode(state.fields[i][f], base.fields[i][f]));
+                }
+            }
+        }
+    }
+}
+
+
+//! Packs the acknowledgement of a keyframe.
+void
+TimerStateManager::pack_ack(PacketBuffer &buffer, const string &owner, guint32 sequence) const
+{
+  buffer.pack_string(owner.c_str());
+  buffer.pack_ulong(sequence);
+}
@@ -0,0 +1,133 @@
+// TimerStateManager.hh --- Distribution of timer state
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TIMERSTATEMANAGER_HH
+#define TIMERSTATEMANAGER_HH
+
+#include <string>
+#include <map>
+
+#include "glib.h"
+
+#include "ICore.hh"
+#include "IDistributionClientMessage.hh"
+
+using namespace std;
+using namespace workrave;
+
+class Break;
+class PacketBuffer;
+
+//! Number of fields in the state of a timer.
+#define TIMER_STATE_FIELDS (8)
+
+//! Number of updates after which a full state is sent.
+#define TIMER_KEYFRAME_INTERVAL (32)
+
+//! Number of full states remembered by the sender and receivers.
+#define TIMER_KEYFRAME_HISTORY (2)
+
+//! Replicates the state of the timers to remote clients.
+/*!
+ *  The master sends the full state (a keyframe) as a DCM_TIMERS message,
+ *  with a sequence number appended. Clients that understand the sequence
+ *  number acknowledge each keyframe. Once all clients acknowledged a
+ *  keyframe, the master only sends the fields that changed since that
+ *  keyframe as a DCM_TIMERS_DELTA message. Clients that cannot decode an
+ *  update acknowledge sequence number 0, which forces a new keyframe.
+ */
+class TimerStateManager
+{
+private:
+  //! State of all timers.
+  struct TimerState
+  {
+    TimerState() :
+      sequence(0),
+      count(0)
+    {
+    }
+
+    //! Sequence number.
+    guint32 sequence;
+
+    //! Number of timers.
+    int count;
+
+    //! Timer IDs.
+    string ids[BREAK_ID_SIZEOF];
+
+    //! Timer state, as sent over the network.
+    guint32 fields[BREAK_ID_SIZEOF][TIMER_STATE_FIELDS];
+  };
+
+  typedef map<string, guint32> AckMap;
+  typedef AckMap::iterator AckMapIter;
+
+public:
+  TimerStateManager(string myid, Break *breaks);
+
+  void signon_remote_client(string client_id);
+  void signoff_remote_client(string client_id);
+
+  void get_timer_state(PacketBuffer &buffer);
+  DistributionClientMessageID get_timer_update(PacketBuffer &buffer);
+
+  bool set_timer_state(const string &client_id, PacketBuffer &buffer, PacketBuffer &ack);
+  bool set_timer_delta(const string &client_id, PacketBuffer &buffer, PacketBuffer &ack);
+  bool set_timer_ack(const string &client_id, PacketBuffer &buffer);
+
+private:
+  void capture(TimerState &state) const;
+  void apply(const TimerState &state) const;
+  const TimerState *find_acked_keyframe() const;
+
+  void pack_keyframe(PacketBuffer &buffer, const TimerState &state) const;
+  void pack_delta(PacketBuffer &buffer, const TimerState &base, const TimerState &state) const;
+  void pack_ack(PacketBuffer &buffer, const string &owner, guint32 sequence) const;
+
+private:
+  //! My ID
+  string myid;
+
+  //! The breaks, whose timers are replicated.
+  Break *breaks;
+
+  //! Sequence number of the most recent update I sent.
+  guint32 sequence;
+
+  //! Number of updates sent since the last keyframe.
+  int updates_since_keyframe;
+
+  //! Keyframes I sent, most recent first.
+  TimerState keyframes[TIMER_KEYFRAME_HISTORY];
+
+  //! Most recent keyframe acknowledged by each remote client.
+  AckMap acks;
+
+  //! ID of the client that sent the remote keyframes.
+  string remote_owner;
+
+  //! Sequence number of the most recent update received.
+  guint32 remote_sequence;
+
+  //! Keyframes received, most recent first.
+  TimerState remote_keyframes[TIMER_KEYFRAME_HISTORY];
+};
+
+#endif // TIMERSTATEMANAGER_HH
@@ -0,0 +1,110 @@
+#!/usr/bin/python
+#
+# Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+# All rights reserved.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3, or (at your option)
+# any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+#
+"""
+Lists the frames of network captures made by Workrave.
+
+Start the node that captures with WORKRAVE_CAPTURE=<file> in the
+environment. To measure how fast the received frames are processed,
+replay the capture with backend/test/distribution-replay, preferably
+under a profiler. It processes the frames on a link that is not
+connected to any peer or core.
+"""
+
+import sys
+import struct
+
+from optparse import OptionParser
+
+CAPTURE_MAGIC = 0x57524350
+CAPTURE_VERSION = 1
+
+COMMANDS = { 0x01 : "hello",
+             0x02 : "claim",
+             0x03 : "client-list",
+             0x04 : "welcome",
+             0x05 : "new-master",
+             0x06 : "client-message",
+             0x07 : "duplicate",
+             0x08 : "claim-reject",
+             0x09 : "signoff",
+             0x0A : "prune",
+             0x0B : "ping",
+             0x0C : "pong",
+             0x0D : "ack",
+             0x0E : "master-lease" }
+
+def read_frames(filename):
+    f = open(filename, "rb")
+
+    header = f.read(8)
+    if len(header) != 8:
+        raise IOError("%s: not a capture file" % filename)
+
+    magic, version, reserved = struct.unpack(">IHH", header)
+    if magic != CAPTURE_MAGIC or version != CAPTURE_VERSION:
+        raise IOError("%s: not a capture file" % filename)
+
+    while True:
+        header = f.read(17)
+        if len(header) != 17:
+            break
+
+        time, direction, client, size = struct.unpack(">qBII", header)
+        data = f.read(size)
+        if len(data) != size:
+            break
+
+        yield time, direction, client, data
+
+    f.close()
+
+def get_command(data):
+    # Version 2 frames start with a zero size and a 32-bit length.
+    offset = 4
+    if struct.unpack(">H", data[0:2])[0] == 0:
+        offset = 8
+
+    if len(data) < offset + 2:
+        return "?"
+
+    cmd = struct.unpack(">H", data[offset:offset + 2])[0]
+    return COMMANDS.get(cmd, "0x%04x" % cmd)
+
+def dump(filename):
+    start = None
+    for time, direction, client, data in read_frames(filename):
+        if start is None:
+            start = time
+
+        print("%12.6f %s %08x %8d %s" % ((time - start) / 1000000.0,
+                                          direction == 0 and "<" or ">",
+                                          client,
+                                          len(data),
+                                          get_command(data)))
+
+def main():
+    parser = OptionParser(usage="%prog CAPTURE")
+
+    options, args = parser.parse_args()
+    if len(args) != 1:
+        parser.error("no capture file specified")
+
+    dump(args[0])
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,515 @@
+// EvdevInputMonitor.cc --- ActivityMonitor based on Linux input devices
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_EVDEV)
+
+#include "debug.hh"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#if HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "EvdevInputMonitor.hh"
+
+#include "Thread.hh"
+
+using namespace std;
+
+//! Virtual pointer position around which the relative motion is summed.
+#define EVDEV_ORIGIN (1 << 20)
+
+
+EvdevInputMonitor::EvdevInputMonitor() :
+  epoll_fd(-1),
+  inotify_fd(-1),
+  abort(false),
+  x(EVDEV_ORIGIN),
+  y(EVDEV_ORIGIN),
+  wheel(0),
+  moved(false)
+{
+  wakeup_pipe[0] = -1;
+  wakeup_pipe[1] = -1;
+  monitor_thread = new Thread(this);
+  enable_mouse_decimation();
+}
+
+
+EvdevInputMonitor::~EvdevInputMonitor()
+{
+  TRACE_ENTER("EvdevInputMonitor::~EvdevInputMonitor");
+  if (monitor_thread != NULL)
+    {
+      monitor_thread->wait();
+      delete monitor_thread;
+    }
+
+  while (!devices.empty())
+    {
+      remove_device(devices.begin()->first);
+    }
+
+  int fds[] = { inotify_fd, epoll_fd, wakeup_pipe[0], wakeup_pipe[1] };
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+    {
+      if (fds[i] != -1)
+        {
+          close(fds[i]);
+        }
+    }
+  TRACE_EXIT();
+}
+
+
+//! Starts monitoring.
+/*!
+ *  If no devices were added before, all input devices in EVDEV_INPUT_DIR
+ *  that can be read are used, and new devices are added when they
+ *  appear. Fails if there are no devices.
+ */
+bool
+EvdevInputMonitor::init()
+{
+  TRACE_ENTER("EvdevInputMonitor::init");
+
+  if (epoll_fd == -1)
+    {
+      epoll_fd = epoll_create(EVDEV_MAX_READY);
+    }
+
+  if (epoll_fd == -1 || pipe(wakeup_pipe) != 0)
+    {
+      TRACE_RETURN("Cannot create epoll set");
+      return false;
+    }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = wakeup_pipe[0];
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_pipe[0], &ev);
+
+  if (devices.empty())
+    {
+      inotify_fd = inotify_init();
+      if (inotify_fd != -1)
+        {
+          fcntl(inotify_fd, F_SETFL, O_NONBLOCK);
+
+          // Permissions of a new device are set after it is created.
+          if (inotify_add_watch(inotify_fd, EVDEV_INPUT_DIR, IN_CREATE | IN_ATTRIB) != -1)
+            {
+              ev.data.fd = inotify_fd;
+              epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev);
+            }
+        }
+
+      scan_devices();
+    }
+
+  bool ok = !devices.empty();
+  if (ok)
+    {
+      monitor_thread->start();
+    }
+
+  TRACE_RETURN(ok << " " << devices.size());
+  return ok;
+}
+
+
+void
+EvdevInputMonitor::terminate()
+{
+  TRACE_ENTER("EvdevInputMonitor::terminate");
+
+  abort = true;
+  if (wakeup_pipe[1] != -1)
+    {
+      char c = 0;
+      while (write(wakeup_pipe[1], &c, 1) == -1 && errno == EINTR)
+        {
+        }
+    }
+  monitor_thread->wait();
+
+  TRACE_EXIT();
+}
+
+
+//! Reads events from the specified file descriptor, and takes ownership of it.
+/*!
+ *  The descriptor can be an input device, e.g. one obtained from logind,
+ *  or any stream of input events. Must be called before init.
+ */
+bool
+EvdevInputMonitor::add_device(int fd, const string &path)
+{
+  TRACE_ENTER_MSG("EvdevInputMonitor::add_device", fd << " " << path);
+
+  if (epoll_fd == -1)
+    {
+      epoll_fd = epoll_create(EVDEV_MAX_READY);
+    }
+
+  if (fd < 0 || epoll_fd == -1)
+    {
+      TRACE_RETURN(false);
+      return false;
+    }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  Device &device = devices[fd];
+  device.path = path;
+  device.abs_x = 0;
+  device.abs_y = 0;
+  device.abs_valid = false;
+  device.partial_size = 0;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+
+  // Regular files cannot be polled.
+  device.pollable = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+
+  TRACE_RETURN(device.pollable);
+  return true;
+}
+
+
+void
+EvdevInputMonitor::run()
+{
+  TRACE_ENTER("EvdevInputMonitor::run");
+
+  map<int, Device>::iterator i = devices.begin();
+  while (i != devices.end())
+    {
+      int fd = i->first;
+      Device &device = i->second;
+      i++;
+
+      if (!device.pollable)
+        {
+          while (!abort && read_device(fd, device))
+            {
+              flush_motion();
+            }
+          flush_motion();
+          remove_device(fd);
+        }
+    }
+
+  while (!abort)
+    {
+      struct epoll_event events[EVDEV_MAX_READY];
+      int count = epoll_wait(epoll_fd, events, EVDEV_MAX_READY, get_mouse_timeout());
+
+      if (count == -1 && errno != EINTR)
+        {
+          TRACE_MSG("epoll_wait failed " << errno);
+          break;
+        }
+
+      if (count == 0)
+        {
+          // Mouse movement was combined and is now due.
+          flush_mouse();
+        }
+
+      for (int j = 0; j < count && !abort; j++)
+        {
+          int fd = events[j].data.fd;
+
+          if (fd == inotify_fd)
+            {
+              process_hotplug();
+            }
+          else if (fd != wakeup_pipe[0])
+            {
+              map<int, Device>::iterator d = devices.find(fd);
+              if (d != devices.end() && !read_device(fd, d->second))
+                {
+                  TRACE_MSG("Device removed " << d->second.path);
+                  remove_device(fd);
+                }
+            }
+        }
+
+      flush_motion();
+    }
+
+  TRACE_EXIT();
+}
+
+
+//! Opens all input devices.
+void
+EvdevInputMonitor::scan_devices()
+{
+  DIR *dir = opendir(EVDEV_INPUT_DIR);
+  if (dir != NULL)
+    {
+      struct dirent *entry;
+      while ((entry = readdir(dir)) != NULL)
+        {
+          if (strncmp(entry->d_name, "event", 5) == 0)
+            {
+              open_device(entry->d_name);
+            }
+        }
+      closedir(dir);
+    }
+}
+
+
+//! Opens the specified input device, unless it is already open.
+void
+EvdevInputMonitor::open_device(const string &name)
+{
+  string path = string(EVDEV_INPUT_DIR) + "/" + name;
+
+  for (map<int, Device>::iterator i = devices.begin(); i != devices.end(); i++)
+    {
+      if (i->second.path == path)
+        {
+          return;
+        }
+    }
+
+  int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+  if (fd == -1)
+    {
+      return;
+    }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  // Only keyboards and pointing devices, not switches or sensors that
+  // report events without any user activity.
+  unsigned long types = 0;
+  if (ioctl(fd, EVIOCGBIT(0, sizeof(types)), &types) == -1 ||
+      !(types & ((1 << EV_KEY) | (1 << EV_REL))))
+    {
+      close(fd);
+      return;
+    }
+
+  add_device(fd, path);
+}
+
+
+//! Stops reading the specified device, and closes it.
+void
+EvdevInputMonitor::remove_device(int fd)
+{
+  map<int, Device>::iterator i = devices.find(fd);
+  if (i != devices.end())
+    {
+      if (i->second.pollable)
+        {
+          epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        }
+      close(fd);
+      devices.erase(i);
+    }
+}
+
+
+//! Opens the devices that appeared in EVDEV_INPUT_DIR.
+void
+EvdevInputMonitor::process_hotplug()
+{
+  char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  int size;
+
+  while ((size = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+      for (char *ptr = buffer; ptr < buffer + size; )
+        {
+          struct inotify_event *event = (struct inotify_event *) ptr;
+
+          if (event->len > 0 && strncmp(event->name, "event", 5) == 0)
+            {
+              open_device(event->name);
+            }
+          ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+
+//! Reads and processes the available events of a device with a single read.
+/*!
+ *  Returns false if the device is removed, or the stream ended.
+ */
+bool
+EvdevInputMonitor::read_device(int fd, Device &device)
+{
+  struct input_event events[EVDEV_READ_EVENTS];
+  char *buffer = (char *) events;
+
+  memcpy(buffer, device.partial, device.partial_size);
+
+  int size;
+  do
+    {
+      size = read(fd, buffer + device.partial_size, sizeof(events) - device.partial_size);
+    }
+  while (size == -1 && errno == EINTR);
+
+  if (size == -1)
+    {
+      return errno == EAGAIN && device.pollable;
+    }
+  else if (size == 0)
+    {
+      return false;
+    }
+
+  size += device.partial_size;
+
+  int count = size / sizeof(struct input_event);
+  for (int i = 0; i < count; i++)
+    {
+      process_event(device, events[i]);
+    }
+
+  // Streams other than devices may end in the middle of an event.
+  device.partial_size = size % sizeof(struct input_event);
+  memcpy(device.partial, buffer + count * sizeof(struct input_event), device.partial_size);
+
+  return true;
+}
+
+
+//! Processes a single input event.
+void
+EvdevInputMonitor::process_event(Device &device, const struct input_event &event)
+{
+  switch (event.type)
+    {
+    case EV_REL:
+      if (event.code == REL_X)
+        {
+          x += event.value;
+          moved = true;
+        }
+      else if (event.code == REL_Y)
+        {
+          y += event.value;
+          moved = true;
+        }
+      else if (event.code == REL_WHEEL || event.code == REL_HWHEEL)
+        {
+          wheel += event.value;
+        }
+      break;
+
+    case EV_ABS:
+      // Touchpads and tablets report absolute positions; only the
+      // motion while touching moves the pointer.
+      if (event.code == ABS_X)
+        {
+          if (device.abs_valid)
+            {
+              x += event.value - device.abs_x;
+              moved = true;
+            }
+          device.abs_x = event.value;
+        }
+      else if (event.code == ABS_Y)
+        {
+          if (device.abs_valid)
+            {
+              y += event.value - device.abs_y;
+              moved = true;
+            }
+          device.abs_y = event.value;
+        }
+      break;
+
+    case EV_KEY:
+      if (event.code >= BTN_DIGI && event.code < BTN_WHEEL)
+        {
+          // Touch and tool changes.
+          device.abs_valid = false;
+        }
+      else if (event.code >= BTN_MISC && event.code < KEY_OK)
+        {
+          if (event.value == 0 || event.value == 1)
+            {
+              fire_button(event.value == 1);
+            }
+        }
+      else if (event.value == 1 || event.value == 2)
+        {
+          fire_keyboard(event.value == 2);
+        }
+      break;
+
+    case EV_SYN:
+      if (event.code == SYN_REPORT)
+        {
+          device.abs_valid = true;
+        }
+      else if (event.code == SYN_DROPPED)
+        {
+          device.abs_valid = false;
+        }
+      break;
+    }
+}
+
+
+//! Reports the motion since the last report.
+void
+EvdevInputMonitor::flush_motion()
+{
+  if (moved || wheel != 0)
+    {
+      // Restart around the origin long before the position overflows.
+      // The listeners ignore the jump in position.
+      if (x < 0 || y < 0 || x > 2 * EVDEV_ORIGIN || y > 2 * EVDEV_ORIGIN)
+        {
+          x = EVDEV_ORIGIN;
+          y = EVDEV_ORIGIN;
+        }
+
+      fire_mouse(x, y, wheel);
+
+      moved = false;
+      wheel = 0;
+    }
+}
+
+#endif
@@ -0,0 +1,138 @@
+// EvdevInputMonitor.hh --- ActivityMonitor based on Linux input devices
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef EVDEVINPUTMONITOR_HH
+#define EVDEVINPUTMONITOR_HH
+
+#if defined(HAVE_EVDEV)
+
+#include <string>
+#include <map>
+
+#include <linux/input.h>
+
+#include "InputMonitor.hh"
+
+#include "Runnable.hh"
+#include "Thread.hh"
+
+//! Directory that contains the input devices.
+#define EVDEV_INPUT_DIR "/dev/input"
+
+//! Maximum number of events read from a device at once.
+#define EVDEV_READ_EVENTS (64)
+
+//! Maximum number of ready devices handled per wakeup.
+#define EVDEV_MAX_READY (16)
+
+//! Activity monitor that reads the Linux input devices directly.
+/*!
+ *  This monitor does not need an X server, so it also works in Wayland
+ *  and headless sessions. All devices are watched by a single epoll set
+ *  in the monitor thread, which only wakes up when there is input. New
+ *  devices in EVDEV_INPUT_DIR are picked up through inotify.
+ *
+ *  Devices can also be passed in as file descriptors, e.g. the ones
+ *  handed out by logind, or a pipe or recorded event stream. Streams
+ *  that cannot be polled, like regular files, are read completely when
+ *  the monitor starts.
+ */
+class EvdevInputMonitor :
+  public InputMonitor,
+  public Runnable
+{
+public:
+  //! Constructor.
+  EvdevInputMonitor();
+
+  //! Destructor.
+  virtual ~EvdevInputMonitor();
+
+  //! Initialize
+  virtual bool init();
+
+  //! Terminate the monitor.
+  virtual void terminate();
+
+  //! Reads events from the specified file descriptor, and takes ownership of it.
+  bool add_device(int fd, const std::string &path = "");
+
+private:
+  //! Input device that is being read.
+  struct Device
+  {
+    //! Path of the device, or empty if passed in as file descriptor.
+    std::string path;
+
+    //! Whether the device is watched by the epoll set.
+    bool pollable;
+
+    //! Last absolute position, valid while touching.
+    int abs_x;
+    int abs_y;
+    bool abs_valid;
+
+    //! Events that are not yet complete.
+    char partial[sizeof(struct input_event)];
+    int partial_size;
+  };
+
+  //! The monitor's execution thread.
+  virtual void run();
+
+  void scan_devices();
+  void open_device(const std::string &name);
+  void remove_device(int fd);
+  void process_hotplug();
+  bool read_device(int fd, Device &device);
+  void process_event(Device &device, const struct input_event &event);
+  void flush_motion();
+
+private:
+  //! Devices, by file descriptor.
+  std::map<int, Device> devices;
+
+  //! The epoll set.
+  int epoll_fd;
+
+  //! Watches EVDEV_INPUT_DIR for new devices, or -1.
+  int inotify_fd;
+
+  //! Pipe that wakes up the monitor thread on termination.
+  int wakeup_pipe[2];
+
+  //! Abort the main loop
+  volatile bool abort;
+
+  //! The activity monitor thread.
+  Thread *monitor_thread;
+
+  //! Pointer position derived from the motion of all devices.
+  int x;
+  int y;
+
+  //! Wheel motion since the last report.
+  int wheel;
+
+  //! Whether the pointer moved since the last report.
+  bool moved;
+};
+
+#endif
+#endif // EVDEVINPUTMONITOR_HH
@@ -110,6 +110,10 @@ RecordInputMonitor::RecordInputMonitor(const string &display_name) :
 
   x11_display_name = display_name;
   monitor_thread = new Thread(this);
+
+  // The record callbacks cannot time out, so the main loop reports the
+  // combined mouse movement.
+  enable_mouse_decimation(true);
 }
 
 
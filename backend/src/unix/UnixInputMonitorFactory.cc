@@ -36,6 +36,8 @@
 #include "RecordInputMonitor.hh"
 #include "X11InputMonitor.hh"
 #include "XScreenSaverMonitor.hh"
+#include "XInput2Monitor.hh"
+#include "EvdevInputMonitor.hh"
 
 UnixInputMonitorFactory::UnixInputMonitorFactory()
   : error_reported(false)
@@ -97,12 +99,24 @@ UnixInputMonitorFactory::get_monitor(IInputMonitorFactory::MonitorCapability cap
             }
           else if (actual_monitor_method == "screensaver")
             {
-              monitor = new XScreenSaverMonitor();
+              monitor = new XScreenSaverMonitor(display);
             }
           else if (actual_monitor_method == "x11events")
             {
               monitor = new X11InputMonitor(display);
             }
+#if defined(HAVE_XI2)
+          else if (actual_monitor_method == "xinput2")
+            {
+              monitor = new XInput2Monitor(display);
+            }
+#endif
+#if defined(HAVE_EVDEV)
+          else if (actual_monitor_method == "evdev")
+            {
+              monitor = new EvdevInputMonitor();
+            }
+#endif
 
           initialized = monitor->init();
 
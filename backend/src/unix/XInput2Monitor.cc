@@ -0,0 +1,394 @@
+// XInput2Monitor.cc --- ActivityMonitor for X11 based on XInput2 raw events
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#if defined(HAVE_XI2)
+
+#include "debug.hh"
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#if HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include <X11/X.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+
+#include "XInput2Monitor.hh"
+
+#include "Thread.hh"
+
+using namespace std;
+
+//! Virtual pointer position around which the motion deltas are summed.
+#define XINPUT2_ORIGIN (1 << 20)
+
+
+XInput2Monitor::XInput2Monitor(const string &display_name) :
+  x11_display(NULL),
+  xi_opcode(0),
+  abort(false),
+  x(XINPUT2_ORIGIN),
+  y(XINPUT2_ORIGIN)
+{
+  x11_display_name = display_name;
+  wakeup_pipe[0] = -1;
+  wakeup_pipe[1] = -1;
+  monitor_thread = new Thread(this);
+  enable_mouse_decimation();
+}
+
+
+XInput2Monitor::~XInput2Monitor()
+{
+  TRACE_ENTER("XInput2Monitor::~XInput2Monitor");
+  if (monitor_thread != NULL)
+    {
+      monitor_thread->wait();
+      delete monitor_thread;
+    }
+
+  if (x11_display != NULL)
+    {
+      XCloseDisplay(x11_display);
+    }
+
+  for (int i = 0; i < 2; i++)
+    {
+      if (wakeup_pipe[i] != -1)
+        {
+          close(wakeup_pipe[i]);
+        }
+    }
+  TRACE_EXIT();
+}
+
+
+bool
+XInput2Monitor::init()
+{
+  bool ok = init_xinput2();
+  if (ok)
+    {
+      monitor_thread->start();
+    }
+  return ok;
+}
+
+
+void
+XInput2Monitor::terminate()
+{
+  TRACE_ENTER("XInput2Monitor::terminate");
+
+  abort = true;
+  if (wakeup_pipe[1] != -1)
+    {
+      char c = 0;
+      while (write(wakeup_pipe[1], &c, 1) == -1 && errno == EINTR)
+        {
+        }
+    }
+  monitor_thread->wait();
+
+  TRACE_EXIT();
+}
+
+
+//! Selects the raw events on the root window.
+/*!
+ *  Raw events are only delivered to the root window by XInput 2.1 and
+ *  later.
+ */
+bool
+XInput2Monitor::init_xinput2()
+{
+  TRACE_ENTER("XInput2Monitor::init_xinput2");
+
+  if ((x11_display = XOpenDisplay(x11_display_name.c_str())) == NULL)
+    {
+      TRACE_RETURN("Cannot open display");
+      return false;
+    }
+
+  int event_base = 0;
+  int error_base = 0;
+  int major = 2;
+  int minor = 1;
+
+  if (!XQueryExtension(x11_display, "XInputExtension", &xi_opcode, &event_base, &error_base) ||
+      XIQueryVersion(x11_display, &major, &minor) != Success ||
+      major < 2 || (major == 2 && minor < 1) ||
+      pipe(wakeup_pipe) != 0)
+    {
+      XCloseDisplay(x11_display);
+      x11_display = NULL;
+      TRACE_RETURN("XInput 2.1 not available");
+      return false;
+    }
+
+  fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+
+  unsigned char mask_bits[XIMaskLen(XI_LASTEVENT)];
+  memset(mask_bits, 0, sizeof(mask_bits));
+  XISetMask(mask_bits, XI_RawMotion);
+  XISetMask(mask_bits, XI_RawKeyPress);
+  XISetMask(mask_bits, XI_RawButtonPress);
+  XISetMask(mask_bits, XI_RawButtonRelease);
+
+  // Added, removed and reconfigured devices invalidate the known axes.
+  unsigned char hierarchy_bits[XIMaskLen(XI_LASTEVENT)];
+  memset(hierarchy_bits, 0, sizeof(hierarchy_bits));
+  XISetMask(hierarchy_bits, XI_HierarchyChanged);
+  XISetMask(hierarchy_bits, XI_DeviceChanged);
+
+  // Master devices report each event of their physical devices once.
+  XIEventMask mask[2];
+  mask[0].deviceid = XIAllMasterDevices;
+  mask[0].mask_len = sizeof(mask_bits);
+  mask[0].mask = mask_bits;
+  mask[1].deviceid = XIAllDevices;
+  mask[1].mask_len = sizeof(hierarchy_bits);
+  mask[1].mask = hierarchy_bits;
+
+  XISelectEvents(x11_display, DefaultRootWindow(x11_display), mask, 2);
+  XSync(x11_display, False);
+
+  TRACE_RETURN(major << "." << minor);
+  return true;
+}
+
+
+void
+XInput2Monitor::run()
+{
+  TRACE_ENTER("XInput2Monitor::run");
+
+  struct pollfd fds[2];
+  fds[0].fd = ConnectionNumber(x11_display);
+  fds[0].events = POLLIN;
+  fds[1].fd = wakeup_pipe[0];
+  fds[1].events = POLLIN;
+
+  while (!abort)
+    {
+      // Also processes the events that Xlib already read from the
+      // connection, which poll does not report.
+      while (XPending(x11_display) > 0)
+        {
+          XEvent event;
+          XNextEvent(x11_display, &event);
+
+          XGenericEventCookie *cookie = &event.xcookie;
+          if (cookie->type == GenericEvent && cookie->extension == xi_opcode &&
+              XGetEventData(x11_display, cookie))
+            {
+              handle_event((XIRawEvent *) cookie->data);
+              XFreeEventData(x11_display, cookie);
+            }
+        }
+
+      if (abort)
+        {
+          break;
+        }
+
+      int count = poll(fds, 2, get_mouse_timeout());
+      if (count == -1 && errno != EINTR)
+        {
+          TRACE_MSG("poll failed " << errno);
+          break;
+        }
+
+      if (count == 0)
+        {
+          // Mouse movement was combined and is now due.
+          flush_mouse();
+        }
+
+      if (fds[0].revents & (POLLERR | POLLHUP))
+        {
+          TRACE_MSG("X connection lost");
+          break;
+        }
+    }
+
+  TRACE_EXIT();
+}
+
+
+void
+XInput2Monitor::handle_event(XIRawEvent *event)
+{
+  switch (event->evtype)
+    {
+    case XI_RawMotion:
+      handle_motion(event);
+      break;
+
+    case XI_RawKeyPress:
+      // Raw events are not sent for auto-repeated keys.
+      fire_keyboard(false);
+      break;
+
+    case XI_RawButtonPress:
+      handle_button(event, true);
+      break;
+
+    case XI_RawButtonRelease:
+      handle_button(event, false);
+      break;
+
+    case XI_HierarchyChanged:
+    case XI_DeviceChanged:
+      devices.clear();
+      break;
+    }
+}
+
+
+//! Returns the axes of a physical device, querying them once.
+XInput2Monitor::Device &
+XInput2Monitor::get_device(int deviceid)
+{
+  TRACE_ENTER_MSG("XInput2Monitor::get_device", deviceid);
+
+  std::map<int, Device>::iterator it = devices.find(deviceid);
+  if (it != devices.end())
+    {
+      TRACE_EXIT();
+      return it->second;
+    }
+
+  Device &device = devices[deviceid];
+  for (int i = 0; i < 2; i++)
+    {
+      device.axis[i].absolute = false;
+      device.axis[i].scale = 1.0;
+      device.axis[i].last = 0.0;
+      device.axis[i].has_last = false;
+    }
+
+  int screen = DefaultScreen(x11_display);
+  int size[2] = { DisplayWidth(x11_display, screen), DisplayHeight(x11_display, screen) };
+
+  int count = 0;
+  XIDeviceInfo *info = XIQueryDevice(x11_display, deviceid, &count);
+  for (int i = 0; info != NULL && i < info->num_classes; i++)
+    {
+      if (info->classes[i]->type == XIValuatorClass)
+        {
+          XIValuatorClassInfo *valuator = (XIValuatorClassInfo *) info->classes[i];
+          if (valuator->number >= 0 && valuator->number < 2 && valuator->mode == XIModeAbsolute)
+            {
+              Axis &axis = device.axis[valuator->number];
+              axis.absolute = true;
+              if (valuator->max > valuator->min)
+                {
+                  axis.scale = size[valuator->number] / (valuator->max - valuator->min);
+                }
+              TRACE_MSG("absolute axis " << valuator->number << " scale " << axis.scale);
+            }
+        }
+    }
+
+  if (info != NULL)
+    {
+      XIFreeDeviceInfo(info);
+    }
+
+  TRACE_EXIT();
+  return device;
+}
+
+
+void
+XInput2Monitor::handle_motion(XIRawEvent *event)
+{
+  // The source is the physical device that moved, not the master.
+  Device &device = get_device(event->sourceid);
+
+  // Only the valuators in the mask are present in the values, in order.
+  double *value = event->valuators.values;
+
+  for (int i = 0; i < event->valuators.mask_len * 8 && i < 2; i++)
+    {
+      if (XIMaskIsSet(event->valuators.mask, i))
+        {
+          Axis &axis = device.axis[i];
+          double delta = *value;
+
+          if (axis.absolute)
+            {
+              delta = axis.has_last ? (*value - axis.last) * axis.scale : 0.0;
+              axis.last = *value;
+              axis.has_last = true;
+            }
+
+          if (i == 0)
+            {
+              x += delta;
+            }
+          else
+            {
+              y += delta;
+            }
+          value++;
+        }
+    }
+
+  // Restart around the origin long before the position overflows. The
+  // listeners ignore the jump in position.
+  if (x < 0 || y < 0 || x > 2 * XINPUT2_ORIGIN || y > 2 * XINPUT2_ORIGIN)
+    {
+      x = XINPUT2_ORIGIN;
+      y = XINPUT2_ORIGIN;
+    }
+
+  fire_mouse((int) x, (int) y, 0);
+}
+
+
+void
+XInput2Monitor::handle_button(XIRawEvent *event, bool is_press)
+{
+  int button = event->detail;
+
+  if (button >= 4 && button <= 7)
+    {
+      // Scroll wheel.
+      if (is_press)
+        {
+          fire_mouse((int) x, (int) y, (button == 4 || button == 6) ? 1 : -1);
+        }
+    }
+  else
+    {
+      fire_button(is_press);
+    }
+}
+
+#endif
@@ -0,0 +1,137 @@
+// XInput2Monitor.hh --- ActivityMonitor for X11 based on XInput2 raw events
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef XINPUT2MONITOR_HH
+#define XINPUT2MONITOR_HH
+
+#if defined(HAVE_XI2)
+
+#include <string>
+#include <map>
+
+#include <X11/X.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
+
+#include "InputMonitor.hh"
+
+#include "Runnable.hh"
+#include "Thread.hh"
+
+//! Activity monitor for a local X server, based on XInput2 raw events.
+/*!
+ *  Raw motion, key and button events of all devices are selected once on
+ *  the root window. The monitor thread blocks until the X server sends an
+ *  event, so it does not wake up at all while the user is idle, and no
+ *  request is made per window.
+ *
+ *  Raw events do not carry the pointer position. The position reported
+ *  to the listeners is the sum of the motion deltas, which is what the
+ *  listeners need to detect and measure movement. Relative axes (mice)
+ *  report deltas; absolute axes (tablets, touchscreens) report positions
+ *  in device units, so the monitor takes their difference and scales it
+ *  to the screen size.
+ */
+class XInput2Monitor :
+  public InputMonitor,
+  public Runnable
+{
+public:
+  //! Constructor.
+  XInput2Monitor(const std::string &display_name);
+
+  //! Destructor.
+  virtual ~XInput2Monitor();
+
+  //! Initialize
+  virtual bool init();
+
+  //! Terminate the monitor.
+  virtual void terminate();
+
+private:
+  //! The monitor's execution thread.
+  virtual void run();
+
+  //! Selects the raw events on the root window.
+  bool init_xinput2();
+
+  //! Handles an XInput2 event.
+  void handle_event(XIRawEvent *event);
+
+  //! Handles a raw motion event.
+  void handle_motion(XIRawEvent *event);
+
+  //! Handles a raw button event.
+  void handle_button(XIRawEvent *event, bool is_press);
+
+  //! Motion axis of a physical device.
+  struct Axis
+  {
+    //! Does the axis report positions instead of deltas?
+    bool absolute;
+
+    //! Pixels per device unit of an absolute axis.
+    double scale;
+
+    //! Last position of an absolute axis.
+    double last;
+
+    //! Is the last position known?
+    bool has_last;
+  };
+
+  //! X and Y axes of a physical device.
+  struct Device
+  {
+    Axis axis[2];
+  };
+
+  //! Returns the axes of a physical device, querying them once.
+  Device &get_device(int deviceid);
+
+private:
+  //! The X11 display name.
+  std::string x11_display_name;
+
+  //! The X11 display handle.
+  Display *x11_display;
+
+  //! Major opcode of the XInput extension.
+  int xi_opcode;
+
+  //! Pipe that wakes up the monitor thread on termination.
+  int wakeup_pipe[2];
+
+  //! Abort the main loop
+  volatile bool abort;
+
+  //! The activity monitor thread.
+  Thread *monitor_thread;
+
+  //! Pointer position derived from the motion deltas.
+  double x;
+  double y;
+
+  //! Axes of the physical devices, by device ID.
+  std::map<int, Device> devices;
+};
+
+#endif
+#endif // XINPUT2MONITOR_HH
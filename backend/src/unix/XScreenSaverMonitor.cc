@@ -17,33 +17,50 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include "debug.hh"
 
-#include <gdk/gdkx.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#if HAVE_UNISTD_H
+# include <unistd.h>
+#endif
 
 #include "XScreenSaverMonitor.hh"
 
-#include "Core.hh"
-#include "ICore.hh"
-#include "ICoreEventListener.hh"
-#include "IInputMonitorListener.hh"
-
 #include "Thread.hh"
 
 using namespace std;
-using namespace workrave;
 
-XScreenSaverMonitor::XScreenSaverMonitor() :
+//! Interval in milliseconds at which activity is checked while it starts.
+#define XSS_POLL_INTERVAL (1000)
+
+//! Maximum interval in milliseconds at which activity is checked while idle.
+#define XSS_MAX_IDLE_INTERVAL (16000)
+
+//! Time in milliseconds before the activity monitor could become idle, at which activity is checked.
+#define XSS_IDLE_MARGIN (500)
+
+
+XScreenSaverMonitor::XScreenSaverMonitor(const string &display_name) :
+  x11_display(NULL),
   abort(false),
   screen_saver_info(NULL)
 {
+  x11_display_name = display_name;
+  wakeup_pipe[0] = -1;
+  wakeup_pipe[1] = -1;
+#if defined(HAVE_XSYNC)
+  idle_counter = None;
+  idle_alarm = None;
+#endif
   monitor_thread = new Thread(this);
-  mutex = g_mutex_new();
-  cond = g_cond_new();
 }
 
 
@@ -56,8 +73,29 @@ XScreenSaverMonitor::~XScreenSaverMonitor()
       delete monitor_thread;
     }
 
-  g_mutex_free(mutex);
-  g_cond_free(cond);
+  if (screen_saver_info != NULL)
+    {
+      XFree(screen_saver_info);
+    }
+
+  if (x11_display != NULL)
+    {
+#if defined(HAVE_XSYNC)
+      if (idle_alarm != None)
+        {
+          XSyncDestroyAlarm(x11_display, idle_alarm);
+        }
+#endif
+      XCloseDisplay(x11_display);
+    }
+
+  for (int i = 0; i < 2; i++)
+    {
+      if (wakeup_pipe[i] != -1)
+        {
+          close(wakeup_pipe[i]);
+        }
+    }
   TRACE_EXIT();
 }
 
@@ -65,33 +103,53 @@ XScreenSaverMonitor::~XScreenSaverMonitor()
 bool
 XScreenSaverMonitor::init()
 {
+  TRACE_ENTER("XScreenSaverMonitor::init");
+
+  if ((x11_display = XOpenDisplay(x11_display_name.c_str())) == NULL)
+    {
+      TRACE_RETURN("Cannot open display");
+      return false;
+    }
+
   int event_base;
   int error_base;
 
-  Bool has_extension = XScreenSaverQueryExtension(gdk_x11_display_get_xdisplay(gdk_display_get_default()), &event_base, &error_base);
+  if (!XScreenSaverQueryExtension(x11_display, &event_base, &error_base) ||
+      pipe(wakeup_pipe) != 0)
+    {
+      XCloseDisplay(x11_display);
+      x11_display = NULL;
+      TRACE_RETURN("XScreenSaver not available");
+      return false;
+    }
+
+  fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+
+  init_idle_alarm();
+
+  screen_saver_info = XScreenSaverAllocInfo();
+  monitor_thread->start();
 
-  if (has_extension)
-  {
-    screen_saver_info = XScreenSaverAllocInfo();
-    monitor_thread->start();
-  }
-  
-  return has_extension;
+  TRACE_EXIT();
+  return true;
 }
 
+
 void
 XScreenSaverMonitor::terminate()
 {
   TRACE_ENTER("XScreenSaverMonitor::terminate");
 
-  g_mutex_lock(mutex);
   abort = true;
-  g_cond_broadcast(cond);
-  g_mutex_unlock(mutex);  
-  
+  if (wakeup_pipe[1] != -1)
+    {
+      char c = 0;
+      while (write(wakeup_pipe[1], &c, 1) == -1 && errno == EINTR)
+        {
+        }
+    }
   monitor_thread->wait();
-  monitor_thread = NULL;
-  
+
   TRACE_EXIT();
 }
 
@@ -101,25 +159,194 @@ XScreenSaverMonitor::run()
 {
   TRACE_ENTER("XScreenSaverMonitor::run");
 
-  g_mutex_lock(mutex);
+  // Time of the previous check, of the last reported input, and of the
+  // first reported input since the user was idle.
+  gint64 last_check = 0;
+  gint64 last_report = 0;
+  gint64 first_report = 0;
+
+  int idle_interval = XSS_POLL_INTERVAL;
+
   while (!abort)
     {
-      XScreenSaverQueryInfo(gdk_x11_display_get_xdisplay(gdk_display_get_default()), gdk_x11_get_default_root_xwindow(), screen_saver_info);
+      XScreenSaverQueryInfo(x11_display, DefaultRootWindow(x11_display), screen_saver_info);
 
-      if (screen_saver_info->idle < 1000)
+      gint64 now = g_get_monotonic_time();
+      gint64 last_input = now - (gint64) screen_saver_info->idle * 1000;
+
+      int noise, activity, idle;
+      get_activity_parameters(noise, activity, idle);
+
+      // Longest time between reports that keeps the user active.
+      gint64 active_period = (gint64) MIN(noise, idle) * 1000;
+
+      bool input = (last_check == 0) ? (screen_saver_info->idle < XSS_POLL_INTERVAL) : (last_input > last_check);
+      if (input)
         {
+          if (last_report == 0 || last_input - last_report > active_period)
+            {
+              first_report = last_input;
+            }
+
           /* Notify the activity monitor */
-          fire_action();
+          fire_action(last_input);
+
+          last_report = last_input;
+          idle_interval = XSS_POLL_INTERVAL;
         }
+      last_check = now;
 
-#if GLIB_CHECK_VERSION(2, 32, 0)
-      gint64 end_time = g_get_monotonic_time() + G_TIME_SPAN_SECOND;
-      g_cond_wait_until(cond, mutex, end_time);
-#else
-      g_usleep(500000);
-#endif      
+      gint64 next_check = last_report + active_period - XSS_IDLE_MARGIN * 1000;
+      int timeout;
+
+      if (last_report != 0 && next_check > now)
+        {
+          if (last_report - first_report < (gint64) activity * 1000)
+            {
+              // Find out soon whether the activity lasts.
+              timeout = XSS_POLL_INTERVAL;
+            }
+          else
+            {
+              timeout = (int) MAX((next_check - now) / 1000, XSS_POLL_INTERVAL);
+            }
+        }
+      else if (arm_idle_alarm(screen_saver_info->idle))
+        {
+          timeout = -1;
+        }
+      else
+        {
+          timeout = idle_interval;
+          idle_interval = MIN(idle_interval * 2, XSS_MAX_IDLE_INTERVAL);
+        }
+
+      TRACE_MSG("idle " << screen_saver_info->idle << " timeout " << timeout);
+      wait(timeout);
     }
-  g_mutex_unlock(mutex);  
-  
+
   TRACE_EXIT();
 }
+
+
+//! Finds the IDLETIME counter.
+void
+XScreenSaverMonitor::init_idle_alarm()
+{
+#if defined(HAVE_XSYNC)
+  TRACE_ENTER("XScreenSaverMonitor::init_idle_alarm");
+
+  int event_base = 0;
+  int error_base = 0;
+  int major = 0;
+  int minor = 0;
+
+  if (XSyncQueryExtension(x11_display, &event_base, &error_base) &&
+      XSyncInitialize(x11_display, &major, &minor))
+    {
+      int count = 0;
+      XSyncSystemCounter *counters = XSyncListSystemCounters(x11_display, &count);
+
+      for (int i = 0; i < count; i++)
+        {
+          if (strcmp(counters[i].name, "IDLETIME") == 0)
+            {
+              idle_counter = counters[i].counter;
+            }
+        }
+
+      if (counters != NULL)
+        {
+          XSyncFreeSystemCounterList(counters);
+        }
+    }
+
+  TRACE_RETURN(idle_counter != None);
+#endif
+}
+
+
+//! Requests an alarm when the user becomes active.
+/*!
+ *  The alarm triggers as soon as the idle time is less than the current
+ *  idle time, i.e. on the next input.
+ *
+ *  \return false if alarms are not available.
+ */
+bool
+XScreenSaverMonitor::arm_idle_alarm(unsigned long idle)
+{
+#if defined(HAVE_XSYNC)
+  if (idle_counter == None)
+    {
+      return false;
+    }
+
+  // The counter may still be zero right after input.
+  int value = (int) MIN(MAX(idle, 1UL), (unsigned long) G_MAXINT);
+
+  XSyncAlarmAttributes attr;
+  attr.trigger.counter = idle_counter;
+  attr.trigger.value_type = XSyncAbsolute;
+  attr.trigger.test_type = XSyncNegativeComparison;
+  attr.events = True;
+  XSyncIntToValue(&attr.trigger.wait_value, value);
+  XSyncIntToValue(&attr.delta, 0);
+
+  unsigned long flags = XSyncCACounter | XSyncCAValueType | XSyncCATestType | XSyncCAValue | XSyncCADelta | XSyncCAEvents;
+
+  if (idle_alarm == None)
+    {
+      idle_alarm = XSyncCreateAlarm(x11_display, flags, &attr);
+    }
+  else
+    {
+      XSyncChangeAlarm(x11_display, idle_alarm, flags, &attr);
+    }
+  XFlush(x11_display);
+
+  return idle_alarm != None;
+#else
+  (void) idle;
+  return false;
+#endif
+}
+
+
+//! Waits for the timeout, an X event or termination.
+/*!
+ *  \param timeout in milliseconds, or -1 to wait without timeout.
+ */
+void
+XScreenSaverMonitor::wait(int timeout)
+{
+  // Poll is skipped if Xlib already read events, so revents may not be
+  // set by poll.
+  struct pollfd fds[2];
+  fds[0].fd = ConnectionNumber(x11_display);
+  fds[0].events = POLLIN;
+  fds[0].revents = 0;
+  fds[1].fd = wakeup_pipe[0];
+  fds[1].events = POLLIN;
+  fds[1].revents = 0;
+
+  // The only events are alarms, which just end the wait.
+  if (XPending(x11_display) == 0 &&
+      poll(fds, 2, timeout) == -1 && errno != EINTR)
+    {
+      TRACE_ENTER("XScreenSaverMonitor::wait");
+      TRACE_MSG("poll failed " << errno);
+      TRACE_EXIT();
+    }
+
+  while (XPending(x11_display) > 0)
+    {
+      XEvent event;
+      XNextEvent(x11_display, &event);
+    }
+
+  if (fds[0].revents & (POLLERR | POLLHUP))
+    {
+      abort = true;
+    }
+}
@@ -17,6 +17,7 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 
+
 #ifndef XSCREENSAVERMONITOR_HH
 #define XSCREENSAVERMONITOR_HH
 
@@ -25,6 +26,9 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/scrnsaver.h>
+#if defined(HAVE_XSYNC)
+#include <X11/extensions/sync.h>
+#endif
 
 #include "InputMonitor.hh"
 
@@ -32,13 +36,20 @@
 #include "Thread.hh"
 
 //! Activity monitor for a local X server.
+/*!
+ *  The monitor polls the time since the last input. While the user is
+ *  active, it only wakes up when the activity monitor could become idle,
+ *  and reports the activity at the time of the last input. While the
+ *  user is idle, it waits for an IDLETIME alarm of the X server, or backs
+ *  off to a longer interval when the SYNC extension is not available.
+ */
 class XScreenSaverMonitor :
   public InputMonitor,
   public Runnable
 {
 public:
   //! Constructor.
-  XScreenSaverMonitor();
+  XScreenSaverMonitor(const std::string &display_name);
 
   //! Destructor.
   virtual ~XScreenSaverMonitor();
@@ -53,10 +64,27 @@ private:
   //! The monitor's execution thread.
   virtual void run();
 
+  //! Finds the IDLETIME counter.
+  void init_idle_alarm();
+
+  //! Requests an alarm when the user becomes active.
+  bool arm_idle_alarm(unsigned long idle);
+
+  //! Waits for the timeout, an X event or termination.
+  void wait(int timeout);
 
 private:
+  //! The X11 display name.
+  std::string x11_display_name;
+
+  //! The X11 display handle.
+  Display *x11_display;
+
+  //! Pipe that wakes up the monitor thread on termination.
+  int wakeup_pipe[2];
+
   //! Abort the main loop
-  bool abort;
+  volatile bool abort;
 
   //! The activity monitor thread.
   Thread *monitor_thread;
@@ -64,8 +92,13 @@ private:
   //
   XScreenSaverInfo *screen_saver_info;
 
-  GMutex *mutex;
-  GCond *cond;
+#if defined(HAVE_XSYNC)
+  //! The IDLETIME system counter, or None.
+  XSyncCounter idle_counter;
+
+  //! Alarm that triggers when the user becomes active, or None.
+  XSyncAlarm idle_alarm;
+#endif
 };
 
 #endif // XSCREENSAVERMONITOR_HH
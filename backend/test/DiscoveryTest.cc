@@ -0,0 +1,138 @@
+// DiscoveryTest.cc --- Test of the discovery of peers
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//! Runs two discoveries on the loopback interface.
+/*!
+ *  Both discoveries join the multicast group on "lo" and announce
+ *  themselves. The test passes when each discovery reports the other
+ *  one, with the announced port and protocol, within the time limit.
+ *  The test is skipped if the multicast group cannot be joined.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include <string>
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "Discovery.hh"
+
+using namespace std;
+
+//! Interface on which the discoveries run.
+#define INTERFACE "lo"
+
+//! Number of heartbeats after which the test fails.
+#define TIME_LIMIT (30)
+
+//! Real time between two heartbeats, in microseconds.
+#define HEARTBEAT_TIME (100000)
+
+//! Exit code that tells automake that the test is skipped.
+#define EXIT_SKIP (77)
+
+
+//! Remembers the announcement of one peer.
+class Listener :
+  public IDiscoveryListener
+{
+public:
+  Listener(const string &peer_id) :
+    peer_id(peer_id),
+    port(0),
+    protocol(0)
+  {
+  }
+
+  virtual void peer_discovered(const string &id, const string &host, int port, int protocol)
+  {
+    printf("discovered %s at %s:%d, protocol %d\n", id.c_str(), host.c_str(), port, protocol);
+
+    if (id == peer_id)
+      {
+        this->port = port;
+        this->protocol = protocol;
+      }
+  }
+
+  //! ID of the peer that must be discovered.
+  string peer_id;
+
+  //! Announced port of the peer, or 0 if not discovered.
+  int port;
+
+  //! Announced protocol of the peer, or 0 if not discovered.
+  int protocol;
+};
+
+
+int
+main(int argc, char **argv)
+{
+  (void) argc;
+  (void) argv;
+
+  g_type_init();
+
+  Discovery *discovery1 = Discovery::create(INTERFACE);
+  Discovery *discovery2 = Discovery::create(INTERFACE);
+
+  if (discovery1 == NULL || discovery2 == NULL)
+    {
+      printf("discovery is not supported\n");
+      return EXIT_SKIP;
+    }
+
+  Listener listener1("node2");
+  Listener listener2("node1");
+  discovery1->set_listener(&listener1);
+  discovery2->set_listener(&listener2);
+
+  if (!discovery1->start("node1", 2001, 1, 0) ||
+      !discovery2->start("node2", 2002, 2, 0))
+    {
+      printf("cannot join the multicast group on %s\n", INTERFACE);
+      delete discovery1;
+      delete discovery2;
+      return EXIT_SKIP;
+    }
+
+  for (int t = 0; t < TIME_LIMIT && (listener1.port == 0 || listener2.port == 0); t++)
+    {
+      discovery1->heartbeat(t);
+      discovery2->heartbeat(t);
+      g_usleep(HEARTBEAT_TIME);
+    }
+
+  bool ok = (listener1.port == 2002 && listener1.protocol == 2 &&
+             listener2.port == 2001 && listener2.protocol == 1);
+
+  discovery1->stop();
+  discovery2->stop();
+  delete discovery1;
+  delete discovery2;
+
+  printf("%s\n", ok ? "ok" : "failed");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,168 @@
+// DistributionReplay.cc --- Replays a network capture on an isolated link
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//! Measures how fast the distribution link processes a capture.
+/*!
+ *  The received frames of a capture made with WORKRAVE_CAPTURE are
+ *  processed by a link on a LoopbackNetwork without other nodes, so
+ *  nothing is sent to real peers. There is no core: the client messages
+ *  are only counted, so no timers, idle logs or master state change.
+ *
+ *  Usage: distribution-replay CAPTURE
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include <string>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "Configurator.hh"
+#include "CoreConfig.hh"
+#include "DistributionManager.hh"
+#include "DistributionSocketLink.hh"
+#include "LoopbackSocketDriver.hh"
+#include "PacketBuffer.hh"
+#include "Util.hh"
+
+#include "MemoryConfigBackend.hh"
+
+using namespace std;
+
+//! Client messages that are counted.
+static const DistributionClientMessageID message_ids[] =
+  {
+    DCM_TIMERS,
+    DCM_MONITOR,
+    DCM_IDLELOG,
+    DCM_SCRIPT,
+    DCM_CONFIG,
+    DCM_TIMERS_DELTA,
+    DCM_TIMERS_ACK,
+    DCM_BREAKS,
+    DCM_STATS,
+    DCM_BREAKCONTROL,
+  };
+
+
+//! Counts the client messages of the replay.
+class MessageCounter :
+  public IDistributionClientMessage
+{
+public:
+  MessageCounter() :
+    count(0)
+  {
+  }
+
+  virtual bool request_client_message(DistributionClientMessageID id, PacketBuffer &buffer)
+  {
+    (void) id;
+    (void) buffer;
+    return false;
+  }
+
+  virtual bool client_message(DistributionClientMessageID id, bool active, const char *client_id,
+                              PacketBuffer &buffer)
+  {
+    (void) id;
+    (void) active;
+    (void) client_id;
+    (void) buffer;
+    count++;
+    return true;
+  }
+
+  //! Number of client messages received.
+  int count;
+};
+
+
+int
+main(int argc, char **argv)
+{
+  if (argc != 2)
+    {
+      fprintf(stderr, "usage: %s CAPTURE\n", argv[0]);
+      return 2;
+    }
+
+  // The link stores its ID in the home directory.
+  gchar *home = g_build_filename(g_get_tmp_dir(), "workrave-replay-XXXXXX", NULL);
+  if (g_mkdtemp(home) == NULL)
+    {
+      fprintf(stderr, "cannot create %s\n", home);
+      return 2;
+    }
+  Util::set_home_directory(home);
+
+  MemoryConfigBackend *backend = new MemoryConfigBackend();
+  Variant enabled(true);
+  backend->set_value(CoreConfig::CFG_KEY_DISTRIBUTION_ENABLED, enabled);
+  Configurator *configurator = new Configurator(backend);
+
+  LoopbackNetwork network;
+
+  // The manager provides the configuration and the log to the link.
+  DistributionManager *manager = new DistributionManager();
+  manager->init(configurator, network.create_driver("manager"), &network);
+
+  DistributionSocketLink *link = new DistributionSocketLink(configurator, network.create_driver("replay"), &network);
+  link->set_distribution_manager(manager);
+  link->init();
+
+  MessageCounter counter;
+  for (size_t i = 0; i < sizeof(message_ids) / sizeof(message_ids[0]); i++)
+    {
+      link->register_client_message(message_ids[i], DCMT_PASSIVE, &counter);
+    }
+
+  int frames = 0;
+  gint64 duration = 0;
+  bool ok = link->replay_capture(argv[1], frames, duration);
+
+  if (ok)
+    {
+      printf("frames:          %d\n", frames);
+      printf("client messages: %d\n", counter.count);
+      printf("duration:        %" G_GINT64_FORMAT " us\n", duration);
+      printf("rate:            %.0f frames/s\n", duration > 0 ? frames * 1000000.0 / duration : 0.0);
+    }
+  else
+    {
+      fprintf(stderr, "cannot replay %s\n", argv[1]);
+    }
+
+  delete link;
+  delete manager;
+  delete configurator;
+
+  gchar *id = g_build_filename(home, "id", NULL);
+  g_unlink(id);
+  g_rmdir(home);
+  g_free(id);
+  g_free(home);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,249 @@
+// DistributionScaleTest.cc --- Multi-node test of the distribution link
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//! Runs a network of distribution links in one process.
+/*!
+ *  Each node is a DistributionManager with its own link, connected to the
+ *  other nodes through a LoopbackNetwork with a virtual clock. Node 0
+ *  listens, and every other node connects either to node 0 (star) or to
+ *  its predecessor (chain). Nodes join one by one. The test passes when
+ *  all nodes know all other nodes within the time limit, and reports the
+ *  virtual time needed after the last join, the processing time per
+ *  heartbeat and the traffic.
+ *
+ *  Usage: distribution-scale-test [nodes] [star|chain] [loss]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "Configurator.hh"
+#include "CoreConfig.hh"
+#include "DistributionManager.hh"
+#include "LoopbackSocketDriver.hh"
+#include "Util.hh"
+
+#include "MemoryConfigBackend.hh"
+
+using namespace std;
+
+//! Number of nodes if not specified.
+#define DEFAULT_NODES (16)
+
+//! Virtual time between two nodes joining, in seconds.
+#define JOIN_INTERVAL (1)
+
+//! Virtual time after the last join after which the test fails, in seconds.
+#define TIME_LIMIT (120)
+
+//! Virtual time between two updates of the network, in milliseconds.
+#define STEP_TIME (50)
+
+//! Port on which all nodes listen.
+#define PORT (27273)
+
+
+//! A node in the simulated network.
+struct Node
+{
+  string hostname;
+  Configurator *configurator;
+  DistributionManager *manager;
+};
+
+
+//! Stores a configuration value in a backend.
+static void
+set_config(IConfigBackend *backend, const string &key, Variant value)
+{
+  backend->set_value(key, value);
+}
+
+
+//! Returns the number of other nodes a node knows, directly or routed.
+static int
+get_known_peers(DistributionManager *manager)
+{
+  DistributionPeerStatisticsList stats = manager->get_peer_statistics();
+  int count = 0;
+
+  for (DistributionPeerStatisticsList::iterator i = stats.begin(); i != stats.end(); i++)
+    {
+      if (i->id != "")
+        {
+          count++;
+        }
+    }
+
+  return count;
+}
+
+
+//! Returns the number of bytes all nodes sent.
+static guint64
+get_bytes_sent(vector<Node> &nodes)
+{
+  guint64 bytes = 0;
+
+  for (size_t n = 0; n < nodes.size(); n++)
+    {
+      DistributionPeerStatisticsList stats = nodes[n].manager->get_peer_statistics();
+
+      for (DistributionPeerStatisticsList::iterator i = stats.begin(); i != stats.end(); i++)
+        {
+          bytes += i->bytes_out;
+        }
+    }
+
+  return bytes;
+}
+
+
+//! Creates the next node and connects it to the network.
+static Node
+create_node(LoopbackNetwork &network, vector<Node> &nodes, const gchar *tmpdir, bool chain)
+{
+  Node node;
+  int n = nodes.size();
+
+  gchar *name = g_strdup_printf("node%d", n);
+  gchar *home = g_build_filename(tmpdir, name, NULL);
+  node.hostname = name;
+  Util::set_home_directory(home);
+  g_free(home);
+  g_free(name);
+
+  // Fill the backend directly; setting values through the configurator
+  // would need a core.
+  MemoryConfigBackend *backend = new MemoryConfigBackend();
+  set_config(backend, CoreConfig::CFG_KEY_DISTRIBUTION_ENABLED, true);
+  set_config(backend, CoreConfig::CFG_KEY_DISTRIBUTION_LISTENING, true);
+  set_config(backend, CoreConfig::CFG_KEY_DISTRIBUTION_TCP_PORT, PORT);
+
+  if (n > 0)
+    {
+      gchar *peer = g_strdup_printf("tcp://%s:%d", nodes[chain ? n - 1 : 0].hostname.c_str(), PORT);
+      set_config(backend, CoreConfig::CFG_KEY_DISTRIBUTION_PEERS, string(peer));
+      g_free(peer);
+    }
+
+  node.configurator = new Configurator(backend);
+  node.manager = new DistributionManager();
+  node.manager->init(node.configurator, network.create_driver(node.hostname), &network);
+
+  return node;
+}
+
+
+int
+main(int argc, char **argv)
+{
+  int num_nodes = argc > 1 ? atoi(argv[1]) : DEFAULT_NODES;
+  bool chain = argc > 2 && strcmp(argv[2], "chain") == 0;
+  double loss = argc > 3 ? atof(argv[3]) : 0.0;
+
+  if (num_nodes < 2)
+    {
+      fprintf(stderr, "usage: %s [nodes] [star|chain] [loss]\n", argv[0]);
+      return 2;
+    }
+
+  // Each node stores its ID in its own home directory.
+  gchar *tmpdir = g_build_filename(g_get_tmp_dir(), "workrave-scale-XXXXXX", NULL);
+  if (g_mkdtemp(tmpdir) == NULL)
+    {
+      fprintf(stderr, "cannot create %s\n", tmpdir);
+      return 2;
+    }
+
+  LoopbackNetwork network(1);
+  network.set_loss(loss);
+
+  vector<Node> nodes;
+  gint64 busy_time = 0;
+  int heartbeats = 0;
+  int converged_time = -1;
+  int time_limit = (num_nodes * JOIN_INTERVAL + TIME_LIMIT) * 1000;
+
+  for (int t = 0; t < time_limit && converged_time == -1; t += STEP_TIME)
+    {
+      if (t % (JOIN_INTERVAL * 1000) == 0 && (int)nodes.size() < num_nodes)
+        {
+          nodes.push_back(create_node(network, nodes, tmpdir, chain));
+        }
+
+      network.advance(STEP_TIME);
+
+      if ((t + STEP_TIME) % 1000 == 0)
+        {
+          gint64 start = g_get_monotonic_time();
+          for (size_t n = 0; n < nodes.size(); n++)
+            {
+              nodes[n].manager->heartbeart();
+            }
+          busy_time += g_get_monotonic_time() - start;
+          heartbeats++;
+
+          bool converged = (int)nodes.size() == num_nodes;
+          for (int n = 0; converged && n < num_nodes; n++)
+            {
+              converged = get_known_peers(nodes[n].manager) == num_nodes - 1;
+            }
+
+          if (converged)
+            {
+              converged_time = (t + STEP_TIME) / 1000 - (num_nodes - 1) * JOIN_INTERVAL;
+            }
+        }
+    }
+
+  printf("nodes:              %d (%s, loss %.2f)\n", num_nodes, chain ? "chain" : "star", loss);
+  printf("converged after:    %d s\n", converged_time);
+  printf("time per heartbeat: %" G_GINT64_FORMAT " us\n", heartbeats > 0 ? busy_time / heartbeats : 0);
+  printf("bytes sent:         %" G_GUINT64_FORMAT "\n", get_bytes_sent(nodes));
+
+  for (size_t n = 0; n < nodes.size(); n++)
+    {
+      delete nodes[n].manager;
+      delete nodes[n].configurator;
+
+      gchar *home = g_build_filename(tmpdir, nodes[n].hostname.c_str(), NULL);
+      gchar *id = g_build_filename(home, "id", NULL);
+      g_unlink(id);
+      g_rmdir(home);
+      g_free(id);
+      g_free(home);
+    }
+
+  g_rmdir(tmpdir);
+  g_free(tmpdir);
+
+  return converged_time != -1 ? 0 : 1;
+}
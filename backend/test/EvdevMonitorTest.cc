@@ -0,0 +1,216 @@
+// EvdevMonitorTest.cc --- Test of the Linux input device monitor
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//! Feeds a recorded event stream to the Linux input device monitor.
+/*!
+ *  The monitor reads a pipe instead of an input device. The test writes
+ *  mouse motion, wheel, button and key events to the pipe, one event in
+ *  two parts, and passes when the listener received all of them within
+ *  the time limit.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+
+#include <glib.h>
+
+#include "EvdevInputMonitor.hh"
+#include "IInputMonitorListener.hh"
+
+//! Number of polls after which the test fails.
+#define TIME_LIMIT (200)
+
+//! Real time between two polls, in microseconds.
+#define POLL_TIME (10000)
+
+
+//! Counts the reported input events.
+class Listener :
+  public IInputMonitorListener
+{
+public:
+  Listener() :
+    motions(0),
+    wheel(0),
+    presses(0),
+    releases(0),
+    keys(0),
+    repeats(0),
+    x(0),
+    y(0)
+  {
+  }
+
+  virtual void action_notify()
+  {
+  }
+
+  virtual void mouse_notify(int x, int y, int wheel)
+  {
+    if (x != this->x || y != this->y)
+      {
+        motions++;
+      }
+    this->x = x;
+    this->y = y;
+    this->wheel += wheel;
+  }
+
+  virtual void button_notify(bool is_press)
+  {
+    if (is_press)
+      {
+        presses++;
+      }
+    else
+      {
+        releases++;
+      }
+  }
+
+  virtual void keyboard_notify(bool repeat)
+  {
+    keys++;
+    if (repeat)
+      {
+        repeats++;
+      }
+  }
+
+  //! Whether all events written by the test were reported.
+  bool is_complete() const
+  {
+    return motions > 0 && wheel == 1 && presses == 1 && releases == 1 && keys == 2;
+  }
+
+  //! Number of reports that changed the position.
+  int motions;
+
+  //! Sum of the wheel movement.
+  int wheel;
+
+  //! Number of button presses and releases.
+  int presses;
+  int releases;
+
+  //! Number of key presses, and how many of them were repeats.
+  int keys;
+  int repeats;
+
+  //! Last reported position.
+  int x;
+  int y;
+};
+
+
+//! Writes an input event to the pipe.
+static void
+write_event(int fd, int type, int code, int value, size_t offset = 0, size_t size = sizeof(struct input_event))
+{
+  struct input_event event;
+  memset(&event, 0, sizeof(event));
+  event.type = type;
+  event.code = code;
+  event.value = value;
+
+  if (write(fd, (char *) &event + offset, size - offset) != (ssize_t)(size - offset))
+    {
+      perror("write");
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+  (void) argc;
+  (void) argv;
+
+  int fds[2];
+  if (pipe(fds) != 0)
+    {
+      perror("pipe");
+      return 2;
+    }
+
+  Listener listener;
+  EvdevInputMonitor *monitor = new EvdevInputMonitor();
+  monitor->subscribe_activity(&listener);
+
+  if (!monitor->add_device(fds[0]) || !monitor->init())
+    {
+      printf("cannot start monitor\n");
+      return 1;
+    }
+
+  // Two mouse movements; the monitor may combine them in one report.
+  write_event(fds[1], EV_REL, REL_X, 10);
+  write_event(fds[1], EV_REL, REL_Y, 5);
+  write_event(fds[1], EV_SYN, SYN_REPORT, 0);
+  write_event(fds[1], EV_REL, REL_X, -3);
+  write_event(fds[1], EV_SYN, SYN_REPORT, 0);
+
+  // Wheel.
+  write_event(fds[1], EV_REL, REL_WHEEL, 1);
+  write_event(fds[1], EV_SYN, SYN_REPORT, 0);
+
+  // Left click.
+  write_event(fds[1], EV_KEY, BTN_LEFT, 1);
+  write_event(fds[1], EV_SYN, SYN_REPORT, 0);
+  write_event(fds[1], EV_KEY, BTN_LEFT, 0);
+  write_event(fds[1], EV_SYN, SYN_REPORT, 0);
+
+  // Key press, split over two writes, then an auto-repeat and a release.
+  write_event(fds[1], EV_KEY, KEY_A, 1, 0, sizeof(struct input_event) / 2);
+  g_usleep(POLL_TIME);
+  write_event(fds[1], EV_KEY, KEY_A, 1, sizeof(struct input_event) / 2);
+  write_event(fds[1], EV_KEY, KEY_A, 2);
+  write_event(fds[1], EV_KEY, KEY_A, 0);
+  write_event(fds[1], EV_SYN, SYN_REPORT, 0);
+
+  for (int t = 0; t < TIME_LIMIT && !listener.is_complete(); t++)
+    {
+      g_usleep(POLL_TIME);
+      monitor->process_events();
+    }
+
+  close(fds[1]);
+  monitor->terminate();
+  monitor->process_events();
+
+  printf("motions %d, wheel %d, presses %d, releases %d, keys %d, repeats %d\n",
+         listener.motions, listener.wheel, listener.presses, listener.releases,
+         listener.keys, listener.repeats);
+
+  // Both movements end up at 7 to the right and 5 down from where they started.
+  bool ok = (listener.is_complete() && listener.x - listener.y == 2 && listener.repeats == 1);
+
+  monitor->unsubscribe_activity(&listener);
+  delete monitor;
+
+  printf("%s\n", ok ? "ok" : "failed");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+// MemoryConfigBackend.hh --- Configuration backend for tests
+//
+// Copyright (C) 2012 Rob Caelers <robc@krandor.org>
+// All rights reserved.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef MEMORYCONFIGBACKEND_HH
+#define MEMORYCONFIGBACKEND_HH
+
+#include <string>
+#include <map>
+
+#include "IConfigBackend.hh"
+
+//! Configuration backend that keeps all values in memory.
+class MemoryConfigBackend :
+  public IConfigBackend
+{
+public:
+  virtual bool load(std::string filename)
+  {
+    (void) filename;
+    return false;
+  }
+
+  virtual bool save(std::string filename)
+  {
+    (void) filename;
+    return true;
+  }
+
+  virtual bool save()
+  {
+    return true;
+  }
+
+  virtual bool remove_key(const std::string &key)
+  {
+    return values.erase(key) > 0;
+  }
+
+  virtual bool get_value(const std::string &key, VariantType type, Variant &value) const
+  {
+    (void) type;
+
+    std::map<std::string, Variant>::const_iterator i = values.find(key);
+    if (i == values.end())
+      {
+        return false;
+      }
+
+    value = i->second;
+    return true;
+  }
+
+  virtual bool set_value(const std::string &key, Variant &value)
+  {
+    values[key] = value;
+    return true;
+  }
+
+private:
+  std::map<std::string, Variant> values;
+};
+
+#endif // MEMORYCONFIGBACKEND_HH
@@ -375,6 +375,15 @@
 /* Define if the RECORD extension is available */
 /* #undef HAVE_XRECORD */
 
+/* Define if the XInput2 extension is available */
+/* #undef HAVE_XI2 */
+
+/* Define if the SYNC extension is available */
+/* #undef HAVE_XSYNC */
+
+/* Define if Linux input devices can be monitored. */
+/* #undef HAVE_EVDEV */
+
 /* Define to 1 if you have the `__fsetlocking' function. */
 /* #undef HAVE___FSETLOCKING */
 